@@ -225,6 +225,45 @@ void rts_checkSchedStatus (char* site, Capability *);
 
 SchedulerStatus rts_getSchedStatus (Capability *cap);
 
+/* ----------------------------------------------------------------------------
+   Controlling the eventlog
+
+   A program linked with -eventlog can start, stop and filter its
+   eventlog while it is running, without any +RTS -l flags.  Haskell
+   code calls these with a "safe" foreign import: they stop all the
+   Capabilities while they work, so they must not be called from an
+   "unsafe" one.  In an RTS without eventlog support they do nothing
+   (and rts_startEventLog() fails).
+
+   The classes are the same as those of +RTS -l.
+   ------------------------------------------------------------------------- */
+
+#define RTS_EVENTLOG_SCHED          (1<<0) /* -ls */
+#define RTS_EVENTLOG_GC             (1<<1) /* -lg */
+#define RTS_EVENTLOG_SPARKS_SAMPLED (1<<2) /* -lp */
+#define RTS_EVENTLOG_SPARKS_FULL    (1<<3) /* -lf */
+#define RTS_EVENTLOG_USER           (1<<4) /* -lu */
+
+// Start logging the given classes to sink, which is written as for
+// +RTS --eventlog-sink (NULL means <program>.eventlog).  If the eventlog
+// is already running it is finished off and a new one started, header
+// and all.  Returns 0 on success, or -1 if the sink can't be opened.
+int  rts_startEventLog (const char *sink, unsigned int classes);
+
+// Finish off the current eventlog and start a new one with the same
+// classes, in sink, or where the current one is going if sink is NULL.
+// Every eventlog after the first that goes to the default file gets a
+// name of its own: <program>-1.eventlog, <program>-2.eventlog, and so
+// on.  A file named by the sink is overwritten.  Returns -1 if the
+// eventlog isn't running or the sink can't be opened.
+int  rts_rotateEventLog (const char *sink);
+
+void rts_stopEventLog (void);
+
+// Change which classes are logged, without starting a new eventlog.
+void         rts_setEventLogClasses (unsigned int classes);
+unsigned int rts_getEventLogClasses (void);
+
 /* --------------------------------------------------------------------------
    Wrapper closures
 
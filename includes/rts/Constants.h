@@ -86,6 +86,12 @@
 #define MAX_LONG_REG    1
 #define MAX_XMM_REG     6
 
+/* -----------------------------------------------------------------------------
+   The maximum number of NUMA nodes we support (see --numa)
+   -------------------------------------------------------------------------- */
+
+#define MAX_NUMA_NODES 16
+
 /* -----------------------------------------------------------------------------
    Semi-Tagging constants
 
@@ -292,4 +298,15 @@
 
 #define MAX_SPARE_WORKERS 6
 
+/* -----------------------------------------------------------------------------
+   The stable pointer table is made of segments of 2^SPT_SEGMENT_BITS
+   entries, which never move (see rts/Stable.c).  A stable pointer is
+   the index of an entry: the segment number, then the index in the
+   segment.
+   -------------------------------------------------------------------------- */
+
+#define SPT_SEGMENT_BITS 10
+#define SPT_SEGMENT_SIZE (1 << SPT_SEGMENT_BITS)
+#define SPT_SEGMENT_MASK (SPT_SEGMENT_SIZE - 1)
+
 #endif /* RTS_CONSTANTS_H */
@@ -27,6 +27,11 @@ struct GC_FLAGS {
 #define SUMMARY_GC_STATS 3
 #define VERBOSE_GC_STATS 4
 
+    FILE   *gcLogFile;          /* +RTS --gc-log: a record for each GC */
+    nat     gcLogFormat;
+#define GC_LOG_JSON 0           /* one JSON object per line */
+#define GC_LOG_CSV  1           /* a header line, then a row per GC */
+
     nat     maxStkSize;         /* in *words* */
     nat     initialStkSize;     /* in *words* */
     nat     stkChunkSize;       /* in *words* */
@@ -49,13 +54,26 @@ struct GC_FLAGS {
 
     rtsBool sweep;		/* use "mostly mark-sweep" instead of copying
                                  * for the oldest generation */
+    rtsBool incMark;            /* mark the oldest generation incrementally */
+    nat     incMarkSlice;       /* in *words*, 0 == default */
     rtsBool ringBell;
     rtsBool frontpanel;
 
     Time    idleGCDelayTime;    /* units: TIME_RESOLUTION */
     rtsBool doIdleGC;
+    Time    releaseDelay;       /* give memory that has been free this long
+                                 * back to the OS (0 == never) */
 
     StgWord heapBase;           /* address to ask the OS for memory */
+    StgWord heapReserveSize;    /* address space to reserve for the heap
+                                 * at startup, in bytes (0 == don't) */
+    nat     hugePages;          /* back the heap with huge pages */
+# define HUGE_PAGES_NONE        0
+# define HUGE_PAGES_TRANSPARENT 1   /* madvise(MADV_HUGEPAGE) */
+# define HUGE_PAGES_EXPLICIT    2   /* MAP_HUGETLB, if there are any */
+
+    rtsBool numa;               /* Use NUMA */
+    StgWord numaMask;           /* The NUMA nodes to use */
 };
 
 struct DEBUG_FLAGS {  
@@ -103,6 +121,10 @@ struct PROFILING_FLAGS {
     Time                heapProfileInterval; /* time between samples */
     nat                 heapProfileIntervalTicks; /* ticks between samples (derived) */
     rtsBool             includeTSOs;
+    nat                 censusSample;        /* % of blocks a census looks at */
+    nat                 heapProfileFormat;   /* how the .hp file is written */
+# define HEAP_PROFILE_TEXT      0
+# define HEAP_PROFILE_BINARY    1
 
 
     rtsBool		showCCSOnException;
@@ -133,13 +155,23 @@ struct TRACE_FLAGS {
     rtsBool sparks_sampled; /* trace spark events by a sampled method */
     rtsBool sparks_full;    /* trace spark events 100% accurately */
     rtsBool user;           /* trace user events (emitted from Haskell code) */
+    char   *sink;           /* where to send the eventlog, or NULL for
+                             * <prog>.eventlog */
 };
 
 struct CONCURRENT_FLAGS {
     Time ctxtSwitchTime;         /* units: TIME_RESOLUTION */
     int ctxtSwitchTicks;         /* derived */
+    nat stmContention;           /* STM_CONTENTION_* */
+    nat stmIrrevocable;          /* aborts before a transaction runs
+                                    irrevocably (STM_CONTENTION_KARMA) */
 };
 
+/* What a transaction does when it fails to commit (--stm-contention) */
+#define STM_CONTENTION_NONE     0 /* run it again at once */
+#define STM_CONTENTION_BACKOFF  1 /* randomized exponential backoff */
+#define STM_CONTENTION_KARMA    2 /* backoff, then run it irrevocably */
+
 /*
  * The tickInterval is the time interval between "ticks", ie.
  * timer signals (see Timer.{c,h}).  It is the frequency at
@@ -161,6 +193,8 @@ struct MISC_FLAGS {
 struct PAR_FLAGS {
   nat            nNodes;         /* number of threads to run simultaneously */
   rtsBool        migrate;        /* migrate threads between capabilities */
+  rtsBool        stealThreads;   /* idle capabilities steal threads,
+                                  * rather than busy ones pushing them */
   nat            maxLocalSparks;
   rtsBool        parGcEnabled;   /* enable parallel GC */
   nat            parGcGen;       /* do parallel GC in this generation
@@ -172,6 +206,10 @@ struct PAR_FLAGS {
                                  /* do load-balancing in this
                                   * generation and higher only */
 
+  rtsBool        parCompactEnabled;
+                                 /* compact the old generation with
+                                  * all the GC threads */
+
   nat            parGcNoSyncWithIdle;
                                  /* if a Capability has been idle for
                                   * this many GCs, do not try to wake
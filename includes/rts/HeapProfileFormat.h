@@ -0,0 +1,74 @@
+/* -----------------------------------------------------------------------------
+ *
+ * (c) The GHC Team, 2013
+ *
+ * Binary heap profile format
+ *
+ * With +RTS --heap-profile-format=binary, the RTS writes the heap
+ * profile (<program>.hp) in this format instead of the text one that
+ * hp2ps has always read.  It says the same things, but it says each
+ * identifier's name only once, and each sample says only what has
+ * changed since the one before, so a profile of a long run is a
+ * fraction of the size and can be read without parsing text.  The
+ * file is written a record at a time, as the program runs, so a tool
+ * can read it while it grows.  hp2ps reads either format.
+ *
+ * This header is included by the RTS and by hp2ps, so it must contain
+ * only #defines.
+ *
+ * The format
+ * ----------
+ *
+ * profile : HP_BIN_MAGIC          -- 8 bytes
+ *           Record*
+ *
+ * Record  : HP_BIN_JOB         String
+ *         | HP_BIN_DATE        String
+ *         | HP_BIN_SAMPLE_UNIT String
+ *         | HP_BIN_VALUE_UNIT  String
+ *         | HP_BIN_IDENT       Varint      -- identifier number
+ *                              String      -- its name
+ *         | HP_BIN_SAMPLE      SVarint     -- time since the last sample
+ *                              Varint      -- n, the number of changes
+ *                              Change*n
+ *         | HP_BIN_MARK        SVarint     -- time since the last sample
+ *
+ * Change  : Varint                -- identifier number
+ *           SVarint               -- value less its value in the last sample
+ *
+ * String  : the bytes of the string, then a zero byte
+ * Varint  : an unsigned integer, 7 bits to a byte, least significant
+ *           first, with the top bit set in all but the last byte
+ * SVarint : a signed integer i, as the Varint (i << 1) ^ (i >> 63)
+ *
+ * Each record starts with a one-byte tag.  Identifiers are numbered
+ * from 0, in the order their HP_BIN_IDENT records appear, and an
+ * identifier's HP_BIN_IDENT comes before any sample that mentions it.
+ * Two identifiers may have the same name.  Times are in microseconds
+ * of SAMPLE_UNIT (the first sample's is relative to 0), and values in
+ * VALUE_UNIT.  Every identifier's value is 0 until a sample changes
+ * it; a sample that doesn't mention an identifier leaves its value as
+ * it was.
+ *
+ * The magic number starts with a byte that no text profile starts
+ * with, and has a CR LF and a ^Z in it, so that a file mangled by
+ * text-mode I/O is noticed.  Its last byte is the version, which
+ * changes if the format does.
+ *
+ * -------------------------------------------------------------------------- */
+
+#ifndef RTS_HEAPPROFILEFORMAT_H
+#define RTS_HEAPPROFILEFORMAT_H
+
+#define HP_BIN_MAGIC        "\211GHP\r\n\032\001"
+#define HP_BIN_MAGIC_LEN    8
+
+#define HP_BIN_JOB          1
+#define HP_BIN_DATE         2
+#define HP_BIN_SAMPLE_UNIT  3
+#define HP_BIN_VALUE_UNIT   4
+#define HP_BIN_IDENT        5
+#define HP_BIN_SAMPLE       6
+#define HP_BIN_MARK         7
+
+#endif /* RTS_HEAPPROFILEFORMAT_H */
@@ -40,6 +40,9 @@ HsInt unloadObj( pathchar *path );
 /* add an obj (populate the global symbol table, but don't resolve yet) */
 HsInt loadObj( pathchar *path );
 
+/* add several objs at once, in parallel where possible */
+HsInt loadObjs( pathchar **paths, HsInt n );
+
 /* add an arch (populate the global symbol table, but don't resolve yet) */
 HsInt loadArchive( pathchar *path );
 
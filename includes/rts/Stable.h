@@ -32,12 +32,15 @@ typedef struct {
 } spEntry;
 
 extern DLL_IMPORT_RTS snEntry *stable_name_table;
-extern DLL_IMPORT_RTS spEntry *stable_ptr_table;
+
+/* The segments of the stable pointer table; see SPT_SEGMENT_BITS */
+extern DLL_IMPORT_RTS spEntry **stable_ptr_table;
 
 EXTERN_INLINE
 StgPtr deRefStablePtr(StgStablePtr sp)
 {
-    return stable_ptr_table[(StgWord)sp].addr;
+    return stable_ptr_table[(StgWord)sp >> SPT_SEGMENT_BITS]
+                           [(StgWord)sp & SPT_SEGMENT_MASK].addr;
 }
 
 #endif /* RTS_STABLE_H */
@@ -76,7 +76,7 @@ typedef struct bdescr_ {
 
     StgWord16 gen_no;          // gen->no, cached
     StgWord16 dest_no;         // number of destination generation
-    StgWord16 _pad1;
+    StgWord16 node;            // which NUMA node does this block live on?
 
     StgWord16 flags;           // block flags, see below
 
@@ -119,6 +119,14 @@ typedef struct bdescr_ {
 #define BF_KNOWN     128
 /* Block was swept in the last generation */
 #define BF_SWEPT     256
+/* Block is in the snapshot of an incremental mark (see sm/IncMark.c) */
+#define BF_SNAPSHOT  512
+/* Large object has been marked by the incremental mark */
+#define BF_INCMARKED 1024
+/* Free block group was already free when decayFreeMemory() last looked */
+#define BF_IDLE      2048
+/* Free block group's memory has been given back to the OS */
+#define BF_RELEASED  4096
 
 /* Finding the block descriptor for a given block -------------------------- */
 
@@ -251,6 +259,14 @@ bdescr *allocBlock(void);
 bdescr *allocGroup_lock(W_ n);
 bdescr *allocBlock_lock(void);
 
+// versions that allocate memory on a particular NUMA node (an index
+// into numa_map[], see Capability.h); the plain versions above
+// allocate on node 0:
+bdescr *allocGroupOnNode(nat node, W_ n);
+bdescr *allocBlockOnNode(nat node);
+bdescr *allocGroupOnNode_lock(nat node, W_ n);
+bdescr *allocBlockOnNode_lock(nat node);
+
 /* De-Allocation ----------------------------------------------------------- */
 
 void freeGroup(bdescr *p);
@@ -361,6 +361,8 @@ struct StgTRecHeader_ {
   StgTRecChunk              *current_chunk;
   StgInvariantCheckQueue    *invariants_to_check;
   TRecState                  state;
+  StgWord                    read_version; // STM_TL2 only: see STM.c
+  StgWord                    irrevocable;  // see stmBackoff() in STM.c
 };
 
 typedef struct {
@@ -210,6 +210,13 @@ typedef struct _GCStats {
   StgDouble gc_wall_seconds;
   StgDouble cpu_seconds;
   StgDouble wall_seconds;
+  // The distribution of GC pauses (elapsed time, not counting the
+  // wait for the other Capabilities to stop), to within 1/8 of the
+  // pause (see Stats.c)
+  StgDouble pause_p50_seconds;
+  StgDouble pause_p99_seconds;
+  StgDouble pause_p999_seconds;
+  StgDouble pause_max_seconds;
 } GCStats;
 void getGCStats (GCStats *s);
 rtsBool getGCStatsEnabled (void);
@@ -224,6 +231,28 @@ typedef struct _ParGCStats {
 } ParGCStats;
 void getParGCStats (ParGCStats *s);
 
+typedef struct _STMStats {
+  StgWord64 commits;            // transactions committed
+  StgWord64 aborts;             // commits that failed validation
+  StgWord64 retries;            // transactions that blocked in retry
+  StgWord64 backoffs;           // times a thread yielded to back off
+  StgWord64 irrevocable;        // transactions that ran irrevocably
+} STMStats;
+void getSTMStats (STMStats *s);
+
+/* Stats on spark creation/conversion, for each Capability */
+typedef struct _SparkCounters {
+  StgWord created;
+  StgWord dud;
+  StgWord overflowed;
+  StgWord converted;
+  StgWord gcd;
+  StgWord fizzled;
+  StgWord steal_attempts;       // pools we tried to steal from
+  StgWord steals;               // attempts that got a spark
+} SparkCounters;
+void getSparkStats (SparkCounters *s);
+
 /*
 typedef struct _TaskStats {
   StgWord64 mut_time;
@@ -234,8 +263,6 @@ typedef struct _TaskStats {
 // would need to allocate arbitrarily large amount of memory
 // because it's a linked list of results
 void getTaskStats (TaskStats **s);
-// Need to stuff SparkCounters in a public header file...
-void getSparkStats (SparkCounters *s);
 */
 
 // Returns the total number of bytes allocated since the start of the program.
@@ -18,6 +18,7 @@ extern W_ mblocks_allocated;
 extern void initMBlocks(void);
 extern void * getMBlock(void);
 extern void * getMBlocks(nat n);
+extern void * getMBlocksOnNode(nat node, nat n);
 extern void freeMBlocks(void *addr, nat n);
 extern void freeAllMBlocks(void);
 
@@ -120,10 +121,25 @@ extern StgWord8 mblock_map[];
  1 bit for the value.  The cache can be as big as we like, but
  currently we use 8k entries, giving us 8GB capacity.
 
+ Better still is not to need the cache at all.  On Unix-like systems
+ we reserve one big aligned range of address space at startup (+RTS
+ --heap-reserve, 1TB by default), without any memory behind it, and
+ take mblocks from the range, committing memory to them as they are
+ allocated.  For an address in the range, HEAP_ALLOCED is then one
+ unsigned comparison and a bit of a bitmap with a bit per mblock of
+ the range (128KB for 1TB), which stays in the cache.  Addresses
+ outside the range, which include all the static closures, go to the
+ cache above, as do mblocks we had to get outside the range because
+ the range was full, or couldn't be reserved.
+
  ---------------------------------------------------------------------------- */
 
 #elif SIZEOF_VOID_P == 8
 
+#if !defined(mingw32_HOST_OS)
+#define USE_HEAP_RESERVATION 1
+#endif
+
 #define MBC_LINE_BITS 0
 #define MBC_TAG_BITS 15
 
@@ -160,6 +176,27 @@ extern W_ mpc_misses;
 
 StgBool HEAP_ALLOCED_miss(StgWord mblock, void *p);
 
+#if defined(USE_HEAP_RESERVATION)
+// The reserved range is [mblock_heap_start, mblock_heap_start +
+// mblock_heap_size), or empty if mblock_heap_size is 0.
+extern StgWord mblock_heap_start;
+extern StgWord mblock_heap_size;
+extern StgWord *mblock_heap_bitmap;
+
+// Is p in an allocated mblock of the reserved range?  The only
+// question if p is in the range at all.
+#define HEAP_RESERVED(p) \
+    ((StgWord)(p) - mblock_heap_start < mblock_heap_size)
+
+INLINE_HEADER
+StgBool HEAP_ALLOCED_RESERVED(void *p)
+{
+    StgWord mblock = ((StgWord)p - mblock_heap_start) >> MBLOCK_SHIFT;
+    return (mblock_heap_bitmap[mblock / BITS_IN(StgWord)]
+            >> (mblock % BITS_IN(StgWord))) & 1;
+}
+#endif
+
 INLINE_HEADER
 StgBool HEAP_ALLOCED(void *p)
 {
@@ -167,6 +204,12 @@ StgBool HEAP_ALLOCED(void *p)
     nat entry_no;
     MbcCacheLine entry, value;
 
+#if defined(USE_HEAP_RESERVATION)
+    if (HEAP_RESERVED(p)) {
+        return HEAP_ALLOCED_RESERVED(p);
+    }
+#endif
+
     mblock   = (StgWord)p >> MBLOCK_SHIFT;
     entry_no = mblock & (MBC_ENTRIES-1);
     entry    = mblock_cache[entry_no];
@@ -196,6 +239,15 @@ StgBool HEAP_ALLOCED_GC(void *p)
     MbcCacheLine entry, value;
     StgBool b;
 
+#if defined(USE_HEAP_RESERVATION)
+    // The bitmap only changes under gc_alloc_block_sync or with the
+    // mutators stopped, and a bit only changes for an mblock that
+    // nobody has a pointer into, so reading it needs no lock.
+    if (HEAP_RESERVED(p)) {
+        return HEAP_ALLOCED_RESERVED(p);
+    }
+#endif
+
     mblock   = (StgWord)p >> MBLOCK_SHIFT;
     entry_no = mblock & (MBC_ENTRIES-1);
     entry    = mblock_cache[entry_no];
@@ -55,11 +55,10 @@ typedef union {
   StgAsyncIOResult *async_result;
 #endif
 #if !defined(THREADED_RTS)
-  StgWord target;
-    // Only for the non-threaded RTS: the target time for a thread
-    // blocked in threadDelay, in units of 1ms.  This is a
-    // compromise: we don't want to take up much space in the TSO.  If
-    // you want better resolution for threadDelay, use -threaded.
+  StgWord sleeping_index;
+    // Only for the non-threaded RTS: the position of a thread
+    // blocked in threadDelay in the heap of sleeping threads, which
+    // holds its target time (see posix/Select.c).
 #endif
 } StgTSOBlockInfo;
 
@@ -168,6 +167,13 @@ typedef struct StgTSO_ {
      */
     StgWord32  tot_stack_size;
 
+    /*
+     * The number of times in a row that this thread's transaction has
+     * failed to commit; the STM's contention manager uses it to decide
+     * how long to back off for.
+     */
+    StgWord32  stm_aborts;
+
 } *StgTSOPtr;
 
 typedef struct StgStack_ {
@@ -225,7 +231,7 @@ void dirty_STACK (Capability *cap, StgStack *stack);
 
         BlockedOnRead          NULL                 blocked_queue
         BlockedOnWrite         NULL		    blocked_queue
-        BlockedOnDelay         NULL                 blocked_queue
+        BlockedOnDelay         NULL                 sleeping threads heap
 	BlockedOnGA            closure TSO blocks on   BQ of that closure
 	BlockedOnGA_NoSend     closure TSO blocks on   BQ of that closure
 
@@ -57,6 +57,7 @@ RTS_RET(stg_catch_frame);
 RTS_RET(stg_catch_retry_frame);
 RTS_RET(stg_atomically_frame);
 RTS_RET(stg_atomically_waiting_frame);
+RTS_RET(stg_atomically_backoff_frame);
 RTS_RET(stg_catch_stm_frame);
 RTS_RET(stg_unmaskAsyncExceptionszh_ret);
 RTS_RET(stg_maskUninterruptiblezh_ret);
@@ -435,6 +436,7 @@ RTS_FUN_DECL(stg_retryzh);
 RTS_FUN_DECL(stg_catchRetryzh);
 RTS_FUN_DECL(stg_catchSTMzh);
 RTS_FUN_DECL(stg_atomicallyzh);
+RTS_FUN_DECL(stg_atomically_backoff);
 RTS_FUN_DECL(stg_newTVarzh);
 RTS_FUN_DECL(stg_readTVarzh);
 RTS_FUN_DECL(stg_readTVarIOzh);
@@ -464,7 +466,6 @@ extern StgWord rts_breakpoint_io_action[];
 
 // Schedule.c
 extern StgWord RTS_VAR(blocked_queue_hd), RTS_VAR(blocked_queue_tl);
-extern StgWord RTS_VAR(sleeping_queue);
 extern StgWord RTS_VAR(blackhole_queue);
 extern StgWord RTS_VAR(sched_mutex);
 
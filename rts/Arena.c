@@ -32,8 +32,9 @@ struct _Arena {
 };
 
 // We like to keep track of how many blocks we've allocated for 
-// Storage.c:memInventory().
-static long arena_blocks = 0;
+// Storage.c:memInventory().  The GC threads fill arenas of their own
+// during a parallel heap census, so we count atomically.
+static volatile StgWord arena_blocks = 0;
 
 // Begin a new arena
 Arena *
@@ -46,7 +47,7 @@ newArena( void )
     arena->current->link = NULL;
     arena->free = arena->current->start;
     arena->lim  = arena->current->start + BLOCK_SIZE_W;
-    arena_blocks++;
+    atomic_inc(&arena_blocks, 1);
 
     return arena;
 }
@@ -82,7 +83,7 @@ arenaAlloc( Arena *arena, size_t size )
 	// allocate a fresh block...
 	req_blocks =  (W_)BLOCK_ROUND_UP(size) / BLOCK_SIZE;
 	bd = allocGroup_lock(req_blocks);
-	arena_blocks += req_blocks;
+	atomic_inc(&arena_blocks, req_blocks);
 
 	bd->gen_no  = 0;
 	bd->gen     = NULL;
@@ -105,8 +106,8 @@ arenaFree( Arena *arena )
 
     for (bd = arena->current; bd != NULL; bd = next) {
 	next = bd->link;
-	arena_blocks -= bd->blocks;
-	ASSERT(arena_blocks >= 0);
+	ASSERT(arena_blocks >= bd->blocks);
+	atomic_inc(&arena_blocks, -(StgWord)bd->blocks);
 	freeGroup_lock(bd);
     }
     stgFree(arena);
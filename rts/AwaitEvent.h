@@ -19,6 +19,37 @@
  */
 RTS_PRIVATE void awaitEvent(rtsBool wait);  /* In posix/Select.c or
                                              * win32/AwaitEvent.c */
+
+#if !defined(mingw32_HOST_OS)
+/* removeThreadFromBlockedQueue(cap, tso)
+ *
+ * Removes a thread that is BlockedOnRead or BlockedOnWrite from
+ * wherever the I/O manager is keeping it.
+ *
+ * Locks assumed   :  sched_mutex
+ */
+RTS_PRIVATE void removeThreadFromBlockedQueue (Capability *cap, StgTSO *tso);
+
+/* Evacuate the threads waiting on file descriptors (a GC root) */
+RTS_PRIVATE void markFdWaiters (evac_fn evac, void *user);
+
+/* removeSleepingThread(tso)
+ *
+ * Removes a thread that is BlockedOnDelay from the sleeping threads.
+ *
+ * Locks assumed   :  sched_mutex
+ */
+RTS_PRIVATE void removeSleepingThread (StgTSO *tso);
+
+/* Evacuate the threads blocked in threadDelay (a GC root) */
+RTS_PRIVATE void markSleepingThreads (evac_fn evac, void *user);
+
+/* Called in the child of forkProcess(): forget any OS-level
+ * registrations that are shared with the parent.
+ */
+RTS_PRIVATE void resetAwaitEventAfterFork (void);
+#endif
+
 #endif
 
 #endif /* AWAITEVENT_H */
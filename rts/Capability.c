@@ -26,6 +26,7 @@
 #include "sm/GC.h" // for gcWorkerThread()
 #include "STM.h"
 #include "RtsUtils.h"
+#include "sm/OSMem.h"
 
 #include <string.h>
 
@@ -49,6 +50,12 @@ Capability **capabilities = NULL;
 // locking, so we don't do that.
 Capability *last_free_capability = NULL;
 
+// Logical NUMA nodes are numbered 0..n_numa_nodes-1, and numa_map[]
+// maps each one to the OS's node number.  Without --numa there is a
+// single logical node.
+nat n_numa_nodes = 1;
+nat numa_map[MAX_NUMA_NODES];
+
 /*
  * Indicates that the RTS wants to synchronise all the Capabilities
  * for some reason.  All Capabilities should stop and return to the
@@ -81,13 +88,101 @@ globalWorkToDo (void)
 #endif
 
 #if defined(THREADED_RTS)
+
+/* -----------------------------------------------------------------------------
+ * Stealing sparks
+ *
+ * A Capability with no sparks of its own tries the others in a random
+ * order, starting with those on its own NUMA node, so that every
+ * thief doesn't start with Capability 0 and sparks tend to be run
+ * near the memory they were created in.  When it finds a spark, it
+ * takes up to half of the rest of the pool too (at most
+ * STEAL_BATCH_MAX), and puts them in its own pool, so that it doesn't
+ * have to come back for each one.
+ * -------------------------------------------------------------------------- */
+
+#define STEAL_BATCH_MAX 32
+
+STATIC_INLINE nat
+stealRandom (Capability *cap)
+{
+    // xorshift
+    StgWord32 x = cap->steal_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    cap->steal_seed = x;
+    return x;
+}
+
+// Move up to half of the sparks left in robbed's pool to our own.
+static void
+stealMoreSparks (Capability *cap, Capability *robbed)
+{
+    StgClosure *spark;
+    long n;
+
+    n = sparkPoolSize(robbed->sparks) / 2;
+    if (n > STEAL_BATCH_MAX) n = STEAL_BATCH_MAX;
+
+    // pushWSDeque() fails if our pool is full, and we can't give the
+    // spark back, so stop well short of that.
+    for (; n > 0 && sparkPoolSize(cap->sparks) + 1
+                      < (long)RtsFlags.ParFlags.maxLocalSparks; n--) {
+        spark = tryStealSpark(robbed->sparks);
+        if (spark == NULL) return;
+        if (fizzledSpark(spark)) {
+            cap->spark_stats.fizzled++;
+            traceEventSparkFizzle(cap);
+            continue;
+        }
+        pushWSDeque(cap->sparks, spark);
+    }
+}
+
+// Try to steal a spark from robbed.  Sets *retry if we lost a race
+// with another thief.
+static StgClosure *
+stealSparkFrom (Capability *cap, Capability *robbed, rtsBool *retry)
+{
+    StgClosure *spark;
+
+    if (emptySparkPoolCap(robbed)) // nothing to steal here
+        return NULL;
+
+    cap->spark_stats.steal_attempts++;
+
+    spark = tryStealSpark(robbed->sparks);
+    while (spark != NULL && fizzledSpark(spark)) {
+        cap->spark_stats.fizzled++;
+        traceEventSparkFizzle(cap);
+        spark = tryStealSpark(robbed->sparks);
+    }
+    if (spark == NULL) {
+        if (!emptySparkPoolCap(robbed)) {
+            // we conflicted with another thread while trying to steal;
+            // try again later.
+            *retry = rtsTrue;
+        }
+        return NULL;
+    }
+
+    cap->spark_stats.steals++;
+    cap->spark_stats.converted++;
+    traceEventSparkSteal(cap, robbed->no);
+
+    stealMoreSparks(cap, robbed);
+
+    return spark;
+}
+
 StgClosure *
 findSpark (Capability *cap)
 {
   Capability *robbed;
   StgClosurePtr spark;
   rtsBool retry;
-  nat i = 0;
+  nat i, start, pass;
 
   if (!emptyRunQueue(cap) || cap->returning_tasks_hd != NULL) {
       // If there are other threads, don't try to run any new
@@ -129,35 +224,24 @@ findSpark (Capability *cap)
                  "cap %d: Trying to steal work from other capabilities", 
                  cap->no);
 
-      /* visit cap.s 0..n-1 in sequence until a theft succeeds. We could
-      start at a random place instead of 0 as well.  */
-      for ( i=0 ; i < n_capabilities ; i++ ) {
-          robbed = capabilities[i];
-          if (cap == robbed)  // ourselves...
-              continue;
-
-          if (emptySparkPoolCap(robbed)) // nothing to steal here
-              continue;
-
-          spark = tryStealSpark(robbed->sparks);
-          while (spark != NULL && fizzledSpark(spark)) {
-              cap->spark_stats.fizzled++;
-              traceEventSparkFizzle(cap);
-              spark = tryStealSpark(robbed->sparks);
-          }
-          if (spark == NULL && !emptySparkPoolCap(robbed)) {
-              // we conflicted with another thread while trying to steal;
-              // try again later.
-              retry = rtsTrue;
+      // visit the other Capabilities from a random place, those on our
+      // own NUMA node (pass 0) before the rest (pass 1).
+      start = stealRandom(cap) % n_capabilities;
+      for (pass = 0; pass < (n_numa_nodes > 1 ? 2 : 1); pass++) {
+          for (i = 0; i < n_capabilities; i++) {
+              robbed = capabilities[(start + i) % n_capabilities];
+              if (cap == robbed)  // ourselves...
+                  continue;
+              if (n_numa_nodes > 1 &&
+                  (robbed->node == cap->node) != (pass == 0))
+                  continue;
+
+              spark = stealSparkFrom(cap, robbed, &retry);
+              if (spark != NULL) {
+                  return spark;
+              }
+              // otherwise: no success, try next one
           }
-
-          if (spark != NULL) {
-              cap->spark_stats.converted++;
-              traceEventSparkSteal(cap, robbed->no);
-              
-              return spark;
-          }
-          // otherwise: no success, try next one
       }
   } while (retry);
 
@@ -232,12 +316,14 @@ initCapability( Capability *cap, nat i )
     nat g;
 
     cap->no = i;
+    cap->node = capNoToNumaNode(i);
     cap->in_haskell        = rtsFalse;
     cap->idle              = 0;
     cap->disabled          = rtsFalse;
 
     cap->run_queue_hd      = END_TSO_QUEUE;
     cap->run_queue_tl      = END_TSO_QUEUE;
+    cap->n_run_queue       = 0;
 
 #if defined(THREADED_RTS)
     initMutex(&cap->lock);
@@ -248,6 +334,7 @@ initCapability( Capability *cap, nat i )
     cap->returning_tasks_hd = NULL;
     cap->returning_tasks_tl = NULL;
     cap->inbox              = (Message*)END_TSO_QUEUE;
+    cap->steal_request      = 0;
     cap->sparks             = allocSparkPool();
     cap->spark_stats.created    = 0;
     cap->spark_stats.dud        = 0;
@@ -255,6 +342,10 @@ initCapability( Capability *cap, nat i )
     cap->spark_stats.converted  = 0;
     cap->spark_stats.gcd        = 0;
     cap->spark_stats.fizzled    = 0;
+    cap->spark_stats.steal_attempts = 0;
+    cap->spark_stats.steals     = 0;
+    cap->steal_seed             = i + 1;
+    cap->n_free_stable_ptrs     = 0;
 #endif
     cap->total_allocated        = 0;
 
@@ -278,9 +369,14 @@ initCapability( Capability *cap, nat i )
     cap->free_trec_chunks = END_STM_CHUNK_LIST;
     cap->free_trec_headers = NO_TREC;
     cap->transaction_tokens = 0;
+    cap->stm_seed = i + 1;
+    memset(&cap->stm_stats, 0, sizeof(STMStats));
     cap->context_switch = 0;
     cap->pinned_object_block = NULL;
     cap->pinned_object_blocks = NULL;
+    for (g = 0; g < BLOCK_CACHE_CLASSES; g++) {
+        cap->block_cache[g] = NULL;
+    }
 
 #ifdef PROFILING
     cap->r.rCCCS = CCS_SYSTEM;
@@ -312,6 +408,43 @@ initCapabilities( void )
     traceCapsetCreate(CAPSET_OSPROCESS_DEFAULT, CapsetTypeOsProcess);
     traceCapsetCreate(CAPSET_CLOCKDOMAIN_DEFAULT, CapsetTypeClockdomain);
 
+    // Work out which NUMA nodes we are going to use.  This has to be
+    // done before we initialise any Capabilities, because each
+    // Capability is assigned to a node.
+    if (RtsFlags.GcFlags.numa) {
+        nat logical = 0, physical;
+        StgWord mask;
+
+        if (!osNumaAvailable()) {
+            errorBelch("--numa: OS reports NUMA is not available");
+            stg_exit(EXIT_FAILURE);
+        }
+        // --numa on its own means all the nodes; an explicit mask
+        // must not name nodes that the machine doesn't have.
+        if (RtsFlags.GcFlags.numaMask != ~(StgWord)0 &&
+            (RtsFlags.GcFlags.numaMask >> osNumaNodes()) != 0) {
+            errorBelch("--numa: node mask 0x%" FMT_HexWord
+                       " names nodes that don't exist (there are %d)",
+                       RtsFlags.GcFlags.numaMask, osNumaNodes());
+            stg_exit(EXIT_FAILURE);
+        }
+        mask = osNumaMask() & RtsFlags.GcFlags.numaMask;
+        for (physical = 0; physical < MAX_NUMA_NODES; physical++) {
+            if (mask & ((StgWord)1 << physical)) {
+                numa_map[logical++] = physical;
+            }
+        }
+        if (logical == 0) {
+            errorBelch("--numa: available node set is empty");
+            stg_exit(EXIT_FAILURE);
+        }
+        n_numa_nodes = logical;
+        debugTrace(DEBUG_sched, "NUMA: using %d node(s)", n_numa_nodes);
+    } else {
+        n_numa_nodes = 1;
+        numa_map[0] = 0;
+    }
+
 #if defined(THREADED_RTS)
 
 #ifndef REG_Base
@@ -454,6 +587,12 @@ releaseCapability_ (Capability* cap,
 
     cap->running_task = NULL;
 
+    // A sender may have pushed a message onto our inbox without
+    // cap->lock, after which it looks at running_task; we must look at
+    // the inbox (below) after clearing running_task, so that one of us
+    // sees the other.  See Messages.c:sendMessage().
+    store_load_barrier();
+
     // Check to see whether a worker thread can be given
     // the go-ahead to return the result of an external call..
     if (cap->returning_tasks_hd != NULL) {
@@ -692,6 +831,7 @@ yieldCapability (Capability** pCap, Task *task, rtsBool gcAllowed)
         gcWorkerThread(cap);
         traceEventGcEnd(cap);
         traceSparkCounters(cap);
+        traceSTMCounters(cap);
         // See Note [migrated bound threads 2]
         if (task->cap == cap) {
             return rtsTrue;
@@ -937,6 +1077,7 @@ shutdownCapability (Capability *cap USED_IF_THREADS,
         }
 
         traceSparkCounters(cap);
+        traceSTMCounters(cap);
 	RELEASE_LOCK(&cap->lock);
 	break;
     }
@@ -1042,7 +1183,7 @@ markCapabilities (evac_fn evac, void *user)
 #if defined(THREADED_RTS)
 rtsBool checkSparkCountInvariant (void)
 {
-    SparkCounters sparks = { 0, 0, 0, 0, 0, 0 };
+    SparkCounters sparks = { 0, 0, 0, 0, 0, 0, 0, 0 };
     StgWord64 remaining = 0;
     nat i;
 
@@ -22,8 +22,10 @@
 #define CAPABILITY_H
 
 #include "sm/GC.h" // for evac_fn
+#include "sm/BlockAlloc.h" // for BLOCK_CACHE_CLASSES
 #include "Task.h"
 #include "Sparks.h"
+#include "Stable.h" // for STABLE_PTR_CACHE_SIZE
 
 #include "BeginPrivate.h"
 
@@ -36,6 +38,15 @@ struct Capability_ {
 
     nat no;  // capability number.
 
+    // The NUMA node on which this capability resides.  This is used to
+    // allocate node-local memory in allocate().
+    //
+    // Note: this is always equal to cap->no % n_numa_nodes.
+    // The reason we slice it this way is that if we add or remove
+    // capabilities via setNumCapabilities(), then we keep the number of
+    // capabilities on each NUMA node balanced.
+    nat node;
+
     // The Task currently holding this Capability.  This task has
     // exclusive access to the contents of this Capability (apart from
     // returning_tasks_hd/returning_tasks_tl).
@@ -57,6 +68,7 @@ struct Capability_ {
     // also lock-free.
     StgTSO *run_queue_hd;
     StgTSO *run_queue_tl;
+    nat n_run_queue;            // length of the run queue
 
     // Tasks currently making safe foreign calls.  Doubly-linked.
     // When returning, a task first acquires the Capability before
@@ -79,6 +91,12 @@ struct Capability_ {
     // full pinned object blocks allocated since the last GC
     bdescr *pinned_object_blocks;
 
+    // Free block groups of 1..BLOCK_CACHE_CLASSES blocks, so that
+    // small block allocations don't need sm_mutex.  Only the owner
+    // of the Capability may touch these.  See "Block caches" in
+    // sm/BlockAlloc.c.
+    bdescr *block_cache[BLOCK_CACHE_CLASSES];
+
     // Context switch flag.  When non-zero, this means: stop running
     // Haskell code, and switch threads.
     int context_switch;
@@ -102,7 +120,6 @@ struct Capability_ {
     //    running_task
     //    returning_tasks_{hd,tl}
     //    wakeup_queue
-    //    inbox
     Mutex lock;
 
     // Tasks waiting to return from a foreign call, or waiting to make
@@ -113,14 +130,29 @@ struct Capability_ {
     Task *returning_tasks_hd; // Singly-linked, with head/tail
     Task *returning_tasks_tl;
 
+    // An idle Capability that wants some of our threads (its number
+    // plus one), or 0.  Set by the idle Capability with cas(); see
+    // Schedule.c:scheduleStealWork().
+    StgWord steal_request;
+
     // Messages, or END_TSO_QUEUE.
-    // Locks required: cap->lock
+    // Lock-free: other Capabilities push with cas(), and the owner
+    // takes the whole list with xchg().  See Messages.c:sendMessage().
     Message *inbox;
 
     SparkPool *sparks;
 
     // Stats on spark creation/conversion
     SparkCounters spark_stats;
+
+    // For choosing Capabilities to steal sparks from at random
+    StgWord32 steal_seed;
+
+    // Free entries of the stable pointer table, so that most
+    // getStablePtr() and freeStablePtr() calls don't need the
+    // stable_mutex.  See Stable.c.
+    StgWord free_stable_ptrs[STABLE_PTR_CACHE_SIZE];
+    nat n_free_stable_ptrs;
 #endif
     // Total words allocated by this cap since rts start
     W_ total_allocated;
@@ -131,6 +163,10 @@ struct Capability_ {
     StgTRecChunk *free_trec_chunks;
     StgTRecHeader *free_trec_headers;
     nat transaction_tokens;
+
+    // State for the STM's contention manager, and its stats
+    StgWord32 stm_seed;
+    STMStats stm_stats;
 } // typedef Capability is defined in RtsAPI.h
   // We never want a Capability to overlap a cache line with anything
   // else, so round it up to a cache line size:
@@ -218,6 +254,14 @@ extern Capability **capabilities;
 //
 extern Capability *last_free_capability;
 
+// The number of NUMA nodes we are using (1 unless --numa is on), and
+// the mapping from our logical node numbers to the OS's node numbers.
+//
+extern nat n_numa_nodes;
+extern nat numa_map[MAX_NUMA_NODES];
+
+#define capNoToNumaNode(n) ((n) % n_numa_nodes)
+
 //
 // Indicates that the RTS wants to synchronise all the Capabilities
 // for some reason.  All Capabilities should stop and return to the
@@ -3,9 +3,21 @@
  * (c) The AQUA Project, Glasgow University, 1995-1998
  * (c) The GHC Team, 1999
  *
- * Dynamically expanding linear hash tables, as described in
- * Per-\AAke Larson, ``Dynamic Hash Tables,'' CACM 31(4), April 1988,
- * pp. 446 -- 457.
+ * Open-addressing hash tables.
+ *
+ * The table is an array of (key, data) slots, divided into groups of
+ * HGROUP, with a control byte for each slot that says whether it is
+ * empty, deleted, or full, and if full, holds 7 bits of the key's
+ * hash.  A lookup hashes to a group and compares the control bytes of
+ * the whole group with the hash at once (treating the 8 bytes as a
+ * word), so it only looks at the keys whose hash bits match: usually
+ * just the one it is after.  If the group has no match and no empty
+ * slot, it goes on to another group.  This is the scheme of Google's
+ * SwissTable, done with word operations rather than SIMD.
+ *
+ * Compared with separate chaining, there is no pointer to chase per
+ * probe and no cell to allocate per insertion, and all of the probing
+ * happens in a few bytes of control data.
  * -------------------------------------------------------------------------- */
 
 #include "PosixSource.h"
@@ -16,87 +28,75 @@
 
 #include <string.h>
 
-#define HSEGSIZE    1024    /* Size of a single hash table segment */
-			    /* Also the minimum size of a hash table */
-#define HDIRSIZE    1024    /* Size of the segment directory */
-			    /* Maximum hash table size is HSEGSIZE * HDIRSIZE */
-#define HLOAD	    5	    /* Maximum average load of a single hash bucket */
+#define HGROUP      8       /* Slots in a group: one word of control bytes */
+#define HMINGROUPS  4       /* Groups in a new table (a power of 2) */
 
-#define HCHUNK	    (1024 * sizeof(W_) / sizeof(HashList))
-			    /* Number of HashList cells to allocate in one go */
+/* Control bytes.  A full slot holds the low 7 bits of the hash */
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xfe
 
+#define GROUP_LSBS  ((StgWord64)0x0101010101010101ULL)
+#define GROUP_MSBS  ((StgWord64)0x8080808080808080ULL)
 
-/* Linked list of (key, data) pairs for separate chaining */
-typedef struct hashlist {
+typedef struct hashentry {
     StgWord key;
     void *data;
-    struct hashlist *next;  /* Next cell in bucket chain (same hash value) */
-} HashList;
-
-typedef struct chunklist {
-  HashList *chunk;
-  struct chunklist *next;
-} HashListChunk;
+} HashEntry;
 
 struct hashtable {
-    int split;		    /* Next bucket to split when expanding */
-    int max;		    /* Max bucket of smaller table */
-    int mask1;		    /* Mask for doing the mod of h_1 (smaller table) */
-    int mask2;		    /* Mask for doing the mod of h_2 (larger table) */
-    int kcount;		    /* Number of keys */
-    int bcount;		    /* Number of buckets */
-    HashList **dir[HDIRSIZE];	/* Directory of segments */
-    HashList *freeList;         /* free list of HashLists */
-    HashListChunk *chunks;
+    HashEntry *slots;           /* (mask + 1) * HGROUP of them */
+    StgWord8 *ctrl;             /* control byte for each slot */
+    nat mask;                   /* Mask for the group number */
+    int kcount;                 /* Number of keys */
+    nat used;                   /* Number of slots full or deleted */
     HashFunction *hash;         /* hash function */
     CompareFunction *compare;   /* key comparison function */
 };
 
+/* Slots that may be full or deleted before we grow or clean the table */
+#define MAX_USED(table)   (((table)->mask + 1) * HGROUP / 8 * 7)
+
 /* -----------------------------------------------------------------------------
- * Hash first using the smaller table.  If the bucket is less than the
- * next bucket to be split, re-hash using the larger table.
+ * Hash functions.  These return a well-mixed hash of the whole key; the
+ * table takes the bits it needs.
  * -------------------------------------------------------------------------- */
 
 int
-hashWord(HashTable *table, StgWord key)
+hashWord(HashTable *table STG_UNUSED, StgWord key)
 {
-    int bucket;
-
-    /* Strip the boring zero bits */
-    key /= sizeof(StgWord);
+    StgWord64 h = key;
 
-    /* Mod the size of the hash table (a power of 2) */
-    bucket = key & table->mask1;
+    /* The finaliser of MurmurHash3: pointers only differ in a few of
+     * their bits, and we want every bit of the hash to depend on them */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
 
-    if (bucket < table->split) {
-	/* Mod the size of the expanded hash table (also a power of 2) */
-	bucket = key & table->mask2;
-    }
-    return bucket;
+    return (int)h;
 }
 
 int
-hashStr(HashTable *table, char *key)
+hashStr(HashTable *table STG_UNUSED, char *key)
 {
-    int h, bucket;
+    StgWord32 h;
     char *s;
 
-    s = key;
-    for (h=0; *s; s++) {
-	h *= 128;
-	h += *s;
-	h = h % 1048583;	/* some random large prime */
+    /* FNV-1a */
+    h = 2166136261U;
+    for (s = key; *s; s++) {
+        h ^= (StgWord8)*s;
+        h *= 16777619U;
     }
 
-    /* Mod the size of the hash table (a power of 2) */
-    bucket = h & table->mask1;
-
-    if (bucket < table->split) {
-	/* Mod the size of the expanded hash table (also a power of 2) */
-	bucket = h & table->mask2;
-    }
+    /* FNV leaves the high bits, which we use for the control byte,
+     * weaker than the low ones */
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
 
-    return bucket;
+    return (int)h;
 }
 
 static int
@@ -111,195 +111,240 @@ compareStr(StgWord key1, StgWord key2)
     return (strcmp((char *)key1, (char *)key2) == 0);
 }
 
-
 /* -----------------------------------------------------------------------------
- * Allocate a new segment of the dynamically growing hash table.
+ * Looking at a group of control bytes at once
  * -------------------------------------------------------------------------- */
 
-static void
-allocSegment(HashTable *table, int segment)
+/* Byte i of the group is bits 8i..8i+7 of the result, whatever the
+ * byte order; compilers turn this into a single load. */
+STATIC_INLINE StgWord64
+loadGroup (StgWord8 *p)
 {
-    table->dir[segment] = stgMallocBytes(HSEGSIZE * sizeof(HashList *), 
-					 "allocSegment");
+    return  (StgWord64)p[0]        | (StgWord64)p[1] << 8
+          | (StgWord64)p[2] << 16  | (StgWord64)p[3] << 24
+          | (StgWord64)p[4] << 32  | (StgWord64)p[5] << 40
+          | (StgWord64)p[6] << 48  | (StgWord64)p[7] << 56;
 }
 
+/* The top bit of each byte that equals b.  A byte just after a real
+ * match may match spuriously, which costs only a key comparison. */
+STATIC_INLINE StgWord64
+matchByte (StgWord64 g, StgWord8 b)
+{
+    StgWord64 x = g ^ (GROUP_LSBS * b);
+    return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+/* CTRL_EMPTY is the only control byte with bit 7 set and bit 1 clear */
+STATIC_INLINE StgWord64
+matchEmpty (StgWord64 g)
+{
+    return g & ~(g << 6) & GROUP_MSBS;
+}
+
+/* Empty or deleted: full slots have bit 7 clear */
+STATIC_INLINE StgWord64
+matchFree (StgWord64 g)
+{
+    return g & GROUP_MSBS;
+}
+
+/* The index of the lowest byte with its top bit set */
+STATIC_INLINE nat
+lowestByte (StgWord64 m)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(m) / 8;
+#else
+    nat i = 0;
+    while (!(m & 0x80)) {
+        m >>= 8;
+        i++;
+    }
+    return i;
+#endif
+}
+
+#define HASH_GROUP(h)  ((nat)(h) >> 7)
+#define HASH_CTRL(h)   ((StgWord8)((h) & 0x7f))
 
 /* -----------------------------------------------------------------------------
- * Expand the larger hash table by one bucket, and split one bucket
- * from the smaller table into two parts.  Only the bucket referenced
- * by @table->split@ is affected by the expansion.
+ * Probing.  We visit the groups in triangular order from the one the
+ * hash picks, which visits every group of a table whose size is a
+ * power of 2.  The table always has an empty slot, so a search for a
+ * key that isn't there ends.
  * -------------------------------------------------------------------------- */
 
-static void
-expand(HashTable *table)
+static HashEntry *
+findEntry (HashTable *table, StgWord key, int h)
 {
-    int oldsegment;
-    int oldindex;
-    int newbucket;
-    int newsegment;
-    int newindex;
-    HashList *hl;
-    HashList *next;
-    HashList *old, *new;
-
-    if (table->split + table->max >= HDIRSIZE * HSEGSIZE)
-	/* Wow!  That's big.  Too big, so don't expand. */
-	return;
-
-    /* Calculate indices of bucket to split */
-    oldsegment = table->split / HSEGSIZE;
-    oldindex = table->split % HSEGSIZE;
-
-    newbucket = table->max + table->split;
-
-    /* And the indices of the new bucket */
-    newsegment = newbucket / HSEGSIZE;
-    newindex = newbucket % HSEGSIZE;
-
-    if (newindex == 0)
-	allocSegment(table, newsegment);
-
-    if (++table->split == table->max) {
-	table->split = 0;
-	table->max *= 2;
-	table->mask1 = table->mask2;
-	table->mask2 = table->mask2 << 1 | 1;
-    }
-    table->bcount++;
-
-    /* Split the bucket, paying no attention to the original order */
-
-    old = new = NULL;
-    for (hl = table->dir[oldsegment][oldindex]; hl != NULL; hl = next) {
-	next = hl->next;
-	if (table->hash(table, hl->key) == newbucket) {
-	    hl->next = new;
-	    new = hl;
-	} else {
-	    hl->next = old;
-	    old = hl;
-	}
+    StgWord8 c = HASH_CTRL(h);
+    nat g = HASH_GROUP(h) & table->mask;
+    nat step = 0;
+    StgWord64 ctrl, m;
+    HashEntry *e;
+
+    for (;;) {
+        ctrl = loadGroup(&table->ctrl[g * HGROUP]);
+        for (m = matchByte(ctrl, c); m != 0; m &= m - 1) {
+            e = &table->slots[g * HGROUP + lowestByte(m)];
+            if (table->compare(e->key, key)) {
+                return e;
+            }
+        }
+        if (matchEmpty(ctrl) != 0) {
+            return NULL;
+        }
+        g = (g + ++step) & table->mask;
     }
-    table->dir[oldsegment][oldindex] = old;
-    table->dir[newsegment][newindex] = new;
-
-    return;
 }
 
-void *
-lookupHashTable(HashTable *table, StgWord key)
+/* The first slot that is free, in the order that findEntry() looks */
+static nat
+findFree (HashTable *table, int h)
 {
-    int bucket;
-    int segment;
-    int index;
-    HashList *hl;
-
-    bucket = table->hash(table, key);
-    segment = bucket / HSEGSIZE;
-    index = bucket % HSEGSIZE;
+    nat g = HASH_GROUP(h) & table->mask;
+    nat step = 0;
+    StgWord64 m;
+
+    for (;;) {
+        m = matchFree(loadGroup(&table->ctrl[g * HGROUP]));
+        if (m != 0) {
+            return g * HGROUP + lowestByte(m);
+        }
+        g = (g + ++step) & table->mask;
+    }
+}
 
-    for (hl = table->dir[segment][index]; hl != NULL; hl = hl->next)
-	if (table->compare(hl->key, key))
-	    return hl->data;
+/* -----------------------------------------------------------------------------
+ * Allocate the slots and control bytes for a table of n groups, all
+ * empty.
+ * -------------------------------------------------------------------------- */
 
-    /* It's not there */
-    return NULL;
+static void
+allocSlots (HashTable *table, nat groups)
+{
+    nat n = groups * HGROUP;
+
+    // one allocation: the slots, then the control bytes
+    table->slots = stgMallocBytes(n * (sizeof(HashEntry) + 1),
+                                  "allocHashTable");
+    table->ctrl = (StgWord8 *)(table->slots + n);
+    memset(table->ctrl, CTRL_EMPTY, n);
+    table->mask = groups - 1;
+    table->used = 0;
 }
 
 /* -----------------------------------------------------------------------------
- * We allocate the hashlist cells in large chunks to cut down on malloc
- * overhead.  Although we keep a free list of hashlist cells, we make
- * no effort to actually return the space to the malloc arena.
+ * When the table is too full, we move everything to a new table: twice
+ * the size if at least half of the slots hold keys, otherwise the same
+ * size, which gets rid of the deleted slots.
  * -------------------------------------------------------------------------- */
 
-static HashList *
-allocHashList (HashTable *table)
+static void
+resize (HashTable *table)
 {
-    HashList *hl, *p;
-    HashListChunk *cl;
+    HashEntry *old_slots = table->slots;
+    StgWord8 *old_ctrl = table->ctrl;
+    nat old_n = (table->mask + 1) * HGROUP;
+    nat groups = table->mask + 1;
+    nat i, j;
+    int h;
+
+    if ((nat)table->kcount * 2 >= old_n) {
+        groups *= 2;
+    }
 
-    if ((hl = table->freeList) != NULL) {
-        table->freeList = hl->next;
-    } else {
-        hl = stgMallocBytes(HCHUNK * sizeof(HashList), "allocHashList");
-	cl = stgMallocBytes(sizeof (*cl), "allocHashList: chunkList");
-        cl->chunk = hl;
-        cl->next = table->chunks;
-        table->chunks = cl;
-
-        table->freeList = hl + 1;
-        for (p = table->freeList; p < hl + HCHUNK - 1; p++)
-	    p->next = p + 1;
-	p->next = NULL;
+    allocSlots(table, groups);
+
+    for (i = 0; i < old_n; i++) {
+        if (old_ctrl[i] & 0x80) continue;  // empty or deleted
+        h = table->hash(table, old_slots[i].key);
+        j = findFree(table, h);
+        table->ctrl[j] = HASH_CTRL(h);
+        table->slots[j] = old_slots[i];
     }
-    return hl;
+    table->used = table->kcount;
+
+    stgFree(old_slots);
 }
 
-static void
-freeHashList (HashTable *table, HashList *hl)
+void *
+lookupHashTable(HashTable *table, StgWord key)
 {
-    hl->next = table->freeList;
-    table->freeList = hl;
+    HashEntry *e;
+
+    e = findEntry(table, key, table->hash(table, key));
+    if (e != NULL) {
+        return e->data;
+    }
+
+    /* It's not there */
+    return NULL;
 }
 
 void
 insertHashTable(HashTable *table, StgWord key, void *data)
 {
-    int bucket;
-    int segment;
-    int index;
-    HashList *hl;
-
-    // Disable this assert; sometimes it's useful to be able to
-    // overwrite entries in the hash table.
-    // ASSERT(lookupHashTable(table, key) == NULL);
-
-    /* When the average load gets too high, we expand the table */
-    if (++table->kcount >= HLOAD * table->bcount)
-	expand(table);
-
-    bucket = table->hash(table, key);
-    segment = bucket / HSEGSIZE;
-    index = bucket % HSEGSIZE;
-
-    hl = allocHashList(table);
+    HashEntry *e;
+    nat i;
+    int h;
+
+    h = table->hash(table, key);
+
+    // Sometimes it's useful to be able to overwrite entries in the
+    // hash table, so we replace the data of a key that is already
+    // there (there is only ever one entry for a key).
+    e = findEntry(table, key, h);
+    if (e != NULL) {
+        e->data = data;
+        return;
+    }
 
-    hl->key = key;
-    hl->data = data;
-    hl->next = table->dir[segment][index];
-    table->dir[segment][index] = hl;
+    /* When the table gets too full, we expand it */
+    if (table->used >= MAX_USED(table)) {
+        resize(table);
+    }
 
+    i = findFree(table, h);
+    if (table->ctrl[i] == CTRL_EMPTY) {
+        table->used++;
+    }
+    table->ctrl[i] = HASH_CTRL(h);
+    table->slots[i].key = key;
+    table->slots[i].data = data;
+    table->kcount++;
 }
 
 void *
 removeHashTable(HashTable *table, StgWord key, void *data)
 {
-    int bucket;
-    int segment;
-    int index;
-    HashList *hl;
-    HashList *prev = NULL;
-
-    bucket = table->hash(table, key);
-    segment = bucket / HSEGSIZE;
-    index = bucket % HSEGSIZE;
-
-    for (hl = table->dir[segment][index]; hl != NULL; hl = hl->next) {
-	if (table->compare(hl->key,key) && (data == NULL || hl->data == data)) {
-	    if (prev == NULL)
-		table->dir[segment][index] = hl->next;
-	    else
-		prev->next = hl->next;
-            freeHashList(table,hl);
-	    table->kcount--;
-	    return hl->data;
-	}
-	prev = hl;
+    HashEntry *e;
+    nat i, g;
+
+    e = findEntry(table, key, table->hash(table, key));
+
+    if (e == NULL || (data != NULL && e->data != data)) {
+        /* It's not there */
+        ASSERT(data == NULL);
+        return NULL;
     }
 
-    /* It's not there */
-    ASSERT(data == NULL);
-    return NULL;
+    i = e - table->slots;
+    g = i / HGROUP;
+
+    // A search only goes past this group if it has no empty slot, so
+    // if it does have one, the slot can be made empty rather than
+    // deleted, and used again without a resize.
+    if (matchEmpty(loadGroup(&table->ctrl[g * HGROUP])) != 0) {
+        table->ctrl[i] = CTRL_EMPTY;
+        table->used--;
+    } else {
+        table->ctrl[i] = CTRL_DELETED;
+    }
+    table->kcount--;
+
+    return e->data;
 }
 
 /* -----------------------------------------------------------------------------
@@ -311,63 +356,35 @@ removeHashTable(HashTable *table, StgWord key, void *data)
 void
 freeHashTable(HashTable *table, void (*freeDataFun)(void *) )
 {
-    long segment;
-    long index;
-    HashList *hl;
-    HashList *next;
-    HashListChunk *cl, *cl_next;
-
-    /* The last bucket with something in it is table->max + table->split - 1 */
-    segment = (table->max + table->split - 1) / HSEGSIZE;
-    index = (table->max + table->split - 1) % HSEGSIZE;
-
-    while (segment >= 0) {
-	while (index >= 0) {
-	    for (hl = table->dir[segment][index]; hl != NULL; hl = next) {
-		next = hl->next;
-		if (freeDataFun != NULL)
-		    (*freeDataFun)(hl->data);
+    nat i, n;
+
+    if (freeDataFun != NULL) {
+        n = (table->mask + 1) * HGROUP;
+        for (i = 0; i < n; i++) {
+            if (!(table->ctrl[i] & 0x80)) {
+                (*freeDataFun)(table->slots[i].data);
             }
-	    index--;
-	}
-	stgFree(table->dir[segment]);
-	segment--;
-	index = HSEGSIZE - 1;
-    }
-    for (cl = table->chunks; cl != NULL; cl = cl_next) {
-        cl_next = cl->next;
-        stgFree(cl->chunk);
-        stgFree(cl);
+        }
     }
+    stgFree(table->slots);
     stgFree(table);
 }
 
 /* -----------------------------------------------------------------------------
- * When we initialize a hash table, we set up the first segment as well,
- * initializing all of the first segment's hash buckets to NULL.
+ * A new table starts small: the profilers make a lot of tables, many
+ * of which stay small, and the table grows as it needs to.
  * -------------------------------------------------------------------------- */
 
 HashTable *
 allocHashTable_(HashFunction *hash, CompareFunction *compare)
 {
     HashTable *table;
-    HashList **hb;
 
     table = stgMallocBytes(sizeof(HashTable),"allocHashTable");
 
-    allocSegment(table, 0);
-
-    for (hb = table->dir[0]; hb < table->dir[0] + HSEGSIZE; hb++)
-	*hb = NULL;
+    allocSlots(table, HMINGROUPS);
 
-    table->split = 0;
-    table->max = HSEGSIZE;
-    table->mask1 = HSEGSIZE - 1;
-    table->mask2 = 2 * HSEGSIZE - 1;
     table->kcount = 0;
-    table->bcount = HSEGSIZE;
-    table->freeList = NULL;
-    table->chunks = NULL;
     table->hash = hash;
     table->compare = compare;
 
@@ -383,7 +400,7 @@ allocHashTable(void)
 HashTable *
 allocStrHashTable(void)
 {
-    return allocHashTable_((HashFunction *)hashStr, 
+    return allocHashTable_((HashFunction *)hashStr,
 			   (CompareFunction *)compareStr);
 }
 
@@ -13,7 +13,9 @@
 
 typedef struct hashtable HashTable; /* abstract */
 
-/* Hash table access where the keys are StgWords */
+/* Hash table access where the keys are StgWords.  A table holds at
+ * most one entry for each key: inserting a key that is already there
+ * replaces its data. */
 HashTable * allocHashTable    ( void );
 void *      lookupHashTable ( HashTable *table, StgWord key );
 void        insertHashTable ( HashTable *table, StgWord key, void *data );
@@ -36,7 +38,11 @@ HashTable * allocStrHashTable ( void );
 #define removeStrHashTable(table, key, data) \
    (removeHashTable(table, (StgWord)key, data))
 
-/* Hash tables for arbitrary keys */
+/* Hash tables for arbitrary keys.  A HashFunction returns a hash of the
+ * whole key, all of whose bits should depend on the key: the table uses
+ * some of them to pick where to look, and the rest to avoid comparing
+ * keys.  hashWord() will mix a word for you.
+ */
 typedef int HashFunction(HashTable *table, StgWord key);
 typedef int CompareFunction(StgWord key1, StgWord key2);
 HashTable * allocHashTable_(HashFunction *hash, CompareFunction *compare);
@@ -138,8 +138,26 @@
 #include <sys/tls.h>
 #endif
 
-/* Hash table mapping symbol names to Symbol */
-static /*Str*/HashTable *symhash;
+/* The symbol table, mapping symbol names to their addresses.  It is
+   split into shards, each a hash table with its own lock, so that objects
+   can be loaded and relocated in parallel (see "Loading objects in
+   parallel").  A symbol's shard is picked by the top bits of its hash. */
+#define SYMHASH_SHARD_BITS 6
+#define SYMHASH_SHARDS     (1 << SYMHASH_SHARD_BITS)
+
+typedef struct {
+    /*Str*/HashTable *table;
+#if defined(THREADED_RTS)
+    Mutex lock;
+#endif
+} SymbolShard;
+
+static SymbolShard symhash[SYMHASH_SHARDS];
+
+static void *lookupSymhash( char *key );
+static void insertSymhash( pathchar *obj_name, char *key, void *data );
+static void removeSymhash( char *key );
+static void insertOcSymbol( ObjectCode *oc, char *key, void *data );
 
 /* Hash table mapping symbol names to StgStablePtr */
 static /*Str*/HashTable *stablehash;
@@ -147,6 +165,52 @@ static /*Str*/HashTable *stablehash;
 /* List of currently loaded objects */
 ObjectCode *objects = NULL;     /* initially empty */
 
+#if defined(THREADED_RTS) && defined(OBJFORMAT_ELF)
+/* Objects are loaded in parallel: see "Loading objects in parallel" */
+#define PARALLEL_LINKER
+#endif
+
+#if defined(USE_MMAP) && defined(OBJFORMAT_ELF)
+/* Archives are loaded lazily: see "Loading archives lazily" below */
+#define LAZY_ARCHIVES
+
+typedef struct _ArchiveMember {
+    struct _Archive *archive;
+    W_ offset;                  /* of its header in the archive */
+    ObjectCode *oc;             /* once it has been loaded */
+} ArchiveMember;
+
+typedef struct _Archive {
+    pathchar *path;
+    char *image;                /* the whole archive, mmap()ed read-only */
+    W_ size;
+    char *index;                /* the symbol index member */
+    W_ indexSize;
+    int offsetSize;             /* of its entries: 4, or 8 for "/SYM64/" */
+    char *longNames;            /* GNU ar's long name member, or NULL */
+    W_ longNamesSize;
+    ArchiveMember *members;     /* those that the index mentions */
+    nat n_members;
+    struct _Archive *next;
+} Archive;
+
+/* List of archives that are loaded lazily */
+static Archive *archives = NULL;
+
+/* Hash table mapping the symbols in their indices to ArchiveMembers */
+static /*Str*/HashTable *lazysymhash;
+
+#if defined(THREADED_RTS)
+/* Held while loading a member, which objects being relocated in
+   parallel may all want at once */
+static Mutex lazy_mutex;
+#endif
+
+static void *lookupLazySymbol( char *lbl );
+static int loadArchiveLazily( pathchar *path );
+static HsBool unloadArchive( pathchar *path );
+#endif
+
 /* List of objects that have been unloaded via unloadObj(), but are waiting
    to be actually freed via checkUnload() */
 ObjectCode *unloaded_objects = NULL; /* initially empty */
@@ -155,6 +219,9 @@ ObjectCode *unloaded_objects = NULL; /* initially empty */
 typedef void (*init_t) (int argc, char **argv, char **env);
 
 static HsInt loadOc( ObjectCode* oc );
+static HsInt loadOcs( ObjectCode **ocs, nat n );
+static void *lookupSymbol_( char *lbl );
+static HsInt resolveObjsUntil( ObjectCode *stop );
 static ObjectCode* mkOc( pathchar *path, char *image, int imageSize,
                          char *archiveMemberName
 #ifndef USE_MMAP
@@ -311,6 +378,31 @@ static void *mmap_32bit_base = (void *)MMAP_32BIT_BASE_DEFAULT;
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+#if defined(THREADED_RTS)
+/* Protects mmapForLinker()'s idea of where to map next: objects may be
+   loaded in parallel */
+static Mutex mmap_mutex;
+#endif
+
+#if defined(PARALLEL_LINKER) && defined(USE_MMAP) && !defined(ALWAYS_PIC) && defined(x86_64_HOST_ARCH)
+/* .bss sections and COMMON symbols must be in the low 2Gb too, like the
+ * code that refers to them.  That's where malloc() puts things on the
+ * main thread, but on the other threads that load objects it uses arenas
+ * that can be anywhere, so we take the memory from mmapForLinker(), a
+ * chunk at a time.  It is never freed, just as malloc()ed .bss isn't.
+ */
+#define LOW_LINKER_DATA
+#define LINKER_DATA_CHUNK (1024 * 1024)
+
+static char *linker_data_free = NULL;
+static char *linker_data_lim = NULL;
+static Mutex linker_data_mutex;
+
+static void *callocForLinker( size_t bytes, char *msg );
+#else
+#define callocForLinker(bytes, msg) stgCallocBytes(1, bytes, msg)
+#endif
+
 /* -----------------------------------------------------------------------------
  * Built-in symbols from the RTS
  */
@@ -1112,6 +1204,8 @@ typedef struct _RtsSymbolVal {
       SymI_HasProto(getOrSetLibHSghcFastStringTable)                    \
       SymI_HasProto(getGCStats)                                         \
       SymI_HasProto(getGCStatsEnabled)                                  \
+      SymI_HasProto(getSTMStats)                                        \
+      SymI_HasProto(getSparkStats)                                      \
       SymI_HasProto(genericRaise)                                       \
       SymI_HasProto(getProgArgv)                                        \
       SymI_HasProto(getFullProgArgv)                                    \
@@ -1139,6 +1233,7 @@ typedef struct _RtsSymbolVal {
       SymI_HasProto(stg_killThreadzh)                                   \
       SymI_HasProto(loadArchive)                                        \
       SymI_HasProto(loadObj)                                            \
+      SymI_HasProto(loadObjs)                                           \
       SymI_HasProto(insertStableSymbol)                                 \
       SymI_HasProto(insertSymbol)                                       \
       SymI_HasProto(lookupSymbol)                                       \
@@ -1184,6 +1279,7 @@ typedef struct _RtsSymbolVal {
       SymI_HasProto(rts_evalLazyIO)                                     \
       SymI_HasProto(rts_evalStableIO)                                   \
       SymI_HasProto(rts_eval_)                                          \
+      SymI_HasProto(rts_getEventLogClasses)                             \
       SymI_HasProto(rts_getBool)                                        \
       SymI_HasProto(rts_getChar)                                        \
       SymI_HasProto(rts_getDouble)                                      \
@@ -1221,6 +1317,10 @@ typedef struct _RtsSymbolVal {
       SymI_HasProto(rts_mkWord16)                                       \
       SymI_HasProto(rts_mkWord32)                                       \
       SymI_HasProto(rts_mkWord64)                                       \
+      SymI_HasProto(rts_rotateEventLog)                                 \
+      SymI_HasProto(rts_setEventLogClasses)                             \
+      SymI_HasProto(rts_startEventLog)                                  \
+      SymI_HasProto(rts_stopEventLog)                                   \
       SymI_HasProto(rts_unlock)                                         \
       SymI_HasProto(rts_unsafeGetMyCapability)                          \
       SymI_HasProto(rtsSupportsBoundThreads)                            \
@@ -1468,17 +1568,8 @@ static RtsSymbolVal rtsSyms[] = {
  * Insert symbols into hash tables, checking for duplicates.
  */
 
-static void ghciInsertStrHashTable ( pathchar* obj_name,
-                                     HashTable *table,
-                                     char* key,
-                                     void *data
-                                   )
+static void reportDuplicateSymbol ( pathchar* obj_name, char* key )
 {
-   if (lookupHashTable(table, (StgWord)key) == NULL)
-   {
-      insertStrHashTable(table, (StgWord)key, data);
-      return;
-   }
    debugBelch(
       "\n\n"
       "GHCi runtime linker: fatal error: I found a duplicate definition for symbol\n"
@@ -1497,6 +1588,84 @@ static void ghciInsertStrHashTable ( pathchar* obj_name,
    );
    stg_exit(1);
 }
+
+static void ghciInsertStrHashTable ( pathchar* obj_name,
+                                     HashTable *table,
+                                     char* key,
+                                     void *data
+                                   )
+{
+   if (lookupHashTable(table, (StgWord)key) == NULL)
+   {
+      insertStrHashTable(table, (StgWord)key, data);
+      return;
+   }
+   reportDuplicateSymbol(obj_name, key);
+}
+
+/* -----------------------------------------------------------------------------
+ * The symbol table
+ */
+
+STATIC_INLINE nat
+symhashShard( char *key )
+{
+    return (StgWord32)hashStr(NULL, key) >> (32 - SYMHASH_SHARD_BITS);
+}
+
+static void *
+lookupSymhash( char *key )
+{
+    SymbolShard *shard = &symhash[symhashShard(key)];
+    void *val;
+
+    ACQUIRE_LOCK(&shard->lock);
+    val = lookupStrHashTable(shard->table, key);
+    RELEASE_LOCK(&shard->lock);
+    return val;
+}
+
+static void
+insertSymhash( pathchar *obj_name, char *key, void *data )
+{
+    SymbolShard *shard = &symhash[symhashShard(key)];
+
+    ACQUIRE_LOCK(&shard->lock);
+    ghciInsertStrHashTable(obj_name, shard->table, key, data);
+    RELEASE_LOCK(&shard->lock);
+}
+
+static void
+removeSymhash( char *key )
+{
+    SymbolShard *shard = &symhash[symhashShard(key)];
+
+    ACQUIRE_LOCK(&shard->lock);
+    removeStrHashTable(shard->table, key, NULL);
+    RELEASE_LOCK(&shard->lock);
+}
+
+/* A symbol defined by an object.  While loadOcs() is loading the object,
+   the symbol is put aside, to go in the table after all of the objects
+   have been loaded. */
+static void
+insertOcSymbol( ObjectCode *oc, char *key, void *data )
+{
+    if (oc->pending == NULL) {
+        insertSymhash(oc->fileName, key, data);
+        return;
+    }
+    if (oc->n_pending == oc->size_pending) {
+        oc->size_pending *= 2;
+        oc->pending = stgReallocBytes(oc->pending,
+                                      oc->size_pending * sizeof(PendingSymbol),
+                                      "insertOcSymbol");
+    }
+    oc->pending[oc->n_pending].name = key;
+    oc->pending[oc->n_pending].addr = data;
+    oc->n_pending++;
+}
+
 /* -----------------------------------------------------------------------------
  * initialize the object linker
  */
@@ -1517,6 +1686,7 @@ void
 initLinker( void )
 {
     RtsSymbolVal *sym;
+    nat i;
 #if defined(OBJFORMAT_ELF) || defined(OBJFORMAT_MACHO)
     int compileResult;
 #endif
@@ -1540,12 +1710,28 @@ initLinker( void )
     initMutex(&dl_mutex);
 #endif
     stablehash = allocStrHashTable();
-    symhash = allocStrHashTable();
+    for (i = 0; i < SYMHASH_SHARDS; i++) {
+        symhash[i].table = allocStrHashTable();
+#if defined(THREADED_RTS)
+        initMutex(&symhash[i].lock);
+#endif
+    }
+#if defined(LAZY_ARCHIVES)
+    lazysymhash = allocStrHashTable();
+#endif
+#if defined(THREADED_RTS)
+    initMutex(&mmap_mutex);
+#if defined(LOW_LINKER_DATA)
+    initMutex(&linker_data_mutex);
+#endif
+#if defined(LAZY_ARCHIVES)
+    initMutex(&lazy_mutex);
+#endif
+#endif
 
     /* populate the symbol table with stuff from the RTS */
     for (sym = rtsSyms; sym->lbl != NULL; sym++) {
-        ghciInsertStrHashTable(WSTR("(GHCi built-in symbols)"),
-                               symhash, sym->lbl, sym->addr);
+        insertSymhash(WSTR("(GHCi built-in symbols)"), sym->lbl, sym->addr);
         IF_DEBUG(linker, debugBelch("initLinker: inserting rts symbol %s, %p\n", sym->lbl, sym->addr));
     }
 #   if defined(OBJFORMAT_MACHO) && defined(powerpc_HOST_ARCH)
@@ -1884,20 +2070,29 @@ insertStableSymbol(pathchar* obj_name, char* key, StgPtr p)
 void
 insertSymbol(pathchar* obj_name, char* key, void* data)
 {
-  ghciInsertStrHashTable(obj_name, symhash, key, data);
+  insertSymhash(obj_name, key, data);
 }
 
 /* -----------------------------------------------------------------------------
  * lookup a symbol in the hash table
+ *
+ * This may load a member of an archive that defines the symbol (see
+ * "Loading archives lazily"), but doesn't resolve it: the linker itself
+ * calls this while it is resolving objects.
  */
-void *
-lookupSymbol( char *lbl )
+static void *
+lookupSymbol_( char *lbl )
 {
     void *val;
     IF_DEBUG(linker, debugBelch("lookupSymbol: looking up %s\n", lbl));
     initLinker() ;
-    ASSERT(symhash != NULL);
-    val = lookupStrHashTable(symhash, lbl);
+    val = lookupSymhash(lbl);
+
+#if defined(LAZY_ARCHIVES)
+    if (val == NULL) {
+        val = lookupLazySymbol(lbl);
+    }
+#endif
 
     if (val == NULL) {
         IF_DEBUG(linker, debugBelch("lookupSymbol: symbol not found\n"));
@@ -1948,6 +2143,24 @@ lookupSymbol( char *lbl )
     }
 }
 
+/* The address of a symbol, ready to use: if finding it loaded members of
+ * archives, those members (and only those: not objects that the caller
+ * has loaded but not resolved yet) are resolved and initialised first. */
+void *
+lookupSymbol( char *lbl )
+{
+    ObjectCode *oc;
+    void *val;
+
+    initLinker();
+    oc = objects;
+    val = lookupSymbol_(lbl);
+    if (objects != oc && !resolveObjsUntil(oc)) {
+        return NULL;
+    }
+    return val;
+}
+
 /* -----------------------------------------------------------------------------
    Create a StablePtr for a foreign export.  This is normally called by
    a C function with __attribute__((constructor)), which is generated
@@ -2002,7 +2215,7 @@ void ghci_enquire ( char* addr )
          if (sym == NULL) continue;
          a = NULL;
          if (a == NULL) {
-            a = lookupStrHashTable(symhash, sym);
+            a = lookupSymhash(sym);
          }
          if (a == NULL) {
              // debugBelch("ghci_enquire: can't find %s\n", sym);
@@ -2030,6 +2243,8 @@ mmapForLinker (size_t bytes, nat flags, int fd)
    pagesize = getpagesize();
    size = ROUND_UP(bytes, pagesize);
 
+   ACQUIRE_LOCK(&mmap_mutex);
+
 #if !defined(ALWAYS_PIC) && defined(x86_64_HOST_ARCH)
 mmap_again:
 
@@ -2087,10 +2302,37 @@ mmap_again:
    }
 #endif
 
+   RELEASE_LOCK(&mmap_mutex);
+
    IF_DEBUG(linker, debugBelch("mmapForLinker: mapped %" FMT_Word " bytes starting at %p\n", (W_)size, result));
    IF_DEBUG(linker, debugBelch("mmapForLinker: done\n"));
    return result;
 }
+
+#if defined(LOW_LINKER_DATA)
+/* Zeroed memory in the low 2Gb, for data that an object refers to */
+static void *
+callocForLinker( size_t bytes, char *msg STG_UNUSED )
+{
+    void *p;
+
+    bytes = ROUND_UP(bytes, 16);
+    if (bytes > LINKER_DATA_CHUNK / 4) {
+        return mmapForLinker(bytes, MAP_ANONYMOUS, -1);
+    }
+
+    ACQUIRE_LOCK(&linker_data_mutex);
+    if (linker_data_free == NULL || bytes > (size_t)(linker_data_lim - linker_data_free)) {
+        linker_data_free = mmapForLinker(LINKER_DATA_CHUNK, MAP_ANONYMOUS, -1);
+        linker_data_lim = linker_data_free + LINKER_DATA_CHUNK;
+    }
+    p = linker_data_free;
+    linker_data_free += bytes;
+    RELEASE_LOCK(&linker_data_mutex);
+
+    return p;
+}
+#endif
 #endif // USE_MMAP
 
 
@@ -2176,6 +2418,10 @@ mkOc( pathchar *path, char *image, int imageSize,
    oc->sections          = NULL;
    oc->proddables        = NULL;
    oc->stable_ptrs       = NULL;
+   oc->pending           = NULL;
+   oc->n_pending         = 0;
+   oc->size_pending      = 0;
+   oc->pending_shards    = NULL;
 
 #ifndef USE_MMAP
 #ifdef darwin_HOST_OS
@@ -2191,10 +2437,361 @@ mkOc( pathchar *path, char *image, int imageSize,
    return oc;
 }
 
+/* -----------------------------------------------------------------------------
+ * Loading archives lazily
+ *
+ * Loading every member of a big archive (libHSbase.a, say) takes a long
+ * time, and most programs use only a few of them.  So where we can,
+ * loadArchive() just mmap()s the archive and reads its symbol index: the
+ * "/" (or "/SYM64/") member that ar puts first, which lists each global
+ * symbol with the offset of the member that defines it.  The symbols go
+ * in lazysymhash, and nothing else is read.  When lookupSymbol_() doesn't
+ * find a symbol in symhash but does find it in lazysymhash, it loads the
+ * member, which puts all of the member's symbols in symhash just as
+ * loadObj() would.  This is what the system linker does with an archive:
+ * it takes only the members that it needs.
+ *
+ * A member loaded while resolveObjs() is relocating another object is
+ * resolved by the same resolveObjs(), which goes round again when new
+ * objects turn up.  lookupSymbol() resolves the members that it loaded
+ * (and nothing else) before it returns, so the address it returns can
+ * be used.
+ *
+ * If the indices give a symbol more than once, the first wins, as with
+ * the system linker.  An archive without an index, or with one that we
+ * can't make sense of, is loaded eagerly as before.
+ * -------------------------------------------------------------------------- */
+
+#if defined(LAZY_ARCHIVES)
+
+#define AR_HDR_SIZE 60
+
+/* The size of the member whose header is at offset off in the archive,
+   or -1 if the header is bad; *data is set to the member's contents. */
+static long
+archiveMemberAt( Archive *a, W_ off, char **data )
+{
+    char *hdr;
+    char tmp[11];
+    long size;
+
+    if (off + AR_HDR_SIZE > a->size) {
+        return -1;
+    }
+    hdr = a->image + off;
+    if (hdr[58] != '\x60' || hdr[59] != '\x0A') {
+        return -1;
+    }
+    memcpy(tmp, hdr + 48, 10);
+    tmp[10] = '\0';
+    size = strtol(tmp, NULL, 10);
+    if (size < 0 || off + AR_HDR_SIZE + size > a->size) {
+        return -1;
+    }
+    *data = hdr + AR_HDR_SIZE;
+    return size;
+}
+
+/* The name of the member whose header is at offset off: either in the
+   header, ending with '/', or "/NNN", where NNN is its offset in the
+   long name member. */
+static int
+archiveMemberName( Archive *a, W_ off, char **name )
+{
+    char *hdr = a->image + off;
+    char *end;
+    W_ n;
+
+    if (hdr[0] == '/' && isdigit((unsigned char)hdr[1])
+        && a->longNames != NULL) {
+        n = strtoul(hdr + 1, NULL, 10);
+        if (n < a->longNamesSize) {
+            *name = a->longNames + n;
+            end = memchr(*name, '/', a->longNamesSize - n);
+            return end ? end - *name : 0;
+        }
+    }
+    *name = hdr;
+    end = memchr(hdr, '/', 16);
+    if (end == NULL) {
+        end = memchr(hdr, ' ', 16);
+    }
+    return end ? end - hdr : 16;
+}
+
+STATIC_INLINE W_
+readBigEndian( char *p, int size )
+{
+    W_ w = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        w = (w << 8) | (unsigned char)p[i];
+    }
+    return w;
+}
+
+/* Check the symbol index, find the members that it mentions, and put its
+   symbols in lazysymhash.  Returns 0 if the index is bad, and then
+   lazysymhash is untouched. */
+static int
+readArchiveIndex( Archive *a )
+{
+    HashTable *byOffset;
+    ArchiveMember *m;
+    char *names, *end, *p;
+    W_ n, i, off;
+    int sz = a->offsetSize;
+
+    if (a->indexSize < (W_)sz) {
+        return 0;
+    }
+    n = readBigEndian(a->index, sz);
+    if (n == 0 || n >= a->indexSize / sz) {
+        return 0;
+    }
+    names = a->index + (n + 1) * sz;
+    end = a->index + a->indexSize;
+
+    // Check it all first, so that we don't have to undo anything
+    for (i = 0, p = names; i < n; i++) {
+        off = readBigEndian(a->index + (i + 1) * sz, sz);
+        if (off < 8 || off + AR_HDR_SIZE > a->size) {
+            return 0;
+        }
+        p = memchr(p, '\0', end - p);
+        if (p == NULL) {
+            return 0;
+        }
+        p++;
+    }
+
+    a->members = stgMallocBytes(n * sizeof(ArchiveMember),
+                                "readArchiveIndex");
+    a->n_members = 0;
+    byOffset = allocHashTable();
+
+    for (i = 0, p = names; i < n; i++, p += strlen(p) + 1) {
+        off = readBigEndian(a->index + (i + 1) * sz, sz);
+        m = lookupHashTable(byOffset, off);
+        if (m == NULL) {
+            m = &a->members[a->n_members++];
+            m->archive = a;
+            m->offset = off;
+            m->oc = NULL;
+            insertHashTable(byOffset, off, m);
+        }
+        if (lookupStrHashTable(lazysymhash, p) == NULL) {
+            insertStrHashTable(lazysymhash, p, m);
+        }
+    }
+
+    freeHashTable(byOffset, NULL);
+    IF_DEBUG(linker, debugBelch("readArchiveIndex: %" FMT_Word " symbols in %d members\n",
+                                n, a->n_members));
+    return 1;
+}
+
+static void
+freeArchive( Archive *a )
+{
+    munmap(a->image, a->size);
+    stgFree(a->path);
+    if (a->members != NULL) {
+        stgFree(a->members);
+    }
+    stgFree(a);
+}
+
+/* Returns: 1 if ok, 0 on error, or -1 if the archive should be loaded
+   eagerly instead. */
+static int
+loadArchiveLazily( pathchar *path )
+{
+    Archive *a;
+    struct_stat st;
+    char *image, *hdr, *data;
+    W_ off;
+    long size;
+    int fd;
+
+    initLinker();
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;              // the eager loader says what went wrong
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < 8 + AR_HDR_SIZE) {
+        close(fd);
+        return -1;
+    }
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -1;
+    }
+    if (strncmp(image, "!<arch>\n", 8) != 0) {
+        munmap(image, st.st_size);
+        return -1;
+    }
+
+    a = stgMallocBytes(sizeof(Archive), "loadArchiveLazily");
+    a->path = pathdup(path);
+    a->image = image;
+    a->size = st.st_size;
+    a->index = NULL;
+    a->indexSize = 0;
+    a->offsetSize = 4;
+    a->longNames = NULL;
+    a->longNamesSize = 0;
+    a->members = NULL;
+    a->n_members = 0;
+
+    // The special members come first: the symbol index, then GNU ar's
+    // long names.  Anything else starting with '/' is "/NNN", an
+    // ordinary member with a long name.
+    for (off = 8; off < a->size; off += AR_HDR_SIZE + size + (size & 1)) {
+        size = archiveMemberAt(a, off, &data);
+        hdr = image + off;
+        if (size < 0 || hdr[0] != '/') {
+            break;
+        } else if (hdr[1] == ' ') {
+            a->index = data;
+            a->indexSize = size;
+            a->offsetSize = 4;
+        } else if (strncmp(hdr, "/SYM64/ ", 8) == 0) {
+            a->index = data;
+            a->indexSize = size;
+            a->offsetSize = 8;
+        } else if (hdr[1] == '/') {
+            a->longNames = data;
+            a->longNamesSize = size;
+        } else {
+            break;
+        }
+    }
+
+    if (a->index == NULL || !readArchiveIndex(a)) {
+        IF_DEBUG(linker, debugBelch("loadArchiveLazily: no usable index in `%" PATH_FMT "', loading it eagerly\n", path));
+        freeArchive(a);
+        return -1;
+    }
+
+    a->next = archives;
+    archives = a;
+    return 1;
+}
+
+/* Load (but don't resolve) a member of an archive */
+static ObjectCode *
+loadArchiveMember( ArchiveMember *m )
+{
+    Archive *a = m->archive;
+    ObjectCode *oc;
+    char *data, *name, *image, *memberName;
+    long size;
+    int nameLen;
+
+    size = archiveMemberAt(a, m->offset, &data);
+    if (size < 0) {
+        errorBelch("loadArchive: bad member header at offset %" FMT_Word " in `%" PATH_FMT "'",
+                   m->offset, a->path);
+        return NULL;
+    }
+    nameLen = archiveMemberName(a, m->offset, &name);
+
+    // Members are only 2-byte aligned in the archive, and we need to
+    // write to the image while relocating it, so it gets its own copy.
+    image = mmapForLinker(size, MAP_ANONYMOUS, -1);
+    if (image == NULL) {
+        return NULL;
+    }
+    memcpy(image, data, size);
+
+    memberName = stgMallocBytes(pathlen(a->path) + nameLen + 3,
+                                "loadArchiveMember");
+    sprintf(memberName, "%" PATH_FMT "(%.*s)", a->path, nameLen, name);
+    IF_DEBUG(linker, debugBelch("loadArchiveMember: loading %s\n", memberName));
+    oc = mkOc(a->path, image, size, memberName);
+    stgFree(memberName);
+
+    m->oc = oc;                 // whether or not it loads: don't try again
+    if (!loadOc(oc)) {
+        errorBelch("loadArchive: failed to load %s", oc->archiveMemberName);
+        return NULL;
+    }
+    return oc;
+}
+
+static void *
+lookupLazySymbol( char *lbl )
+{
+    ArchiveMember *m;
+
+    m = lookupStrHashTable(lazysymhash, lbl);
+    if (m == NULL) {
+        return NULL;
+    }
+    // Another thread may be loading the member: if so, we wait for it,
+    // and then the symbol is in symhash.
+    ACQUIRE_LOCK(&lazy_mutex);
+    if (m->oc == NULL) {
+        IF_DEBUG(linker, debugBelch("lookupLazySymbol: %s needs a member of `%" PATH_FMT "'\n",
+                                    lbl, m->archive->path));
+        loadArchiveMember(m);
+    }
+    RELEASE_LOCK(&lazy_mutex);
+    return lookupSymhash(lbl);
+}
+
+/* Forget the archives loaded from path.  The members that were loaded
+   are objects with the same path, which unloadObj() unloads. */
+static HsBool
+unloadArchive( pathchar *path )
+{
+    Archive *a, *prev, *next;
+    ArchiveMember *m;
+    char *p, *end;
+    W_ i, n;
+    HsBool found = HS_BOOL_FALSE;
+
+    prev = NULL;
+    for (a = archives; a; a = next) {
+        next = a->next;
+        if (pathcmp(a->path, path)) {
+            prev = a;
+            continue;
+        }
+
+        n = readBigEndian(a->index, a->offsetSize);
+        p = a->index + (n + 1) * a->offsetSize;
+        end = a->index + a->indexSize;
+        for (i = 0; i < n && p < end; i++, p += strlen(p) + 1) {
+            m = lookupStrHashTable(lazysymhash, p);
+            if (m != NULL && m->archive == a) {
+                removeStrHashTable(lazysymhash, p, NULL);
+            }
+        }
+
+        if (prev == NULL) {
+            archives = next;
+        } else {
+            prev->next = next;
+        }
+        freeArchive(a);
+        found = HS_BOOL_TRUE;
+    }
+    return found;
+}
+
+#endif /* LAZY_ARCHIVES */
+
 HsInt
 loadArchive( pathchar *path )
 {
     ObjectCode* oc;
+    ObjectCode **ocs;
+    int n_ocs, size_ocs;
     char *image;
     int memberSize;
     FILE *f;
@@ -2232,11 +2829,21 @@ loadArchive( pathchar *path )
     IF_DEBUG(linker, debugBelch("loadArchive: start\n"));
     IF_DEBUG(linker, debugBelch("loadArchive: Loading archive `%" PATH_FMT" '\n", path));
 
+#if defined(LAZY_ARCHIVES)
+    n = loadArchiveLazily(path);
+    if (n >= 0) {
+        return n;
+    }
+#endif
+
     gnuFileIndex = NULL;
     gnuFileIndexSize = 0;
 
     fileNameSize = 32;
     fileName = stgMallocBytes(fileNameSize, "loadArchive(fileName)");
+    size_ocs = 16;
+    ocs = stgMallocBytes(size_ocs * sizeof(ObjectCode *), "loadArchive(ocs)");
+    n_ocs = 0;
 
     f = pathopen(path, WSTR("rb"));
     if (!f)
@@ -2537,10 +3144,13 @@ loadArchive( pathchar *path )
 
             stgFree(archiveMemberName);
 
-            if (0 == loadOc(oc)) {
-                stgFree(fileName);
-                return 0;
+            // loaded all together at the end
+            if (n_ocs == size_ocs) {
+                size_ocs *= 2;
+                ocs = stgReallocBytes(ocs, size_ocs * sizeof(ObjectCode *),
+                                      "loadArchive(ocs)");
             }
+            ocs[n_ocs++] = oc;
         }
         else if (isGnuIndex) {
             if (gnuFileIndex != NULL) {
@@ -2596,19 +3206,22 @@ loadArchive( pathchar *path )
 #endif
     }
 
+    n = loadOcs(ocs, n_ocs);
+    stgFree(ocs);
+
     IF_DEBUG(linker, debugBelch("loadArchive: done\n"));
-    return 1;
+    return n;
 }
 
 /* -----------------------------------------------------------------------------
- * Load an obj (populate the global symbol table, but don't resolve yet)
+ * Read an obj into memory, and make its ObjectCode (*poc), or set *poc
+ * to NULL if it has been loaded already.
  *
  * Returns: 1 if ok, 0 on error.
  */
-HsInt
-loadObj( pathchar *path )
+static HsInt
+readObj( pathchar *path, ObjectCode **poc )
 {
-   ObjectCode* oc;
    char *image;
    int fileSize;
    struct_stat st;
@@ -2645,10 +3258,12 @@ loadObj( pathchar *path )
             "   %" PATH_FMT "\n"
             "GHCi will ignore this, but be warned.\n"
             , path));
+          *poc = NULL;
           return 1; /* success */
        }
    }
 
+   *poc = NULL;
    r = pathstat(path, &st);
    if (r == -1) {
        IF_DEBUG(linker, debugBelch("File doesn't exist\n"));
@@ -2723,17 +3338,78 @@ loadObj( pathchar *path )
    fclose(f);
 #endif /* USE_MMAP */
 
-   oc = mkOc(path, image, fileSize, NULL
+   *poc = mkOc(path, image, fileSize, NULL
 #ifndef USE_MMAP
 #ifdef darwin_HOST_OS
-            , misalignment
+              , misalignment
 #endif
 #endif
-            );
+              );
+
+   return 1;
+}
 
+/* -----------------------------------------------------------------------------
+ * Load an obj (populate the global symbol table, but don't resolve yet)
+ *
+ * Returns: 1 if ok, 0 on error.
+ */
+HsInt
+loadObj( pathchar *path )
+{
+   ObjectCode *oc;
+
+   if (!readObj(path, &oc)) {
+       return 0;
+   }
+   if (oc == NULL) {
+       return 1;                // loaded already
+   }
    return loadOc(oc);
 }
 
+/* -----------------------------------------------------------------------------
+ * Load several objs, in parallel where we can (see "Loading objects in
+ * parallel").  The symbol table ends up as if they had been loaded one
+ * at a time, in the order given.
+ *
+ * Returns: 1 if ok, 0 on error.
+ */
+HsInt
+loadObjs( pathchar **paths, HsInt n )
+{
+   ObjectCode **ocs;
+   HsInt i, r;
+   nat n_ocs;
+
+   IF_DEBUG(linker, debugBelch("loadObjs: %" FMT_Int " objects\n", n));
+   initLinker();
+
+   if (n <= 0) {
+       return 1;
+   }
+
+   ocs = stgMallocBytes(n * sizeof(ObjectCode *), "loadObjs");
+   n_ocs = 0;
+   r = 1;
+   for (i = 0; i < n; i++) {
+       if (!readObj(paths[i], &ocs[n_ocs])) {
+           r = 0;
+           break;
+       }
+       if (ocs[n_ocs] != NULL) {
+           n_ocs++;
+       }
+   }
+
+   // load the ones we read, even if one failed
+   if (!loadOcs(ocs, n_ocs)) {
+       r = 0;
+   }
+   stgFree(ocs);
+   return r;
+}
+
 static HsInt
 loadOc( ObjectCode* oc ) {
    int r;
@@ -2792,34 +3468,353 @@ loadOc( ObjectCode* oc ) {
 }
 
 /* -----------------------------------------------------------------------------
- * resolve all the currently unlinked objects in memory
+ * Loading objects in parallel
+ *
+ * GHCi loads hundreds of objects at a time, and verifying, reading the
+ * symbols of and relocating each one takes a while, so loadObjs() (and
+ * loadArchive(), when it loads every member) and resolveObjs() share the
+ * work out between threads:
+ *
+ *   1. Each thread takes objects in turn and runs loadOc() on them.  The
+ *      symbols that ocGetNames_* finds don't go in symhash yet, but on
+ *      the object's pending list (see insertOcSymbol()), which is then
+ *      sorted by the shard of symhash that each symbol belongs in.
+ *
+ *   2. Each thread takes shards in turn, and puts every object's pending
+ *      symbols for the shard in it, taking the objects in the order they
+ *      were given.  So each shard ends up just as if the objects had been
+ *      loaded one after another, and if a symbol is defined twice, we
+ *      complain about the same object (the first one, in the order given,
+ *      that defines a symbol that is defined already), whatever order the
+ *      threads happen to run in.
+ *
+ *   3. resolveObjs() relocates the objects in parallel.  Relocating only
+ *      reads symhash, unless it loads a member of an archive (see
+ *      "Loading archives lazily"): that takes lazy_mutex, and the member
+ *      is relocated in another round.  When every object has been
+ *      relocated, their initialisers run one at a time on the calling
+ *      thread, in the order they always did.
+ *
+ * The threads last as long as the job does, and there is one for each
+ * processor, counting the calling thread.  Only the threaded RTS on ELF
+ * platforms has them; elsewhere the same steps happen on the calling
+ * thread alone.
+ * -------------------------------------------------------------------------- */
+
+typedef struct {
+    void (*work)(void *arg, nat i);
+    void *arg;
+    nat n;                      /* number of items */
+    volatile StgWord next;      /* the next item to take */
+#if defined(PARALLEL_LINKER)
+    Mutex lock;
+    Condition done;
+    nat running;                /* threads yet to finish */
+#endif
+} LinkerJob;
+
+static void
+runLinkerJob( LinkerJob *job )
+{
+    StgWord i;
+
+    while ((i = atomic_inc(&job->next, 1) - 1) < job->n) {
+        job->work(job->arg, i);
+    }
+}
+
+#if defined(PARALLEL_LINKER)
+static void OSThreadProcAttr
+linkerWorker( void *arg )
+{
+    LinkerJob *job = arg;
+
+    runLinkerJob(job);
+
+    ACQUIRE_LOCK(&job->lock);
+    if (--job->running == 0) {
+        signalCondition(&job->done);
+    }
+    RELEASE_LOCK(&job->lock);
+}
+#endif
+
+/* Call work(arg, i) for each i from 0 to n-1, sharing the calls out
+   between as many threads as we can use. */
+static void
+linkerParallel( nat n, void (*work)(void *arg, nat i), void *arg )
+{
+    LinkerJob job;
+#if defined(PARALLEL_LINKER)
+    OSThreadId tid;
+    nat i, threads;
+#endif
+
+    job.work = work;
+    job.arg  = arg;
+    job.n    = n;
+    job.next = 0;
+
+#if defined(PARALLEL_LINKER)
+    threads = getNumberOfProcessors();
+    if (threads > n) {
+        threads = n;
+    }
+    if (threads > 1) {
+        initMutex(&job.lock);
+        initCondition(&job.done);
+        job.running = 0;
+
+        ACQUIRE_LOCK(&job.lock);
+        for (i = 1; i < threads; i++) {
+            if (createOSThread(&tid, (OSThreadProc*)linkerWorker, &job) != 0) {
+                break;          // make do with the threads we have
+            }
+            job.running++;
+        }
+        RELEASE_LOCK(&job.lock);
+
+        runLinkerJob(&job);
+
+        ACQUIRE_LOCK(&job.lock);
+        while (job.running > 0) {
+            waitCondition(&job.done, &job.lock);
+        }
+        RELEASE_LOCK(&job.lock);
+        closeCondition(&job.done);
+        closeMutex(&job.lock);
+        return;
+    }
+#endif
+
+    runLinkerJob(&job);
+}
+
+typedef struct {
+    ObjectCode **ocs;
+    nat n;
+    HsInt *ok;                  /* for each object */
+    /* the first object (n if none) to define a symbol in each shard
+       that is defined already, and the symbol */
+    nat dup_oc[SYMHASH_SHARDS];
+    char *dup_sym[SYMHASH_SHARDS];
+} ObjectsJob;
+
+#if defined(PARALLEL_LINKER)
+/* Sort an object's pending symbols by shard, keeping those of each shard
+   in the order they were found. */
+static void
+sortPendingSymbols( ObjectCode *oc )
+{
+    PendingSymbol *sorted;
+    int next[SYMHASH_SHARDS];
+    int i, s;
+
+    oc->pending_shards = stgCallocBytes(SYMHASH_SHARDS + 1, sizeof(int),
+                                        "sortPendingSymbols");
+    for (i = 0; i < oc->n_pending; i++) {
+        oc->pending_shards[symhashShard(oc->pending[i].name) + 1]++;
+    }
+    for (s = 0; s < SYMHASH_SHARDS; s++) {
+        oc->pending_shards[s + 1] += oc->pending_shards[s];
+        next[s] = oc->pending_shards[s];
+    }
+
+    sorted = stgMallocBytes(oc->size_pending * sizeof(PendingSymbol),
+                            "sortPendingSymbols");
+    for (i = 0; i < oc->n_pending; i++) {
+        sorted[next[symhashShard(oc->pending[i].name)]++] = oc->pending[i];
+    }
+    stgFree(oc->pending);
+    oc->pending = sorted;
+}
+
+static void
+loadOcWork( void *arg, nat i )
+{
+    ObjectsJob *job = arg;
+
+    job->ok[i] = loadOc(job->ocs[i]);
+    if (job->ok[i]) {
+        sortPendingSymbols(job->ocs[i]);
+    }
+}
+
+static void
+insertPendingWork( void *arg, nat s )
+{
+    ObjectsJob *job = arg;
+    SymbolShard *shard = &symhash[s];
+    ObjectCode *oc;
+    PendingSymbol *p;
+    nat i;
+    int j;
+
+    ACQUIRE_LOCK(&shard->lock);
+    for (i = 0; i < job->n && job->dup_oc[s] == job->n; i++) {
+        if (!job->ok[i]) continue;
+        oc = job->ocs[i];
+        for (j = oc->pending_shards[s]; j < oc->pending_shards[s + 1]; j++) {
+            p = &oc->pending[j];
+            if (lookupStrHashTable(shard->table, p->name) != NULL) {
+                job->dup_oc[s] = i;
+                job->dup_sym[s] = p->name;
+                break;
+            }
+            insertStrHashTable(shard->table, p->name, p->addr);
+        }
+    }
+    RELEASE_LOCK(&shard->lock);
+}
+#endif
+
+/* loadOc() a batch of objects, in parallel where we can.
+ *
+ * Returns: 1 if ok, 0 if any of them failed to load.
+ */
+static HsInt
+loadOcs( ObjectCode **ocs, nat n )
+{
+#if defined(PARALLEL_LINKER)
+    ObjectsJob job;
+    nat s, first;
+#endif
+    nat i;
+    HsInt r;
+
+    IF_DEBUG(linker, debugBelch("loadOcs: %d objects\n", n));
+
+#if !defined(PARALLEL_LINKER)
+    // With one thread, there's nothing to gain by putting the symbols
+    // aside (and Mach-O's ocGetNames looks up those of the objects
+    // before, for weak definitions)
+    r = 1;
+    for (i = 0; i < n; i++) {
+        if (!loadOc(ocs[i])) {
+            r = 0;
+        }
+    }
+    return r;
+#else
+    if (n == 0) {
+        return 1;
+    }
+
+    job.ocs = ocs;
+    job.n = n;
+    job.ok = stgMallocBytes(n * sizeof(HsInt), "loadOcs");
+    for (i = 0; i < n; i++) {
+        ocs[i]->n_pending = 0;
+        ocs[i]->size_pending = 64;
+        ocs[i]->pending = stgMallocBytes(ocs[i]->size_pending * sizeof(PendingSymbol),
+                                         "loadOcs");
+    }
+
+    linkerParallel(n, loadOcWork, &job);
+
+    for (s = 0; s < SYMHASH_SHARDS; s++) {
+        job.dup_oc[s] = n;
+    }
+    linkerParallel(SYMHASH_SHARDS, insertPendingWork, &job);
+
+    first = 0;
+    for (s = 1; s < SYMHASH_SHARDS; s++) {
+        if (job.dup_oc[s] < job.dup_oc[first]) {
+            first = s;
+        }
+    }
+    if (job.dup_oc[first] < n) {
+        reportDuplicateSymbol(ocs[job.dup_oc[first]]->fileName,
+                              job.dup_sym[first]);
+    }
+
+    r = 1;
+    for (i = 0; i < n; i++) {
+        if (!job.ok[i]) {
+            r = 0;
+        }
+        stgFree(ocs[i]->pending);
+        ocs[i]->pending = NULL;
+        if (ocs[i]->pending_shards != NULL) {
+            stgFree(ocs[i]->pending_shards);
+            ocs[i]->pending_shards = NULL;
+        }
+    }
+    stgFree(job.ok);
+    return r;
+#endif
+}
+
+static void
+resolveOcWork( void *arg, nat i )
+{
+    ObjectsJob *job = arg;
+    ObjectCode *oc = job->ocs[i];
+
+#   if defined(OBJFORMAT_ELF)
+    job->ok[i] = ocResolve_ELF ( oc );
+#   elif defined(OBJFORMAT_PEi386)
+    job->ok[i] = ocResolve_PEi386 ( oc );
+#   elif defined(OBJFORMAT_MACHO)
+    job->ok[i] = ocResolve_MachO ( oc );
+#   else
+    barf("resolveObjs: not implemented on this platform");
+#   endif
+}
+
+/* -----------------------------------------------------------------------------
+ * Resolve the unlinked objects in front of stop in the objects list (all
+ * of them, if stop is NULL).  New objects, including the archive members
+ * that relocating these ones loads, always go on the front of the list,
+ * so passing the head of the list as it was before loading something
+ * resolves just what was loaded since.
  *
  * Returns: 1 if ok, 0 on error.
  */
-HsInt
-resolveObjs( void )
+static HsInt
+resolveObjsUntil( ObjectCode *stop )
 {
+    ObjectsJob job;
     ObjectCode *oc;
+    nat i, n;
     int r;
 
-    IF_DEBUG(linker, debugBelch("resolveObjs: start\n"));
-    initLinker();
+    // Relocating an object can load members of archives that it refers
+    // to, which go on the front of the list, so we go round again until
+    // no more turn up.
+    for (;;) {
+        n = 0;
+        for (oc = objects; oc != stop; oc = oc->next) {
+            if (oc->status == OBJECT_LOADED) n++;
+        }
+        if (n == 0) break;
+
+        job.ocs = stgMallocBytes(n * sizeof(ObjectCode *), "resolveObjs");
+        job.ok = stgMallocBytes(n * sizeof(HsInt), "resolveObjs");
+        job.n = n;
+        i = 0;
+        for (oc = objects; oc != stop; oc = oc->next) {
+            if (oc->status == OBJECT_LOADED) job.ocs[i++] = oc;
+        }
 
-    for (oc = objects; oc; oc = oc->next) {
-        if (oc->status != OBJECT_RESOLVED) {
-#           if defined(OBJFORMAT_ELF)
-            r = ocResolve_ELF ( oc );
-#           elif defined(OBJFORMAT_PEi386)
-            r = ocResolve_PEi386 ( oc );
-#           elif defined(OBJFORMAT_MACHO)
-            r = ocResolve_MachO ( oc );
-#           else
-            barf("resolveObjs: not implemented on this platform");
-#           endif
-            if (!r) { return r; }
+        linkerParallel(n, resolveOcWork, &job);
 
-            // run init/init_array/ctors/mod_init_func
+        r = 1;
+        for (i = 0; i < n; i++) {
+            if (job.ok[i]) {
+                job.ocs[i]->status = OBJECT_RELOCATED;
+            } else {
+                r = 0;
+            }
+        }
+        stgFree(job.ocs);
+        stgFree(job.ok);
+        if (!r) { return r; }
+    }
 
+    // run init/init_array/ctors/mod_init_func
+    for (oc = objects; oc != stop; oc = oc->next) {
+        if (oc->status == OBJECT_RELOCATED) {
             loading_obj = oc; // tells foreignExportStablePtr what to do
 #if defined(OBJFORMAT_ELF)
             r = ocRunInit_ELF ( oc );
@@ -2837,10 +3832,26 @@ resolveObjs( void )
             oc->status = OBJECT_RESOLVED;
         }
     }
-    IF_DEBUG(linker, debugBelch("resolveObjs: done\n"));
     return 1;
 }
 
+/* -----------------------------------------------------------------------------
+ * resolve all the currently unlinked objects in memory
+ *
+ * Returns: 1 if ok, 0 on error.
+ */
+HsInt
+resolveObjs( void )
+{
+    HsInt r;
+
+    IF_DEBUG(linker, debugBelch("resolveObjs: start\n"));
+    initLinker();
+    r = resolveObjsUntil(NULL);
+    IF_DEBUG(linker, debugBelch("resolveObjs: done\n"));
+    return r;
+}
+
 /* -----------------------------------------------------------------------------
  * delete an object from the pool
  */
@@ -2850,13 +3861,22 @@ unloadObj( pathchar *path )
     ObjectCode *oc, *prev, *next;
     HsBool unloadedAnyObj = HS_BOOL_FALSE;
 
-    ASSERT(symhash != NULL);
+#if defined(LAZY_ARCHIVES)
+    ASSERT(objects != NULL || archives != NULL);
+#else
     ASSERT(objects != NULL);
+#endif
 
     initLinker();
 
     IF_DEBUG(linker, debugBelch("unloadObj: %" PATH_FMT "\n", path));
 
+#if defined(LAZY_ARCHIVES)
+    if (unloadArchive(path)) {
+        unloadedAnyObj = HS_BOOL_TRUE;
+    }
+#endif
+
     prev = NULL;
     for (oc = objects; oc; prev = oc, oc = next) {
         next = oc->next;
@@ -2870,7 +3890,7 @@ unloadObj( pathchar *path )
                 int i;
                 for (i = 0; i < oc->n_symbols; i++) {
                    if (oc->symbols[i] != NULL) {
-                       removeStrHashTable(symhash, oc->symbols[i], NULL);
+                       removeSymhash(oc->symbols[i]);
                    }
                 }
             }
@@ -3994,7 +5014,7 @@ ocGetNames_PEi386 ( ObjectCode* oc )
          ASSERT(i >= 0 && i < oc->n_symbols);
          /* cstring_from_COFF_symbol_name always succeeds. */
          oc->symbols[i] = (char*)sname;
-         ghciInsertStrHashTable(oc->fileName, symhash, (char*)sname, addr);
+         insertOcSymbol(oc, (char*)sname, addr);
       } else {
 #        if 0
          debugBelch(
@@ -4154,7 +5174,7 @@ ocResolve_PEi386 ( ObjectCode* oc )
               + ((size_t)(sym->Value));
          } else {
             copyName ( sym->Name, strtab, symbol, 1000-1 );
-            S = (size_t) lookupSymbol( (char*)symbol );
+            S = (size_t) lookupSymbol_( (char*)symbol );
             if ((void*)S != NULL) goto foundit;
             errorBelch("%" PATH_FMT ": unknown symbol `%s'", oc->fileName, symbol);
             return 0;
@@ -4790,7 +5810,7 @@ ocGetNames_ELF ( ObjectCode* oc )
    char*     strtab;
    Elf_Shdr* shdr     = (Elf_Shdr*) (ehdrC + ehdr->e_shoff);
 
-   ASSERT(symhash != NULL);
+   ASSERT(linker_init_done == 1);
 
    for (i = 0; i < ehdr->e_shnum; i++) {
       /* Figure out what kind of section it is.  Logic derived from
@@ -4803,8 +5823,8 @@ ocGetNames_ELF ( ObjectCode* oc )
          /* This is a non-empty .bss section.  Allocate zeroed space for
             it, and set its .sh_offset field such that
             ehdrC + .sh_offset == addr_of_zeroed_space.  */
-         char* zspace = stgCallocBytes(1, shdr[i].sh_size,
-                                       "ocGetNames_ELF(BSS)");
+         char* zspace = callocForLinker(shdr[i].sh_size,
+                                        "ocGetNames_ELF(BSS)");
          shdr[i].sh_offset = ((char*)zspace) - ((char*)ehdrC);
          /*
          debugBelch("BSS section at 0x%x, size %d\n",
@@ -4845,7 +5865,7 @@ ocGetNames_ELF ( ObjectCode* oc )
 
          if (secno == SHN_COMMON) {
             isLocal = FALSE;
-            ad = stgCallocBytes(1, stab[j].st_size, "ocGetNames_ELF(COMMON)");
+            ad = callocForLinker(stab[j].st_size, "ocGetNames_ELF(COMMON)");
             /*
             debugBelch("COMMON symbol, size %d name %s\n",
                             stab[j].st_size, nm);
@@ -4902,7 +5922,7 @@ ocGetNames_ELF ( ObjectCode* oc )
             if (isLocal) {
                /* Ignore entirely. */
             } else {
-               ghciInsertStrHashTable(oc->fileName, symhash, nm, ad);
+               insertOcSymbol(oc, nm, ad);
             }
          } else {
             /* Skip. */
@@ -5000,7 +6020,7 @@ do_Elf_Rel_relocations ( ObjectCode* oc, char* ehdrC,
             stablePtr = (StgStablePtr)lookupHashTable(stablehash, (StgWord)symbol);
             if (NULL == stablePtr) {
               /* No, so look up the name in our global table. */
-              S_tmp = lookupSymbol( symbol );
+              S_tmp = lookupSymbol_( symbol );
               S = (Elf_Addr)S_tmp;
             } else {
               stableVal = deRefStablePtr( stablePtr );
@@ -5315,7 +6335,7 @@ do_Elf_Rela_relocations ( ObjectCode* oc, char* ehdrC,
          } else {
             /* No, so look up the name in our global table. */
             symbol = strtab + sym.st_name;
-            S_tmp = lookupSymbol( symbol );
+            S_tmp = lookupSymbol_( symbol );
             S = (Elf_Addr)S_tmp;
 
 #ifdef ELF_FUNCTION_DESC
@@ -5861,7 +6881,7 @@ resolveImports(
             addr = (void*) (symbol->n_value);
             IF_DEBUG(linker, debugBelch("resolveImports: undefined external %s has value %p\n", nm, addr));
         } else {
-            addr = lookupSymbol(nm);
+            addr = lookupSymbol_(nm);
             IF_DEBUG(linker, debugBelch("resolveImports: looking up %s, %p\n", nm, addr));
         }
 
@@ -6017,7 +7037,7 @@ relocateSection(
 		    // symtab, or it is undefined, meaning dlsym must be used
 		    // to resolve it.
 
-		    addr = lookupSymbol(nm);
+		    addr = lookupSymbol_(nm);
 		    IF_DEBUG(linker, debugBelch("relocateSection: looked up %s, "
 						"external X86_64_RELOC_GOT or X86_64_RELOC_GOT_LOAD\n", nm));
 		    IF_DEBUG(linker, debugBelch("               : addr = %p\n", addr));
@@ -6069,7 +7089,7 @@ relocateSection(
                 IF_DEBUG(linker, debugBelch("relocateSection, defined external symbol %s, relocated address %p\n", nm, (void *)value));
             }
             else {
-                addr = lookupSymbol(nm);
+                addr = lookupSymbol_(nm);
 		if (addr == NULL)
 		{
 		     errorBelch("\nlookupSymbol failed in relocateSection (relocate external)\n"
@@ -6372,7 +7392,7 @@ relocateSection(
                 else {
                     struct nlist *symbol = &nlist[reloc->r_symbolnum];
                     char *nm = image + symLC->stroff + symbol->n_un.n_strx;
-                    void *symbolAddress = lookupSymbol(nm);
+                    void *symbolAddress = lookupSymbol_(nm);
 
                     if (!symbolAddress) {
                         errorBelch("\nunknown symbol `%s'", nm);
@@ -6598,18 +7618,18 @@ ocGetNames_MachO(ObjectCode* oc)
                 if(nlist[i].n_type & N_EXT)
                 {
                     char *nm = image + symLC->stroff + nlist[i].n_un.n_strx;
-                    if ((nlist[i].n_desc & N_WEAK_DEF) && lookupSymbol(nm)) {
+                    if ((nlist[i].n_desc & N_WEAK_DEF) && lookupSymbol_(nm)) {
                         // weak definition, and we already have a definition
                         IF_DEBUG(linker, debugBelch("    weak: %s\n", nm));
                     }
                     else
                     {
                             IF_DEBUG(linker, debugBelch("ocGetNames_MachO: inserting %s\n", nm));
-                            ghciInsertStrHashTable(oc->fileName, symhash, nm,
-                                                    image
-                                                    + sections[nlist[i].n_sect-1].offset
-                                                    - sections[nlist[i].n_sect-1].addr
-                                                    + nlist[i].n_value);
+                            insertOcSymbol(oc, nm,
+                                           image
+                                           + sections[nlist[i].n_sect-1].offset
+                                           - sections[nlist[i].n_sect-1].addr
+                                           + nlist[i].n_value);
                             oc->symbols[curSymbol++] = nm;
                     }
                 }
@@ -6640,8 +7660,7 @@ ocGetNames_MachO(ObjectCode* oc)
                 nlist[i].n_value = commonCounter;
 
                 IF_DEBUG(linker, debugBelch("ocGetNames_MachO: inserting common symbol: %s\n", nm));
-                ghciInsertStrHashTable(oc->fileName, symhash, nm,
-                                       (void*)commonCounter);
+                insertOcSymbol(oc, nm, (void*)commonCounter);
                 oc->symbols[curSymbol++] = nm;
 
                 commonCounter += sz;
@@ -6811,7 +7830,7 @@ machoInitSymbolsWithoutUnderscore(void)
 
 #undef SymI_NeedsProto
 #define SymI_NeedsProto(x)  \
-    ghciInsertStrHashTable("(GHCi built-in symbols)", symhash, #x, *p++);
+    insertSymhash("(GHCi built-in symbols)", #x, *p++);
 
     RTS_MACHO_NOUNDERLINE_SYMBOLS
 
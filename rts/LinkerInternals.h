@@ -11,6 +11,7 @@
 
 typedef enum {
     OBJECT_LOADED,
+    OBJECT_RELOCATED,           /* but its initialisers haven't run */
     OBJECT_RESOLVED,
     OBJECT_UNLOADED
 } OStatus;
@@ -74,6 +75,14 @@ typedef struct {
 #endif
 } SymbolExtra;
 
+/* A symbol found by ocGetNames_* while objects are being loaded in
+ * parallel, waiting to go in the symbol table.
+ */
+typedef struct _PendingSymbol {
+    char *name;
+    void *addr;
+} PendingSymbol;
+
 /* Top-level structure for an object module.  One of these is allocated
  * for each object file in use.
  */
@@ -133,6 +142,15 @@ typedef struct _ObjectCode {
 
     ForeignExportStablePtr *stable_ptrs;
 
+    /* While this object is loaded in parallel with others (see
+       loadOcs()), the symbols that would go in the symbol table, sorted
+       by shard; pending_shards[i] is where shard i's start.  NULL
+       otherwise. */
+    PendingSymbol *pending;
+    int            n_pending;
+    int            size_pending;
+    int           *pending_shards;
+
 } ObjectCode;
 
 #define OC_INFORMATIVE_FILENAME(OC)             \
@@ -17,13 +17,24 @@
 
 /* ----------------------------------------------------------------------------
    Send a message to another Capability
+
+   The inbox is a lock-free stack with many producers (any Capability
+   can send) and a single consumer (the Capability that owns it; see
+   Schedule.c:scheduleProcessInbox()).  We push with a CAS, and only
+   take to_cap->lock if to_cap looks idle and we may have to wake it.
+
+   The Capability must never go idle with a message in its inbox.  We
+   push and then look at running_task; releaseCapability_() clears
+   running_task and then looks at the inbox, with a store/load barrier
+   in between.  So either we see that the Capability is free, and wake
+   it up ourselves, or releaseCapability_() sees the message.
    ------------------------------------------------------------------------- */
 
 #ifdef THREADED_RTS
 
 void sendMessage(Capability *from_cap, Capability *to_cap, Message *msg)
 {
-    ACQUIRE_LOCK(&to_cap->lock);
+    Message *old;
 
 #ifdef DEBUG    
     {
@@ -38,20 +49,29 @@ void sendMessage(Capability *from_cap, Capability *to_cap, Message *msg)
     }
 #endif
 
-    msg->link = to_cap->inbox;
-    to_cap->inbox = msg;
-
     recordClosureMutated(from_cap,(StgClosure*)msg);
 
+    do {
+        old = to_cap->inbox;
+        msg->link = old;
+    } while (cas((StgVolatilePtr)&to_cap->inbox,
+                 (StgWord)old, (StgWord)msg) != (StgWord)old);
+
+    // the cas() is a full barrier, so we read running_task after the
+    // message is in the inbox.
     if (to_cap->running_task == NULL) {
-	to_cap->running_task = myTask(); 
-            // precond for releaseCapability_()
-        releaseCapability_(to_cap,rtsFalse);
+        ACQUIRE_LOCK(&to_cap->lock);
+        if (to_cap->running_task == NULL) {
+            to_cap->running_task = myTask(); 
+                // precond for releaseCapability_()
+            releaseCapability_(to_cap,rtsFalse);
+        } else {
+            interruptCapability(to_cap);
+        }
+        RELEASE_LOCK(&to_cap->lock);
     } else {
         interruptCapability(to_cap);
     }
-
-    RELEASE_LOCK(&to_cap->lock);
 }
 
 #endif /* THREADED_RTS */
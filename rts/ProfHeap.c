@@ -18,7 +18,9 @@
 #include "LdvProfile.h"
 #include "Arena.h"
 #include "Printer.h"
+#include "sm/GC.h"
 #include "sm/GCThread.h"
+#include "rts/HeapProfileFormat.h"
 
 #include <string.h>
 
@@ -88,6 +90,39 @@ typedef struct {
 static Census *censuses = NULL;
 static nat n_censuses = 0;
 
+/* -----------------------------------------------------------------------------
+ * Taking a census in parallel
+ *
+ * A census happens at the end of a GC, when the other GC threads of a
+ * parallel GC are still waiting to go back to the mutator, so we wake
+ * them up to help (see wakeupCensusThreads()).  The heap is cut into
+ * chunks of up to CENSUS_CHUNK_BLOCKS block groups, which the threads
+ * take in turn.  Each of the other threads counts what it finds in a
+ * Census of its own, so that nothing needs locking, and mergeCensus()
+ * adds these into censuses[era] at the end.
+ *
+ * With +RTS --heap-census-sample=<n>, a census only looks at about n%
+ * of the block groups, chosen afresh each time, and scales its counts
+ * up to make up for the rest.  LDV profiling has to see every
+ * closure, so it ignores this.
+ * -------------------------------------------------------------------------- */
+
+typedef struct {
+    bdescr *bd;         // the first block group of the chunk
+    bdescr *stop;       // the group after the last one (or NULL)
+} CensusChunk;
+
+#define CENSUS_CHUNK_BLOCKS 32
+
+static CensusChunk *census_chunks = NULL;
+static nat n_census_chunks = 0;
+static nat max_census_chunks = 0;
+static volatile StgWord next_census_chunk;
+
+static Census *thread_censuses = NULL;  // indexed by GC thread
+
+static nat census_sample;               // % of the block groups to look at
+
 #ifdef PROFILING
 static void aggregateCensusInfo( void );
 #endif
@@ -337,7 +372,9 @@ void initProfiling2 (void)
     sprintf(hp_filename, "%s.hp", prog);
     
     /* open the log file */
-    if ((hp_file = fopen(hp_filename, "w")) == NULL) {
+    if ((hp_file = fopen(hp_filename,
+                         RtsFlags.ProfFlags.heapProfileFormat
+                             == HEAP_PROFILE_BINARY ? "wb" : "w")) == NULL) {
       debugBelch("Can't open profiling report file %s\n", 
 	      hp_filename);
       RtsFlags.ProfFlags.doHeapProfile = 0;
@@ -356,10 +393,138 @@ void endProfiling( void )
 }
 #endif /* !PROFILING */
 
+/* -----------------------------------------------------------------------------
+ * The binary profile (+RTS --heap-profile-format=binary): see
+ * includes/rts/HeapProfileFormat.h.
+ *
+ * An identity gets a number, and its name is written out, the first
+ * time it is counted.  hp_last[] holds the value of each number in the
+ * last sample written, and the sample being made is totted up in
+ * hp_cur[]; a sample record lists only the numbers whose value has
+ * changed.
+ * -------------------------------------------------------------------------- */
+
+static rtsBool     hp_binary;
+static HashTable * hp_idents;           // identity -> number + 1
+static W_        * hp_last;
+static W_        * hp_cur;
+static nat         hp_n_idents;
+static nat         hp_max_idents;
+static StgWord64   hp_last_time;        // in microseconds
+
+static void
+putVarint (StgWord64 w)
+{
+    while (w >= 0x80) {
+        fputc((int)(w & 0x7f) | 0x80, hp_file);
+        w >>= 7;
+    }
+    fputc((int)w, hp_file);
+}
+
+static void
+putSVarint (StgInt64 i)
+{
+    putVarint(((StgWord64)i << 1) ^ (StgWord64)(i >> 63));
+}
+
+static void
+initBinaryProfile (void)
+{
+    hp_binary = RtsFlags.ProfFlags.heapProfileFormat == HEAP_PROFILE_BINARY;
+    if (hp_binary) {
+        hp_idents = allocHashTable();
+        hp_last = NULL;
+        hp_cur = NULL;
+        hp_n_idents = 0;
+        hp_max_idents = 0;
+        hp_last_time = 0;
+        fwrite(HP_BIN_MAGIC, 1, HP_BIN_MAGIC_LEN, hp_file);
+    }
+}
+
+static void
+freeBinaryProfile (void)
+{
+    if (hp_binary) {
+        freeHashTable(hp_idents, NULL);
+        if (hp_last != NULL) {
+            stgFree(hp_last);
+            stgFree(hp_cur);
+        }
+    }
+}
+
+// The header lines: JOB "...", and so on
+static void
+beginHeader (char *key, StgWord8 tag)
+{
+    if (hp_binary) {
+        fputc(tag, hp_file);
+    } else {
+        fprintf(hp_file, "%s \"", key);
+    }
+}
+
+static void
+endHeader (void)
+{
+    if (hp_binary) {
+        fputc('\0', hp_file);
+    } else {
+        fprintf(hp_file, "\"\n");
+    }
+}
+
+static void
+beginBinarySample (void)
+{
+    if (hp_n_idents > 0) {
+        memset(hp_cur, 0, hp_n_idents * sizeof(W_));
+    }
+}
+
+static void
+endBinarySample (StgDouble sampleValue)
+{
+    StgWord64 t;
+    nat i, changes;
+
+    t = (StgWord64)(sampleValue * 1000000 + 0.5);
+
+    changes = 0;
+    for (i = 0; i < hp_n_idents; i++) {
+        if (hp_cur[i] != hp_last[i]) changes++;
+    }
+
+    fputc(HP_BIN_SAMPLE, hp_file);
+    putSVarint((StgInt64)(t - hp_last_time));
+    putVarint(changes);
+    for (i = 0; i < hp_n_idents; i++) {
+        if (hp_cur[i] != hp_last[i]) {
+            putVarint(i);
+            putSVarint((StgInt64)(hp_cur[i] - hp_last[i]));
+            hp_last[i] = hp_cur[i];
+        }
+    }
+    hp_last_time = t;
+    fflush(hp_file);
+}
+
 static void
 printSample(rtsBool beginSample, StgDouble sampleValue)
 {
     StgDouble fractionalPart, integralPart;
+
+    if (hp_binary) {
+        if (beginSample) {
+            beginBinarySample();
+        } else {
+            endBinarySample(sampleValue);
+        }
+        return;
+    }
+
     fractionalPart = modf(sampleValue, &integralPart);
     fprintf(hp_file, "%s %" FMT_Word64 ".%02" FMT_Word64 "\n",
             (beginSample ? "BEGIN_SAMPLE" : "END_SAMPLE"),
@@ -405,8 +570,11 @@ initHeapProfiling(void)
 
     initEra( &censuses[era] );
 
+    initBinaryProfile();
+
     /* initProfilingLogFile(); */
-    fprintf(hp_file, "JOB \"%s", prog_name);
+    beginHeader("JOB", HP_BIN_JOB);
+    fprintf(hp_file, "%s", prog_name);
 
 #ifdef PROFILING
     {
@@ -419,12 +587,18 @@ initHeapProfiling(void)
     }
 #endif /* PROFILING */
 
-    fprintf(hp_file, "\"\n" );
+    endHeader();
 
-    fprintf(hp_file, "DATE \"%s\"\n", time_str());
+    beginHeader("DATE", HP_BIN_DATE);
+    fprintf(hp_file, "%s", time_str());
+    endHeader();
 
-    fprintf(hp_file, "SAMPLE_UNIT \"seconds\"\n");
-    fprintf(hp_file, "VALUE_UNIT \"bytes\"\n");
+    beginHeader("SAMPLE_UNIT", HP_BIN_SAMPLE_UNIT);
+    fprintf(hp_file, "seconds");
+    endHeader();
+    beginHeader("VALUE_UNIT", HP_BIN_VALUE_UNIT);
+    fprintf(hp_file, "bytes");
+    endHeader();
 
     printSample(rtsTrue, 0);
     printSample(rtsFalse, 0);
@@ -479,9 +653,16 @@ endHeapProfiling(void)
 
     stgFree(censuses);
 
+    if (census_chunks != NULL) {
+        stgFree(census_chunks);
+        census_chunks = NULL;
+        max_census_chunks = 0;
+    }
+
     seconds = mut_user_time();
     printSample(rtsTrue, seconds);
     printSample(rtsFalse, seconds);
+    freeBinaryProfile();
     fclose(hp_file);
 }
 
@@ -731,6 +912,117 @@ aggregateCensusInfo( void )
 /* -----------------------------------------------------------------------------
  * Print out the results of a heap census.
  * -------------------------------------------------------------------------- */
+/* -----------------------------------------------------------------------------
+ * Writing out a census
+ * -------------------------------------------------------------------------- */
+
+static void
+printIdentity (void *identity)
+{
+#if !defined(PROFILING)
+    switch (RtsFlags.ProfFlags.doHeapProfile) {
+    case HEAP_BY_CLOSURE_TYPE:
+	fprintf(hp_file, "%s", (char *)identity);
+	break;
+    }
+#endif
+
+#ifdef PROFILING
+    switch (RtsFlags.ProfFlags.doHeapProfile) {
+    case HEAP_BY_CCS:
+	fprint_ccs(hp_file, (CostCentreStack *)identity, RtsFlags.ProfFlags.ccsLength);
+	break;
+    case HEAP_BY_MOD:
+    case HEAP_BY_DESCR:
+    case HEAP_BY_TYPE:
+	fprintf(hp_file, "%s", (char *)identity);
+	break;
+    case HEAP_BY_RETAINER:
+    {
+	RetainerSet *rs = (RetainerSet *)identity;
+
+	// it might be the distinguished retainer set rs_MANY:
+	if (rs == &rs_MANY) {
+	    fprintf(hp_file, "MANY");
+	    break;
+	}
+
+	// Mark this retainer set by negating its id, because it
+	// has appeared in at least one census.  We print the
+	// values of all such retainer sets into the log file at
+	// the end.  A retainer set may exist but not feature in
+	// any censuses if it arose as the intermediate retainer
+	// set for some closure during retainer set calculation.
+	if (rs->id > 0)
+	    rs->id = -(rs->id);
+
+	// report in the unit of bytes: * sizeof(StgWord)
+	printRetainerSetShort(hp_file, rs, RtsFlags.ProfFlags.ccsLength);
+	break;
+    }
+    default:
+	barf("dumpCensus; doHeapProfile");
+    }
+#endif
+}
+
+// Number an identity for the binary profile, writing out its name
+// (name, or else the printed identity) the first time.
+static nat
+internIdentity (void *identity, char *name)
+{
+    void *key = name != NULL ? name : identity;
+    StgWord n;
+
+    n = (StgWord)lookupHashTable(hp_idents, (StgWord)key);
+    if (n != 0) {
+	return n - 1;
+    }
+
+    if (hp_n_idents == hp_max_idents) {
+	hp_max_idents = hp_max_idents == 0 ? 256 : hp_max_idents * 2;
+	hp_last = stgReallocBytes(hp_last, hp_max_idents * sizeof(W_),
+				  "internIdentity");
+	hp_cur = stgReallocBytes(hp_cur, hp_max_idents * sizeof(W_),
+				 "internIdentity");
+    }
+    n = hp_n_idents++;
+    hp_last[n] = 0;
+    hp_cur[n] = 0;
+    insertHashTable(hp_idents, (StgWord)key, (void *)(n + 1));
+
+    fputc(HP_BIN_IDENT, hp_file);
+    putVarint(n);
+    if (name != NULL) {
+	fputs(name, hp_file);
+    } else {
+	printIdentity(identity);
+    }
+    fputc('\0', hp_file);
+
+    return n;
+}
+
+// One band of a sample: name if it is not NULL, otherwise identity
+static void
+printCount (void *identity, char *name, W_ bytes)
+{
+    nat n;
+
+    if (hp_binary) {
+	n = internIdentity(identity, name);
+	hp_cur[n] += bytes;
+	return;
+    }
+
+    if (name != NULL) {
+	fputs(name, hp_file);
+    } else {
+	printIdentity(identity);
+    }
+    fprintf(hp_file, "\t%" FMT_Word "\n", bytes);
+}
+
 static void
 dumpCensus( Census *census )
 {
@@ -741,15 +1033,16 @@ dumpCensus( Census *census )
 
 #ifdef PROFILING
     if (RtsFlags.ProfFlags.doHeapProfile == HEAP_BY_LDV) {
-      fprintf(hp_file, "VOID\t%lu\n", (unsigned long)(census->void_total) * sizeof(W_));
-	fprintf(hp_file, "LAG\t%lu\n", 
-		(unsigned long)(census->not_used - census->void_total) * sizeof(W_));
-	fprintf(hp_file, "USE\t%lu\n", 
-		(unsigned long)(census->used - census->drag_total) * sizeof(W_));
-	fprintf(hp_file, "INHERENT_USE\t%lu\n", 
-		(unsigned long)(census->prim) * sizeof(W_));
-	fprintf(hp_file, "DRAG\t%lu\n",
-		(unsigned long)(census->drag_total) * sizeof(W_));
+	printCount(NULL, "VOID",
+		   (W_)(census->void_total) * sizeof(W_));
+	printCount(NULL, "LAG",
+		   (W_)(census->not_used - census->void_total) * sizeof(W_));
+	printCount(NULL, "USE",
+		   (W_)(census->used - census->drag_total) * sizeof(W_));
+	printCount(NULL, "INHERENT_USE",
+		   (W_)(census->prim) * sizeof(W_));
+	printCount(NULL, "DRAG",
+		   (W_)(census->drag_total) * sizeof(W_));
 	printSample(rtsFalse, census->time);
 	return;
     }
@@ -778,53 +1071,7 @@ dumpCensus( Census *census )
 
 	if (count == 0) continue;
 
-#if !defined(PROFILING)
-	switch (RtsFlags.ProfFlags.doHeapProfile) {
-	case HEAP_BY_CLOSURE_TYPE:
-	    fprintf(hp_file, "%s", (char *)ctr->identity);
-	    break;
-	}
-#endif
-	
-#ifdef PROFILING
-	switch (RtsFlags.ProfFlags.doHeapProfile) {
-	case HEAP_BY_CCS:
-	    fprint_ccs(hp_file, (CostCentreStack *)ctr->identity, RtsFlags.ProfFlags.ccsLength);
-	    break;
-	case HEAP_BY_MOD:
-	case HEAP_BY_DESCR:
-	case HEAP_BY_TYPE:
-	    fprintf(hp_file, "%s", (char *)ctr->identity);
-	    break;
-	case HEAP_BY_RETAINER:
-	{
-	    RetainerSet *rs = (RetainerSet *)ctr->identity;
-
-	    // it might be the distinguished retainer set rs_MANY:
-	    if (rs == &rs_MANY) {
-		fprintf(hp_file, "MANY");
-		break;
-	    }
-
-	    // Mark this retainer set by negating its id, because it
-	    // has appeared in at least one census.  We print the
-	    // values of all such retainer sets into the log file at
-	    // the end.  A retainer set may exist but not feature in
-	    // any censuses if it arose as the intermediate retainer
-	    // set for some closure during retainer set calculation.
-	    if (rs->id > 0)
-		rs->id = -(rs->id);
-
-	    // report in the unit of bytes: * sizeof(StgWord)
-	    printRetainerSetShort(hp_file, rs, RtsFlags.ProfFlags.ccsLength);
-	    break;
-	}
-	default:
-	    barf("dumpCensus; doHeapProfile");
-	}
-#endif
-
-	fprintf(hp_file, "\t%" FMT_SizeT "\n", (W_)count * sizeof(W_));
+	printCount(ctr->identity, NULL, (W_)count * sizeof(W_));
     }
 
     printSample(rtsFalse, census->time);
@@ -911,15 +1158,30 @@ static void heapProfObject(Census *census, StgClosure *p, nat size,
 /* -----------------------------------------------------------------------------
  * Code to perform a heap census.
  * -------------------------------------------------------------------------- */
+
+// Is bd one of the block groups that this census looks at?
+STATIC_INLINE rtsBool
+censusSampleBlock( bdescr *bd )
+{
+    nat h;
+
+    if (census_sample >= 100) return rtsTrue;
+    // mix the era in, so that a different sample is taken each time
+    h = (nat)hashWord(NULL, (StgWord)bd + era * (StgWord)0x9e3779b9);
+    return (h % 100) < census_sample;
+}
+
 static void
-heapCensusChain( Census *census, bdescr *bd )
+heapCensusChain( Census *census, bdescr *bd, bdescr *stop )
 {
     StgPtr p;
     StgInfoTable *info;
     nat size;
     rtsBool prim;
 
-    for (; bd != NULL; bd = bd->link) {
+    for (; bd != stop; bd = bd->link) {
+
+        if (!censusSampleBlock(bd)) continue;
 
         // HACK: pretend a pinned block is just one big ARR_WORDS
         // owned by CCS_PINNED.  These blocks can be full of holes due
@@ -1074,11 +1336,103 @@ heapCensusChain( Census *census, bdescr *bd )
     }
 }
 
+/* -----------------------------------------------------------------------------
+ * Cut a chain of block groups into chunks for the census
+ * -------------------------------------------------------------------------- */
+static void
+addCensusChunks( bdescr *bd )
+{
+    nat n;
+
+    while (bd != NULL) {
+        if (n_census_chunks == max_census_chunks) {
+            max_census_chunks = max_census_chunks == 0 ? 64
+                                                       : max_census_chunks * 2;
+            census_chunks = stgReallocBytes(census_chunks,
+                                            max_census_chunks * sizeof(CensusChunk),
+                                            "addCensusChunks");
+        }
+        census_chunks[n_census_chunks].bd = bd;
+        for (n = 0; bd != NULL && n < CENSUS_CHUNK_BLOCKS; n++) {
+            bd = bd->link;
+        }
+        census_chunks[n_census_chunks].stop = bd;
+        n_census_chunks++;
+    }
+}
+
+// Count the chunks that nobody else has taken yet
+static void
+censusChunks( Census *census )
+{
+    StgWord i;
+
+    while ((i = atomic_inc(&next_census_chunk, 1) - 1) < n_census_chunks) {
+        heapCensusChain(census, census_chunks[i].bd, census_chunks[i].stop);
+    }
+}
+
+// Called by the other GC threads once wakeupCensusThreads() has woken
+// them up.
+void
+heapCensusWorker( nat thread_index )
+{
+    Census *census = &thread_censuses[thread_index];
+
+    initEra(census);
+    censusChunks(census);
+}
+
+/* -----------------------------------------------------------------------------
+ * Add the counts of a GC thread's census into the census proper, and
+ * free it.
+ * -------------------------------------------------------------------------- */
+static void
+mergeCensus( Census *census, Census *from )
+{
+    counter *c, *ctr;
+
+    census->prim     += from->prim;
+    census->not_used += from->not_used;
+    census->used     += from->used;
+
+    for (c = from->ctrs; c != NULL; c = c->next) {
+        ctr = lookupHashTable(census->hash, (StgWord)c->identity);
+        if (ctr == NULL) {
+            ctr = arenaAlloc(census->arena, sizeof(counter));
+            initLDVCtr(ctr);
+            insertHashTable(census->hash, (StgWord)c->identity, ctr);
+            ctr->identity = c->identity;
+            ctr->next = census->ctrs;
+            census->ctrs = ctr;
+        }
+#ifdef PROFILING
+        if (RtsFlags.ProfFlags.bioSelector != NULL) {
+            ctr->c.ldv.prim     += c->c.ldv.prim;
+            ctr->c.ldv.not_used += c->c.ldv.not_used;
+            ctr->c.ldv.used     += c->c.ldv.used;
+        } else
+#endif
+        {
+            ctr->c.resid += c->c.resid;
+        }
+    }
+
+    freeHashTable(from->hash, NULL);
+    arenaFree(from->arena);
+    from->hash = NULL;
+    from->arena = NULL;
+}
+
 void heapCensus (Time t)
 {
   nat g, n;
   Census *census;
   gen_workspace *ws;
+  counter *ctr;
+#if defined(THREADED_RTS)
+  rtsBool parallel;
+#endif
 
   census = &censuses[era];
   census->time  = mut_user_time_until(t);
@@ -1094,18 +1448,59 @@ void heapCensus (Time t)
   stat_startHeapCensus();
 #endif
 
-  // Traverse the heap, collecting the census info
+  census_sample = RtsFlags.ProfFlags.censusSample;
+#ifdef PROFILING
+  if (doingLDVProfiling()) {
+      census_sample = 100;
+  }
+#endif
+
+  // Cut the heap into chunks
+  n_census_chunks = 0;
+  next_census_chunk = 0;
   for (g = 0; g < RtsFlags.GcFlags.generations; g++) {
-      heapCensusChain( census, generations[g].blocks );
+      addCensusChunks( generations[g].blocks );
       // Are we interested in large objects?  might be
       // confusing to include the stack in a heap profile.
-      heapCensusChain( census, generations[g].large_objects );
+      addCensusChunks( generations[g].large_objects );
 
       for (n = 0; n < n_capabilities; n++) {
           ws = &gc_threads[n]->gens[g];
-          heapCensusChain(census, ws->todo_bd);
-          heapCensusChain(census, ws->part_list);
-          heapCensusChain(census, ws->scavd_list);
+          addCensusChunks(ws->todo_bd);
+          addCensusChunks(ws->part_list);
+          addCensusChunks(ws->scavd_list);
+      }
+  }
+
+  // Traverse the heap, collecting the census info
+#if defined(THREADED_RTS)
+  thread_censuses = stgMallocBytes(n_capabilities * sizeof(Census),
+                                   "heapCensus");
+  for (n = 0; n < n_capabilities; n++) {
+      thread_censuses[n].hash = NULL;
+  }
+  parallel = n_census_chunks > 1 && wakeupCensusThreads();
+
+  censusChunks(census);
+
+  if (parallel) {
+      shutdownCensusThreads();
+      for (n = 0; n < n_capabilities; n++) {
+          if (thread_censuses[n].hash != NULL) {
+              mergeCensus(census, &thread_censuses[n]);
+          }
+      }
+  }
+  stgFree(thread_censuses);
+  thread_censuses = NULL;
+#else
+  censusChunks(census);
+#endif
+
+  // make up for the block groups that we didn't look at
+  if (census_sample < 100) {
+      for (ctr = census->ctrs; ctr != NULL; ctr = ctr->next) {
+          ctr->c.resid = (nat)((StgWord64)ctr->c.resid * 100 / census_sample);
       }
   }
 
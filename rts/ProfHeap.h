@@ -12,6 +12,7 @@
 #include "BeginPrivate.h"
 
 void    heapCensus         (Time t);
+void    heapCensusWorker   (nat thread_index);
 nat     initHeapProfiling  (void);
 void    endHeapProfiling   (void);
 rtsBool strMatchesSelector (char* str, char* sel);
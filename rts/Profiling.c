@@ -271,7 +271,9 @@ initProfilingLogFile(void)
 	sprintf(hp_filename, "%s.hp", prog);
 
 	/* open the log file */
-	if ((hp_file = fopen(hp_filename, "w")) == NULL) {
+	if ((hp_file = fopen(hp_filename,
+                             RtsFlags.ProfFlags.heapProfileFormat
+                                 == HEAP_PROFILE_BINARY ? "wb" : "w")) == NULL) {
 	    debugBelch("Can't open profiling report file %s\n", 
 		    hp_filename);
 	    RtsFlags.ProfFlags.doHeapProfile = 0;
@@ -19,6 +19,7 @@
 #include "sm/Sanity.h"
 #include "Profiling.h"
 #include "Messages.h"
+#include "AwaitEvent.h"
 #if defined(mingw32_HOST_OS)
 #include "win32/IOManager.h"
 #endif
@@ -664,19 +665,22 @@ removeFromQueues(Capability *cap, StgTSO *tso)
   case BlockedOnWrite:
 #if defined(mingw32_HOST_OS)
   case BlockedOnDoProc:
-#endif
       removeThreadFromDeQueue(cap, &blocked_queue_hd, &blocked_queue_tl, tso);
-#if defined(mingw32_HOST_OS)
       /* (Cooperatively) signal that the worker thread should abort
        * the request.
        */
       abandonWorkRequest(tso->block_info.async_result->reqID);
+#else
+      removeThreadFromBlockedQueue(cap, tso);
 #endif
       goto done;
 
+#if !defined(mingw32_HOST_OS)
+  // On Windows, threadDelay blocks with BlockedOnDoProc (addDelayRequest)
   case BlockedOnDelay:
-        removeThreadFromQueue(cap, &sleeping_queue, tso);
+        removeSleepingThread(tso);
 	goto done;
+#endif
 #endif
 
   default:
@@ -996,6 +1000,7 @@ raiseAsync(Capability *cap, StgTSO *tso, StgClosure *exception,
                 stmAbortTransaction(cap, trec);
                 stmFreeAbortedTRec(cap, trec);
                 tso->trec = outer;
+                stmResetBackoff(tso);
 
                 atomically = (StgThunk*)allocate(cap,sizeofW(StgThunk)+1);
                 TICK_ALLOC_SE_THK(1,0);
@@ -70,6 +70,8 @@ static void initStatsFile    (FILE *f);
 static int  openStatsFile    (char *filename, const char *FILENAME_FMT,
                               FILE **file_ret);
 
+static int  openGcLog        (char *sink, FILE **file_ret);
+
 static StgWord64 decodeSize  (const char *flag, nat offset,
                               StgWord64 min, StgWord64 max);
 
@@ -95,6 +97,8 @@ void initRtsFlagsDefaults(void)
 {
     RtsFlags.GcFlags.statsFile		= NULL;
     RtsFlags.GcFlags.giveStats		= NO_GC_STATS;
+    RtsFlags.GcFlags.gcLogFile          = NULL;
+    RtsFlags.GcFlags.gcLogFormat        = GC_LOG_JSON;
 
     RtsFlags.GcFlags.maxStkSize		= (8 * 1024 * 1024) / sizeof(W_);
     RtsFlags.GcFlags.initialStkSize	= 1024 / sizeof(W_);
@@ -113,12 +117,15 @@ void initRtsFlagsDefaults(void)
     RtsFlags.GcFlags.compact            = rtsFalse;
     RtsFlags.GcFlags.compactThreshold   = 30.0;
     RtsFlags.GcFlags.sweep              = rtsFalse;
+    RtsFlags.GcFlags.incMark            = rtsFalse;
+    RtsFlags.GcFlags.incMarkSlice       = 0;
     RtsFlags.GcFlags.idleGCDelayTime    = USToTime(300000); // 300ms
 #ifdef THREADED_RTS
     RtsFlags.GcFlags.doIdleGC           = rtsTrue;
 #else
     RtsFlags.GcFlags.doIdleGC           = rtsFalse;
 #endif
+    RtsFlags.GcFlags.releaseDelay       = SecondsToTime(10);
 
 #if osf3_HOST_OS
 /* ToDo: Perhaps by adjusting this value we can make linking without
@@ -131,6 +138,14 @@ void initRtsFlagsDefaults(void)
 #else
     RtsFlags.GcFlags.heapBase           = 0;   /* means don't care */
 #endif
+#if SIZEOF_VOID_P == 8
+    RtsFlags.GcFlags.heapReserveSize    = (StgWord)1 << 40;  /* 1T */
+#else
+    RtsFlags.GcFlags.heapReserveSize    = 0;
+#endif
+    RtsFlags.GcFlags.hugePages          = HUGE_PAGES_NONE;
+    RtsFlags.GcFlags.numa               = rtsFalse;
+    RtsFlags.GcFlags.numaMask           = 1;
 
 #ifdef DEBUG
     RtsFlags.DebugFlags.scheduler	= rtsFalse;
@@ -156,6 +171,8 @@ void initRtsFlagsDefaults(void)
 
     RtsFlags.ProfFlags.doHeapProfile      = rtsFalse;
     RtsFlags.ProfFlags. heapProfileInterval = USToTime(100000); // 100ms
+    RtsFlags.ProfFlags.censusSample       = 100;
+    RtsFlags.ProfFlags.heapProfileFormat  = HEAP_PROFILE_TEXT;
 
 #ifdef PROFILING
     RtsFlags.ProfFlags.includeTSOs        = rtsFalse;
@@ -179,6 +196,7 @@ void initRtsFlagsDefaults(void)
     RtsFlags.TraceFlags.sparks_sampled= rtsFalse;
     RtsFlags.TraceFlags.sparks_full   = rtsFalse;
     RtsFlags.TraceFlags.user          = rtsFalse;
+    RtsFlags.TraceFlags.sink          = NULL;
 #endif
 
 #ifdef PROFILING
@@ -188,6 +206,8 @@ void initRtsFlagsDefaults(void)
     RtsFlags.MiscFlags.tickInterval     = DEFAULT_TICK_INTERVAL;
 #endif
     RtsFlags.ConcFlags.ctxtSwitchTime   = USToTime(20000); // 20ms
+    RtsFlags.ConcFlags.stmContention    = STM_CONTENTION_KARMA;
+    RtsFlags.ConcFlags.stmIrrevocable   = 32;
 
     RtsFlags.MiscFlags.install_signal_handlers = rtsTrue;
     RtsFlags.MiscFlags.machineReadable = rtsFalse;
@@ -196,10 +216,12 @@ void initRtsFlagsDefaults(void)
 #ifdef THREADED_RTS
     RtsFlags.ParFlags.nNodes	        = 1;
     RtsFlags.ParFlags.migrate           = rtsTrue;
+    RtsFlags.ParFlags.stealThreads      = rtsFalse;
     RtsFlags.ParFlags.parGcEnabled      = 1;
     RtsFlags.ParFlags.parGcGen          = 0;
     RtsFlags.ParFlags.parGcLoadBalancingEnabled = rtsTrue;
     RtsFlags.ParFlags.parGcLoadBalancingGen = 1;
+    RtsFlags.ParFlags.parCompactEnabled = rtsTrue;
     RtsFlags.ParFlags.parGcNoSyncWithIdle   = 0;
     RtsFlags.ParFlags.setAffinity       = 0;
 #endif
@@ -242,6 +264,13 @@ usage_text[] = {
 "",
 "  -A<size> Sets the minimum allocation area size (default 512k) Egs: -A1m -A10k",
 "  -M<size> Sets the maximum heap size (default unlimited)  Egs: -M256k -M1G",
+"  --heap-reserve=<size>",
+"           Reserve this much address space for the heap at startup",
+"           (64-bit Unix only; default 1T, 0 to turn off)",
+"  --huge-pages[=<how>]",
+"           Back the heap with 2M pages (Linux only): <how> is",
+"           'transparent' (the default) or 'explicit', which uses the",
+"           pages set aside in /proc/sys/vm/nr_hugepages",
 "  -H<size> Sets the minimum heap size (default 0M)   Egs: -H24m  -H1G",
 "  -m<n>    Minimum % of heap which must be available (default 3%)",
 "  -G<n>    Number of generations (default: 2)",
@@ -251,14 +280,24 @@ usage_text[] = {
 "  -c       Use in-place compaction for all oldest generation collections",
 "           (the default is to use copying)",
 "  -w       Use mark-region for the oldest generation (experimental)",
+"  -wi[<size>] Mark the oldest generation incrementally, tracing <size>",
+"           of it after each minor GC (default: twice the -A size);",
+"           implies -w",
 #if defined(THREADED_RTS)
 "  -I<sec>  Perform full GC after <sec> idle time (default: 0.3, 0 == off)",
 #endif
+"  --release-delay=<sec>",
+"           Give free memory back to the OS once it has been free for",
+"           <sec> seconds, or when the program is idle (default: 10, 0 == off)",
 "",
 "  -T         Collect GC statistics (useful for in-program statistics access)",
 "  -t[<file>] One-line GC statistics (if <file> omitted, uses stderr)",
 "  -s[<file>] Summary  GC statistics (if <file> omitted, uses stderr)",
 "  -S[<file>] Detailed GC statistics (if <file> omitted, uses stderr)",
+"  --gc-log=<sink>",
+"             Write a record of each GC to <sink>: a file, stderr, or fd:<n>",
+"  --gc-log-format=<fmt>",
+"             The format of the --gc-log records: json (default) or csv",
 "",
 "",
 "  -Z       Don't squeeze out update frames on stack overflow",
@@ -316,6 +355,9 @@ usage_text[] = {
 #  endif
 "               -x    disable an event class, for any flag above",
 "             the initial enabled event classes are 'sgpu'",
+"  --eventlog-sink=<sink>",
+"             Send the -l events to <sink> instead: a file or named pipe,",
+"             unix:<path> (a unix-domain socket), or fd:<n>",
 #endif
 
 #if !defined(PROFILING)
@@ -323,6 +365,12 @@ usage_text[] = {
 "  -h       Heap residency profile (output file <program>.hp)",
 #endif
 "  -i<sec>  Time between heap profile samples (seconds, default: 0.1)",
+"  --heap-census-sample=<n>",
+"           Count only about <n>% of the heap in each heap profile sample,",
+"           and scale the counts up (default: 100)",
+"  --heap-profile-format=<fmt>",
+"           Write the heap profile as text (the default) or as binary,",
+"           which is smaller and faster for hp2ps to read",
 "",
 #if defined(TICKY_TICKY)
 "  -r<file>  Produce ticky-ticky statistics (with -rstderr for stderr)",
@@ -339,6 +387,14 @@ usage_text[] = {
 #else
 "            Default: 0.01 sec.",
 #endif
+"  --stm-contention=<policy>",
+"            What a transaction does when it fails to commit: none (run",
+"            it again at once), backoff (back off for a random, growing",
+"            time), or karma (back off, then run it irrevocably).",
+"            Default: karma",
+"  --stm-irrevocable=<n>",
+"            With karma, run a transaction irrevocably once it has failed",
+"            to commit <n> times in a row.  Default: 32",
 "",
 #if defined(DEBUG)
 "  -Ds  DEBUG: scheduler",
@@ -368,14 +424,22 @@ usage_text[] = {
 "            (default: 0, -qg alone turns off parallel GC)",
 "  -qb[<n>]  Use load-balancing in the parallel GC only for generations >= <n>",
 "            (default: 1, -qb alone turns off load-balancing)",
+"  -qc       Don't use the parallel GC threads for compaction",
 "  -qa       Use the OS to set thread affinity (experimental)",
 "  -qm       Don't automatically migrate threads between CPUs",
+"  -qs       Idle CPUs steal threads from busy ones, rather than busy",
+"            CPUs pushing threads to idle ones",
 "  -qi<n>    If a processor has been idle for the last <n> GCs, do not",
 "            wake it up for a non-load-balancing parallel GC.",
 "            (0 disables,  default: 0)",
 #endif
 "  --install-signal-handlers=<yes|no>",
 "            Install signal handlers (default: yes)",
+#if !defined(mingw32_HOST_OS)
+"  --numa[=<node_mask>]",
+"            Use NUMA, on the nodes given by <node_mask> (a bit mask;",
+"            default: all the nodes available to the process)",
+#endif
 #if defined(THREADED_RTS)
 "  -e<n>     Maximum number of outstanding local sparks (default: 4096)",
 #endif
@@ -717,6 +781,141 @@ error = rtsTrue;
                       printRtsInfo();
                       stg_exit(0);
                   }
+                  else if (!strncmp("heap-census-sample=",
+                               &rts_argv[arg][2], 19)) {
+                      OPTION_UNSAFE;
+                      RtsFlags.ProfFlags.censusSample
+                          = strtoul(&rts_argv[arg][21], (char **) NULL, 10);
+                      if (RtsFlags.ProfFlags.censusSample < 1
+                          || RtsFlags.ProfFlags.censusSample > 100) {
+                          errorBelch("bad value for %s", rts_argv[arg]);
+                          error = rtsTrue;
+                      }
+                  }
+                  else if (!strncmp("heap-profile-format=",
+                               &rts_argv[arg][2], 20)) {
+                      OPTION_UNSAFE;
+                      if (!strcmp(&rts_argv[arg][22], "text")) {
+                          RtsFlags.ProfFlags.heapProfileFormat
+                              = HEAP_PROFILE_TEXT;
+                      } else if (!strcmp(&rts_argv[arg][22], "binary")) {
+                          RtsFlags.ProfFlags.heapProfileFormat
+                              = HEAP_PROFILE_BINARY;
+                      } else {
+                          errorBelch("unknown heap profile format: %s",
+                                     rts_argv[arg]);
+                          error = rtsTrue;
+                      }
+                  }
+                  else if (!strncmp("gc-log=",
+                               &rts_argv[arg][2], 7)) {
+                      OPTION_UNSAFE;
+                      if (openGcLog(&rts_argv[arg][9],
+                                    &RtsFlags.GcFlags.gcLogFile) == -1) {
+                          error = rtsTrue;
+                      }
+                      // the records need the stats that -T collects
+                      if (RtsFlags.GcFlags.giveStats == NO_GC_STATS) {
+                          RtsFlags.GcFlags.giveStats = COLLECT_GC_STATS;
+                      }
+                  }
+                  else if (strequal("gc-log-format=json",
+                               &rts_argv[arg][2])) {
+                      OPTION_SAFE;
+                      RtsFlags.GcFlags.gcLogFormat = GC_LOG_JSON;
+                  }
+                  else if (strequal("gc-log-format=csv",
+                               &rts_argv[arg][2])) {
+                      OPTION_SAFE;
+                      RtsFlags.GcFlags.gcLogFormat = GC_LOG_CSV;
+                  }
+                  else if (!strncmp("eventlog-sink=",
+                               &rts_argv[arg][2], 14)) {
+                      OPTION_UNSAFE;
+                      TRACING_BUILD_ONLY(
+                          RtsFlags.TraceFlags.sink = &rts_argv[arg][16];
+                          );
+                  }
+                  else if (strequal("stm-contention=none",
+                               &rts_argv[arg][2])) {
+                      OPTION_SAFE;
+                      RtsFlags.ConcFlags.stmContention = STM_CONTENTION_NONE;
+                  }
+                  else if (strequal("stm-contention=backoff",
+                               &rts_argv[arg][2])) {
+                      OPTION_SAFE;
+                      RtsFlags.ConcFlags.stmContention = STM_CONTENTION_BACKOFF;
+                  }
+                  else if (strequal("stm-contention=karma",
+                               &rts_argv[arg][2])) {
+                      OPTION_SAFE;
+                      RtsFlags.ConcFlags.stmContention = STM_CONTENTION_KARMA;
+                  }
+                  else if (!strncmp("stm-irrevocable=",
+                               &rts_argv[arg][2], 16)) {
+                      OPTION_SAFE;
+                      RtsFlags.ConcFlags.stmIrrevocable
+                          = strtoul(&rts_argv[arg][18], (char **) NULL, 10);
+                      if (RtsFlags.ConcFlags.stmIrrevocable == 0) {
+                          errorBelch("bad value for %s", rts_argv[arg]);
+                          error = rtsTrue;
+                      }
+                  }
+                  else if (!strncmp("heap-reserve=",
+                               &rts_argv[arg][2], 13)) {
+                      OPTION_UNSAFE;
+                      RtsFlags.GcFlags.heapReserveSize = (StgWord)
+                          decodeSize(rts_argv[arg], 15, 0, HS_WORD_MAX);
+                  }
+                  else if (strequal("huge-pages",
+                               &rts_argv[arg][2]) ||
+                           strequal("huge-pages=transparent",
+                               &rts_argv[arg][2])) {
+                      OPTION_UNSAFE;
+                      RtsFlags.GcFlags.hugePages = HUGE_PAGES_TRANSPARENT;
+                  }
+                  else if (!strncmp("release-delay=",
+                               &rts_argv[arg][2], 14)) {
+                      OPTION_UNSAFE;
+                      RtsFlags.GcFlags.releaseDelay
+                          = fsecondsToTime(atof(rts_argv[arg]+16));
+                  }
+                  else if (strequal("huge-pages=explicit",
+                               &rts_argv[arg][2])) {
+                      OPTION_UNSAFE;
+                      RtsFlags.GcFlags.hugePages = HUGE_PAGES_EXPLICIT;
+                  }
+#if defined(mingw32_HOST_OS)
+                  // We neither place memory nor threads on NUMA
+                  // nodes on Windows (see osNumaAvailable()).
+                  else if (strequal("numa",
+                               &rts_argv[arg][2]) ||
+                           !strncmp("numa=",
+                               &rts_argv[arg][2], 5)) {
+                      OPTION_UNSAFE;
+                      errorBelch("%s: NUMA is not supported on Windows",
+                                 rts_argv[arg]);
+                      error = rtsTrue;
+                  }
+#else
+                  else if (strequal("numa",
+                               &rts_argv[arg][2])) {
+                      OPTION_UNSAFE;
+                      RtsFlags.GcFlags.numa = rtsTrue;
+                      RtsFlags.GcFlags.numaMask = ~(StgWord)0;
+                  }
+                  else if (!strncmp("numa=",
+                               &rts_argv[arg][2], 5)) {
+                      OPTION_UNSAFE;
+                      RtsFlags.GcFlags.numa = rtsTrue;
+                      RtsFlags.GcFlags.numaMask
+                          = strtoul(&rts_argv[arg][7], (char **) NULL, 0);
+                      if (RtsFlags.GcFlags.numaMask == 0) {
+                          errorBelch("bad NUMA node mask: %s", rts_argv[arg]);
+                          error = rtsTrue;
+                      }
+                  }
+#endif
                   else {
 		      OPTION_SAFE;
 		      errorBelch("unknown RTS option: %s",rts_argv[arg]);
@@ -787,6 +986,14 @@ error = rtsTrue;
               case 'w':
         	OPTION_UNSAFE;
 		RtsFlags.GcFlags.sweep = rtsTrue;
+                if (rts_argv[arg][2] == 'i') {
+                    RtsFlags.GcFlags.incMark = rtsTrue;
+                    if (rts_argv[arg][3] != '\0') {
+                        RtsFlags.GcFlags.incMarkSlice =
+                            decodeSize(rts_argv[arg], 3, sizeof(W_), HS_INT_MAX)
+                                / sizeof(W_);
+                    }
+                }
 		break;
 
 	      case 'F':
@@ -1229,6 +1436,9 @@ error = rtsTrue;
                                 = strtol(rts_argv[arg]+3, (char **) NULL, 10);
                         }
                         break;
+                    case 'c':
+                        RtsFlags.ParFlags.parCompactEnabled = rtsFalse;
+                        break;
                     case 'i':
                         RtsFlags.ParFlags.parGcNoSyncWithIdle
                             = strtol(rts_argv[arg]+3, (char **) NULL, 10);
@@ -1239,6 +1449,9 @@ error = rtsTrue;
 		    case 'm':
 			RtsFlags.ParFlags.migrate = rtsFalse;
 			break;
+                    case 's':
+                        RtsFlags.ParFlags.stealThreads = rtsTrue;
+                        break;
                     case 'w':
                         // -qw was removed; accepted for backwards compat
                         break;
@@ -1502,6 +1715,37 @@ openStatsFile (char *filename,           // filename, or NULL
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+ * openGcLog: open the sink for +RTS --gc-log, which is a file name,
+ * "stderr", or fd:<n> for a descriptor inherited from the parent.
+ * -------------------------------------------------------------------------- */
+
+static int // return -1 on error
+openGcLog (char *sink, FILE **file_ret)
+{
+    FILE *f;
+    int fd;
+
+    if (strequal(sink, "stderr")) {
+        f = stderr;
+    } else if (!strncmp(sink, "fd:", 3)) {
+        fd = parseFdSink(sink);
+        if (fd < 0) {
+            return -1;
+        }
+        f = fdopen(fd, "w");
+    } else {
+        f = fopen(sink, "w");
+    }
+    if (f == NULL) {
+        errorBelch("Can't open GC log %s\n", sink);
+        return -1;
+    }
+    *file_ret = f;
+
+    return 0;
+}
+
 /* -----------------------------------------------------------------------------
  * initStatsFile: write a line to the file containing the program name
  * and the arguments it was invoked with.
@@ -1543,7 +1787,9 @@ decodeSize(const char *flag, nat offset, StgWord64 min, StgWord64 max)
         m = atof(s);
         c = s[strlen(s)-1];
 
-        if (c == 'g' || c == 'G')
+        if (c == 't' || c == 'T')
+            m *= 1024.0*1024*1024*1024;
+        else if (c == 'g' || c == 'G')
             m *= 1024*1024*1024;
         else if (c == 'm' || c == 'M')
             m *= 1024*1024;
@@ -37,6 +37,11 @@ extern char *ctime_r(const time_t *, char *);
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <limits.h>
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
 
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
@@ -318,3 +323,29 @@ void checkFPUStack(void)
 #endif
 }
 
+
+/* The descriptor in an "fd:<n>" sink (--eventlog-sink, --gc-log), or
+ * -1, having said why, if <n> is anything but plain digits or the
+ * descriptor isn't open.
+ */
+int parseFdSink(char *sink)
+{
+    char *end;
+    long fd;
+
+    // just digits: no sign, no spaces, nothing after
+    errno = 0;
+    fd = strtol(sink + 3, &end, 10);
+    if (sink[3] < '0' || sink[3] > '9' || *end != '\0' ||
+        errno != 0 || fd > INT_MAX) {
+        errorBelch("bad file descriptor: %s", sink);
+        return -1;
+    }
+#if defined(F_GETFD)
+    if (fcntl((int)fd, F_GETFD) == -1) {
+        sysErrorBelch("%s", sink);
+        return -1;
+    }
+#endif
+    return (int)fd;
+}
@@ -45,6 +45,8 @@ void printRtsInfo(void);
 
 void checkFPUStack(void);
 
+int parseFdSink(char *sink);
+
 #include "EndPrivate.h"
 
 #endif /* RTSUTILS_H */
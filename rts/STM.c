@@ -39,6 +39,25 @@
  * and, when committing a transaction, no locks are acquired for TVars that have
  * been read but not updated.
  *
+ * STM_TL2 is STM_FG_LOCKS with a global version clock, as in TL2.  The
+ * num_updates field of a TVar holds the clock value of the last commit
+ * that wrote to it, rather than a count of updates, and a TRec's
+ * read_version holds the clock value when the transaction started.  Each
+ * TVar is checked against read_version as it is first read (see
+ * read_current_value), so the transaction always has a consistent view:
+ *
+ *   - a transaction that has updated nothing commits straight away, with
+ *     no locking and no validation;
+ *
+ *   - an updating transaction locks the TVars it updates, takes a new
+ *     version from the clock, and only has to check the TVars it has read
+ *     if somebody else has committed since it started.
+ *
+ * When a read finds a TVar that is newer than read_version, we try to
+ * move read_version forward (extend_read_version); if that fails then the
+ * outermost transaction is condemned, and will be re-run when it tries to
+ * commit.
+ *
  * Concurrency control is implemented in the functions:
  *
  *    lock_stm
@@ -349,6 +368,16 @@ static void unlock_inv(StgAtomicInvariant *inv) {
 }
 #endif
 
+#if defined(STM_TL2)
+#define IF_STM_TL2(__X) do { __X } while (0)
+
+// The global version clock: each commit that updates TVars moves it on by
+// one, and stamps the TVars it writes with the new value.
+static volatile StgWord stm_version_clock = 0;
+#else
+#define IF_STM_TL2(__X) do { } while (0)
+#endif
+
 /*......................................................................*/
  
 static StgBool watcher_is_tso(StgTVarWatchQueue *q) {
@@ -459,6 +488,8 @@ static StgTRecHeader *new_stg_trec_header(Capability *cap,
   result -> enclosing_trec = enclosing_trec;
   result -> current_chunk = new_stg_trec_chunk(cap);
   result -> invariants_to_check = END_INVARIANT_CHECK_QUEUE;
+  result -> read_version = 0;
+  result -> irrevocable = 0;
 
   if (enclosing_trec == NO_TREC) {
     result -> state = TREC_ACTIVE;
@@ -543,6 +574,7 @@ static StgTRecHeader *alloc_stg_trec_header(Capability *cap,
     result -> enclosing_trec = enclosing_trec;
     result -> current_chunk -> next_entry_idx = 0;
     result -> invariants_to_check = END_INVARIANT_CHECK_QUEUE;
+    result -> irrevocable = 0;
     if (enclosing_trec == NO_TREC) {
       result -> state = TREC_ACTIVE;
     } else {
@@ -776,6 +808,17 @@ static StgBool entry_is_update(TRecEntry *e) {
   return result;
 } 
 
+static StgBool trec_is_read_only(StgTRecHeader *trec) {
+  StgBool result = TRUE;
+  FOR_EACH_ENTRY(trec, e, {
+    if (entry_is_update(e)) {
+      result = FALSE;
+      BREAK_FOR_EACH;
+    }
+  });
+  return result;
+}
+
 #if defined(STM_FG_LOCKS)
 static StgBool entry_is_read_only(TRecEntry *e) {
   StgBool result;
@@ -857,6 +900,8 @@ static StgBool validate_and_acquire_ownership (Capability *cap,
         }
       } else {
         ASSERT(config_use_read_phase);
+#if !defined(STM_TL2)
+        // (STM_TL2 checks read_version in check_read_only instead)
         IF_STM_FG_LOCKS({
           TRACE("%p : will need to check %p", trec, s);
           if (s -> current_value != e -> expected_value) {
@@ -873,6 +918,7 @@ static StgBool validate_and_acquire_ownership (Capability *cap,
             TRACE("%p : need to check version %ld", trec, e -> num_updates);
           }
         });
+#endif
       }
     });
   }
@@ -894,11 +940,37 @@ static StgBool validate_and_acquire_ownership (Capability *cap,
 // The paper "Concurrent programming without locks" (under submission), or
 // Keir Fraser's PhD dissertation "Practical lock-free programming" discuss
 // this kind of algorithm.
+//
+// With STM_TL2 there is nothing stashed: a read-only TVar is still good if
+// it holds its expected value and hasn't been written since read_version.
 
 static StgBool check_read_only(StgTRecHeader *trec STG_UNUSED) {
   StgBool result = TRUE;
 
   ASSERT (config_use_read_phase);
+#if defined(STM_TL2)
+  FOR_EACH_ENTRY(trec, e, {
+    StgTVar *s;
+    s = e -> tvar;
+    if (entry_is_read_only(e)) {
+      // Value first, then version: a TVar written by a commit that took
+      // its version before ours is either still locked or already has
+      // its new num_updates.
+      if (s -> current_value != e -> expected_value) {
+        TRACE("%p : mismatch", trec);
+        result = FALSE;
+        BREAK_FOR_EACH;
+      }
+      load_load_barrier();
+      if ((StgWord)(s -> num_updates) > trec -> read_version) {
+        TRACE("%p : %p is newer than version %" FMT_Word,
+              trec, s, trec -> read_version);
+        result = FALSE;
+        BREAK_FOR_EACH;
+      }
+    }
+  });
+#else
   IF_STM_FG_LOCKS({
     FOR_EACH_ENTRY(trec, e, {
       StgTVar *s;
@@ -918,9 +990,52 @@ static StgBool check_read_only(StgTRecHeader *trec STG_UNUSED) {
       }
     });
   });
+#endif
+
+  return result;
+}
+
+#if defined(STM_TL2)
+// extend_read_version : we've come across a TVar that has been written
+// since read_version.  If none of the TVars we have already read have
+// changed, then we might as well have started now, so we move read_version
+// (of the whole nest) forward and carry on.  Otherwise our view is out of
+// date and we return FALSE; read_version moves on all the same, so that
+// the caller can condemn the transaction without it also failing every
+// nested commit on the way to the top.
+
+static StgBool extend_read_version(StgTRecHeader *trec) {
+  StgTRecHeader *t;
+  StgBool result = TRUE;
+  StgWord now;
+
+  now = stm_version_clock;
+  load_load_barrier();
+  for (t = trec; result && t != NO_TREC; t = t -> enclosing_trec) {
+    FOR_EACH_ENTRY(t, e, {
+      StgTVar *s;
+      s = e -> tvar;
+      if (s -> current_value != e -> expected_value) {
+        result = FALSE;
+        BREAK_FOR_EACH;
+      }
+      load_load_barrier();
+      if ((StgWord)(s -> num_updates) > now) {
+        result = FALSE;
+        BREAK_FOR_EACH;
+      }
+    });
+  }
 
+  for (t = trec; t != NO_TREC; t = t -> enclosing_trec) {
+    t -> read_version = now;
+  }
+
+  TRACE("%p : extend_read_version to %" FMT_Word " %s", 
+        trec, now, result ? "succeeded" : "failed");
   return result;
 }
+#endif
 
 
 /************************************************************************/
@@ -973,6 +1088,138 @@ static void getToken(Capability *cap STG_UNUSED) {
 
 /*......................................................................*/
 
+// Irrevocable transactions.  A transaction that keeps failing to commit
+// can take stm_irrevocable (see cm_karma), which marks its TRec.  Until
+// that TRec commits, aborts or starts waiting, no other transaction may
+// commit an update, so once it has run through without meeting a commit
+// that was already under way it is sure to commit.  Read-only
+// transactions are unaffected, as they can't make it invalid.
+//
+// stm_irrevocable holds a ticket, copied into the TRec's irrevocable
+// field, rather than a pointer to the TRec, which the GC may move.
+
+static volatile StgWord stm_irrevocable = 0;      // 0 => nobody has it
+static volatile StgWord stm_irrevocable_tickets = 0;
+
+static StgBool take_irrevocable(StgTRecHeader *trec) {
+  StgWord ticket;
+  ASSERT(trec -> enclosing_trec == NO_TREC);
+  if (stm_irrevocable != 0) {
+    return FALSE;
+  }
+  ticket = atomic_inc(&stm_irrevocable_tickets, 1);
+  if (cas(&stm_irrevocable, 0, ticket) != 0) {
+    return FALSE;
+  }
+  TRACE("%p : running irrevocably", trec);
+  trec -> irrevocable = ticket;
+  return TRUE;
+}
+
+static void release_irrevocable(StgTRecHeader *trec) {
+  if (trec -> irrevocable != 0) {
+    ASSERT(stm_irrevocable == trec -> irrevocable);
+    TRACE("%p : no longer irrevocable", trec);
+    trec -> irrevocable = 0;
+    write_barrier();
+    stm_irrevocable = 0;
+  }
+}
+
+static StgBool blocked_by_irrevocable(StgTRecHeader *trec) {
+  StgWord owner = stm_irrevocable;
+  return (owner != 0 && owner != trec -> irrevocable &&
+          !trec_is_read_only(trec));
+}
+
+/*......................................................................*/
+
+// Contention management: what a thread does before running a transaction
+// that failed to commit again.  There is one manager for each
+// --stm-contention policy.
+//
+// cm_backoff spins for a random number of iterations, up to twice as
+// many each time the transaction fails in a row, so that threads that
+// keep colliding spread out; after a few failures it also yields, so
+// that whatever it is colliding with on this capability can get on.
+// cm_karma does the same, but a transaction that has failed
+// --stm-irrevocable times in a row runs irrevocably instead.
+
+#define BACKOFF_MAX_SHIFT 16   // spin at most 2^16 times
+#define BACKOFF_YIELD     4    // failures in a row before we yield too
+
+typedef StgBool ContentionManager(Capability *cap, StgTSO *tso, 
+                                  StgTRecHeader *trec);
+
+static StgWord32 backoff_random(Capability *cap) {
+  StgWord32 x = cap -> stm_seed;
+  // xorshift
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  cap -> stm_seed = x;
+  return x;
+}
+
+static StgBool cm_none(Capability *cap STG_UNUSED, 
+                       StgTSO *tso STG_UNUSED, 
+                       StgTRecHeader *trec STG_UNUSED) {
+  return FALSE;
+}
+
+static StgBool cm_backoff(Capability *cap, StgTSO *tso, 
+                          StgTRecHeader *trec STG_UNUSED) {
+#if defined(THREADED_RTS)
+  // (with only one OS thread, nothing can commit while we spin)
+  StgWord32 spins, i;
+  spins = backoff_random(cap) & 
+    ((1 << stg_min(tso -> stm_aborts, BACKOFF_MAX_SHIFT)) - 1);
+  for (i = 0; i < spins; i++) {
+    busy_wait_nop();
+  }
+#endif
+  if (tso -> stm_aborts >= BACKOFF_YIELD) {
+    cap -> stm_stats.backoffs++;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+static StgBool cm_karma(Capability *cap, StgTSO *tso, StgTRecHeader *trec) {
+  if (tso -> stm_aborts >= RtsFlags.ConcFlags.stmIrrevocable &&
+      take_irrevocable(trec)) {
+    cap -> stm_stats.irrevocable++;
+    return FALSE;
+  }
+  return cm_backoff(cap, tso, trec);
+}
+
+static ContentionManager *contention_managers[] = {
+  [STM_CONTENTION_NONE]    = cm_none,
+  [STM_CONTENTION_BACKOFF] = cm_backoff,
+  [STM_CONTENTION_KARMA]   = cm_karma,
+};
+
+StgBool stmBackoff(Capability *cap, StgTSO *tso, StgTRecHeader *trec) {
+  StgBool yield;
+  ASSERT (trec != NO_TREC && trec -> enclosing_trec == NO_TREC);
+
+  if (tso -> stm_aborts < 0xffffffff) {
+    tso -> stm_aborts++;
+  }
+  yield = contention_managers[RtsFlags.ConcFlags.stmContention](cap, tso, trec);
+  TRACE("%p : thread %lu failed to commit %d times in a row%s", trec,
+        (unsigned long)tso -> id, tso -> stm_aborts, 
+        yield ? ", yielding" : "");
+  return yield;
+}
+
+void stmResetBackoff(StgTSO *tso) {
+  tso -> stm_aborts = 0;
+}
+
+/*......................................................................*/
+
 StgTRecHeader *stmStartTransaction(Capability *cap,
                                    StgTRecHeader *outer) {
   StgTRecHeader *t;
@@ -983,6 +1230,14 @@ StgTRecHeader *stmStartTransaction(Capability *cap,
   getToken(cap);
 
   t = alloc_stg_trec_header(cap, outer);
+  IF_STM_TL2({
+    if (outer == NO_TREC) {
+      t -> read_version = stm_version_clock;
+      load_load_barrier();
+    } else {
+      t -> read_version = outer -> read_version;
+    }
+  });
   TRACE("%p : stmStartTransaction()=%p", outer, t);
   return t;
 }
@@ -1012,6 +1267,8 @@ void stmAbortTransaction(Capability *cap,
       remove_watch_queue_entries_for_trec(cap, trec);
     } 
 
+    release_irrevocable(trec);
+
   } else {
     // We're a nested transaction: merge our read set into our parent's
     TRACE("%p : retaining read-set into parent %p", trec, et);
@@ -1313,11 +1570,27 @@ StgInvariantCheckQueue *stmGetInvariantsToCheck(Capability *cap, StgTRecHeader *
 
 /*......................................................................*/
 
+// Count the outcome of a top-level commit.  The only thread that commits
+// a transaction is the one running it, so that's the one on cap.
+
+static void count_commit(Capability *cap, StgBool committed) {
+  if (committed) {
+    cap -> stm_stats.commits++;
+    cap -> r.rCurrentTSO -> stm_aborts = 0;
+  } else {
+    cap -> stm_stats.aborts++;
+  }
+}
+
 StgBool stmCommitTransaction(Capability *cap, StgTRecHeader *trec) {
   int result;
-  StgInt64 max_commits_at_start = max_commits;
   StgBool touched_invariants;
   StgBool use_read_phase;
+#if defined(STM_TL2)
+  StgWord write_version = 0;
+#else
+  StgInt64 max_commits_at_start = max_commits;
+#endif
 
   TRACE("%p : stmCommitTransaction()", trec);
   ASSERT (trec != NO_TREC);
@@ -1328,6 +1601,14 @@ StgBool stmCommitTransaction(Capability *cap, StgTRecHeader *trec) {
   ASSERT ((trec -> state == TREC_ACTIVE) || 
           (trec -> state == TREC_CONDEMNED));
 
+  if (blocked_by_irrevocable(trec)) {
+    TRACE("%p : another transaction is running irrevocably", trec);
+    unlock_stm(trec);
+    free_stg_trec_header(cap, trec);
+    count_commit(cap, FALSE);
+    return FALSE;
+  }
+
   // touched_invariants is true if we've written to a TVar with invariants 
   // attached to it, or if we're trying to add a new invariant to the system.
 
@@ -1385,11 +1666,38 @@ StgBool stmCommitTransaction(Capability *cap, StgTRecHeader *trec) {
 
   use_read_phase = ((config_use_read_phase) && (!touched_invariants));
 
+#if defined(STM_TL2)
+  // Everything we read was current at read_version, so if we haven't
+  // updated anything then that's where we commit: there's nothing to lock
+  // and nothing to check.
+  if (use_read_phase && trec -> state == TREC_ACTIVE && 
+      trec_is_read_only(trec) && !shake()) {
+    TRACE("%p : read-only, committed at version %" FMT_Word,
+          trec, trec -> read_version);
+    release_irrevocable(trec);
+    unlock_stm(trec);
+    free_stg_trec_header(cap, trec);
+    count_commit(cap, TRUE);
+    return TRUE;
+  }
+#endif
+
   result = validate_and_acquire_ownership(cap, trec, (!use_read_phase), TRUE);
   if (result) {
     // We now know that all the updated locations hold their expected values.
     ASSERT (trec -> state == TREC_ACTIVE);
 
+#if defined(STM_TL2)
+    // Take the version our updates will carry.  Any commit that took a
+    // version before us has its TVars locked by now, so if nobody has
+    // committed since read_version, what we read can't have changed.
+    write_version = atomic_inc(&stm_version_clock, 1);
+    if (use_read_phase && write_version != trec -> read_version + 1) {
+      TRACE("%p : doing read check", trec);
+      result = check_read_only(trec);
+      TRACE("%p : read-check %s", trec, result ? "succeeded" : "failed");
+    }
+#else
     if (use_read_phase) {
       StgInt64 max_commits_at_end;
       StgInt64 max_concurrent_commits;
@@ -1404,6 +1712,7 @@ StgBool stmCommitTransaction(Capability *cap, StgTRecHeader *trec) {
         result = FALSE;
       }
     }
+#endif
     
     if (result) {
       // We now know that all of the read-only locations held their exepcted values
@@ -1442,9 +1751,15 @@ StgBool stmCommitTransaction(Capability *cap, StgTRecHeader *trec) {
           ACQ_ASSERT(tvar_is_locked(s, trec));
           TRACE("%p : writing %p to %p, waking waiters", trec, e -> new_value, s);
           unpark_waiters_on(cap,s);
+#if defined(STM_TL2)
+          // readers check the version after seeing the new value
+          s -> num_updates = (StgInt)write_version;
+          write_barrier();
+#else
           IF_STM_FG_LOCKS({
             s -> num_updates ++;
           });
+#endif
           unlock_tvar(cap, trec, s, e -> new_value, TRUE);
         } 
         ACQ_ASSERT(!tvar_is_locked(s, trec));
@@ -1454,10 +1769,14 @@ StgBool stmCommitTransaction(Capability *cap, StgTRecHeader *trec) {
     }
   } 
 
+  release_irrevocable(trec);
+
   unlock_stm(trec);
 
   free_stg_trec_header(cap, trec);
 
+  count_commit(cap, result);
+
   TRACE("%p : stmCommitTransaction()=%d", trec, result);
 
   return result;
@@ -1525,9 +1844,14 @@ StgBool stmWait(Capability *cap, StgTSO *tso, StgTRecHeader *trec) {
   ASSERT ((trec -> state == TREC_ACTIVE) || 
           (trec -> state == TREC_CONDEMNED));
 
+  // A thread that is waiting mustn't hold up everybody else
+  release_irrevocable(trec);
+
   lock_stm(trec);
   result = validate_and_acquire_ownership(cap, trec, TRUE, TRUE);
   if (result) {
+    cap -> stm_stats.retries++;
+
     // The transaction is valid so far so we can actually start waiting.
     // (Otherwise the transaction was not valid and the thread will have to
     // retry it).
@@ -1600,8 +1924,41 @@ StgBool stmReWait(Capability *cap, StgTSO *tso) {
 
 /*......................................................................*/
 
+// With STM_TL2 this is where reads are validated: we take the value
+// only if the TVar's version is the same before and after, and the TVar
+// hasn't been written since our read_version.
+
 static StgClosure *read_current_value(StgTRecHeader *trec STG_UNUSED, StgTVar *tvar) {
   StgClosure *result;
+#if defined(STM_TL2)
+  StgWord version;
+
+  for (;;) {
+    version = (StgWord)(tvar -> num_updates);
+    load_load_barrier();
+    result = tvar -> current_value;
+    if (GET_INFO(UNTAG_CLOSURE(result)) == &stg_TREC_HEADER_info) {
+      TRACE("%p : read_current_value(%p) saw %p", trec, tvar, result);
+      continue;
+    }
+    load_load_barrier();
+    if ((StgWord)(tvar -> num_updates) != version) {
+      continue;
+    }
+    if (version > trec -> read_version && !extend_read_version(trec)) {
+      // Something we read earlier has changed, so the transaction can only
+      // fail.  Condemn the outermost TRec, which will be re-run when it
+      // tries to commit, and carry on with the new value until then.
+      StgTRecHeader *t = trec;
+      while (t -> enclosing_trec != NO_TREC) {
+        t = t -> enclosing_trec;
+      }
+      TRACE("%p : read_current_value(%p) condemning %p", trec, tvar, t);
+      t -> state = TREC_CONDEMNED;
+    }
+    break;
+  }
+#else
   result = tvar -> current_value;
 
 #if defined(STM_FG_LOCKS)
@@ -1609,6 +1966,7 @@ static StgClosure *read_current_value(StgTRecHeader *trec STG_UNUSED, StgTVar *t
     TRACE("%p : read_current_value(%p) saw %p", trec, tvar, result);
     result = tvar -> current_value;
   }
+#endif
 #endif
 
   TRACE("%p : read_current_value(%p)=%p", trec, tvar, result);
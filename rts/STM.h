@@ -26,6 +26,18 @@
                   saw_update_by field of the TVars so that they do not 
                   need to be locked for reading.
 
+  STM_TL2      -- per-TVar exclusion as STM_FG_LOCKS, plus a global
+                  version clock in the style of TL2 (Dice, Shalev and
+                  Shavit, "Transactional Locking II", DISC 2006).  Each
+                  TVar records the clock value of the last commit that
+                  updated it, and each read checks that against the
+                  version the transaction started at, so reads are
+                  validated as they happen rather than all at the end.
+                  A transaction that updates nothing commits without
+                  taking any lock or looking at any TVar.  Build with
+                  -DSTM_TL2 (in GhcRtsCcOpts) to use it: it needs a
+                  64-bit THREADED_RTS.
+
   STM.C contains more details about the locking schemes used.
 
 */
@@ -38,6 +50,13 @@
 #define STM_FG_LOCKS
 #else
 #define STM_UNIPROC
+#undef STM_TL2
+#endif
+
+#if defined(STM_TL2)
+#if WORD_SIZE_IN_BITS < 64
+#error "STM_TL2 needs a 64-bit version clock"
+#endif
 #endif
 
 #include "BeginPrivate.h"
@@ -160,6 +179,25 @@ void stmAddInvariantToCheck(Capability *cap,
 StgBool stmCommitTransaction(Capability *cap, StgTRecHeader *trec);
 StgBool stmCommitNestedTransaction(Capability *cap, StgTRecHeader *trec);
 
+/*
+ * Contention management.  stmBackoff is called when tso's transaction
+ * has failed to commit, and trec is the new transaction record it is
+ * about to run in.  It may spin for a while, or arrange for trec to run
+ * irrevocably (so that nothing else can commit until it does); it
+ * returns TRUE if the thread should also yield its capability before
+ * running the transaction again.  See --stm-contention.
+ */
+
+StgBool stmBackoff(Capability *cap, StgTSO *tso, StgTRecHeader *trec);
+
+/*
+ * Forget tso's run of failed commits: an exception is taking it out of
+ * its atomically block, so its next transaction has nothing to do with
+ * this one and should not start off backing off.
+ */
+
+void stmResetBackoff(StgTSO *tso);
+
 /*
  * Test whether the current transaction context is valid and, if so,
  * start the thread waiting for updates to any of the tvars it has
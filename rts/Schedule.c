@@ -28,6 +28,7 @@
 #include "Weak.h"
 #include "sm/GC.h" // waitForGcThreads, releaseGCThreads, N
 #include "sm/GCThread.h"
+#include "sm/BlockAlloc.h"
 #include "Sparks.h"
 #include "Capability.h"
 #include "Task.h"
@@ -69,7 +70,6 @@
 // Blocked/sleeping thrads
 StgTSO *blocked_queue_hd = NULL;
 StgTSO *blocked_queue_tl = NULL;
-StgTSO *sleeping_queue = NULL;    // perhaps replace with a hash table?
 #endif
 
 /* Set to true when the latest garbage collection failed to reclaim
@@ -142,6 +142,9 @@ static void scheduleProcessInbox(Capability **cap);
 static void scheduleDetectDeadlock (Capability **pcap, Task *task);
 static void schedulePushWork(Capability *cap, Task *task);
 #if defined(THREADED_RTS)
+static void scheduleStealWork(Capability *cap);
+#endif
+#if defined(THREADED_RTS)
 static void scheduleActivateSpark(Capability *cap);
 #endif
 static void schedulePostRunThread(Capability *cap, StgTSO *t);
@@ -276,7 +279,13 @@ schedule (Capability *initialCapability, Task *task)
     scheduleFindWork(&cap);
 
     /* work pushing, currently relevant only for THREADED_RTS:
-       (pushes threads, wakes up idle capabilities for stealing) */
+       (pushes threads, wakes up idle capabilities for stealing),
+       or with +RTS -qs, stealing threads when we are idle */
+#if defined(THREADED_RTS)
+    if (RtsFlags.ParFlags.stealThreads) {
+        scheduleStealWork(cap);
+    } else
+#endif
     schedulePushWork(cap,task);
 
     scheduleDetectDeadlock(&cap,task);
@@ -575,6 +584,7 @@ removeFromRunQueue (Capability *cap, StgTSO *tso)
         setTSOPrev(cap, tso->_link, tso->block_info.prev);
     }
     tso->_link = tso->block_info.prev = END_TSO_QUEUE;
+    cap->n_run_queue--;
 
     IF_DEBUG(sanity, checkRunQueue(cap));
 }
@@ -763,6 +773,7 @@ schedulePushWork(Capability *cap USED_IF_THREADS,
 	    prev = cap->run_queue_hd;
 	    t = prev->_link;
 	    prev->_link = END_TSO_QUEUE;
+	    cap->n_run_queue = 1;
 	    for (; t != END_TSO_QUEUE; t = next) {
 		next = t->_link;
 		t->_link = END_TSO_QUEUE;
@@ -771,6 +782,7 @@ schedulePushWork(Capability *cap USED_IF_THREADS,
 		    setTSOLink(cap, prev, t);
                     setTSOPrev(cap, t, prev);
 		    prev = t;
+		    cap->n_run_queue++;
 		} else if (i == n_free_caps) {
 #ifdef SPARK_PUSHING
 		    pushed_to_all = rtsTrue;
@@ -780,6 +792,7 @@ schedulePushWork(Capability *cap USED_IF_THREADS,
 		    setTSOLink(cap, prev, t);
                     setTSOPrev(cap, t, prev);
 		    prev = t;
+		    cap->n_run_queue++;
 		} else {
 		    appendToRunQueue(free_caps[i],t);
 
@@ -834,6 +847,87 @@ schedulePushWork(Capability *cap USED_IF_THREADS,
 
 }
 
+/* -----------------------------------------------------------------------------
+ * scheduleStealWork()
+ *
+ * With +RTS -qs, an idle Capability pulls threads from a busy one,
+ * instead of the busy one pushing threads to idle Capabilities that it
+ * can grab (schedulePushWork()).
+ *
+ * Only the Capability that owns a run queue can touch it, so an idle
+ * Capability doesn't take threads itself: it leaves a request in the
+ * steal_request field of the busiest Capability it can see and
+ * interrupts it, and goes to sleep.  The busy Capability notices the
+ * request the next time round its scheduler loop and sends up to half
+ * of its run queue to the idle one with migrateThread(), which wakes
+ * it up.  Bound threads and threads locked to their Capability (by
+ * forkOn) are never sent.
+ * -------------------------------------------------------------------------- */
+
+#if defined(THREADED_RTS)
+static void
+scheduleStealWork (Capability *cap)
+{
+    Capability *thief, *victim, *cap0;
+    StgTSO *t, *prev;
+    StgWord req;
+    nat i, n, most;
+
+    // migration can be turned off with +RTS -qm
+    if (!RtsFlags.ParFlags.migrate) return;
+
+    if (sched_state != SCHED_RUNNING) return;
+
+    // Give threads to a Capability that asked for them.
+    if (cap->steal_request != 0) {
+        req = xchg((StgPtr)&cap->steal_request, 0);
+        thief = capabilities[req - 1];
+
+        if (!thief->disabled) {
+            n = 0;
+            // from the end of the run queue: these are the threads
+            // that would have waited longest here.  Always keep the
+            // thread at the front.
+            for (t = cap->run_queue_tl;
+                 t != END_TSO_QUEUE && t != cap->run_queue_hd
+                     && cap->n_run_queue > 1 + n;
+                 t = prev) {
+                prev = t->block_info.prev;
+                if (t->bound != NULL || tsoLocked(t)) continue;
+                removeFromRunQueue(cap, t);
+                migrateThread(cap, t, thief);
+                n++;
+            }
+            debugTrace(DEBUG_sched, "cap %d: sent %d threads to cap %d",
+                       cap->no, n, thief->no);
+        }
+    }
+
+    if (!emptyRunQueue(cap) || !emptyInbox(cap) || cap->disabled) return;
+
+    // We have nothing to do: ask the busiest Capability for some of
+    // its threads.  The run queue lengths are read without any
+    // locking, which is fine for a hint.
+    victim = NULL;
+    most = 1;
+    for (i = 0; i < n_capabilities; i++) {
+        cap0 = capabilities[i];
+        if (cap0 != cap && !cap0->disabled && cap0->n_run_queue > most) {
+            victim = cap0;
+            most = cap0->n_run_queue;
+        }
+    }
+
+    if (victim != NULL &&
+        cas((StgVolatilePtr)&victim->steal_request,
+            0, cap->no + 1) == 0) {
+        debugTrace(DEBUG_sched, "cap %d: asking cap %d for threads",
+                   cap->no, victim->no);
+        interruptCapability(victim);
+    }
+}
+#endif
+
 /* ----------------------------------------------------------------------------
  * Start any pending signal handlers
  * ------------------------------------------------------------------------- */
@@ -867,7 +961,7 @@ scheduleCheckBlockedThreads(Capability *cap USED_IF_NOT_THREADS)
     // run queue is empty, and there are no other tasks running, we
     // can wait indefinitely for something to happen.
     //
-    if ( !emptyQueue(blocked_queue_hd) || !emptyQueue(sleeping_queue) )
+    if ( !EMPTY_BLOCKED_QUEUE() || !EMPTY_SLEEPING_QUEUE() )
     {
 	awaitEvent (emptyRunQueue(cap));
     }
@@ -993,7 +1087,6 @@ scheduleProcessInbox (Capability **pcap USED_IF_THREADS)
 {
 #if defined(THREADED_RTS)
     Message *m, *next;
-    int r;
     Capability *cap = *pcap;
 
     while (!emptyInbox(cap)) {
@@ -1003,23 +1096,9 @@ scheduleProcessInbox (Capability **pcap USED_IF_THREADS)
             cap = *pcap;
         }
 
-        // don't use a blocking acquire; if the lock is held by
-        // another thread then just carry on.  This seems to avoid
-        // getting stuck in a message ping-pong situation with other
-        // processors.  We'll check the inbox again later anyway.
-        //
-        // We should really use a more efficient queue data structure
-        // here.  The trickiness is that we must ensure a Capability
-        // never goes idle if the inbox is non-empty, which is why we
-        // use cap->lock (cap->lock is released as the last thing
-        // before going idle; see Capability.c:releaseCapability()).
-        r = TRY_ACQUIRE_LOCK(&cap->lock);
-        if (r != 0) return;
-
-        m = cap->inbox;
-        cap->inbox = (Message*)END_TSO_QUEUE;
-
-        RELEASE_LOCK(&cap->lock);
+        // take the whole inbox at once; senders push onto it with
+        // cas() and never take anything off, so no lock is needed.
+        m = (Message*)xchg((StgPtr)&cap->inbox, (StgWord)END_TSO_QUEUE);
 
         while (m != (Message*)END_TSO_QUEUE) {
             next = m->link;
@@ -1109,7 +1188,7 @@ scheduleHandleHeapOverflow( Capability *cap, StgTSO *t )
 	    cap->r.rNursery->n_blocks == 1) {  // paranoia to prevent infinite loop
 	                                       // if the nursery has only one block.
 	    
-            bd = allocGroup_lock(blocks);
+            bd = allocGroupOnCap_lock(cap,blocks);
             cap->r.rNursery->n_blocks += blocks;
 	    
 	    // link the new group into the list
@@ -1426,6 +1505,51 @@ static void releaseAllCapabilities(nat n, Capability *cap, Task *task)
 }
 #endif
 
+/* -----------------------------------------------------------------------------
+ * Stop the world for something other than a GC
+ *
+ * stopAllCapabilities() returns with the calling Task holding every
+ * Capability, so no Haskell code is running and no GC is in progress;
+ * resumeAllCapabilities() lets them all go again.  The caller must not
+ * already hold a Capability: Haskell code gets here through a safe
+ * foreign call.  Used to start and stop the eventlog (see Trace.c).
+ * -------------------------------------------------------------------------- */
+
+Capability *
+stopAllCapabilities (void)
+{
+    Capability *cap;
+#if defined(THREADED_RTS)
+    Task *task;
+    nat sync;
+#endif
+
+    cap = rts_lock();
+
+#if defined(THREADED_RTS)
+    task = cap->running_task;
+
+    do {
+        sync = requestSync(&cap, task, SYNC_OTHER);
+    } while (sync);
+
+    acquireAllCapabilities(cap,task);
+
+    pending_sync = 0;
+#endif
+
+    return cap;
+}
+
+void
+resumeAllCapabilities (Capability *cap)
+{
+#if defined(THREADED_RTS)
+    releaseAllCapabilities(n_capabilities, cap, cap->running_task);
+#endif
+    rts_unlock(cap);
+}
+
 /* -----------------------------------------------------------------------------
  * Perform a garbage collection if necessary
  * -------------------------------------------------------------------------- */
@@ -1460,7 +1584,12 @@ scheduleDoGC (Capability **pcap, Task *task USED_IF_THREADS,
     if (sched_state < SCHED_INTERRUPTING
         && RtsFlags.ParFlags.parGcEnabled
         && collect_gen >= RtsFlags.ParFlags.parGcGen
-        && ! oldest_gen->mark)
+        && (! oldest_gen->mark
+            // the mark is sequential, but the GC threads can help
+            // with compaction (see GarbageCollect())
+            || (RtsFlags.ParFlags.parCompactEnabled
+                && oldest_gen->compact
+                && collect_gen == RtsFlags.GcFlags.generations-1)))
     {
         gc_type = SYNC_GC_PAR;
     } else {
@@ -1499,6 +1628,10 @@ scheduleDoGC (Capability **pcap, Task *task USED_IF_THREADS,
         }
     } while (sync);
 
+    // the time we spend waiting for the other Capabilities to stop
+    // counts towards this GC (see stat_endGC())
+    stat_startGCSync(gc_threads[cap->no]);
+
     // don't declare this until after we have sync'd, because
     // n_capabilities may change.
     rtsBool idle_cap[n_capabilities];
@@ -1653,6 +1786,7 @@ delete_threads_and_gc:
 #endif
 
     traceSparkCounters(cap);
+    traceSTMCounters(cap);
 
     switch (recent_activity) {
     case ACTIVITY_INACTIVE:
@@ -1665,6 +1799,11 @@ delete_threads_and_gc:
 #ifndef PROFILING
             stopTimer();
 #endif
+            // Nothing will want the free memory for now, so give it
+            // back to the OS (see decayFreeMemory()).
+            ACQUIRE_SM_LOCK;
+            decayFreeMemory(rtsTrue);
+            RELEASE_SM_LOCK;
             break;
         }
         // fall through...
@@ -1845,6 +1984,11 @@ forkProcess(HsStablePtr *entry
         resetTracing();
 #endif
 
+#if !defined(THREADED_RTS) && !defined(mingw32_HOST_OS)
+        // before deleteThread_() below unregisters any blocked threads
+        resetAwaitEventAfterFork();
+#endif
+
         // Now, all OS threads except the thread that forked are
 	// stopped.  We need to stop all Haskell threads, including
 	// those involved in foreign calls.  Also we need to delete
@@ -2102,8 +2246,8 @@ deleteAllThreads ( Capability *cap )
     // being GC'd, and we don't want the "main thread has been GC'd" panic.
 
 #if !defined(THREADED_RTS)
-    ASSERT(blocked_queue_hd == END_TSO_QUEUE);
-    ASSERT(sleeping_queue == END_TSO_QUEUE);
+    ASSERT(EMPTY_BLOCKED_QUEUE());
+    ASSERT(EMPTY_SLEEPING_QUEUE());
 #endif
 }
 
@@ -2416,7 +2560,6 @@ initScheduler(void)
 #if !defined(THREADED_RTS)
   blocked_queue_hd  = END_TSO_QUEUE;
   blocked_queue_tl  = END_TSO_QUEUE;
-  sleeping_queue    = END_TSO_QUEUE;
 #endif
 
   sched_state    = SCHED_RUNNING;
@@ -2505,7 +2648,10 @@ void markScheduler (evac_fn evac USED_IF_NOT_THREADS,
 #if !defined(THREADED_RTS)
     evac(user, (StgClosure **)(void *)&blocked_queue_hd);
     evac(user, (StgClosure **)(void *)&blocked_queue_tl);
-    evac(user, (StgClosure **)(void *)&sleeping_queue);
+#if !defined(mingw32_HOST_OS)
+    markFdWaiters(evac, user);
+    markSleepingThreads(evac, user);
+#endif
 #endif 
 }
 
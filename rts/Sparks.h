@@ -15,15 +15,8 @@
 
 /* typedef for SparkPool in RtsTypes.h */
 
-/* Stats on spark creation/conversion */
-typedef struct {
-    StgWord created;
-    StgWord dud;
-    StgWord overflowed;
-    StgWord converted;
-    StgWord gcd;
-    StgWord fizzled;
-} SparkCounters;
+/* SparkCounters, the stats on spark creation/conversion, are in
+ * includes/rts/storage/GC.h, for getSparkStats() */
 
 #if defined(THREADED_RTS)
 
@@ -16,6 +16,9 @@
 #include "RtsUtils.h"
 #include "Trace.h"
 #include "Stable.h"
+#include "Capability.h"
+
+#include <string.h>
 
 /* Comment from ADR's implementation in old RTS:
 
@@ -77,9 +80,8 @@
   application, etc of a stable pointer.
 
   Stable Pointers are exported to the outside world as indices and not
-  pointers, because the stable pointer table is allowed to be
-  reallocated for growth. The table is never shrunk for its space to
-  be reclaimed.
+  pointers, because the stable pointer table is allowed to grow. The
+  table is never shrunk for its space to be reclaimed.
 
   Future plans for stable ptrs include distinguishing them by the
   generation of the pointed object. See
@@ -91,10 +93,83 @@ static snEntry *stable_name_free = NULL;
 static unsigned int SNT_size = 0;
 #define INIT_SNT_SIZE 64
 
-spEntry *stable_ptr_table = NULL;
-static spEntry *stable_ptr_free = NULL;
-static unsigned int SPT_size = 0;
-#define INIT_SPT_SIZE 64
+/* -----------------------------------------------------------------------------
+ * Young entries
+ *
+ * A minor GC need only look at the entries that may point into a
+ * generation younger than the oldest: the others are roots it doesn't
+ * collect, and can't move.  So we keep a "young" flag for each
+ * segment of the stable pointer table, and for each chunk of
+ * SNT_CHUNK_SIZE entries of the stable name table, a bit like the card
+ * table of a mutable array.  Making an entry sets its flag, and each GC
+ * that looks at a segment or chunk works out the flag again from the
+ * entries it finds there.
+ * -------------------------------------------------------------------------- */
+
+#define SNT_CHUNK_BITS 10
+#define SNT_CHUNK_SIZE (1 << SNT_CHUNK_BITS)
+#define SNT_CHUNKS(size) (((size) + SNT_CHUNK_SIZE - 1) / SNT_CHUNK_SIZE)
+
+static StgWord8 *stable_name_young = NULL;
+
+// Would a minor GC leave the object alone?  It is either static, or in
+// the oldest generation.
+STATIC_INLINE rtsBool
+isOldObject (StgPtr p)
+{
+    p = (StgPtr)UNTAG_CLOSURE((StgClosure *)p);
+    return !HEAP_ALLOCED_GC(p) || Bdescr(p)->gen == oldest_gen;
+}
+
+/* -----------------------------------------------------------------------------
+ * The stable pointer table
+ *
+ * The table is an array of segments of SPT_SEGMENT_SIZE entries.  A
+ * segment never moves once it has been allocated, and when we run out
+ * of entries we add a segment rather than reallocating the table, so
+ * deRefStablePtr() can read an entry without taking any lock, even
+ * while another thread is enlarging the table.  When the array of
+ * segments itself is full, we copy it to one twice the size; the old
+ * one is kept until exitStableTables(), because a reader may still be
+ * looking at it.
+ *
+ * A free entry has addr == NULL.  The free entries are kept by number
+ * on a stack (stable_ptr_free), under stable_mutex, and in the
+ * threaded RTS each Capability also keeps up to STABLE_PTR_CACHE_SIZE
+ * of them (cap->free_stable_ptrs), which only it uses, so that
+ * getStablePtr() and freeStablePtr() on a Capability need the lock only
+ * when the cache is empty or full.
+ * -------------------------------------------------------------------------- */
+
+typedef struct {
+    spEntry entries[SPT_SEGMENT_SIZE];  /* first: see deRefStablePtr() */
+    StgWord young;                      /* may point to young objects */
+} sptSegment;
+
+spEntry **stable_ptr_table = NULL;      /* really sptSegment *[] */
+static nat SPT_segments = 0;            /* segments allocated */
+static nat SPT_dir_size = 0;            /* size of stable_ptr_table[] */
+#define INIT_SPT_DIR_SIZE 4
+
+/* old copies of stable_ptr_table[]: it doubles, so there are few */
+#define MAX_OLD_SPT_DIRS 32
+static spEntry **old_SPT_dirs[MAX_OLD_SPT_DIRS];
+static nat n_old_SPT_dirs = 0;
+
+static StgWord *stable_ptr_free = NULL; /* stack of free entries */
+static nat n_stable_ptr_free = 0;
+static nat stable_ptr_free_size = 0;
+
+#define SPT_size (SPT_segments * SPT_SEGMENT_SIZE)
+
+#define SPT_SEGMENT(sp) \
+    ((sptSegment *)stable_ptr_table[(sp) >> SPT_SEGMENT_BITS])
+#define SPT_ENTRY(sp) \
+    (&stable_ptr_table[(sp) >> SPT_SEGMENT_BITS][(sp) & SPT_SEGMENT_MASK])
+
+/* the next segment for a GC thread to mark; see markStablePtrSegments() */
+static volatile StgWord spt_next_segment = 0;
+static rtsBool spt_mark_all = rtsFalse;
 
 #ifdef THREADED_RTS
 Mutex stable_mutex;
@@ -146,17 +221,6 @@ initSnEntryFreeList(snEntry *table, nat n, snEntry *free)
   stable_name_free = table;
 }
 
-STATIC_INLINE void
-initSpEntryFreeList(spEntry *table, nat n, spEntry *free)
-{
-  spEntry *p;
-  for (p = table + n - 1; p >= table; p--) {
-      p->addr = (P_)free;
-      free = p;
-  }
-  stable_ptr_free = table;
-}
-
 void
 initStableTables(void)
 {
@@ -169,13 +233,16 @@ initStableTables(void)
      * return NULL if an entry isn't found in the hash table.
      */
     initSnEntryFreeList(stable_name_table + 1,INIT_SNT_SIZE-1,NULL);
+    stable_name_young = stgMallocBytes(SNT_CHUNKS(SNT_size),
+                                       "initStableNameTable");
+    memset(stable_name_young, 0, SNT_CHUNKS(SNT_size));
     addrToStableHash = allocHashTable();
 
-    if (SPT_size > 0) return;
-    SPT_size = INIT_SPT_SIZE;
-    stable_ptr_table = stgMallocBytes(SPT_size * sizeof *stable_ptr_table,
+    if (SPT_segments > 0) return;
+    SPT_dir_size = INIT_SPT_DIR_SIZE;
+    stable_ptr_table = stgMallocBytes(SPT_dir_size * sizeof *stable_ptr_table,
                                       "initStablePtrTable");
-    initSpEntryFreeList(stable_ptr_table,INIT_SPT_SIZE,NULL);
+    enlargeStablePtrTable();
 
 #ifdef THREADED_RTS
     initMutex(&stable_mutex);
@@ -199,21 +266,62 @@ enlargeStableNameTable(void)
                         "enlargeStableNameTable");
 
     initSnEntryFreeList(stable_name_table + old_SNT_size, old_SNT_size, NULL);
+
+    stable_name_young = stgReallocBytes(stable_name_young,
+                                        SNT_CHUNKS(SNT_size),
+                                        "enlargeStableNameTable");
+    memset(stable_name_young + SNT_CHUNKS(old_SNT_size), 0,
+           SNT_CHUNKS(SNT_size) - SNT_CHUNKS(old_SNT_size));
 }
 
+// Add a segment to the table, and put its entries on the free stack.
+// Needs stable_mutex.
 static void
 enlargeStablePtrTable(void)
 {
-    nat old_SPT_size = SPT_size;
+    spEntry **dir;
+    sptSegment *seg;
+    StgWord base;
+    nat i;
+
+    if (SPT_segments == SPT_dir_size) {
+        dir = stgMallocBytes(2 * SPT_dir_size * sizeof *stable_ptr_table,
+                             "enlargeStablePtrTable");
+        memcpy(dir, stable_ptr_table, SPT_dir_size * sizeof *stable_ptr_table);
+        if (n_old_SPT_dirs == MAX_OLD_SPT_DIRS) {
+            barf("enlargeStablePtrTable: too many stable pointers");
+        }
+        old_SPT_dirs[n_old_SPT_dirs++] = stable_ptr_table;
+        // the new array must be filled in before anyone can see it
+        write_barrier();
+        stable_ptr_table = dir;
+        SPT_dir_size *= 2;
+    }
 
-    // 2nd and subsequent times
-    SPT_size *= 2;
-    stable_ptr_table =
-        stgReallocBytes(stable_ptr_table,
-                        SPT_size * sizeof *stable_ptr_table,
-                        "enlargeStablePtrTable");
+    seg = stgMallocBytes(sizeof(sptSegment), "enlargeStablePtrTable");
+    for (i = 0; i < SPT_SEGMENT_SIZE; i++) {
+        seg->entries[i].addr = NULL;
+    }
+    seg->young = 0;
+    // nobody looks at this segment until we hand out one of its entries
+    stable_ptr_table[SPT_segments] = seg->entries;
+    base = (StgWord)SPT_segments * SPT_SEGMENT_SIZE;
+    SPT_segments++;
+
+    // every entry may be free at once, so the stack must be able to
+    // hold the whole table
+    if (stable_ptr_free_size < SPT_size) {
+        stable_ptr_free_size = SPT_size;
+        stable_ptr_free =
+            stgReallocBytes(stable_ptr_free,
+                            stable_ptr_free_size * sizeof *stable_ptr_free,
+                            "enlargeStablePtrTable");
+    }
 
-    initSpEntryFreeList(stable_ptr_table + old_SPT_size, old_SPT_size, NULL);
+    // the lowest numbers are handed out first
+    for (i = SPT_SEGMENT_SIZE; i > 0; i--) {
+        stable_ptr_free[n_stable_ptr_free++] = base + i - 1;
+    }
 }
 
 /* -----------------------------------------------------------------------------
@@ -230,12 +338,32 @@ exitStableTables(void)
     if (stable_name_table)
         stgFree(stable_name_table);
     stable_name_table = NULL;
+
+    if (stable_name_young)
+        stgFree(stable_name_young);
+    stable_name_young = NULL;
     SNT_size = 0;
 
-    if (stable_ptr_table)
+    if (stable_ptr_table) {
+        nat i;
+        for (i = 0; i < SPT_segments; i++) {
+            stgFree(stable_ptr_table[i]);
+        }
+        for (i = 0; i < n_old_SPT_dirs; i++) {
+            stgFree(old_SPT_dirs[i]);
+        }
         stgFree(stable_ptr_table);
+    }
     stable_ptr_table = NULL;
-    SPT_size = 0;
+    SPT_segments = 0;
+    SPT_dir_size = 0;
+    n_old_SPT_dirs = 0;
+
+    if (stable_ptr_free)
+        stgFree(stable_ptr_free);
+    stable_ptr_free = NULL;
+    n_stable_ptr_free = 0;
+    stable_ptr_free_size = 0;
 
 #ifdef THREADED_RTS
     closeMutex(&stable_mutex);
@@ -250,23 +378,78 @@ freeSnEntry(snEntry *sn)
   stable_name_free = sn;
 }
 
-STATIC_INLINE void
-freeSpEntry(spEntry *sp)
+/* -----------------------------------------------------------------------------
+ * Each Capability's cache of free stable pointers.  Only the Task that
+ * holds a Capability may use its cache, so we use the cache only if we
+ * can see that the calling Task is the one running its Capability;
+ * otherwise (a foreign thread, or a safe foreign call) we go to the
+ * global free stack, under the lock.
+ * -------------------------------------------------------------------------- */
+
+#ifdef THREADED_RTS
+STATIC_INLINE Capability *
+myStablePtrCache(void)
 {
-    sp->addr = (P_)stable_ptr_free;
-    stable_ptr_free = sp;
+    Task *task = myTask();
+
+    if (task != NULL && task->cap != NULL &&
+        task->cap->running_task == task) {
+        return task->cap;
+    }
+    return NULL;
+}
+
+// Move cached entries to the global free stack.  Needs stable_mutex.
+static void
+flushStablePtrCache(Capability *cap, nat keep)
+{
+    while (cap->n_free_stable_ptrs > keep) {
+        stable_ptr_free[n_stable_ptr_free++] =
+            cap->free_stable_ptrs[--cap->n_free_stable_ptrs];
+    }
 }
 
+// Fill half of the cache from the global free stack.
+static void
+refillStablePtrCache(Capability *cap)
+{
+    stableLock();
+    while (cap->n_free_stable_ptrs < STABLE_PTR_CACHE_SIZE / 2) {
+        if (n_stable_ptr_free == 0) enlargeStablePtrTable();
+        cap->free_stable_ptrs[cap->n_free_stable_ptrs++] =
+            stable_ptr_free[--n_stable_ptr_free];
+    }
+    stableUnlock();
+}
+#endif
+
 void
 freeStablePtrUnsafe(StgStablePtr sp)
 {
     ASSERT((StgWord)sp < SPT_size);
-    freeSpEntry(&stable_ptr_table[(StgWord)sp]);
+    SPT_ENTRY((StgWord)sp)->addr = NULL;
+    stable_ptr_free[n_stable_ptr_free++] = (StgWord)sp;
 }
 
 void
 freeStablePtr(StgStablePtr sp)
 {
+#ifdef THREADED_RTS
+    Capability *cap = myStablePtrCache();
+
+    if (cap != NULL) {
+        ASSERT((StgWord)sp < SPT_size);
+        SPT_ENTRY((StgWord)sp)->addr = NULL;
+        if (cap->n_free_stable_ptrs == STABLE_PTR_CACHE_SIZE) {
+            stableLock();
+            flushStablePtrCache(cap, STABLE_PTR_CACHE_SIZE / 2);
+            stableUnlock();
+        }
+        cap->free_stable_ptrs[cap->n_free_stable_ptrs++] = (StgWord)sp;
+        return;
+    }
+#endif
+
     stableLock();
     freeStablePtrUnsafe(sp);
     stableUnlock();
@@ -336,6 +519,8 @@ lookupStableName (StgPtr p)
   if (sn != 0) {
     ASSERT(stable_name_table[sn].addr == p);
     debugTrace(DEBUG_stable, "cached stable name %ld at %p",sn,p);
+    // the caller may be about to fill in sn_obj with a new object
+    stable_name_young[sn >> SNT_CHUNK_BITS] = 1;
     stableUnlock();
     return sn;
   }
@@ -344,6 +529,7 @@ lookupStableName (StgPtr p)
   stable_name_free  = (snEntry*)(stable_name_free->addr);
   stable_name_table[sn].addr = p;
   stable_name_table[sn].sn_obj = NULL;
+  stable_name_young[sn >> SNT_CHUNK_BITS] = 1;
   /* debugTrace(DEBUG_stable, "new stable name %d at %p\n",sn,p); */
 
   /* add the new stable name to the hash table */
@@ -358,12 +544,23 @@ StgStablePtr
 getStablePtr(StgPtr p)
 {
   StgWord sp;
+#ifdef THREADED_RTS
+  Capability *cap = myStablePtrCache();
+
+  if (cap != NULL) {
+      if (cap->n_free_stable_ptrs == 0) refillStablePtrCache(cap);
+      sp = cap->free_stable_ptrs[--cap->n_free_stable_ptrs];
+      SPT_ENTRY(sp)->addr = p;
+      SPT_SEGMENT(sp)->young = 1;
+      return (StgStablePtr)(sp);
+  }
+#endif
 
   stableLock();
-  if (!stable_ptr_free) enlargeStablePtrTable();
-  sp = stable_ptr_free - stable_ptr_table;
-  stable_ptr_free  = (spEntry*)(stable_ptr_free->addr);
-  stable_ptr_table[sp].addr = p;
+  if (n_stable_ptr_free == 0) enlargeStablePtrTable();
+  sp = stable_ptr_free[--n_stable_ptr_free];
+  SPT_ENTRY(sp)->addr = p;
+  SPT_SEGMENT(sp)->young = 1;
   stableUnlock();
   return (StgStablePtr)(sp);
 }
@@ -374,24 +571,34 @@ getStablePtr(StgPtr p)
 
 #define FOR_EACH_STABLE_PTR(p, CODE)                                    \
     do {                                                                \
-        spEntry *p;                                                     \
-        spEntry *__end_ptr = &stable_ptr_table[SPT_size];               \
-        for (p = stable_ptr_table; p < __end_ptr; p++) {                \
-            /* Internal pointers are free slots. NULL is last in free */ \
-            /* list. */                                                 \
-            if (p->addr &&                                              \
-                (p->addr < (P_)stable_ptr_table || p->addr >= (P_)__end_ptr)) \
-            {                                                           \
-                do { CODE } while(0);                                   \
+        spEntry *p, *__end_ptr;                                         \
+        nat __seg;                                                      \
+        for (__seg = 0; __seg < SPT_segments; __seg++) {                \
+            p = stable_ptr_table[__seg];                                \
+            __end_ptr = p + SPT_SEGMENT_SIZE;                           \
+            for (; p < __end_ptr; p++) {                                \
+                /* NULL is a free entry */                              \
+                if (p->addr != NULL) {                                  \
+                    do { CODE } while(0);                               \
+                }                                                       \
             }                                                           \
         }                                                               \
     } while(0)
 
-#define FOR_EACH_STABLE_NAME(p, CODE)                                   \
+// The stable names in the chunks that may point to young objects, or
+// all of them if all is true.
+#define FOR_EACH_STABLE_NAME_IN(p, all, CODE)                           \
     do {                                                                \
-        snEntry *p;                                                     \
+        snEntry *p, *__chunk_end;                                       \
         snEntry *__end_ptr = &stable_name_table[SNT_size];              \
-        for (p = stable_name_table + 1; p < __end_ptr; p++) {           \
+        nat __chunk;                                                    \
+        for (__chunk = 0; __chunk < SNT_CHUNKS(SNT_size); __chunk++) {  \
+          if (!(all) && !stable_name_young[__chunk]) continue;          \
+          p = &stable_name_table[__chunk * SNT_CHUNK_SIZE];             \
+          __chunk_end = p + SNT_CHUNK_SIZE;                             \
+          if (__chunk_end > __end_ptr) __chunk_end = __end_ptr;         \
+          if (p == stable_name_table) p++; /* 0 isn't used */           \
+          for (; p < __chunk_end; p++) {                                \
             /* Internal pointers are free slots.  */                    \
             /* If p->addr == NULL, it's a */                            \
             /* stable name where the object has been GC'd, but the */   \
@@ -405,27 +612,84 @@ getStablePtr(StgPtr p)
                 /* disambiguates as last free list item. */             \
                 do { CODE } while(0);                                   \
             }                                                           \
+          }                                                             \
         }                                                               \
     } while(0)
 
-STATIC_INLINE void
+#define FOR_EACH_STABLE_NAME(p, CODE) FOR_EACH_STABLE_NAME_IN(p, rtsTrue, CODE)
+
+/* Is this a major GC, which must look at every entry?  Set by
+ * initStableTablesForGC(). */
+static rtsBool stable_gc_major = rtsTrue;
+
+void
 markStablePtrTable(evac_fn evac, void *user)
 {
     FOR_EACH_STABLE_PTR(p, evac(user, (StgClosure **)&p->addr););
 }
 
 STATIC_INLINE void
-rememberOldStableNameAddresses(void)
+rememberOldStableNameAddresses(rtsBool all)
 {
-    /* TODO: Only if !full GC */
-    FOR_EACH_STABLE_NAME(p, p->old = p->addr;);
+    FOR_EACH_STABLE_NAME_IN(p, all, p->old = p->addr;);
 }
 
 void
 markStableTables(evac_fn evac, void *user)
 {
     markStablePtrTable(evac, user);
-    rememberOldStableNameAddresses();
+    rememberOldStableNameAddresses(rtsTrue);
+}
+
+/* -----------------------------------------------------------------------------
+ * Marking the stable tables in the GC
+ *
+ * The GC leader calls initStableTablesForGC() before it starts the
+ * other GC threads.  Then every GC thread calls markStablePtrSegments()
+ * as part of marking its roots, and they share out the segments of the
+ * stable pointer table between them; in a minor GC, the segments with
+ * no young entries are skipped.  The leader also calls
+ * markStableNameTable(), which only remembers the old addresses of the
+ * stable names (for updateStableTables()).
+ * -------------------------------------------------------------------------- */
+
+void
+initStableTablesForGC(rtsBool major)
+{
+    stable_gc_major = major;
+    spt_next_segment = 0;
+}
+
+void
+markStablePtrSegments(evac_fn evac, void *user)
+{
+    StgWord i;
+    sptSegment *seg;
+    spEntry *p;
+    StgWord young;
+
+    for (;;) {
+        i = atomic_inc(&spt_next_segment, 1) - 1;
+        if (i >= SPT_segments) return;
+
+        seg = (sptSegment *)stable_ptr_table[i];
+        if (!stable_gc_major && !seg->young) continue;
+
+        young = 0;
+        for (p = seg->entries; p < seg->entries + SPT_SEGMENT_SIZE; p++) {
+            if (p->addr != NULL) {
+                evac(user, (StgClosure **)&p->addr);
+                if (!isOldObject(p->addr)) young = 1;
+            }
+        }
+        seg->young = young;
+    }
+}
+
+void
+markStableNameTable(void)
+{
+    rememberOldStableNameAddresses(stable_gc_major);
 }
 
 /* -----------------------------------------------------------------------------
@@ -479,8 +743,20 @@ threadStableTables( evac_fn evac, void *user )
 void
 gcStableTables( void )
 {
-    FOR_EACH_STABLE_NAME(
-        p, {
+#ifdef THREADED_RTS
+    nat i;
+
+    // a disabled Capability isn't using its free stable pointers
+    // (see setNumCapabilities())
+    for (i = 0; i < n_capabilities; i++) {
+        if (capabilities[i]->disabled) {
+            flushStablePtrCache(capabilities[i], 0);
+        }
+    }
+#endif
+
+    FOR_EACH_STABLE_NAME_IN(
+        p, stable_gc_major, {
             // Update the pointer to the StableName object, if there is one
             if (p->sn_obj != NULL) {
                 p->sn_obj = isAlive(p->sn_obj);
@@ -519,9 +795,34 @@ gcStableTables( void )
  * that changed.
  * -------------------------------------------------------------------------- */
 
+static StgWord8
+stableNameChunkIsYoung(nat chunk)
+{
+    snEntry *p, *end;
+
+    p = &stable_name_table[chunk * SNT_CHUNK_SIZE];
+    end = p + SNT_CHUNK_SIZE;
+    if (end > &stable_name_table[SNT_size]) end = &stable_name_table[SNT_size];
+    if (p == stable_name_table) p++; // 0 isn't used
+
+    for (; p < end; p++) {
+        if (p->addr >= (P_)stable_name_table &&
+            p->addr < (P_)&stable_name_table[SNT_size]) {
+            continue; // free
+        }
+        if ((p->addr != NULL && !isOldObject(p->addr)) ||
+            (p->sn_obj != NULL && !isOldObject((StgPtr)p->sn_obj))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 void
 updateStableTables(rtsBool full)
 {
+    nat chunk;
+
     if (full && addrToStableHash != NULL && 0 != keyCountHashTable(addrToStableHash)) {
         freeHashTable(addrToStableHash,NULL);
         addrToStableHash = allocHashTable();
@@ -536,8 +837,8 @@ updateStableTables(rtsBool full)
                 }
             });
     } else {
-        FOR_EACH_STABLE_NAME(
-            p, {
+        FOR_EACH_STABLE_NAME_IN(
+            p, rtsFalse, {
                 if (p->addr != p->old) {
                     removeHashTable(addrToStableHash, (W_)p->old, NULL);
                     /* Movement happened: */
@@ -547,4 +848,13 @@ updateStableTables(rtsBool full)
                 }
             });
     }
+
+    // Work out again which chunks may point to young objects.  We
+    // looked at every chunk whose flag is set (or every chunk, if
+    // full), and the others still point only to old objects.
+    for (chunk = 0; chunk < SNT_CHUNKS(SNT_size); chunk++) {
+        if (full || stable_name_young[chunk]) {
+            stable_name_young[chunk] = stableNameChunkIsYoung(chunk);
+        }
+    }
 }
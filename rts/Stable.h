@@ -37,6 +37,17 @@ StgWord lookupStableName      ( StgPtr p );
  */
 void    markStableTables      ( evac_fn evac, void *user );
 
+/* Just the stable ptrs, with no other side effects; used by the
+ * incremental mark (sm/IncMark.c) */
+void    markStablePtrTable    ( evac_fn evac, void *user );
+
+/* The GC's way of doing markStableTables(), which shares the stable
+ * ptrs out between the GC threads and, in a minor GC, skips those that
+ * point only to old objects */
+void    initStableTablesForGC ( rtsBool major );
+void    markStablePtrSegments ( evac_fn evac, void *user );
+void    markStableNameTable   ( void );
+
 void    threadStableTables    ( evac_fn evac, void *user );
 void    gcStableTables        ( void );
 void    updateStableTables    ( rtsBool full );
@@ -44,6 +55,9 @@ void    updateStableTables    ( rtsBool full );
 void    stableLock            ( void );
 void    stableUnlock          ( void );
 
+// Free stable pointers kept by each Capability (see Capability.h)
+#define STABLE_PTR_CACHE_SIZE 64
+
 #ifdef THREADED_RTS
 // needed by Schedule.c:forkProcess()
 extern Mutex stable_mutex;
@@ -18,6 +18,9 @@
 #include "sm/GC.h" // gc_alloc_block_sync, whitehole_spin
 #include "sm/GCThread.h"
 #include "sm/BlockAlloc.h"
+#include "sm/OSMem.h"
+
+#include <string.h>
 
 #if USE_PAPI
 #include "Papi.h"
@@ -73,6 +76,33 @@ static Time *GC_coll_max_pause = NULL;
 static void statsFlush( void );
 static void statsClose( void );
 
+static void gcLogRecord( W_ alloc, W_ copied, W_ live, W_ slop, nat gen,
+                         nat par_n_threads, W_ par_max_copied,
+                         Time sync, Time mark, Time sweep,
+                         Time gc_elapsed, Time gc_cpu, Time elapsed );
+static void gcLogClose( void );
+
+/* -----------------------------------------------------------------------------
+   The distribution of GC pauses.
+
+   We count the pauses in buckets.  A pause of less than 16 time units
+   has a bucket to itself; longer pauses share buckets picked by the
+   top set bit of the pause and the PAUSE_SUB_BITS bits below it, so
+   each bucket is no wider than 1/8 of the pauses in it.  That way a
+   small fixed table covers every pause from a few nanoseconds up,
+   and the percentiles we report from it are within 1/8 of the truth.
+   -------------------------------------------------------------------------- */
+
+#define PAUSE_SUB_BITS  3
+#define PAUSE_SUBS      (1 << PAUSE_SUB_BITS)
+#define PAUSE_BUCKETS   (64 * PAUSE_SUBS)
+
+static StgWord64 pause_buckets[PAUSE_BUCKETS];
+static StgWord64 pause_count = 0;
+static Time      pause_max   = 0;
+
+static nat gc_log_count = 0;        // records written to the --gc-log
+
 /* -----------------------------------------------------------------------------
    Current elapsed time
    ------------------------------------------------------------------------- */
@@ -161,6 +191,11 @@ initStats0(void)
     max_slop = 0;
 
     GC_end_faults = 0;
+
+    memset(pause_buckets, 0, sizeof(pause_buckets));
+    pause_count = 0;
+    pause_max = 0;
+    gc_log_count = 0;
 }    
 
 /* ---------------------------------------------------------------------------
@@ -193,6 +228,14 @@ initStats1 (void)
         GC_coll_elapsed[i] = 0;
         GC_coll_max_pause[i] = 0;
     }
+
+    if (RtsFlags.GcFlags.gcLogFile != NULL
+        && RtsFlags.GcFlags.gcLogFormat == GC_LOG_CSV) {
+        fprintf(RtsFlags.GcFlags.gcLogFile,
+                "gc,gen,t_ns,allocated,copied,live,slop,par_max_copied,"
+                "sync_ns,mark_ns,sweep_ns,pause_ns,cpu_ns,"
+                "thread_copied,thread_scanned,thread_stolen\n");
+    }
 }
 
 /* -----------------------------------------------------------------------------
@@ -249,6 +292,97 @@ stat_endExit(void)
     getProcessTimes(&end_exit_cpu, &end_exit_elapsed);
 }
 
+/* -----------------------------------------------------------------------------
+   The pause histogram (see pause_buckets above)
+   -------------------------------------------------------------------------- */
+
+STATIC_INLINE nat
+topBit (StgWord64 x) // x != 0
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(x);
+#else
+    nat n = 0;
+    while (x >>= 1) n++;
+    return n;
+#endif
+}
+
+static nat
+pauseBucket (Time t)
+{
+    StgWord64 x = (StgWord64)t;
+    nat k;
+
+    if (x < 2 * PAUSE_SUBS) {
+        return (nat)x;
+    }
+    k = topBit(x);
+    return ((k - PAUSE_SUB_BITS + 1) << PAUSE_SUB_BITS)
+         + (nat)((x >> (k - PAUSE_SUB_BITS)) & (PAUSE_SUBS - 1));
+}
+
+// The longest pause that goes in bucket i
+static Time
+pauseBucketTop (nat i)
+{
+    nat shift;
+
+    if (i < 2 * PAUSE_SUBS) {
+        return (Time)i;
+    }
+    shift = (i >> PAUSE_SUB_BITS) - 1;
+    return (Time)((((StgWord64)(PAUSE_SUBS + (i & (PAUSE_SUBS - 1))) + 1)
+                   << shift) - 1);
+}
+
+static void
+recordPause (Time t)
+{
+    if (t < 0) t = 0;
+    pause_buckets[pauseBucket(t)]++;
+    pause_count++;
+    if (t > pause_max) {
+        pause_max = t;
+    }
+}
+
+// The pause that a fraction q of all the pauses were no longer than
+static Time
+pausePercentile (double q)
+{
+    StgWord64 rank, seen;
+    nat i;
+
+    if (pause_count == 0) {
+        return 0;
+    }
+    rank = (StgWord64)(q * pause_count);
+    if ((double)rank < q * pause_count || rank == 0) {
+        rank++;
+    }
+    seen = 0;
+    for (i = 0; i < PAUSE_BUCKETS; i++) {
+        seen += pause_buckets[i];
+        if (seen >= rank) {
+            return stg_min(pauseBucketTop(i), pause_max);
+        }
+    }
+    return pause_max;
+}
+
+/* -----------------------------------------------------------------------------
+   Called when the scheduler has claimed the right to GC, before it
+   waits for the other Capabilities to stop.  (Not called at all in
+   the non-threaded RTS, where there is nobody to wait for.)
+   -------------------------------------------------------------------------- */
+
+void
+stat_startGCSync (gc_thread *gct)
+{
+    gct->gc_sync_start_elapsed = getProcessElapsedTime();
+}
+
 /* -----------------------------------------------------------------------------
    Called at the beginning of each GC
    -------------------------------------------------------------------------- */
@@ -295,6 +429,25 @@ stat_startGC (Capability *cap, gc_thread *gct)
     }
 }
 
+/* -----------------------------------------------------------------------------
+   Called at the end of the GC's phases: when everything live has been
+   found (and copied or marked), and when the oldest generation has
+   been swept or compacted (straight after the mark if it isn't being
+   marked).  The phases end up in the --gc-log records.
+   -------------------------------------------------------------------------- */
+
+void
+stat_endGCMark (gc_thread *gct)
+{
+    gct->gc_mark_end_elapsed = getProcessElapsedTime();
+}
+
+void
+stat_endGCSweep (gc_thread *gct)
+{
+    gct->gc_sweep_end_elapsed = getProcessElapsedTime();
+}
+
 void
 stat_gcWorkerThreadStart (gc_thread *gct STG_UNUSED)
 {
@@ -439,6 +592,19 @@ stat_endGC (Capability *cap, gc_thread *gct,
         if (GC_coll_max_pause[gen] < gc_elapsed) {
             GC_coll_max_pause[gen] = gc_elapsed;
         }
+        recordPause(gc_elapsed);
+
+        if (RtsFlags.GcFlags.gcLogFile != NULL) {
+            Time sync = 0;
+            if (gct->gc_sync_start_elapsed != 0) {
+                sync = gct->gc_start_elapsed - gct->gc_sync_start_elapsed;
+            }
+            gcLogRecord(alloc, copied, live, slop, gen,
+                        par_n_threads, par_max_copied, sync,
+                        gct->gc_mark_end_elapsed - gct->gc_start_elapsed,
+                        gct->gc_sweep_end_elapsed - gct->gc_mark_end_elapsed,
+                        gc_elapsed, gc_cpu, elapsed - start_init_elapsed);
+        }
 
 	GC_tot_copied += (StgWord64) copied;
         GC_par_max_copied += (StgWord64) par_max_copied;
@@ -464,6 +630,9 @@ stat_endGC (Capability *cap, gc_thread *gct,
         if (slop > max_slop) max_slop = slop;
     }
 
+    // the next GC might not be preceded by stat_startGCSync()
+    gct->gc_sync_start_elapsed = 0;
+
     if (rub_bell) {
 	debugBelch("\b\b\b  \b\b\b");
 	rub_bell = 0;
@@ -690,10 +859,28 @@ stat_exit (void)
 	    showStgWord64(max_slop*sizeof(W_), temp, rtsTrue/*commas*/);
 	    statsPrintf("%16s bytes maximum slop\n", temp);
 
-	    statsPrintf("%16" FMT_SizeT " MB total memory in use (%" FMT_SizeT " MB lost due to fragmentation)\n\n", 
+	    statsPrintf("%16" FMT_SizeT " MB total memory in use (%" FMT_SizeT " MB lost due to fragmentation)\n", 
                         peak_mblocks_allocated * MBLOCK_SIZE_W / (1024 * 1024 / sizeof(W_)),
                         (W_)(peak_mblocks_allocated * BLOCKS_PER_MBLOCK * BLOCK_SIZE_W - hw_alloc_blocks * BLOCK_SIZE_W) / (1024 * 1024 / sizeof(W_)));
 
+            {
+                W_ free_bytes, released_bytes, rss;
+                StgWord64 total_released;
+
+                freeMemoryStats(&free_bytes, &released_bytes, &total_released);
+                statsPrintf("%16" FMT_Word " MB free at exit: %" FMT_Word " MB retained, %" FMT_Word " MB returned to the OS (%" FMT_Word64 " MB in all)\n",
+                            free_bytes / (1024 * 1024),
+                            (free_bytes - released_bytes) / (1024 * 1024),
+                            released_bytes / (1024 * 1024),
+                            total_released / (1024 * 1024));
+                rss = osResidentMemory();
+                if (rss != 0) {
+                    statsPrintf("%16" FMT_Word " MB resident at exit\n",
+                                rss / (1024 * 1024));
+                }
+                statsPrintf("\n");
+            }
+
 	    /* Print garbage collections in each gen */
             statsPrintf("                                    Tot time (elapsed)  Avg pause  Max pause\n");
             for (g = 0; g < RtsFlags.GcFlags.generations; g++) {
@@ -708,6 +895,14 @@ stat_exit (void)
                             TimeToSecondsDbl(GC_coll_max_pause[g]));
             }
 
+            if (pause_count > 0) {
+                statsPrintf("\n  GC pauses: %.4fs p50, %.4fs p99, %.4fs p99.9, %.4fs max\n",
+                            TimeToSecondsDbl(pausePercentile(0.5)),
+                            TimeToSecondsDbl(pausePercentile(0.99)),
+                            TimeToSecondsDbl(pausePercentile(0.999)),
+                            TimeToSecondsDbl(pause_max));
+            }
+
 #if defined(THREADED_RTS)
             if (RtsFlags.ParFlags.parGcEnabled && n_capabilities > 1) {
                 statsPrintf("\n  Parallel GC work balance: %.2f%% (serial 0%%, perfect 100%%)\n", 
@@ -728,7 +923,7 @@ stat_exit (void)
 
             {
                 nat i;
-                SparkCounters sparks = { 0, 0, 0, 0, 0, 0};
+                SparkCounters sparks = { 0, 0, 0, 0, 0, 0, 0, 0 };
                 for (i = 0; i < n_capabilities; i++) {
                     sparks.created   += capabilities[i]->spark_stats.created;
                     sparks.dud       += capabilities[i]->spark_stats.dud;
@@ -745,6 +940,16 @@ stat_exit (void)
             }
 #endif
 
+            {
+                STMStats stm;
+                getSTMStats(&stm);
+                if (stm.commits + stm.aborts + stm.retries > 0) {
+                    statsPrintf("  STM: %" FMT_Word64 " committed (%" FMT_Word64 " aborted, %" FMT_Word64 " retried, %" FMT_Word64 " backed off, %" FMT_Word64 " irrevocable)\n\n",
+                                stm.commits, stm.aborts, stm.retries,
+                                stm.backoffs, stm.irrevocable);
+                }
+            }
+
 	    statsPrintf("  INIT    time  %6.2fs  (%6.2fs elapsed)\n",
                         TimeToSecondsDbl(init_cpu), TimeToSecondsDbl(init_elapsed));
 
@@ -850,6 +1055,8 @@ stat_exit (void)
 	statsClose();
     }
 
+    gcLogClose();
+
     if (GC_coll_cpu) {
       stgFree(GC_coll_cpu);
       GC_coll_cpu = NULL;
@@ -987,17 +1194,46 @@ extern void getGCStats( GCStats *s )
     s->wall_seconds = TimeToSecondsDbl(current_elapsed - end_init_elapsed);
     s->par_tot_bytes_copied = GC_par_tot_copied*(StgWord64)sizeof(W_);
     s->par_max_bytes_copied = GC_par_max_copied*(StgWord64)sizeof(W_);
+    s->pause_p50_seconds = TimeToSecondsDbl(pausePercentile(0.5));
+    s->pause_p99_seconds = TimeToSecondsDbl(pausePercentile(0.99));
+    s->pause_p999_seconds = TimeToSecondsDbl(pausePercentile(0.999));
+    s->pause_max_seconds = TimeToSecondsDbl(pause_max);
+}
+extern void getSTMStats( STMStats *s )
+{
+    nat i;
+
+    s->commits = 0;
+    s->aborts = 0;
+    s->retries = 0;
+    s->backoffs = 0;
+    s->irrevocable = 0;
+    for (i = 0; i < n_capabilities; i++) {
+        s->commits     += capabilities[i]->stm_stats.commits;
+        s->aborts      += capabilities[i]->stm_stats.aborts;
+        s->retries     += capabilities[i]->stm_stats.retries;
+        s->backoffs    += capabilities[i]->stm_stats.backoffs;
+        s->irrevocable += capabilities[i]->stm_stats.irrevocable;
+    }
 }
+
 // extern void getTaskStats( TaskStats **s ) {}
-#if 0
+
+// The spark counters summed over all the Capabilities (all zero in the
+// non-threaded RTS, which has no sparks).
 extern void getSparkStats( SparkCounters *s ) {
+#if defined(THREADED_RTS)
     nat i;
+#endif
     s->created = 0;
     s->dud = 0;
     s->overflowed = 0;
     s->converted = 0;
     s->gcd = 0;
     s->fizzled = 0;
+    s->steal_attempts = 0;
+    s->steals = 0;
+#if defined(THREADED_RTS)
     for (i = 0; i < n_capabilities; i++) {
         s->created   += capabilities[i]->spark_stats.created;
         s->dud       += capabilities[i]->spark_stats.dud;
@@ -1005,9 +1241,11 @@ extern void getSparkStats( SparkCounters *s ) {
         s->converted += capabilities[i]->spark_stats.converted;
         s->gcd       += capabilities[i]->spark_stats.gcd;
         s->fizzled   += capabilities[i]->spark_stats.fizzled;
+        s->steal_attempts += capabilities[i]->spark_stats.steal_attempts;
+        s->steals    += capabilities[i]->spark_stats.steals;
     }
-}
 #endif
+}
 
 /* -----------------------------------------------------------------------------
    Dumping stuff in the stats file, or via the debug message interface
@@ -1045,3 +1283,90 @@ statsClose( void )
 	fclose(sf);
     }
 }
+
+/* -----------------------------------------------------------------------------
+   The +RTS --gc-log records: one for each GC, as a line of JSON or a
+   row of CSV, with the work of each GC thread and the time the GC spent
+   in each phase.  In the CSV the work of the GC threads goes in lists
+   separated by ';', so that each row has the same columns.
+   -------------------------------------------------------------------------- */
+
+static void
+gcLogRecord (W_ alloc, W_ copied, W_ live, W_ slop, nat gen,
+             nat par_n_threads, W_ par_max_copied,
+             Time sync, Time mark, Time sweep,
+             Time gc_elapsed, Time gc_cpu, Time elapsed)
+{
+    FILE *f = RtsFlags.GcFlags.gcLogFile;
+    nat i;
+
+    gc_log_count++;
+
+    if (RtsFlags.GcFlags.gcLogFormat == GC_LOG_CSV) {
+        fprintf(f, "%u,%u,%" FMT_Int64 ",%" FMT_Word ",%" FMT_Word
+                ",%" FMT_Word ",%" FMT_Word ",%" FMT_Word
+                ",%" FMT_Int64 ",%" FMT_Int64 ",%" FMT_Int64
+                ",%" FMT_Int64 ",%" FMT_Int64 ",",
+                gc_log_count, gen, TimeToNS(elapsed),
+                alloc * sizeof(W_), copied * sizeof(W_),
+                live * sizeof(W_), slop * sizeof(W_),
+                par_max_copied * sizeof(W_),
+                TimeToNS(sync), TimeToNS(mark), TimeToNS(sweep),
+                TimeToNS(gc_elapsed), TimeToNS(gc_cpu));
+        for (i = 0; i < par_n_threads; i++) {
+            fprintf(f, "%s%" FMT_Word, i == 0 ? "" : ";",
+                    gc_threads[i]->copied * sizeof(W_));
+        }
+        fprintf(f, ",");
+        for (i = 0; i < par_n_threads; i++) {
+            fprintf(f, "%s%" FMT_Word, i == 0 ? "" : ";",
+                    gc_threads[i]->scanned * sizeof(W_));
+        }
+        fprintf(f, ",");
+        for (i = 0; i < par_n_threads; i++) {
+            fprintf(f, "%s%" FMT_Word, i == 0 ? "" : ";",
+                    gc_threads[i]->stolen);
+        }
+        fprintf(f, "\n");
+    } else {
+        fprintf(f, "{\"gc\":%u,\"gen\":%u,\"t_ns\":%" FMT_Int64
+                ",\"allocated\":%" FMT_Word ",\"copied\":%" FMT_Word
+                ",\"live\":%" FMT_Word ",\"slop\":%" FMT_Word
+                ",\"par_max_copied\":%" FMT_Word
+                ",\"sync_ns\":%" FMT_Int64 ",\"mark_ns\":%" FMT_Int64
+                ",\"sweep_ns\":%" FMT_Int64 ",\"pause_ns\":%" FMT_Int64
+                ",\"cpu_ns\":%" FMT_Int64 ",\"threads\":[",
+                gc_log_count, gen, TimeToNS(elapsed),
+                alloc * sizeof(W_), copied * sizeof(W_),
+                live * sizeof(W_), slop * sizeof(W_),
+                par_max_copied * sizeof(W_),
+                TimeToNS(sync), TimeToNS(mark), TimeToNS(sweep),
+                TimeToNS(gc_elapsed), TimeToNS(gc_cpu));
+        for (i = 0; i < par_n_threads; i++) {
+            fprintf(f, "%s{\"copied\":%" FMT_Word ",\"scanned\":%" FMT_Word
+                    ",\"stolen\":%" FMT_Word "}",
+                    i == 0 ? "" : ",",
+                    gc_threads[i]->copied * sizeof(W_),
+                    gc_threads[i]->scanned * sizeof(W_),
+                    gc_threads[i]->stolen);
+        }
+        fprintf(f, "]}\n");
+    }
+
+    // whoever is reading the log wants to see each GC as it happens
+    fflush(f);
+}
+
+static void
+gcLogClose( void )
+{
+    FILE *f = RtsFlags.GcFlags.gcLogFile;
+    if (f != NULL) {
+        if (f == stderr) {
+            fflush(f);
+        } else {
+            fclose(f);
+        }
+        RtsFlags.GcFlags.gcLogFile = NULL;
+    }
+}
@@ -27,7 +27,10 @@ struct gc_thread_;
 void      stat_startInit(void);
 void      stat_endInit(void);
 
+void      stat_startGCSync(struct gc_thread_ *_gct);
 void      stat_startGC(Capability *cap, struct gc_thread_ *_gct);
+void      stat_endGCMark (struct gc_thread_ *_gct);
+void      stat_endGCSweep(struct gc_thread_ *_gct);
 void      stat_endGC  (Capability *cap, struct gc_thread_ *_gct,
                        W_ live, W_ copied, W_ slop, nat gen,
                        nat n_gc_threads, W_ par_max_copied, W_ par_tot_copied);
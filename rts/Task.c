@@ -370,9 +370,17 @@ workerStart(Task *task)
     cap = task->cap;
     RELEASE_LOCK(&task->lock);
 
+    // Only worker threads are placed (-qa, --numa).  A bound task is
+    // running on an OS thread that belongs to the caller, and may take
+    // a different Capability each time it calls in, so we leave its
+    // affinity alone; its memory still comes from its Capability's
+    // node.
     if (RtsFlags.ParFlags.setAffinity) {
         setThreadAffinity(cap->no, n_capabilities);
     }
+    if (RtsFlags.GcFlags.numa) {
+        setThreadNode(numa_map[cap->node]);
+    }
 
     // set the thread-local pointer to the Task:
     setMyTask(task);
@@ -111,6 +111,7 @@ createThread(Capability *cap, W_ size)
     tso->tot_stack_size = stack->stack_size;
 
     tso->trec = NO_TREC;
+    tso->stm_aborts = 0;
 
 #ifdef PROFILING
     tso->prof.cccs = CCS_MAIN;
@@ -729,7 +730,7 @@ printThreadBlockage(StgTSO *tso)
     debugBelch("is blocked on write to fd %d", (int)(tso->block_info.fd));
     break;
   case BlockedOnDelay:
-    debugBelch("is blocked until %ld", (long)(tso->block_info.target));
+    debugBelch("is blocked in threadDelay");
     break;
 #endif
   case BlockedOnMVar:
@@ -20,11 +20,15 @@
 #include "eventlog/EventLog.h"
 #include "Threads.h"
 #include "Printer.h"
+#include "Schedule.h"
+#include "RtsUtils.h"
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
+#include <string.h>
+
 #ifdef DEBUG
 // debugging flags, set with +RTS -D<something>
 int DEBUG_sched;
@@ -58,6 +62,13 @@ static Mutex trace_utx;
 
 static rtsBool eventlog_enabled;
 
+// The eventlog buffers exist; the program may have stopped the
+// eventlog since (see rts_stopEventLog()).
+static rtsBool eventlog_started;
+
+// The sink given to rts_startEventLog(), which we own.
+static char *eventlog_sink = NULL;
+
 /* ---------------------------------------------------------------------------
    Starting up / shuttting down the tracing facilities
  --------------------------------------------------------------------------- */
@@ -122,6 +133,7 @@ void initTracing (void)
 
     if (eventlog_enabled) {
         initEventLogging();
+        eventlog_started = rtsTrue;
     }
 }
 
@@ -134,8 +146,13 @@ void endTracing (void)
 
 void freeTracing (void)
 {
-    if (eventlog_enabled) {
+    if (eventlog_started) {
         freeEventLogging();
+        eventlog_started = rtsFalse;
+    }
+    if (eventlog_sink != NULL) {
+        stgFree(eventlog_sink);
+        eventlog_sink = NULL;
     }
 }
 
@@ -149,7 +166,7 @@ void resetTracing (void)
 
 void tracingAddCapapilities (nat from, nat to)
 {
-    if (eventlog_enabled) {
+    if (eventlog_started) {
         moreCapEventBufs(from,to);
     }
 }
@@ -575,6 +592,23 @@ void traceSparkCounters_ (Capability *cap,
     }
 }
 
+void traceSTMCounters_ (Capability *cap, STMStats counters)
+{
+#ifdef DEBUG
+    if (RtsFlags.TraceFlags.tracing == TRACE_STDERR) {
+        debugBelch("cap %d: STM: %" FMT_Word64 " commits, %" FMT_Word64
+                   " aborts, %" FMT_Word64 " retries, %" FMT_Word64
+                   " backoffs, %" FMT_Word64 " irrevocable\n",
+                   cap->no, counters.commits, counters.aborts,
+                   counters.retries, counters.backoffs,
+                   counters.irrevocable);
+    } else
+#endif
+    {
+        postSTMCountersEvent(cap, counters);
+    }
+}
+
 void traceTaskCreate_ (Task       *task,
                        Capability *cap)
 {
@@ -789,6 +823,220 @@ void traceEnd (void)
 
 #endif /* TRACING */
 
+/* ---------------------------------------------------------------------------
+   Controlling the eventlog from the program (see RtsAPI.h)
+
+   A class of events is just one of the TRACE_* flags, so a trace point
+   whose class is off costs what it always has: one test of a flag that
+   is almost always clear.  The flags only change, and the eventlog only
+   starts and stops, while we hold every Capability, so nobody is half
+   way through posting an event.  Tasks also post to eventBuf without a
+   Capability; restartEventLogging() keeps them out.
+ --------------------------------------------------------------------------- */
+
+#ifdef TRACING
+
+static void setTraceClasses (unsigned int classes)
+{
+    TRACE_sched         = (classes & RTS_EVENTLOG_SCHED)          ? 1 : 0;
+    TRACE_gc            = (classes & RTS_EVENTLOG_GC)             ? 1 : 0;
+    TRACE_spark_sampled = (classes & RTS_EVENTLOG_SPARKS_SAMPLED) ? 1 : 0;
+    TRACE_spark_full    = (classes & RTS_EVENTLOG_SPARKS_FULL)    ? 1 : 0;
+    TRACE_user          = (classes & RTS_EVENTLOG_USER)           ? 1 : 0;
+
+    RtsFlags.TraceFlags.scheduler      = TRACE_sched;
+    RtsFlags.TraceFlags.gc             = TRACE_gc;
+    RtsFlags.TraceFlags.sparks_sampled = TRACE_spark_sampled;
+    RtsFlags.TraceFlags.sparks_full    = TRACE_spark_full;
+    RtsFlags.TraceFlags.user           = TRACE_user;
+
+    // as in initTracing()
+    if (TRACE_gc && RtsFlags.GcFlags.giveStats == NO_GC_STATS) {
+        RtsFlags.GcFlags.giveStats = COLLECT_GC_STATS;
+    }
+}
+
+static unsigned int getTraceClasses (void)
+{
+    if (!eventlog_enabled) return 0;
+
+    return (TRACE_sched         ? RTS_EVENTLOG_SCHED          : 0)
+         | (TRACE_gc            ? RTS_EVENTLOG_GC             : 0)
+         | (TRACE_spark_sampled ? RTS_EVENTLOG_SPARKS_SAMPLED : 0)
+         | (TRACE_spark_full    ? RTS_EVENTLOG_SPARKS_FULL    : 0)
+         | (TRACE_user          ? RTS_EVENTLOG_USER           : 0);
+}
+
+// The events that the RTS posted when it started up (see hs_init_ghc()
+// and initCapabilities()), without which a new eventlog would make no
+// sense to the tools reading it.
+static void postEventLogPreamble (void)
+{
+    nat i;
+
+    postEventStartup(n_capabilities);
+    postCapsetEvent(EVENT_CAPSET_CREATE, CAPSET_OSPROCESS_DEFAULT,
+                    CapsetTypeOsProcess);
+    postCapsetEvent(EVENT_CAPSET_CREATE, CAPSET_CLOCKDOMAIN_DEFAULT,
+                    CapsetTypeClockdomain);
+    traceWallClockTime_();
+    traceOSProcessInfo_();
+
+    for (i = 0; i < n_capabilities; i++) {
+        postCapEvent(EVENT_CAP_CREATE, i);
+        postCapsetEvent(EVENT_CAPSET_ASSIGN_CAP, CAPSET_OSPROCESS_DEFAULT, i);
+        postCapsetEvent(EVENT_CAPSET_ASSIGN_CAP, CAPSET_CLOCKDOMAIN_DEFAULT, i);
+        if (capabilities[i]->disabled) {
+            postCapEvent(EVENT_CAP_DISABLE, i);
+        }
+    }
+
+    if (TRACE_gc) {
+        postEventHeapInfo(CAPSET_HEAP_DEFAULT,
+                          RtsFlags.GcFlags.generations,
+                          RtsFlags.GcFlags.maxHeapSize * BLOCK_SIZE_W * sizeof(W_),
+                          RtsFlags.GcFlags.minAllocAreaSize * BLOCK_SIZE_W * sizeof(W_),
+                          MBLOCK_SIZE_W * sizeof(W_),
+                          BLOCK_SIZE_W  * sizeof(W_));
+    }
+}
+
+// Called with every Capability held
+static int restartEventLog (unsigned int classes)
+{
+    // nothing new goes into the old eventlog while we finish it off
+    setTraceClasses(0);
+    eventlog_enabled = rtsFalse;
+
+    if (!restartEventLogging()) {
+        RtsFlags.TraceFlags.tracing = TRACE_NONE;
+        return -1;
+    }
+    eventlog_started = rtsTrue;
+
+    RtsFlags.TraceFlags.tracing = TRACE_EVENTLOG;
+    eventlog_enabled = rtsTrue;
+    setTraceClasses(classes);
+    postEventLogPreamble();
+    return 0;
+}
+
+static void setEventLogSink (const char *sink)
+{
+    // RtsFlags.TraceFlags.sink may point into the command line, so we
+    // only free our own copies.
+    if (eventlog_sink != NULL) {
+        stgFree(eventlog_sink);
+        eventlog_sink = NULL;
+    }
+    if (sink != NULL) {
+        eventlog_sink = stgMallocBytes(strlen(sink) + 1, "setEventLogSink");
+        strcpy(eventlog_sink, sink);
+    }
+    RtsFlags.TraceFlags.sink = eventlog_sink;
+}
+
+int rts_startEventLog (const char *sink, unsigned int classes)
+{
+    Capability *cap;
+    int r;
+
+#ifdef DEBUG
+    if (RtsFlags.TraceFlags.tracing == TRACE_STDERR) {
+        errorBelch("rts_startEventLog: already tracing to stderr (+RTS -v)");
+        return -1;
+    }
+#endif
+
+    cap = stopAllCapabilities();
+    setEventLogSink(sink);
+    r = restartEventLog(classes);
+    resumeAllCapabilities(cap);
+    return r;
+}
+
+int rts_rotateEventLog (const char *sink)
+{
+    Capability *cap;
+    unsigned int classes;
+    int r;
+
+    cap = stopAllCapabilities();
+    if (!eventlog_enabled) {
+        resumeAllCapabilities(cap);
+        errorBelch("rts_rotateEventLog: the eventlog is not running");
+        return -1;
+    }
+    classes = getTraceClasses();
+    if (sink != NULL) {
+        setEventLogSink(sink);
+    }
+    r = restartEventLog(classes);
+    resumeAllCapabilities(cap);
+    return r;
+}
+
+void rts_stopEventLog (void)
+{
+    Capability *cap;
+
+    cap = stopAllCapabilities();
+    if (eventlog_enabled) {
+        setTraceClasses(0);
+        eventlog_enabled = rtsFalse;
+        RtsFlags.TraceFlags.tracing = TRACE_NONE;
+        // the buffers stay around, for Tasks that have yet to notice
+        stopEventLogging();
+    }
+    resumeAllCapabilities(cap);
+}
+
+void rts_setEventLogClasses (unsigned int classes)
+{
+    Capability *cap;
+
+    cap = stopAllCapabilities();
+    // with no eventlog running there is nowhere for the events to go
+    if (eventlog_enabled) {
+        setTraceClasses(classes);
+    }
+    resumeAllCapabilities(cap);
+}
+
+unsigned int rts_getEventLogClasses (void)
+{
+    return getTraceClasses();
+}
+
+#else /* !TRACING */
+
+int rts_startEventLog (const char *sink STG_UNUSED,
+                       unsigned int classes STG_UNUSED)
+{
+    errorBelch("rts_startEventLog: the program was not linked with -eventlog");
+    return -1;
+}
+
+int rts_rotateEventLog (const char *sink STG_UNUSED)
+{
+    return -1;
+}
+
+void rts_stopEventLog (void)
+{
+}
+
+void rts_setEventLogClasses (unsigned int classes STG_UNUSED)
+{
+}
+
+unsigned int rts_getEventLogClasses (void)
+{
+    return 0;
+}
+
+#endif /* TRACING */
+
 // If DTRACE is enabled, but neither DEBUG nor TRACING, we need a C land
 // wrapper for the user-msg probe (as we can't expand that in PrimOps.cmm)
 //
@@ -268,6 +268,8 @@ void traceSparkCounters_ (Capability *cap,
                           SparkCounters counters,
                           StgWord remaining);
 
+void traceSTMCounters_ (Capability *cap, STMStats counters);
+
 void traceTaskCreate_ (Task       *task,
                        Capability *cap);
 
@@ -304,6 +306,7 @@ INLINE_HEADER void traceEventStartup_ (int n_caps STG_UNUSED) {};
 #define traceWallClockTime_() /* nothing */
 #define traceOSProcessInfo_() /* nothing */
 #define traceSparkCounters_(cap, counters, remaining) /* nothing */
+#define traceSTMCounters_(cap, counters) /* nothing */
 #define traceTaskCreate_(taskID, cap) /* nothing */
 #define traceTaskMigrate_(taskID, cap, new_cap) /* nothing */
 #define traceTaskDelete_(taskID) /* nothing */
@@ -791,6 +794,15 @@ INLINE_HEADER void traceSparkCounters(Capability *cap STG_UNUSED)
 #endif
 }
 
+INLINE_HEADER void traceSTMCounters(Capability *cap STG_UNUSED)
+{
+    if (RTS_UNLIKELY(TRACE_sched) &&
+        (cap->stm_stats.commits != 0 || cap->stm_stats.aborts != 0 ||
+         cap->stm_stats.retries != 0)) {
+        traceSTMCounters_(cap, cap->stm_stats);
+    }
+}
+
 INLINE_HEADER void traceEventSparkCreate(Capability *cap STG_UNUSED)
 {
     traceSparkEvent(cap, EVENT_SPARK_CREATE);
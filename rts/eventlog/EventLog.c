@@ -19,39 +19,94 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+#include <sys/socket.h>
+#include <sys/un.h>
+#define USE_UNIX_SOCKET_SINK
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 // PID of the process that writes to event_log_filename (#4512)
 static pid_t event_log_pid = -1;
+static rtsBool event_log_forked = rtsFalse;
 
 static char *event_log_filename = NULL;
 
-// File for logging events
-FILE *event_log_file = NULL;
+// Eventlogs begun by this process so far: the program can stop and
+// start the eventlog while it runs (see restartEventLogging()).
+static nat event_log_count = 0;
+
+static rtsBool event_log_inited  = rtsFalse; // the buffers exist
+static rtsBool event_log_running = rtsFalse; // header written, no end yet
+
+// Where the events go: event_log_filename, or whatever
+// +RTS --eventlog-sink asked for (see openEventLogSink()).
+static int event_log_fd = -1;
+static rtsBool event_log_close_fd; // rtsFalse for an fd:<n> sink
 
 #define EVENT_LOG_SIZE 2 * (1024 * 1024) // 2MB
 
+// Number of chunks each EventsBuf is divided into
+#define EVENT_BUF_CHUNKS 4
+
 static int flushCount;
 
 // Struct for record keeping of buffer to store event types and events.
+//
+// Events are written into the chunk starting at begin.  When it is
+// full, the chunk is handed over to be written out (by the writer
+// thread in the threaded RTS, see eventWriterThread()) and we carry
+// on in the next chunk of the ring.  The owner of the buffer is the
+// only one to move head, and the writer is the only one to move tail,
+// so the chunks change hands without taking a lock.
 typedef struct _EventsBuf {
   StgInt8 *begin;
   StgInt8 *pos;
   StgInt8 *marker;
-  StgWord64 size;
+  StgWord64 size;   // of each chunk
   EventCapNo capno; // which capability this buffer belongs to, or -1
+  StgInt8 *chunks[EVENT_BUF_CHUNKS];
+  StgWord64 chunk_len[EVENT_BUF_CHUNKS]; // bytes in each full chunk
+  volatile StgWord head; // chunks handed over so far
+  volatile StgWord tail; // chunks written out so far
 } EventsBuf;
 
 EventsBuf *capEventBuf; // one EventsBuf for each Capability
+static nat n_cap_event_bufs;
 
 EventsBuf eventBuf; // an EventsBuf not associated with any Capability
 #ifdef THREADED_RTS
 Mutex eventBufMutex; // protected by this mutex
+
+// The writer thread.  It holds event_writer_mutex except while it is
+// waiting for work or writing, so holding the mutex also keeps the
+// writer away from capEventBuf.
+static Mutex      event_writer_mutex;
+static Condition  event_writer_wakeup; // chunks have been handed over
+static Condition  event_writer_done;   // chunks have been written out
+static OSThreadId event_writer_tid;
+static volatile rtsBool event_writer_running = rtsFalse;
+static volatile rtsBool event_writer_sleeping = rtsFalse;
+static rtsBool    event_writer_stop;
 #endif
 
 char *EventDesc[] = {
@@ -106,6 +161,7 @@ char *EventDesc[] = {
   [EVENT_TASK_CREATE]         = "Task create",
   [EVENT_TASK_MIGRATE]        = "Task migrate",
   [EVENT_TASK_DELETE]         = "Task delete",
+  [EVENT_STM_COUNTERS]        = "STM counters",
 };
 
 // Event type. 
@@ -121,6 +177,21 @@ EventType eventTypes[NUM_GHC_EVENT_TAGS];
 static void initEventsBuf(EventsBuf* eb, StgWord64 size, EventCapNo capno);
 static void resetEventsBuf(EventsBuf* eb);
 static void printAndClearEventBuf (EventsBuf *eventsBuf);
+static void handOffEventBuf(EventsBuf *eb);
+static void writeEventBufs(void);
+static rtsBool pendingEventBufs(void);
+
+static void allocEventLogging(void);
+static rtsBool beginEventLog(void);
+static void postHeaderEvents(void);
+static void setEventLogFilename(void);
+static rtsBool openEventLogSink(void);
+static void closeEventLogSink(void);
+
+#ifdef THREADED_RTS
+static void startEventWriter(void);
+static void stopEventWriter(void);
+#endif
 
 static void postEventType(EventsBuf *eb, EventType *et);
 
@@ -216,66 +287,36 @@ static inline void postInt64(EventsBuf *eb, StgInt64 i)
 void
 initEventLogging(void)
 {
-    StgWord8 t, c;
-    nat n_caps;
-    char *prog;
+    allocEventLogging();
 
-    prog = stgMallocBytes(strlen(prog_name) + 1, "initEventLogging");
-    strcpy(prog, prog_name);
-#ifdef mingw32_HOST_OS
-    // on Windows, drop the .exe suffix if there is one
-    {
-        char *suff;
-        suff = strrchr(prog,'.');
-        if (suff != NULL && !strcmp(suff,".exe")) {
-            *suff = '\0';
-        }
+    if (!beginEventLog()) {
+        stg_exit(EXIT_FAILURE);
     }
-#endif
+}
 
-    event_log_filename = stgMallocBytes(strlen(prog)
-                                        + 10 /* .%d */
-                                        + 10 /* .eventlog */,
-                                        "initEventLogging");
+/*
+ * Allocate buffer(s) to store events.
+ * Create buffer large enough for the header begin marker, all event
+ * types, and header end marker to prevent checking if buffer has room
+ * for each of these steps, and remove the need to flush the buffer to
+ * disk during initialization.
+ *
+ * Use a single buffer to store the header with event types, then flush
+ * the buffer so all buffers are empty for writing events.
+ */
+static void
+allocEventLogging(void)
+{
+    nat n_caps;
 
     if (sizeof(EventDesc) / sizeof(char*) != NUM_GHC_EVENT_TAGS) {
         barf("EventDesc array has the wrong number of elements");
     }
 
-    if (event_log_pid == -1) { // #4512
-        // Single process
-        sprintf(event_log_filename, "%s.eventlog", prog);
-        event_log_pid = getpid();
-    } else {
-        // Forked process, eventlog already started by the parent
-        // before fork
-        event_log_pid = getpid();
-        // We don't have a FMT* symbol for pid_t, so we go via Word64
-        // to be sure of not losing range. It would be nicer to have a
-        // FMT* symbol or similar, though.
-        sprintf(event_log_filename, "%s.%" FMT_Word64 ".eventlog", prog, (StgWord64)event_log_pid);
-    }
-    stgFree(prog);
-
-    /* Open event log file for writing. */
-    if ((event_log_file = fopen(event_log_filename, "wb")) == NULL) {
-        sysErrorBelch("initEventLogging: can't open %s", event_log_filename);
-        stg_exit(EXIT_FAILURE);    
-    }
-
-    /* 
-     * Allocate buffer(s) to store events.
-     * Create buffer large enough for the header begin marker, all event
-     * types, and header end marker to prevent checking if buffer has room
-     * for each of these steps, and remove the need to flush the buffer to
-     * disk during initialization.
-     *
-     * Use a single buffer to store the header with event types, then flush 
-     * the buffer so all buffers are empty for writing events.
-     */
 #ifdef THREADED_RTS
-    // XXX n_capabilities hasn't been initislised yet
-    n_caps = RtsFlags.ParFlags.nNodes;
+    // n_capabilities hasn't been initialised yet at startup, but it
+    // has if the eventlog is started later on.
+    n_caps = n_capabilities > 0 ? n_capabilities : RtsFlags.ParFlags.nNodes;
 #else
     n_caps = 1;
 #endif
@@ -283,6 +324,49 @@ initEventLogging(void)
 
     initEventsBuf(&eventBuf, EVENT_LOG_SIZE, (EventCapNo)(-1));
 
+#ifdef THREADED_RTS
+    initMutex(&eventBufMutex);
+#endif
+    event_log_inited = rtsTrue;
+}
+
+// Open the sink and write the header, after which the buffers are
+// ready for events.
+static rtsBool
+beginEventLog(void)
+{
+    nat c;
+
+    setEventLogFilename();
+    if (!openEventLogSink()) {
+        return rtsFalse;
+    }
+    event_log_count++;
+
+    postHeaderEvents();
+
+    /*
+     * Flush header and data begin marker to the file, thus preparing the
+     * file to have events written to it.
+     */
+    printAndClearEventBuf(&eventBuf);
+
+    for (c = 0; c < n_cap_event_bufs; ++c) {
+        postBlockMarker(&capEventBuf[c]);
+    }
+
+    event_log_running = rtsTrue;
+#ifdef THREADED_RTS
+    startEventWriter();
+#endif
+    return rtsTrue;
+}
+
+static void
+postHeaderEvents(void)
+{
+    StgWord8 t;
+
     // Write in buffer: the header begin marker.
     postInt32(&eventBuf, EVENT_HEADER_BEGIN);
 
@@ -382,6 +466,10 @@ initEventLogging(void)
             eventTypes[t].size = 7 * sizeof(StgWord64);
             break;
 
+        case EVENT_STM_COUNTERS:     // (cap, 5*counter)
+            eventTypes[t].size = 5 * sizeof(StgWord64);
+            break;
+
         case EVENT_HEAP_ALLOCATED:    // (heap_capset, alloc_bytes)
         case EVENT_HEAP_SIZE:         // (heap_capset, size_bytes)
         case EVENT_HEAP_LIVE:         // (heap_capset, live_bytes)
@@ -442,21 +530,6 @@ initEventLogging(void)
     
     // Prepare event buffer for events (data).
     postInt32(&eventBuf, EVENT_DATA_BEGIN);
-
-    // Flush capEventBuf with header.
-    /*
-     * Flush header and data begin marker to the file, thus preparing the
-     * file to have events written to it.
-     */
-    printAndClearEventBuf(&eventBuf);
-
-    for (c = 0; c < n_caps; ++c) {
-        postBlockMarker(&capEventBuf[c]);
-    }
-
-#ifdef THREADED_RTS
-    initMutex(&eventBufMutex);
-#endif
 }
 
 void
@@ -464,11 +537,21 @@ endEventLogging(void)
 {
     nat c;
 
+    if (!event_log_running) return;
+    event_log_running = rtsFalse;
+
     // Flush all events remaining in the buffers.
-    for (c = 0; c < n_capabilities; ++c) {
+    for (c = 0; c < n_cap_event_bufs; ++c) {
         printAndClearEventBuf(&capEventBuf[c]);
     }
     printAndClearEventBuf(&eventBuf);
+
+#ifdef THREADED_RTS
+    // wait for the writer to finish; from here on we write the
+    // buffers out ourselves.
+    stopEventWriter();
+#endif
+
     resetEventsBuf(&eventBuf); // we don't want the block marker
 
     // Mark end of events (data).
@@ -477,9 +560,56 @@ endEventLogging(void)
     // Flush the end of data marker.
     printAndClearEventBuf(&eventBuf);
 
-    if (event_log_file != NULL) {
-        fclose(event_log_file);
+    closeEventLogSink();
+}
+
+/*
+ * Finish off the eventlog while the program runs (rts_stopEventLog()).
+ * As for restartEventLogging(), the caller holds every Capability, and
+ * we take eventBufMutex because Tasks without one may still be posting
+ * to eventBuf.
+ */
+void
+stopEventLogging(void)
+{
+    ACQUIRE_LOCK(&eventBufMutex);
+    endEventLogging();
+    RELEASE_LOCK(&eventBufMutex);
+}
+
+/*
+ * Finish off the eventlog, if there is one, and begin a new one.  This
+ * is how the program starts the eventlog while it runs (Trace.c), so
+ * the eventlog need not have been initialised.  The caller must hold
+ * every Capability; we take eventBufMutex to keep Tasks out of
+ * eventBuf.  If the new sink can't be opened we return rtsFalse, and
+ * the eventlog stays stopped.
+ */
+rtsBool
+restartEventLogging(void)
+{
+    nat c;
+    rtsBool ok;
+
+    if (!event_log_inited) {
+        allocEventLogging();
+        return beginEventLog();
+    }
+
+    ACQUIRE_LOCK(&eventBufMutex);
+
+    endEventLogging();
+
+    // Anything posted since the end marker belongs to no eventlog.
+    for (c = 0; c < n_cap_event_bufs; ++c) {
+        resetEventsBuf(&capEventBuf[c]);
     }
+    resetEventsBuf(&eventBuf);
+
+    ok = beginEventLog();
+
+    RELEASE_LOCK(&eventBufMutex);
+    return ok;
 }
 
 void
@@ -487,6 +617,11 @@ moreCapEventBufs (nat from, nat to)
 {
     nat c;
 
+#ifdef THREADED_RTS
+    // the writer may be looking at capEventBuf
+    if (event_writer_running) ACQUIRE_LOCK(&event_writer_mutex);
+#endif
+
     if (from > 0) {
         capEventBuf = stgReallocBytes(capEventBuf, to * sizeof(EventsBuf),
                                       "moreCapEventBufs");
@@ -498,42 +633,67 @@ moreCapEventBufs (nat from, nat to)
     for (c = from; c < to; ++c) {
         initEventsBuf(&capEventBuf[c], EVENT_LOG_SIZE, c);
     }
+    n_cap_event_bufs = to;
+
+#ifdef THREADED_RTS
+    if (event_writer_running) RELEASE_LOCK(&event_writer_mutex);
+#endif
 }
 
 
 void
 freeEventLogging(void)
 {
-    StgWord8 c;
+    nat c;
     
     // Free events buffer.
-    for (c = 0; c < n_capabilities; ++c) {
-        if (capEventBuf[c].begin != NULL) 
-            stgFree(capEventBuf[c].begin);
+    for (c = 0; c < n_cap_event_bufs; ++c) {
+        if (capEventBuf[c].chunks[0] != NULL) 
+            stgFree(capEventBuf[c].chunks[0]);
     }
     if (capEventBuf != NULL)  {
         stgFree(capEventBuf);
+        capEventBuf = NULL;
+    }
+    n_cap_event_bufs = 0;
+    if (eventBuf.chunks[0] != NULL) {
+        stgFree(eventBuf.chunks[0]);
+        eventBuf.chunks[0] = NULL;
     }
     if (event_log_filename != NULL) {
         stgFree(event_log_filename);
+        event_log_filename = NULL;
     }
+    event_log_inited = rtsFalse;
 }
 
+// Wait until everything handed over so far has been written out.
 void 
 flushEventLog(void)
 {
-    if (event_log_file != NULL) {
-        fflush(event_log_file);
+#ifdef THREADED_RTS
+    if (event_writer_running) {
+        ACQUIRE_LOCK(&event_writer_mutex);
+        while (pendingEventBufs()) {
+            signalCondition(&event_writer_wakeup);
+            waitCondition(&event_writer_done, &event_writer_mutex);
+        }
+        RELEASE_LOCK(&event_writer_mutex);
     }
+#endif
 }
 
 void 
 abortEventLogging(void)
 {
+#ifdef THREADED_RTS
+    // after fork() there is no writer thread in this process; anything
+    // still in the buffers belongs to the parent.
+    event_writer_running = rtsFalse;
+#endif
+    event_log_running = rtsFalse;
     freeEventLogging();
-    if (event_log_file != NULL) {
-        fclose(event_log_file);
-    }
+    closeEventLogSink();
 }
 /*
  * Post an event message to the capability's eventlog buffer.
@@ -662,6 +822,27 @@ postSparkCountersEvent (Capability *cap,
     postWord64(eb,remaining);
 }
 
+void
+postSTMCountersEvent (Capability *cap, STMStats counters)
+{
+    EventsBuf *eb;
+
+    eb = &capEventBuf[cap->no];
+
+    if (!hasRoomForEvent(eb, EVENT_STM_COUNTERS)) {
+        // Flush event buffer to make room for new event.
+        printAndClearEventBuf(eb);
+    }
+
+    postEventHeader(eb, EVENT_STM_COUNTERS);
+    /* EVENT_STM_COUNTERS (commits, aborts, retries, backoffs, irrevocable) */
+    postWord64(eb,counters.commits);
+    postWord64(eb,counters.aborts);
+    postWord64(eb,counters.retries);
+    postWord64(eb,counters.backoffs);
+    postWord64(eb,counters.irrevocable);
+}
+
 void
 postCapEvent (EventTypeNum  tag,
               EventCapNo    capno)
@@ -1170,22 +1351,12 @@ void postBlockMarker (EventsBuf *eb)
 
 void printAndClearEventBuf (EventsBuf *ebuf)
 {
-    StgWord64 numBytes = 0, written = 0;
-
     closeBlockMarker(ebuf);
 
     if (ebuf->begin != NULL && ebuf->pos != ebuf->begin)
     {
-        numBytes = ebuf->pos - ebuf->begin;
-        
-        written = fwrite(ebuf->begin, 1, numBytes, event_log_file);
-        if (written != numBytes) {
-            debugBelch(
-                "printAndClearEventLog: fwrite() failed, written=%" FMT_Word64
-                " doesn't match numBytes=%" FMT_Word64, written, numBytes);
-            return;
-        }
-        
+        handOffEventBuf(ebuf);
+
         resetEventsBuf(ebuf);
         flushCount++;
 
@@ -1193,10 +1364,52 @@ void printAndClearEventBuf (EventsBuf *ebuf)
     }
 }
 
+// Hand the current chunk over to be written out, and move on to the
+// next one.  Only waits if the writer has fallen so far behind that
+// every chunk of this buffer is waiting to be written.
+void handOffEventBuf (EventsBuf *eb)
+{
+    eb->chunk_len[eb->head % EVENT_BUF_CHUNKS] = eb->pos - eb->begin;
+    write_barrier();
+    eb->head++;
+
+#ifdef THREADED_RTS
+    if (event_writer_running) {
+        store_load_barrier();
+        if (event_writer_sleeping) {
+            ACQUIRE_LOCK(&event_writer_mutex);
+            signalCondition(&event_writer_wakeup);
+            RELEASE_LOCK(&event_writer_mutex);
+        }
+        if (eb->head - eb->tail == EVENT_BUF_CHUNKS) {
+            ACQUIRE_LOCK(&event_writer_mutex);
+            while (eb->head - eb->tail == EVENT_BUF_CHUNKS) {
+                signalCondition(&event_writer_wakeup);
+                waitCondition(&event_writer_done, &event_writer_mutex);
+            }
+            RELEASE_LOCK(&event_writer_mutex);
+        }
+    } else {
+        writeEventBufs();
+    }
+#else
+    writeEventBufs();
+#endif
+
+    eb->begin = eb->chunks[eb->head % EVENT_BUF_CHUNKS];
+}
+
 void initEventsBuf(EventsBuf* eb, StgWord64 size, EventCapNo capno)
 {
-    eb->begin = eb->pos = stgMallocBytes(size, "initEventsBuf");
-    eb->size = size;
+    nat i;
+
+    eb->chunks[0] = stgMallocBytes(size, "initEventsBuf");
+    eb->size = size / EVENT_BUF_CHUNKS;
+    for (i = 1; i < EVENT_BUF_CHUNKS; i++) {
+        eb->chunks[i] = eb->chunks[0] + i * eb->size;
+    }
+    eb->begin = eb->pos = eb->chunks[0];
+    eb->head = eb->tail = 0;
     eb->marker = NULL;
     eb->capno = capno;
 }
@@ -1251,4 +1464,371 @@ void postEventType(EventsBuf *eb, EventType *et)
     postInt32(eb, EVENT_ET_END);
 }
 
+/* -----------------------------------------------------------------------------
+   Writing out the buffers
+
+   Full chunks are collected from all the buffers and written out with
+   as few system calls as we can (writev() where we have it).  In the
+   threaded RTS this is done by the writer thread, so a Capability
+   whose buffer fills up doesn't have to wait for the I/O; in the
+   non-threaded RTS, and before the writer has started or after it has
+   stopped, the thread that filled the buffer does it.
+   -------------------------------------------------------------------------- */
+
+#define MAX_EVENT_CHUNKS 64
+
+typedef struct {
+    StgInt8  *base;
+    StgWord64 len;
+    nat       buf;      // index of the buffer, see getEventBuf()
+} EventChunk;
+
+static EventsBuf *getEventBuf (nat i)
+{
+    return i < n_cap_event_bufs ? &capEventBuf[i] : &eventBuf;
+}
+
+// Collect up to MAX_EVENT_CHUNKS chunks that have been handed over
+static nat collectEventChunks (EventChunk *chunks)
+{
+    EventsBuf *eb;
+    StgWord t, h;
+    nat i, n;
+
+    n = 0;
+    for (i = 0; i <= n_cap_event_bufs; i++) {
+        eb = getEventBuf(i);
+        h = eb->head;
+        load_load_barrier();
+        for (t = eb->tail; t != h && n < MAX_EVENT_CHUNKS; t++, n++) {
+            chunks[n].base = eb->chunks[t % EVENT_BUF_CHUNKS];
+            chunks[n].len  = eb->chunk_len[t % EVENT_BUF_CHUNKS];
+            chunks[n].buf  = i;
+        }
+    }
+    return n;
+}
+
+// Give the chunks back to their buffers once they have been written
+static void releaseEventChunks (EventChunk *chunks, nat n)
+{
+    nat i;
+
+    write_barrier();
+    for (i = 0; i < n; i++) {
+        getEventBuf(chunks[i].buf)->tail++;
+    }
+}
+
+static rtsBool pendingEventBufs (void)
+{
+    EventsBuf *eb;
+    nat i;
+
+    for (i = 0; i <= n_cap_event_bufs; i++) {
+        eb = getEventBuf(i);
+        if (eb->head != eb->tail) return rtsTrue;
+    }
+    return rtsFalse;
+}
+
+static void writeEventSinkFailed (void)
+{
+    debugBelch("writeEventChunks: write() failed: %s; "
+               "no more events will be logged\n", strerror(errno));
+    closeEventLogSink();
+}
+
+static void writeEventChunks (EventChunk *chunks, nat n)
+{
+#ifdef HAVE_SYS_UIO_H
+    struct iovec iov[MAX_EVENT_CHUNKS];
+    ssize_t r;
+    nat i;
+
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = chunks[i].base;
+        iov[i].iov_len  = chunks[i].len;
+    }
+
+    // a pipe or a socket may take less than we asked it to
+    i = 0;
+    while (i < n && event_log_fd >= 0) {
+        r = writev(event_log_fd, &iov[i], n - i);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            writeEventSinkFailed();
+            return;
+        }
+        while (i < n && (size_t)r >= iov[i].iov_len) {
+            r -= iov[i].iov_len;
+            i++;
+        }
+        if (i < n) {
+            iov[i].iov_base = (char *)iov[i].iov_base + r;
+            iov[i].iov_len -= r;
+        }
+    }
+#else
+    StgInt8 *p;
+    StgWord64 len;
+    int r;
+    nat i;
+
+    for (i = 0; i < n && event_log_fd >= 0; i++) {
+        p = chunks[i].base;
+        len = chunks[i].len;
+        while (len > 0) {
+            r = write(event_log_fd, p, len);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                writeEventSinkFailed();
+                return;
+            }
+            p += r;
+            len -= r;
+        }
+    }
+#endif
+}
+
+// Write out everything that has been handed over.  Used when there is
+// no writer thread.
+static void writeEventBufs (void)
+{
+    EventChunk chunks[MAX_EVENT_CHUNKS];
+    nat n;
+
+    while ((n = collectEventChunks(chunks)) > 0) {
+        writeEventChunks(chunks, n);
+        releaseEventChunks(chunks, n);
+    }
+}
+
+#ifdef THREADED_RTS
+
+static void OSThreadProcAttr
+eventWriterThread (void *arg STG_UNUSED)
+{
+    EventChunk chunks[MAX_EVENT_CHUNKS];
+    nat n;
+
+    ACQUIRE_LOCK(&event_writer_mutex);
+    for (;;) {
+        n = collectEventChunks(chunks);
+        if (n > 0) {
+            // the chunks are ours until we release them, so the I/O
+            // can happen without the lock.
+            RELEASE_LOCK(&event_writer_mutex);
+            writeEventChunks(chunks, n);
+            ACQUIRE_LOCK(&event_writer_mutex);
+            releaseEventChunks(chunks, n);
+            broadcastCondition(&event_writer_done);
+            continue;
+        }
+        if (event_writer_stop) break;
+
+        // handOffEventBuf() checks event_writer_sleeping after making
+        // a chunk available, so either it sees the flag and wakes us
+        // up, or we see its chunk here.
+        event_writer_sleeping = rtsTrue;
+        store_load_barrier();
+        if (!pendingEventBufs()) {
+            waitCondition(&event_writer_wakeup, &event_writer_mutex);
+        }
+        event_writer_sleeping = rtsFalse;
+    }
+    event_writer_running = rtsFalse;
+    broadcastCondition(&event_writer_done);
+    RELEASE_LOCK(&event_writer_mutex);
+}
+
+static void startEventWriter (void)
+{
+    initMutex(&event_writer_mutex);
+    initCondition(&event_writer_wakeup);
+    initCondition(&event_writer_done);
+    event_writer_stop = rtsFalse;
+    event_writer_sleeping = rtsFalse;
+    event_writer_running = rtsTrue;
+
+    if (createOSThread(&event_writer_tid, (OSThreadProc*)eventWriterThread,
+                       NULL) != 0) {
+        sysErrorBelch("startEventWriter: can't create the eventlog writer");
+        stg_exit(EXIT_FAILURE);
+    }
+}
+
+// Wait for the writer to write out everything it has been given, and
+// exit.
+static void stopEventWriter (void)
+{
+    if (!event_writer_running) return;
+
+    ACQUIRE_LOCK(&event_writer_mutex);
+    event_writer_stop = rtsTrue;
+    signalCondition(&event_writer_wakeup);
+    while (event_writer_running) {
+        waitCondition(&event_writer_done, &event_writer_mutex);
+    }
+    RELEASE_LOCK(&event_writer_mutex);
+
+    // startEventWriter() makes new ones if the eventlog is restarted
+    closeCondition(&event_writer_done);
+    closeCondition(&event_writer_wakeup);
+    closeMutex(&event_writer_mutex);
+}
+
+#endif /* THREADED_RTS */
+
+/* -----------------------------------------------------------------------------
+   Eventlog sinks
+
+   By default events go to <program>.eventlog.  +RTS --eventlog-sink
+   can send them elsewhere instead, so that they can be consumed while
+   the program is running:
+
+     <file>          any file, including a named pipe
+     unix:<path>     a unix-domain stream socket, which we connect to
+     fd:<n>          a descriptor inherited from the parent process
+
+   A forked child can't share the parent's stream, so it reconnects to
+   a socket, and otherwise uses its own <program>.<pid>.eventlog.  Each
+   eventlog after the first that a process writes to the default file
+   gets a name of its own too, <program>-<n>.eventlog.
+   -------------------------------------------------------------------------- */
+
+static void setEventLogFilename (void)
+{
+    char *prog;
+    pid_t pid;
+
+    pid = getpid();
+    if (event_log_pid != pid) { // #4512
+        // a forked child: the parent started the eventlog before fork
+        event_log_forked = event_log_pid != -1;
+        event_log_pid = pid;
+        event_log_count = 0;
+    }
+
+    prog = stgMallocBytes(strlen(prog_name) + 1, "initEventLogging");
+    strcpy(prog, prog_name);
+#ifdef mingw32_HOST_OS
+    // on Windows, drop the .exe suffix if there is one
+    {
+        char *suff;
+        suff = strrchr(prog,'.');
+        if (suff != NULL && !strcmp(suff,".exe")) {
+            *suff = '\0';
+        }
+    }
+#endif
+
+    if (event_log_filename != NULL) {
+        stgFree(event_log_filename);
+    }
+    event_log_filename = stgMallocBytes(strlen(prog)
+                                        + 10 /* .%d */
+                                        + 10 /* -%d */
+                                        + 10 /* .eventlog */,
+                                        "initEventLogging");
+
+    if (!event_log_forked) {
+        if (event_log_count == 0) {
+            sprintf(event_log_filename, "%s.eventlog", prog);
+        } else {
+            sprintf(event_log_filename, "%s-%u.eventlog",
+                    prog, event_log_count);
+        }
+    } else {
+        // We don't have a FMT* symbol for pid_t, so we go via Word64
+        // to be sure of not losing range. It would be nicer to have a
+        // FMT* symbol or similar, though.
+        if (event_log_count == 0) {
+            sprintf(event_log_filename, "%s.%" FMT_Word64 ".eventlog",
+                    prog, (StgWord64)event_log_pid);
+        } else {
+            sprintf(event_log_filename, "%s.%" FMT_Word64 "-%u.eventlog",
+                    prog, (StgWord64)event_log_pid, event_log_count);
+        }
+    }
+    stgFree(prog);
+}
+
+#ifdef USE_UNIX_SOCKET_SINK
+static int connectEventLogSocket (char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errorBelch("initEventLogging: socket path too long: %s", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        sysErrorBelch("initEventLogging: socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        sysErrorBelch("initEventLogging: can't connect to %s", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+// Returns rtsFalse, having said why, if the sink can't be opened
+static rtsBool openEventLogSink (void)
+{
+    rtsBool forked = event_log_forked;
+    char *sink = RtsFlags.TraceFlags.sink;
+    char *filename = event_log_filename;
+
+    event_log_close_fd = rtsTrue;
+
+    if (sink != NULL) {
+#ifdef USE_UNIX_SOCKET_SINK
+        if (!strncmp(sink, "unix:", 5)) {
+            event_log_fd = connectEventLogSocket(sink + 5);
+            return event_log_fd >= 0;
+        }
+#endif
+        if (!strncmp(sink, "fd:", 3)) {
+            if (!forked) {
+                event_log_fd = parseFdSink(sink);
+                if (event_log_fd < 0) {
+                    return rtsFalse;
+                }
+                event_log_close_fd = rtsFalse;
+                return rtsTrue;
+            }
+        } else if (!forked) {
+            filename = sink;
+        }
+    }
+
+    event_log_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                        0666);
+    if (event_log_fd < 0) {
+        sysErrorBelch("initEventLogging: can't open %s", filename);
+        return rtsFalse;
+    }
+    return rtsTrue;
+}
+
+static void closeEventLogSink (void)
+{
+    if (event_log_fd >= 0 && event_log_close_fd) {
+        close(event_log_fd);
+    }
+    event_log_fd = -1;
+}
+
 #endif /* TRACING */
@@ -23,6 +23,8 @@ extern char *EventTagDesc[];
 
 void initEventLogging(void);
 void endEventLogging(void);
+void stopEventLogging(void);      // see rts_stopEventLog()
+rtsBool restartEventLogging(void); // see rts_startEventLog()
 void freeEventLogging(void);
 void abortEventLogging(void); // #4512 - after fork child needs to abort
 void flushEventLog(void);     // event log inherited from parent
@@ -95,6 +97,11 @@ void postSparkCountersEvent (Capability *cap,
                              SparkCounters counters,
                              StgWord remaining);
 
+/*
+ * Post an event with the counters of the STM's commits and aborts
+ */
+void postSTMCountersEvent (Capability *cap, STMStats counters);
+
 /*
  * Post an event to annotate a thread with a label
  */
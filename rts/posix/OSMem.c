@@ -13,6 +13,7 @@
 
 #include "RtsUtils.h"
 #include "sm/OSMem.h"
+#include "Trace.h"
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -37,11 +38,106 @@
 #include <mach/vm_map.h>
 #endif
 
+#if defined(linux_HOST_OS)
+#include <sys/syscall.h>
+#if defined(SYS_mbind) && defined(SYS_get_mempolicy)
+// We make the system calls directly rather than depending on libnuma.
+#define HAVE_NUMA_SYSCALLS 1
+#define MPOL_PREFERRED       1
+#define MPOL_F_MEMS_ALLOWED  (1 << 2)
+// get_mempolicy() fails unless the mask is at least as large as the
+// kernel's idea of the maximum number of nodes.
+#define NUMA_MASK_BITS       1024
+#endif
+#endif
+
 static caddr_t next_request = 0;
 
+static void initHugePages (void);
+
 void osMemInit(void)
 {
     next_request = (caddr_t)RtsFlags.GcFlags.heapBase;
+    initHugePages();
+}
+
+/* -----------------------------------------------------------------------------
+   Huge pages (see --huge-pages)
+
+   With 4k pages, a large heap needs far more TLB entries than the
+   hardware has, and allocation and copying GC, which sweep through
+   memory, miss all the time.  Backing the heap with 2M pages cuts the
+   misses by a factor of 512.  There are two ways to get them on Linux:
+
+     - transparent: madvise(MADV_HUGEPAGE) asks the kernel to use huge
+       pages for the range where it can, at page-fault time or later
+       (by khugepaged).  It needs nothing set up, and the range is still
+       ordinary memory, so it can be freed a page at a time.
+
+     - explicit: mmap(MAP_HUGETLB) takes pages from the pool set aside
+       by the administrator (/proc/sys/vm/nr_hugepages).  They are
+       certain to be huge, but the mapping must be aligned to, and a
+       multiple of, the huge page size, and can't be split.
+
+   The megablock and block layout doesn't change: a huge page just
+   holds two mblocks.  To make the most of it, the reserved heap range
+   is aligned to a huge page and committed a huge page at a time (see
+   getReservedMBlocks()); mblocks from anywhere else only get the
+   madvise().  If there is no pool to take explicit huge pages from, we
+   say so and use transparent ones instead, and if a commit can't have
+   them later (the pool ran out, or the range isn't aligned) it falls
+   back to ordinary pages.
+   -------------------------------------------------------------------------- */
+
+#define HUGE_PAGE_SIZE  ((W_)2 * 1024 * 1024)
+
+// what we are actually doing, which may be less than was asked for
+static nat huge_pages = HUGE_PAGES_NONE;
+
+static void
+initHugePages (void)
+{
+    huge_pages = RtsFlags.GcFlags.hugePages;
+
+#if !defined(MADV_HUGEPAGE)
+    if (huge_pages != HUGE_PAGES_NONE) {
+        errorBelch("warning: huge pages are not supported on this platform");
+        huge_pages = HUGE_PAGES_NONE;
+    }
+#elif !defined(MAP_HUGETLB)
+    if (huge_pages == HUGE_PAGES_EXPLICIT) {
+        huge_pages = HUGE_PAGES_TRANSPARENT;
+    }
+#else
+    if (huge_pages == HUGE_PAGES_EXPLICIT) {
+        void *p;
+
+        // see whether there are any to be had
+        p = mmap(NULL, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            errorBelch("warning: no huge pages available (%s); "
+                       "using transparent huge pages", strerror(errno));
+            huge_pages = HUGE_PAGES_TRANSPARENT;
+        } else {
+            munmap(p, HUGE_PAGE_SIZE);
+        }
+    }
+#endif
+}
+
+static void
+adviseHugePages (void *at STG_UNUSED, W_ size STG_UNUSED)
+{
+#if defined(MADV_HUGEPAGE)
+    if (huge_pages != HUGE_PAGES_NONE) {
+        // only a hint: if it fails we just get ordinary pages
+        if (madvise(at, size, MADV_HUGEPAGE) == -1) {
+            debugTrace(DEBUG_gc, "madvise(MADV_HUGEPAGE) failed: %s",
+                       strerror(errno));
+        }
+    }
+#endif
 }
 
 /* -----------------------------------------------------------------------------
@@ -224,6 +320,8 @@ osGetMBlocks(nat n)
   // ToDo: check that we haven't already grabbed the memory at next_request
   next_request = ret + size;
 
+  adviseHugePages(ret, size);
+
   return ret;
 }
 
@@ -236,6 +334,58 @@ void osReleaseFreeMemory(void) {
     /* Nothing to do on POSIX */
 }
 
+// Tell the OS that it can have the pages in a range back: the range
+// stays mapped, and reads as zeroes when it is next touched.  Returns
+// rtsFalse if nothing was given back.
+rtsBool osDiscardMemory(void *at, W_ size)
+{
+    W_ page = getPageSize();
+    W_ start = ((W_)at + page - 1) & ~(page - 1);
+    W_ end = ((W_)at + size) & ~(page - 1);
+
+    // explicit huge pages can only be given back whole, with munmap()
+    if (huge_pages == HUGE_PAGES_EXPLICIT || end <= start) {
+        return rtsFalse;
+    }
+
+#if defined(MADV_DONTNEED)
+    // Not MADV_FREE: the pages would still count against our RSS, and
+    // the memory limit of a container, until the kernel got round to
+    // taking them.
+    if (madvise((void *)start, end - start, MADV_DONTNEED) == -1) {
+        debugTrace(DEBUG_gc, "madvise(MADV_DONTNEED) failed: %s",
+                   strerror(errno));
+        return rtsFalse;
+    }
+    return rtsTrue;
+#else
+    return rtsFalse;
+#endif
+}
+
+// The resident set size of the process, in bytes, or 0 if we can't tell
+W_ osResidentMemory(void)
+{
+#if defined(linux_HOST_OS)
+    FILE *f;
+    unsigned long size, resident;
+    int n;
+
+    f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    if (n != 2) {
+        return 0;
+    }
+    return (W_)resident * getPageSize();
+#else
+    return 0;
+#endif
+}
+
 void osFreeAllMBlocks(void)
 {
     void *mblock;
@@ -247,6 +397,134 @@ void osFreeAllMBlocks(void)
     }
 }
 
+/* -----------------------------------------------------------------------------
+   Reserving address space for the heap (see HEAP_ALLOCED() in
+   includes/rts/storage/MBlock.h)
+
+   osReserveHeapMemory() maps *len bytes, aligned to MBLOCK_SIZE (or
+   to a huge page, if we are using them), with no access and no swap
+   set aside, so that they cost nothing but address space.  If it
+   can't have that much (a ulimit -v, say), it tries for half as much,
+   and so on down to an mblock, and sets *len to what it got.
+   osCommitMemory() and osDecommitMemory() map ordinary memory into,
+   and out of, parts of the range.
+   -------------------------------------------------------------------------- */
+
+#if defined(USE_HEAP_RESERVATION)
+
+#if !defined(MAP_NORESERVE)
+#define MAP_NORESERVE 0
+#endif
+
+// The size that the reserved range should be aligned to and committed
+// in units of, so that it can be covered by huge pages; 0 if we aren't
+// using them.
+W_ osHugePageSize (void)
+{
+    return huge_pages == HUGE_PAGES_NONE ? 0 : HUGE_PAGE_SIZE;
+}
+
+// Explicit huge pages can't be decommitted in parts, so the reserved
+// range keeps the memory of free mblocks.
+rtsBool osHugePagesExplicit (void)
+{
+    return huge_pages == HUGE_PAGES_EXPLICIT;
+}
+
+void *
+osReserveHeapMemory (void *hint, W_ *len)
+{
+    StgWord8 *ret, *start;
+    W_ size, align;
+
+    align = MBLOCK_SIZE;
+    if (osHugePageSize() > align) {
+        align = osHugePageSize();
+    }
+
+    ret = MAP_FAILED;
+    for (size = *len; size >= MBLOCK_SIZE; size /= 2) {
+        size &= ~(W_)MBLOCK_MASK;
+        // more than we need, so that we can align it
+        ret = mmap(hint, size + align, PROT_NONE,
+                   MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (ret != MAP_FAILED) break;
+    }
+    if (ret == MAP_FAILED) {
+        return NULL;
+    }
+
+    // unmap the slop on either side
+    start = (StgWord8 *)(((W_)ret + align - 1) & ~(align - 1));
+    if (start > ret && munmap(ret, start - ret) == -1) {
+        barf("osReserveHeapMemory: munmap failed");
+    }
+    if (munmap(start + size, ret + align - start) == -1) {
+        barf("osReserveHeapMemory: munmap failed");
+    }
+
+    *len = size;
+    return start;
+}
+
+void
+osCommitMemory (void *at, W_ size)
+{
+    void *ret;
+
+#if defined(MAP_HUGETLB)
+    if (huge_pages == HUGE_PAGES_EXPLICIT
+        && ((W_)at & (HUGE_PAGE_SIZE - 1)) == 0
+        && (size & (HUGE_PAGE_SIZE - 1)) == 0) {
+        ret = mmap(at, size, PROT_READ | PROT_WRITE,
+                   MAP_ANON | MAP_PRIVATE | MAP_FIXED | MAP_HUGETLB, -1, 0);
+        if (ret != MAP_FAILED) {
+            return;
+        }
+        // The pool has run dry.  The failed mmap() may have unmapped
+        // the range, but we map it straight away again below.
+        debugTrace(DEBUG_gc, "no huge pages for %" FMT_Word " bytes at %p",
+                   size, at);
+    }
+#endif
+
+    ret = mmap(at, size, PROT_READ | PROT_WRITE,
+               MAP_ANON | MAP_PRIVATE | MAP_FIXED, -1, 0);
+    if (ret == MAP_FAILED) {
+        if (errno == ENOMEM) {
+            errorBelch("out of memory (requested %" FMT_Word " bytes)", size);
+            stg_exit(EXIT_FAILURE);
+        }
+        barf("osCommitMemory: mmap: %s", strerror(errno));
+    }
+
+    adviseHugePages(at, size);
+}
+
+void
+osDecommitMemory (void *at, W_ size)
+{
+    void *ret;
+
+    // mapping the range afresh throws away the pages, and what they
+    // counted against the overcommit limit
+    ret = mmap(at, size, PROT_NONE,
+               MAP_ANON | MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    if (ret == MAP_FAILED) {
+        barf("osDecommitMemory: mmap: %s", strerror(errno));
+    }
+}
+
+void
+osReleaseHeapMemory (void *at, W_ size)
+{
+    if (munmap(at, size) == -1) {
+        sysErrorBelch("osReleaseHeapMemory: munmap failed");
+    }
+}
+
+#endif /* USE_HEAP_RESERVATION */
+
 W_ getPageSize (void)
 {
     static W_ pageSize = 0;
@@ -277,3 +555,98 @@ void setExecutable (void *p, W_ len, rtsBool exec)
         barf("setExecutable: failed to protect 0x%p\n", p);
     }
 }
+
+/* -----------------------------------------------------------------------------
+   NUMA support (see --numa)
+
+   osNumaMask() returns the set of nodes the process may allocate
+   memory on, osNumaNodes() counts the nodes up to the highest of
+   those (to check --numa=<mask>), and osBindMBlocksToNode() asks the
+   kernel to prefer a particular node for a range of mblocks.  Binding
+   is only a hint: if it fails the memory is still perfectly usable,
+   it just might be further away.
+   -------------------------------------------------------------------------- */
+
+#if defined(HAVE_NUMA_SYSCALLS)
+
+static StgWord
+getNumaNodesAllowed (void)
+{
+    static rtsBool done = rtsFalse;
+    static StgWord mask = 0;
+    unsigned long nodes[NUMA_MASK_BITS / (8 * sizeof(unsigned long))];
+    int mode;
+
+    if (done) return mask;
+    done = rtsTrue;
+
+    memset(nodes, 0, sizeof(nodes));
+    if (syscall(SYS_get_mempolicy, &mode, nodes, NUMA_MASK_BITS,
+                NULL, MPOL_F_MEMS_ALLOWED) != 0) {
+        return 0;
+    }
+    // We only care about the first MAX_NUMA_NODES nodes
+    mask = (StgWord)nodes[0];
+    if (MAX_NUMA_NODES < 8 * sizeof(StgWord)) {
+        mask &= ((StgWord)1 << MAX_NUMA_NODES) - 1;
+    }
+    return mask;
+}
+
+rtsBool osNumaAvailable(void)
+{
+    return getNumaNodesAllowed() != 0;
+}
+
+nat osNumaNodes(void)
+{
+    StgWord mask = getNumaNodesAllowed();
+    nat n = 0;
+
+    while (mask != 0) {
+        n++;
+        mask >>= 1;
+    }
+    return n == 0 ? 1 : n;
+}
+
+StgWord osNumaMask(void)
+{
+    return getNumaNodesAllowed();
+}
+
+void osBindMBlocksToNode(void *addr, StgWord size, nat node)
+{
+    unsigned long mask = 1UL << node;
+
+    if (syscall(SYS_mbind, addr, (unsigned long)size, MPOL_PREFERRED,
+                &mask, (unsigned long)(8 * sizeof(mask) + 1), 0) != 0) {
+        debugTrace(DEBUG_gc, "osBindMBlocksToNode: mbind(%p, %" FMT_Word
+                   ", node %d) failed: %s", addr, size, node,
+                   strerror(errno));
+    }
+}
+
+#else
+
+rtsBool osNumaAvailable(void)
+{
+    return rtsFalse;
+}
+
+nat osNumaNodes(void)
+{
+    return 1;
+}
+
+StgWord osNumaMask(void)
+{
+    return 1;
+}
+
+void osBindMBlocksToNode(void *addr STG_UNUSED, StgWord size STG_UNUSED,
+                         nat node STG_UNUSED)
+{
+}
+
+#endif
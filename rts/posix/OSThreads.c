@@ -308,6 +308,60 @@ setThreadAffinity (nat n GNUC3_ATTRIBUTE(__unused__),
 }
 #endif
 
+#if defined(linux_HOST_OS) && defined(HAVE_SCHED_H) && defined(HAVE_SCHED_SETAFFINITY)
+// Restrict the current thread to the CPUs of NUMA node 'node' (an OS
+// node number).  The node's CPUs are read from sysfs, which contains
+// a list of ranges such as "0-7,16-23".  We intersect the result with
+// the thread's current affinity, so that this combines with -qa.  If
+// anything goes wrong we just leave the affinity alone: running on
+// the "wrong" node is slower, but not incorrect.
+void
+setThreadNode (nat node)
+{
+    char path[64];
+    FILE *f;
+    cpu_set_t node_cs, cs;
+    int lo, hi, i, c;
+    nat ncpus = 0;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/node/node%d/cpulist", node);
+    f = fopen(path, "r");
+    if (f == NULL) return;
+
+    CPU_ZERO(&node_cs);
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &hi) != 1) break;
+            c = fgetc(f);
+        }
+        for (i = lo; i <= hi && i < CPU_SETSIZE; i++) {
+            CPU_SET(i, &node_cs);
+            ncpus++;
+        }
+        if (c != ',') break;
+    }
+    fclose(f);
+
+    if (ncpus == 0) return;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cs) == 0) {
+        CPU_AND(&cs, &cs, &node_cs);
+        if (CPU_COUNT(&cs) == 0) return;
+    } else {
+        cs = node_cs;
+    }
+    sched_setaffinity(0, sizeof(cpu_set_t), &cs);
+}
+#else
+void
+setThreadNode (nat node GNUC3_ATTRIBUTE(__unused__))
+{
+}
+#endif
+
 void
 interruptOSThread (OSThreadId id)
 {
@@ -21,6 +21,7 @@
 #include "AwaitEvent.h"
 #include "Stats.h"
 #include "GetTime.h"
+#include "Threads.h"
 
 # ifdef HAVE_SYS_SELECT_H
 #  include <sys/select.h>
@@ -32,87 +33,205 @@
 
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
 #include "Clock.h"
 
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <unistd.h>
+#define USED_IF_EPOLL
+#else
+#define USED_IF_EPOLL STG_UNUSED
+#endif
+
 #if !defined(THREADED_RTS)
 
-// The target time for a threadDelay is stored in a one-word quantity
-// in the TSO (tso->block_info.target).  On a 32-bit machine we
-// therefore can't afford to use nanosecond resolution because it
-// would overflow too quickly, so instead we use millisecond
-// resolution.
+// The number of threads parked in the per-fd waiter table (see the
+// epoll backend below).  Always zero when using select().
+nat n_fd_waiters = 0;
 
-#if SIZEOF_VOID_P == 4
-#define LowResTimeToTime(t)          (USToTime((t) * 1000))
-#define TimeToLowResTimeRoundDown(t) ((LowResTime)(TimeToUS(t) / 1000))
-#define TimeToLowResTimeRoundUp(t)   ((TimeToUS(t) + 1000-1) / 1000)
-#else
-#define LowResTimeToTime(t) (t)
-#define TimeToLowResTimeRoundDown(t) (t)
-#define TimeToLowResTimeRoundUp(t)   (t)
-#endif
+/* -----------------------------------------------------------------------------
+ * Sleeping threads
+ *
+ * Threads blocked in threadDelay are kept in a binary min-heap ordered
+ * on their wake-up time, so that adding a sleeper, removing one (when
+ * it receives an exception, e.g. from System.Timeout) and waking the
+ * earliest are all O(log n) rather than the O(n) of a sorted list.
+ *
+ * The wake-up time lives in the heap entry, not the TSO, so it can be
+ * a full-resolution Time from the monotonic clock even on 32-bit
+ * machines.  The TSO instead records its position in the heap
+ * (tso->block_info.sleeping_index) so that it can be found again.
+ * -------------------------------------------------------------------------- */
+
+typedef struct {
+    Time    target;     // when to wake the thread up
+    StgTSO *tso;
+} Sleeper;
 
-/*
- * Return the time since the program started, in LowResTime,
- * rounded down.
- */
-static LowResTime getLowResTimeOfDay(void)
+static Sleeper *sleepers = NULL;
+static nat      sleepers_size = 0;
+nat             n_sleeping_threads = 0;
+
+static Time getSleepTime (void)
 {
-    return TimeToLowResTimeRoundDown(getProcessElapsedTime());
+    return NSToTime(getMonotonicNSec());
 }
 
 /*
- * For a given microsecond delay, return the target time in LowResTime.
+ * For a given microsecond delay, return the target time.
  */
-LowResTime getDelayTarget (HsInt us)
+static Time getDelayTarget (HsInt us)
 {
-    Time elapsed;
-    elapsed = getProcessElapsedTime();
+    Time now;
+    now = getSleepTime();
 
     // If the desired target would be larger than the maximum Time,
     // default to the maximum Time. (#7087)
-    if (us > TimeToUS(TIME_MAX - elapsed)) {
-        return TimeToLowResTimeRoundDown(TIME_MAX);
+    if (us > TimeToUS(TIME_MAX - now)) {
+        return TIME_MAX;
     } else {
-        // round up the target time, because we never want to sleep *less*
-        // than the desired amount.
-        return TimeToLowResTimeRoundUp(elapsed + USToTime(us));
+        return now + USToTime(us);
     }
 }
 
-/* There's a clever trick here to avoid problems when the time wraps
- * around.  Since our maximum delay is smaller than 31 bits of ticks
- * (it's actually 31 bits of microseconds), we can safely check
- * whether a timer has expired even if our timer will wrap around
- * before the target is reached, using the following formula:
- *
- *        (int)((uint)current_time - (uint)target_time) < 0
- *
- * if this is true, then our time has expired.
- * (idea due to Andy Gill).
+STATIC_INLINE void
+setSleeper (nat i, Sleeper s)
+{
+    sleepers[i] = s;
+    s.tso->block_info.sleeping_index = i;
+}
+
+static void
+siftUpSleeper (nat i)
+{
+    Sleeper s = sleepers[i];
+    nat parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (sleepers[parent].target <= s.target) break;
+        setSleeper(i, sleepers[parent]);
+        i = parent;
+    }
+    setSleeper(i, s);
+}
+
+static void
+siftDownSleeper (nat i)
+{
+    Sleeper s = sleepers[i];
+    nat child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= n_sleeping_threads) break;
+        if (child + 1 < n_sleeping_threads &&
+            sleepers[child + 1].target < sleepers[child].target) {
+            child++;
+        }
+        if (s.target <= sleepers[child].target) break;
+        setSleeper(i, sleepers[child]);
+        i = child;
+    }
+    setSleeper(i, s);
+}
+
+static void
+deleteSleeper (nat i)
+{
+    ASSERT(i < n_sleeping_threads);
+
+    n_sleeping_threads--;
+    if (i == n_sleeping_threads) {
+        return;
+    }
+    setSleeper(i, sleepers[n_sleeping_threads]);
+    if (i > 0 && sleepers[i].target < sleepers[(i - 1) / 2].target) {
+        siftUpSleeper(i);
+    } else {
+        siftDownSleeper(i);
+    }
+}
+
+/*
+ * Called from stg_delayzh: put the current thread to sleep for the
+ * given number of microseconds.
  */
-static rtsBool wakeUpSleepingThreads (LowResTime now)
+void addSleepingThread (StgTSO *tso, HsInt us)
+{
+    ASSERT(tso->why_blocked == BlockedOnDelay);
+
+    if (n_sleeping_threads == sleepers_size) {
+        sleepers_size = sleepers_size == 0 ? 64 : sleepers_size * 2;
+        sleepers = stgReallocBytes(sleepers, sleepers_size * sizeof(Sleeper),
+                                   "addSleepingThread");
+    }
+
+    sleepers[n_sleeping_threads].target = getDelayTarget(us);
+    sleepers[n_sleeping_threads].tso    = tso;
+    n_sleeping_threads++;
+    siftUpSleeper(n_sleeping_threads - 1);
+}
+
+void removeSleepingThread (StgTSO *tso)
+{
+    nat i = (nat)tso->block_info.sleeping_index;
+
+    ASSERT(i < n_sleeping_threads && sleepers[i].tso == tso);
+    deleteSleeper(i);
+}
+
+void markSleepingThreads (evac_fn evac, void *user)
+{
+    nat i;
+
+    // The heap is ordered on the targets, so moving the TSOs does not
+    // disturb it.
+    for (i = 0; i < n_sleeping_threads; i++) {
+        evac(user, (StgClosure **)(void *)&sleepers[i].tso);
+    }
+}
+
+/*
+ * Wake up all the threads whose target time has passed.  Returns
+ * rtsTrue if any were woken.
+ */
+static rtsBool wakeUpSleepingThreads (Time now)
 {
     StgTSO *tso;
     rtsBool flag = rtsFalse;
 
-    while (sleeping_queue != END_TSO_QUEUE) {
-	tso = sleeping_queue;
-        if (((long)now - (long)tso->block_info.target) < 0) {
-            break;
-        }
-	sleeping_queue = tso->_link;
-	tso->why_blocked = NotBlocked;
-	tso->_link = END_TSO_QUEUE;
-	IF_DEBUG(scheduler,debugBelch("Waking up sleeping thread %lu\n", (unsigned long)tso->id));
-	// MainCapability: this code is !THREADED_RTS
-	pushOnRunQueue(&MainCapability,tso);
-	flag = rtsTrue;
+    while (n_sleeping_threads > 0 && sleepers[0].target <= now) {
+        tso = sleepers[0].tso;
+        deleteSleeper(0);
+        tso->why_blocked = NotBlocked;
+        tso->_link = END_TSO_QUEUE;
+        IF_DEBUG(scheduler,debugBelch("Waking up sleeping thread %lu\n", (unsigned long)tso->id));
+        // MainCapability: this code is !THREADED_RTS
+        pushOnRunQueue(&MainCapability,tso);
+        flag = rtsTrue;
     }
     return flag;
 }
 
+/*
+ * The time until the next sleeping thread is due, or -1 if there
+ * are none.
+ */
+static Time nextSleeperDue (Time now)
+{
+    if (n_sleeping_threads == 0) {
+        return -1;
+    } else if (sleepers[0].target <= now) {
+        return 0;
+    } else {
+        return sleepers[0].target - now;
+    }
+}
+
 static void GNUC3_ATTRIBUTE(__noreturn__)
 fdOutOfRange (int fd)
 {
@@ -120,6 +239,357 @@ fdOutOfRange (int fd)
     stg_exit(EXIT_FAILURE);
 }
 
+/* -----------------------------------------------------------------------------
+ * The epoll backend
+ *
+ * Rebuilding the fd_sets from blocked_queue_hd on every call to
+ * awaitEvent() costs O(blocked threads) per scheduler pass, and
+ * select() cannot cope with fds >= FD_SETSIZE at all.  Where epoll is
+ * available we therefore keep a persistent registration instead:
+ *
+ *   - waitRead#/waitWrite# still append the thread to blocked_queue_hd
+ *     (see PrimOps.cmm), which now serves only as an incoming queue.
+ *
+ *   - On the next awaitEvent(), registerBlockedThreads() moves each
+ *     new thread onto the reader or writer list of its fd in
+ *     fd_waiters[], and updates the epoll interest set for that fd.
+ *
+ *   - epoll_wait() tells us which fds are ready, and we wake up just
+ *     the threads on those fds.
+ *
+ * So the cost of a scheduler pass is O(new waiters + ready fds), and
+ * there is no limit on the fd number other than the process's own.
+ *
+ * The lists in fd_waiters[] are GC roots (markFdWaiters()), and a
+ * thread can be removed from them when it receives an asynchronous
+ * exception (removeThreadFromBlockedQueue()).
+ *
+ * As with select(), a thread blocked on an fd that another thread
+ * closes is woken only if the kernel reports an error or hangup for
+ * the fd; fds that epoll does not support (e.g. regular files, which
+ * are always ready) cause their waiters to be woken straight away.
+ * -------------------------------------------------------------------------- */
+
+#if defined(USE_EPOLL)
+
+typedef struct {
+    StgTSO   *readers;  // threads BlockedOnRead on this fd
+    StgTSO   *writers;  // threads BlockedOnWrite on this fd
+    StgWord32 events;   // the events registered with epoll, 0 if none
+} FdWaiters;
+
+static FdWaiters *fd_waiters = NULL;
+static int        fd_waiters_size = 0;
+
+static int     epoll_fd = -1;
+static rtsBool epoll_unavailable = rtsFalse;
+
+#define MAX_EPOLL_EVENTS 256
+static struct epoll_event epoll_events[MAX_EPOLL_EVENTS];
+
+static rtsBool
+useEpoll (void)
+{
+    if (epoll_fd >= 0) {
+        return rtsTrue;
+    }
+    if (epoll_unavailable) {
+        return rtsFalse;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        // e.g. running on a kernel without epoll: fall back to select()
+        IF_DEBUG(scheduler, debugBelch("epoll_create1 failed (errno %d), "
+                                       "using select()\n", errno));
+        epoll_unavailable = rtsTrue;
+        return rtsFalse;
+    }
+    return rtsTrue;
+}
+
+static void
+ensureFdWaiters (int fd)
+{
+    int i, new_size;
+
+    if (fd < fd_waiters_size) {
+        return;
+    }
+
+    new_size = fd_waiters_size == 0 ? 64 : fd_waiters_size;
+    while (new_size <= fd) {
+        new_size *= 2;
+    }
+
+    fd_waiters = stgReallocBytes(fd_waiters, new_size * sizeof(FdWaiters),
+                                 "ensureFdWaiters");
+    for (i = fd_waiters_size; i < new_size; i++) {
+        fd_waiters[i].readers = END_TSO_QUEUE;
+        fd_waiters[i].writers = END_TSO_QUEUE;
+        fd_waiters[i].events  = 0;
+    }
+    fd_waiters_size = new_size;
+}
+
+static void
+wakeFdWaiterQueue (StgTSO **queue)
+{
+    StgTSO *tso, *next;
+
+    for (tso = *queue; tso != END_TSO_QUEUE; tso = next) {
+        next = tso->_link;
+        IF_DEBUG(scheduler,debugBelch("Waking up blocked thread %lu\n",
+                                      (unsigned long)tso->id));
+        tso->why_blocked = NotBlocked;
+        tso->_link = END_TSO_QUEUE;
+        // MainCapability: this code is !THREADED_RTS
+        pushOnRunQueue(&MainCapability,tso);
+        n_fd_waiters--;
+    }
+    *queue = END_TSO_QUEUE;
+}
+
+/*
+ * Bring the epoll registration of fd in line with the threads waiting
+ * on it.  If epoll refuses the fd, all of its waiters are woken up
+ * and left to discover the problem by retrying their read or write.
+ */
+static void
+syncFdInterest (int fd)
+{
+    FdWaiters *w = &fd_waiters[fd];
+    struct epoll_event ev;
+    StgWord32 want = 0;
+    int op, r;
+
+    if (w->readers != END_TSO_QUEUE) want |= EPOLLIN;
+    if (w->writers != END_TSO_QUEUE) want |= EPOLLOUT;
+
+    if (want == w->events) {
+        return;
+    }
+
+    if (want == 0) {
+        // ENOENT/EBADF just mean the fd has already been closed,
+        // which removes it from the epoll set anyway.
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        w->events = 0;
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = want;
+    ev.data.fd = fd;
+
+    op = (w->events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    r = epoll_ctl(epoll_fd, op, fd, &ev);
+    if (r < 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        // the fd was closed (dropping its registration) and reopened
+        r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    } else if (r < 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+        r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    }
+
+    if (r < 0) {
+        // EBADF: not an open fd; EPERM: a regular file or directory,
+        // which is always ready.  Either way, waking the threads up is
+        // the right thing to do (cf. the EBADF case for select()).
+        IF_DEBUG(scheduler, debugBelch("epoll_ctl on fd %d failed "
+                                       "(errno %d), waking waiters\n",
+                                       fd, errno));
+        wakeFdWaiterQueue(&w->readers);
+        wakeFdWaiterQueue(&w->writers);
+        w->events = 0;
+        return;
+    }
+
+    w->events = want;
+}
+
+/*
+ * Move the threads that have blocked since the last call from
+ * blocked_queue_hd into fd_waiters[].
+ */
+static void
+registerBlockedThreads (void)
+{
+    StgTSO *tso, *next, **queue;
+    int fd;
+
+    for (tso = blocked_queue_hd; tso != END_TSO_QUEUE; tso = next) {
+        next = tso->_link;
+        fd = (int)tso->block_info.fd;
+
+        if (fd < 0) {
+            // the read/write will fail with EBADF, let it do so
+            tso->why_blocked = NotBlocked;
+            tso->_link = END_TSO_QUEUE;
+            pushOnRunQueue(&MainCapability,tso);
+            continue;
+        }
+
+        ensureFdWaiters(fd);
+
+        switch (tso->why_blocked) {
+        case BlockedOnRead:
+            queue = &fd_waiters[fd].readers;
+            break;
+        case BlockedOnWrite:
+            queue = &fd_waiters[fd].writers;
+            break;
+        default:
+            barf("registerBlockedThreads");
+        }
+
+        setTSOLink(&MainCapability, tso, *queue);
+        *queue = tso;
+        n_fd_waiters++;
+
+        syncFdInterest(fd);
+    }
+
+    blocked_queue_hd = blocked_queue_tl = END_TSO_QUEUE;
+}
+
+static void
+awaitEventEpoll (rtsBool wait)
+{
+    int i, fd, n, timeout;
+    StgWord32 events;
+    Time now, due;
+
+    do {
+
+      now = getSleepTime();
+      if (wakeUpSleepingThreads(now)) {
+          return;
+      }
+
+      registerBlockedThreads();
+
+      // threads may have been woken because their fd was refused
+      if (!emptyRunQueue(&MainCapability)) {
+          return;
+      }
+
+      if (!wait) {
+          timeout = 0;
+      } else if ((due = nextSleeperDue(now)) >= 0) {
+          // epoll_wait() only has millisecond resolution: round up,
+          // so that we don't wake up early and spin
+          StgWord64 ms = (TimeToUS(due) + 999) / 1000;
+          timeout = ms > INT_MAX ? INT_MAX : (int)ms;
+      } else {
+          timeout = -1;
+      }
+
+      n = epoll_wait(epoll_fd, epoll_events, MAX_EPOLL_EVENTS, timeout);
+
+      if (n < 0) {
+          if (errno != EINTR) {
+              sysErrorBelch("epoll_wait");
+              stg_exit(EXIT_FAILURE);
+          }
+
+          // See the comments in awaitEventSelect().
+#if defined(RTS_USER_SIGNALS)
+          if (RtsFlags.MiscFlags.install_signal_handlers && signals_pending()) {
+              startSignalHandlers(&MainCapability);
+              return; /* still hold the lock */
+          }
+#endif
+          if (sched_state >= SCHED_INTERRUPTING) {
+              return; /* still hold the lock */
+          }
+          wakeUpSleepingThreads(getSleepTime());
+          continue;
+      }
+
+      for (i = 0; i < n; i++) {
+          fd     = epoll_events[i].data.fd;
+          events = epoll_events[i].events;
+
+          if (events & (EPOLLERR | EPOLLHUP)) {
+              events |= EPOLLIN | EPOLLOUT;
+          }
+          if (events & EPOLLIN) {
+              wakeFdWaiterQueue(&fd_waiters[fd].readers);
+          }
+          if (events & EPOLLOUT) {
+              wakeFdWaiterQueue(&fd_waiters[fd].writers);
+          }
+          syncFdInterest(fd);
+      }
+
+    } while (wait && sched_state == SCHED_RUNNING
+             && emptyRunQueue(&MainCapability));
+}
+
+#endif /* USE_EPOLL */
+
+void
+removeThreadFromBlockedQueue (Capability *cap, StgTSO *tso)
+{
+#if defined(USE_EPOLL)
+    StgTSO *t;
+    int fd;
+
+    // The thread is either still on the incoming queue, or has been
+    // registered in fd_waiters[].
+    for (t = blocked_queue_hd; t != END_TSO_QUEUE; t = t->_link) {
+        if (t == tso) break;
+    }
+
+    if (t == END_TSO_QUEUE) {
+        fd = (int)tso->block_info.fd;
+        ASSERT(fd >= 0 && fd < fd_waiters_size);
+        if (tso->why_blocked == BlockedOnRead) {
+            removeThreadFromQueue(cap, &fd_waiters[fd].readers, tso);
+        } else {
+            removeThreadFromQueue(cap, &fd_waiters[fd].writers, tso);
+        }
+        n_fd_waiters--;
+        syncFdInterest(fd);
+        return;
+    }
+#endif
+    removeThreadFromDeQueue(cap, &blocked_queue_hd, &blocked_queue_tl, tso);
+}
+
+void
+markFdWaiters (evac_fn evac USED_IF_EPOLL, void *user USED_IF_EPOLL)
+{
+#if defined(USE_EPOLL)
+    int fd;
+
+    if (n_fd_waiters == 0) {
+        return;
+    }
+    for (fd = 0; fd < fd_waiters_size; fd++) {
+        evac(user, (StgClosure **)(void *)&fd_waiters[fd].readers);
+        evac(user, (StgClosure **)(void *)&fd_waiters[fd].writers);
+    }
+#endif
+}
+
+void
+resetAwaitEventAfterFork (void)
+{
+#if defined(USE_EPOLL)
+    int fd;
+
+    // The epoll instance is shared with the parent: drop our reference
+    // to it without touching its interest set, and register afresh.
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    for (fd = 0; fd < fd_waiters_size; fd++) {
+        fd_waiters[fd].events = 0;
+    }
+#endif
+}
+
 /* Argument 'wait' says whether to wait for I/O to become available,
  * or whether to just check and return immediately.  If there are
  * other threads ready to run, we normally do the non-waiting variety,
@@ -133,8 +603,8 @@ fdOutOfRange (int fd)
  * not write handles.
  *
  */
-void
-awaitEvent(rtsBool wait)
+static void
+awaitEventSelect(rtsBool wait)
 {
     StgTSO *tso, *prev, *next;
     rtsBool ready;
@@ -144,7 +614,7 @@ awaitEvent(rtsBool wait)
     rtsBool select_succeeded = rtsTrue;
     rtsBool unblock_all = rtsFalse;
     struct timeval tv, *ptv;
-    LowResTime now;
+    Time now, due;
 
     IF_DEBUG(scheduler,
 	     debugBelch("scheduler: checking for threads blocked on I/O");
@@ -161,7 +631,7 @@ awaitEvent(rtsBool wait)
      */
     do {
 
-      now = getLowResTimeOfDay();
+      now = getSleepTime();
       if (wakeUpSleepingThreads(now)) {
 	  return;
       }
@@ -212,10 +682,12 @@ awaitEvent(rtsBool wait)
           tv.tv_sec  = 0;
           tv.tv_usec = 0;
           ptv = &tv;
-      } else if (sleeping_queue != END_TSO_QUEUE) {
-          Time min = LowResTimeToTime(sleeping_queue->block_info.target - now);
-          tv.tv_sec  = TimeToSeconds(min);
-          tv.tv_usec = TimeToUS(min) % 1000000;
+      } else if ((due = nextSleeperDue(now)) >= 0) {
+          // round up to the next microsecond, so that we don't
+          // wake up early and spin
+          StgWord64 us = TimeToUS(due) + (due % USToTime(1) != 0);
+          tv.tv_sec  = us / 1000000;
+          tv.tv_usec = us % 1000000;
           ptv = &tv;
       } else {
           ptv = NULL;
@@ -271,7 +743,7 @@ awaitEvent(rtsBool wait)
 	  
 	  /* check for threads that need waking up 
 	   */
-          wakeUpSleepingThreads(getLowResTimeOfDay());
+          wakeUpSleepingThreads(getSleepTime());
 
 	  /* If new runnable threads have arrived, stop waiting for
 	   * I/O and run them.
@@ -327,5 +799,17 @@ awaitEvent(rtsBool wait)
 	     && emptyRunQueue(&MainCapability));
 }
 
+void
+awaitEvent(rtsBool wait)
+{
+#if defined(USE_EPOLL)
+    if (useEpoll()) {
+        awaitEventEpoll(wait);
+        return;
+    }
+#endif
+    awaitEventSelect(wait);
+}
+
 #endif /* THREADED_RTS */
 
@@ -9,9 +9,7 @@
 #ifndef POSIX_SELECT_H
 #define POSIX_SELECT_H
 
-// An absolute time value in units of 10ms.
-typedef StgWord LowResTime;
-
-RTS_PRIVATE LowResTime getDelayTarget (HsInt us);
+// Called from stg_delayzh (PrimOps.cmm)
+RTS_PRIVATE void addSleepingThread (StgTSO *tso, HsInt us);
 
 #endif /* POSIX_SELECT_H */
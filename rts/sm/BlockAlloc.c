@@ -22,10 +22,12 @@
 #include "RtsUtils.h"
 #include "BlockAlloc.h"
 #include "OSMem.h"
+#include "Capability.h"
+#include "GetTime.h"
 
 #include <string.h>
 
-static void  initMBlock(void *mblock);
+static void  initMBlock(void *mblock, nat node);
 
 /* -----------------------------------------------------------------------------
 
@@ -117,6 +119,32 @@ static void  initMBlock(void *mblock);
 
   checkFreeListSanity() checks all the invariants on the free lists.
 
+  NUMA
+  ~~~~
+
+  With --numa, each NUMA node has its own set of free lists, and
+  every mblock is tagged with the node it was allocated on (bd->node,
+  which is set for every bdescr in the mblock by initMBlock()).  Since
+  coalescing never crosses an mblock boundary except in the
+  free_mblock_list, and each node has its own free_mblock_list, a free
+  group always goes back to the lists of the node it came from.
+  allocGroupOnNode() and friends allocate from a particular node;
+  allocGroup() and friends allocate from node 0.  Without --numa
+  there is only one node, and everything is allocated from node 0.
+
+  Released memory
+  ~~~~~~~~~~~~~~~
+
+  A free group may have had its memory given back to the OS by
+  decayFreeMemory() (see below), which leaves it on the free list with
+  BF_RELEASED set in its head.  Nothing else needs to know: when the
+  group is allocated, its pages come back as zeroes the first time
+  they are touched.  The flags are cleared when a group is freed, and
+  when two free groups are merged the result only keeps the flags that
+  both had (merge_free_flags()).  The one exception is the slop of an
+  mblock that allocGroup() splits: it goes straight back on the free
+  list untouched, so it keeps BF_RELEASED if the mblock had it.
+
   --------------------------------------------------------------------------- */
 
 /* ---------------------------------------------------------------------------
@@ -133,8 +161,8 @@ static void  initMBlock(void *mblock);
 
 // In THREADED_RTS mode, the free list is protected by sm_mutex.
 
-static bdescr *free_list[MAX_FREE_LIST];
-static bdescr *free_mblock_list;
+static bdescr *free_list[MAX_NUMA_NODES][MAX_FREE_LIST];
+static bdescr *free_mblock_list[MAX_NUMA_NODES];
 
 // free_list[i] contains blocks that are at least size 2^i, and at
 // most size 2^(i+1) - 1.  
@@ -151,11 +179,13 @@ W_ hw_alloc_blocks;  // high-water allocated blocks
 
 void initBlockAllocator(void)
 {
-    nat i;
-    for (i=0; i < MAX_FREE_LIST; i++) {
-        free_list[i] = NULL;
+    nat i, node;
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        for (i=0; i < MAX_FREE_LIST; i++) {
+            free_list[node][i] = NULL;
+        }
+        free_mblock_list[node] = NULL;
     }
-    free_mblock_list = NULL;
     n_alloc_blocks = 0;
     hw_alloc_blocks = 0;
 }
@@ -173,6 +203,7 @@ initGroup(bdescr *head)
   n = head->blocks;
   head->free   = head->start;
   head->link   = NULL;
+  head->flags &= ~(BF_IDLE | BF_RELEASED);
   for (i=1, bd = head+1; i < n; i++, bd++) {
       bd->free = 0;
       bd->blocks = 0;
@@ -208,17 +239,26 @@ log_2(W_ n)
 }
 
 STATIC_INLINE void
-free_list_insert (bdescr *bd)
+free_list_insert (nat node, bdescr *bd)
 {
     nat ln;
 
     ASSERT(bd->blocks < BLOCKS_PER_MBLOCK);
     ln = log_2(bd->blocks);
     
-    dbl_link_onto(bd, &free_list[ln]);
+    dbl_link_onto(bd, &free_list[node][ln]);
 }
 
 
+// The flags that say how long a free group has been free, and whether
+// its memory has been released, only hold for a merged group if they
+// held for both parts.
+STATIC_INLINE void
+merge_free_flags (bdescr *into, bdescr *from)
+{
+    into->flags &= from->flags | ~(BF_IDLE | BF_RELEASED);
+}
+
 STATIC_INLINE bdescr *
 tail_of (bdescr *bd)
 {
@@ -244,23 +284,23 @@ setup_tail (bdescr *bd)
 // Take a free block group bd, and split off a group of size n from
 // it.  Adjust the free list as necessary, and return the new group.
 static bdescr *
-split_free_block (bdescr *bd, W_ n, nat ln)
+split_free_block (bdescr *bd, nat node, W_ n, nat ln)
 {
     bdescr *fg; // free group
 
     ASSERT(bd->blocks > n);
-    dbl_link_remove(bd, &free_list[ln]);
+    dbl_link_remove(bd, &free_list[node][ln]);
     fg = bd + bd->blocks - n; // take n blocks off the end
     fg->blocks = n;
     bd->blocks -= n;
     setup_tail(bd);
     ln = log_2(bd->blocks);
-    dbl_link_onto(bd, &free_list[ln]);
+    dbl_link_onto(bd, &free_list[node][ln]);
     return fg;
 }
 
 static bdescr *
-alloc_mega_group (nat mblocks)
+alloc_mega_group (nat node, nat mblocks)
 {
     bdescr *best, *bd, *prev;
     nat n;
@@ -269,16 +309,18 @@ alloc_mega_group (nat mblocks)
 
     best = NULL;
     prev = NULL;
-    for (bd = free_mblock_list; bd != NULL; prev = bd, bd = bd->link)
+    for (bd = free_mblock_list[node]; bd != NULL; prev = bd, bd = bd->link)
     {
         if (bd->blocks == n) 
         {
+            StgWord16 released = bd->flags & BF_RELEASED;
             if (prev) {
                 prev->link = bd->link;
             } else {
-                free_mblock_list = bd->link;
+                free_mblock_list[node] = bd->link;
             }
             initGroup(bd);
+            bd->flags |= released;
             return bd;
         }
         else if (bd->blocks > n)
@@ -298,25 +340,29 @@ alloc_mega_group (nat mblocks)
                           (best_mblocks-mblocks)*MBLOCK_SIZE);
 
         best->blocks = MBLOCK_GROUP_BLOCKS(best_mblocks - mblocks);
-        initMBlock(MBLOCK_ROUND_DOWN(bd));
+        initMBlock(MBLOCK_ROUND_DOWN(bd), node);
+        bd->flags = (bd->flags & ~BF_RELEASED) | (best->flags & BF_RELEASED);
     }
     else
     {
-        void *mblock = getMBlocks(mblocks);
-        initMBlock(mblock);		// only need to init the 1st one
+        void *mblock = getMBlocksOnNode(node, mblocks);
+        initMBlock(mblock, node);	// only need to init the 1st one
         bd = FIRST_BDESCR(mblock);
+        bd->flags &= ~BF_RELEASED;
     }
     bd->blocks = MBLOCK_GROUP_BLOCKS(mblocks);
     return bd;
 }
 
 bdescr *
-allocGroup (W_ n)
+allocGroupOnNode (nat node, W_ n)
 {
     bdescr *bd, *rem;
     nat ln;
+    StgWord16 released;
 
     if (n == 0) barf("allocGroup: requested zero blocks");
+    ASSERT(node < n_numa_nodes);
     
     if (n >= BLOCKS_PER_MBLOCK)
     {
@@ -329,7 +375,7 @@ allocGroup (W_ n)
         n_alloc_blocks += mblocks * BLOCKS_PER_MBLOCK;
         if (n_alloc_blocks > hw_alloc_blocks) hw_alloc_blocks = n_alloc_blocks;
 
-        bd = alloc_mega_group(mblocks);
+        bd = alloc_mega_group(node, mblocks);
         // only the bdescrs of the first MB are required to be initialised
         initGroup(bd);
         goto finish;
@@ -340,7 +386,7 @@ allocGroup (W_ n)
 
     ln = log_2_ceil(n);
 
-    while (ln < MAX_FREE_LIST && free_list[ln] == NULL) {
+    while (ln < MAX_FREE_LIST && free_list[node][ln] == NULL) {
         ln++;
     }
 
@@ -354,7 +400,8 @@ allocGroup (W_ n)
         }
 #endif
 
-        bd = alloc_mega_group(1);
+        bd = alloc_mega_group(node, 1);
+        released = bd->flags & BF_RELEASED;
         bd->blocks = n;
         initGroup(bd);		         // we know the group will fit
         rem = bd + n;
@@ -362,19 +409,22 @@ allocGroup (W_ n)
         initGroup(rem); // init the slop
         n_alloc_blocks += rem->blocks;
         freeGroup(rem);      	         // add the slop on to the free list
+        // freeGroup() clears BF_RELEASED, but if the mblock had been
+        // released, the slop still hasn't been touched since.
+        rem->flags |= released;
         goto finish;
     }
 
-    bd = free_list[ln];
+    bd = free_list[node][ln];
 
     if (bd->blocks == n)	        // exactly the right size!
     {
-        dbl_link_remove(bd, &free_list[ln]);
+        dbl_link_remove(bd, &free_list[node][ln]);
         initGroup(bd);
     }
     else if (bd->blocks >  n)            // block too big...
     {                              
-        bd = split_free_block(bd, n, ln);
+        bd = split_free_block(bd, node, n, ln);
         ASSERT(bd->blocks == n);
         initGroup(bd);
     }
@@ -406,34 +456,34 @@ finish:
 // preferably if there are any.
 //
 bdescr *
-allocLargeChunk (W_ min, W_ max)
+allocLargeChunkOnNode (nat node, W_ min, W_ max)
 {
     bdescr *bd;
     nat ln, lnmax;
 
     if (min >= BLOCKS_PER_MBLOCK) {
-        return allocGroup(max);
+        return allocGroupOnNode(node,max);
     }
 
     ln = log_2_ceil(min);
     lnmax = log_2_ceil(max); // tops out at MAX_FREE_LIST
 
-    while (ln < lnmax && free_list[ln] == NULL) {
+    while (ln < lnmax && free_list[node][ln] == NULL) {
         ln++;
     }
     if (ln == lnmax) {
-        return allocGroup(max);
+        return allocGroupOnNode(node,max);
     }
-    bd = free_list[ln];
+    bd = free_list[node][ln];
 
     if (bd->blocks <= max)              // exactly the right size!
     {
-        dbl_link_remove(bd, &free_list[ln]);
+        dbl_link_remove(bd, &free_list[node][ln]);
         initGroup(bd);
     }
     else   // block too big...
     {                              
-        bd = split_free_block(bd, max, ln);
+        bd = split_free_block(bd, node, max, ln);
         ASSERT(bd->blocks == max);
         initGroup(bd);
     }
@@ -446,6 +496,18 @@ allocLargeChunk (W_ min, W_ max)
     return bd;
 }
 
+bdescr *
+allocLargeChunk (W_ min, W_ max)
+{
+    return allocLargeChunkOnNode(0, min, max);
+}
+
+bdescr *
+allocGroup (W_ n)
+{
+    return allocGroupOnNode(0, n);
+}
+
 bdescr *
 allocGroup_lock(W_ n)
 {
@@ -472,6 +534,155 @@ allocBlock_lock(void)
     return bd;
 }
 
+bdescr *
+allocGroupOnNode_lock(nat node, W_ n)
+{
+    bdescr *bd;
+    ACQUIRE_SM_LOCK;
+    bd = allocGroupOnNode(node,n);
+    RELEASE_SM_LOCK;
+    return bd;
+}
+
+bdescr *
+allocBlockOnNode(nat node)
+{
+    return allocGroupOnNode(node,1);
+}
+
+bdescr *
+allocBlockOnNode_lock(nat node)
+{
+    bdescr *bd;
+    ACQUIRE_SM_LOCK;
+    bd = allocBlockOnNode(node);
+    RELEASE_SM_LOCK;
+    return bd;
+}
+
+/* -----------------------------------------------------------------------------
+   Block caches
+
+   Each Capability keeps a small cache of free block groups of
+   1..BLOCK_CACHE_CLASSES blocks (cap->block_cache[n-1] holds groups
+   of exactly n blocks, linked through bd->link).  The hot allocation
+   paths in the mutator (allocate(), allocatePinned(), extending the
+   nursery for a large heap check) and in the GC (allocBlock_sync())
+   take their blocks from the cache without any locking, because only
+   the owner of the Capability touches it.  When a cache is empty we
+   take the global lock once and refill it with BLOCK_CACHE_BATCH
+   blocks' worth of groups, carved out of a single contiguous group
+   from the Capability's NUMA node.
+
+   From the point of view of the block allocator, cached blocks are
+   allocated (they are counted in n_alloc_blocks), so memInventory()
+   counts them separately.  The caches are flushed back to the free
+   lists by the GC, so they never hold on to more than a few blocks per
+   Capability for long, and the cached groups get a chance to coalesce.
+   -------------------------------------------------------------------------- */
+
+// Fast path: take a group of n blocks from the cache, or return NULL.
+// The caller must own cap, but need not hold any lock.
+bdescr *
+allocGroupFromCache (Capability *cap, W_ n)
+{
+    bdescr *bd;
+
+    if (n == 0 || n > BLOCK_CACHE_CLASSES) return NULL;
+
+    bd = cap->block_cache[n-1];
+    if (bd != NULL) {
+        cap->block_cache[n-1] = bd->link;
+        bd->link = NULL;
+        IF_DEBUG(sanity, memset(bd->start, 0xaa, bd->blocks * BLOCK_SIZE));
+    }
+    return bd;
+}
+
+// Slow path: refill the cache for groups of n blocks and return one of
+// them.  The caller must own cap and hold the lock that protects the
+// block allocator (sm_mutex, or gc_alloc_block_sync during GC).
+bdescr *
+allocGroupRefillCache (Capability *cap, W_ n)
+{
+    bdescr *bd, *hd;
+    W_ i, count;
+
+    if (n == 0 || n > BLOCK_CACHE_CLASSES) {
+        return allocGroupOnNode(cap->node, n);
+    }
+
+    count = stg_max(1, BLOCK_CACHE_BATCH / n);
+    bd = allocGroupOnNode(cap->node, count * n);
+
+    // Split the group into count groups of n blocks.  We return the
+    // first and cache the rest.
+    ASSERT(bd->blocks == count * n);
+    for (i = count - 1; i > 0; i--) {
+        hd = bd + i * n;
+        hd->blocks = n;
+        initGroup(hd);
+        hd->link = cap->block_cache[n-1];
+        cap->block_cache[n-1] = hd;
+    }
+    bd->blocks = n;
+    initGroup(bd);
+    return bd;
+}
+
+bdescr *
+allocGroupOnCap_lock (Capability *cap, W_ n)
+{
+    bdescr *bd;
+
+    bd = allocGroupFromCache(cap, n);
+    if (bd == NULL) {
+        ACQUIRE_SM_LOCK;
+        bd = allocGroupRefillCache(cap, n);
+        RELEASE_SM_LOCK;
+    }
+    return bd;
+}
+
+bdescr *
+allocBlockOnCap_lock (Capability *cap)
+{
+    return allocGroupOnCap_lock(cap, 1);
+}
+
+// Return the contents of all the caches to the free lists.  Called
+// during GC, when we own all the Capabilities.
+void
+flushBlockCaches (void)
+{
+    nat i, c;
+    bdescr *bd, *next;
+
+    for (i = 0; i < n_capabilities; i++) {
+        for (c = 0; c < BLOCK_CACHE_CLASSES; c++) {
+            for (bd = capabilities[i]->block_cache[c]; bd != NULL; bd = next) {
+                next = bd->link;
+                freeGroup(bd);
+            }
+            capabilities[i]->block_cache[c] = NULL;
+        }
+    }
+}
+
+W_
+countBlockCaches (void)
+{
+    nat i, c;
+    W_ n = 0;
+
+    for (i = 0; i < n_capabilities; i++) {
+        for (c = 0; c < BLOCK_CACHE_CLASSES; c++) {
+            n += countBlocks(capabilities[i]->block_cache[c]);
+        }
+    }
+    return n;
+}
+
 /* -----------------------------------------------------------------------------
    De-Allocation
    -------------------------------------------------------------------------- */
@@ -490,6 +701,7 @@ coalesce_mblocks (bdescr *p)
         p->blocks  = MBLOCK_GROUP_BLOCKS(BLOCKS_TO_MBLOCKS(p->blocks) +
                                          BLOCKS_TO_MBLOCKS(q->blocks));
         p->link = q->link;
+        merge_free_flags(p, q);
         return p;
     }
     return q;
@@ -499,11 +711,13 @@ static void
 free_mega_group (bdescr *mg)
 {
     bdescr *bd, *prev;
+    nat node;
 
     // Find the right place in the free list.  free_mblock_list is
     // sorted by *address*, not by size as the free_list is.
     prev = NULL;
-    bd = free_mblock_list;
+    node = mg->node;
+    bd = free_mblock_list[node];
     while (bd && bd->start < mg->start) {
         prev = bd;
         bd = bd->link;
@@ -518,8 +732,8 @@ free_mega_group (bdescr *mg)
     }
     else
     {
-        mg->link = free_mblock_list;
-        free_mblock_list = mg;
+        mg->link = free_mblock_list[node];
+        free_mblock_list[node] = mg;
     }
     // coalesce forwards
     coalesce_mblocks(mg);
@@ -531,7 +745,7 @@ free_mega_group (bdescr *mg)
 void
 freeGroup(bdescr *p)
 {
-  nat ln;
+  nat ln, node;
 
   // Todo: not true in multithreaded GC
   // ASSERT_SM_LOCK();
@@ -541,11 +755,14 @@ freeGroup(bdescr *p)
   p->free = (void *)-1;  /* indicates that this block is free */
   p->gen = NULL;
   p->gen_no = 0;
+  p->flags &= ~(BF_IDLE | BF_RELEASED);
   /* fill the block group with garbage if sanity checking is on */
   IF_DEBUG(sanity,memset(p->start, 0xaa, (W_)p->blocks * BLOCK_SIZE));
 
   if (p->blocks == 0) barf("freeGroup: block size is zero");
 
+  node = p->node;
+
   if (p->blocks >= BLOCKS_PER_MBLOCK)
   {
       nat mblocks;
@@ -571,7 +788,7 @@ freeGroup(bdescr *p)
       {
           p->blocks += next->blocks;
           ln = log_2(next->blocks);
-          dbl_link_remove(next, &free_list[ln]);
+          dbl_link_remove(next, &free_list[node][ln]);
           if (p->blocks == BLOCKS_PER_MBLOCK)
           {
               free_mega_group(p);
@@ -591,8 +808,9 @@ freeGroup(bdescr *p)
       if (prev->free == (P_)-1)
       {
           ln = log_2(prev->blocks);
-          dbl_link_remove(prev, &free_list[ln]);
+          dbl_link_remove(prev, &free_list[node][ln]);
           prev->blocks += p->blocks;
+          merge_free_flags(prev, p);
           if (prev->blocks >= BLOCKS_PER_MBLOCK)
           {
               free_mega_group(prev);
@@ -603,7 +821,7 @@ freeGroup(bdescr *p)
   }
       
   setup_tail(p);
-  free_list_insert(p);
+  free_list_insert(node,p);
 
   IF_DEBUG(sanity, checkFreeListSanity());
 }
@@ -636,7 +854,7 @@ freeChain_lock(bdescr *bd)
 }
 
 static void
-initMBlock(void *mblock)
+initMBlock(void *mblock, nat node)
 {
     bdescr *bd;
     StgWord8 *block;
@@ -652,6 +870,7 @@ initMBlock(void *mblock)
     for (; block <= (StgWord8*)LAST_BLOCK(mblock); bd += 1, 
              block += BLOCK_SIZE) {
         bd->start = (void*)block;
+        bd->node = node;
     }
 }
 
@@ -691,28 +910,32 @@ countAllocdBlocks(bdescr *bd)
 
 void returnMemoryToOS(nat n /* megablocks */)
 {
-    static bdescr *bd;
+    bdescr *bd;
+    nat node;
     nat size;
 
-    bd = free_mblock_list;
-    while ((n > 0) && (bd != NULL)) {
-        size = BLOCKS_TO_MBLOCKS(bd->blocks);
-        if (size > n) {
-            nat newSize = size - n;
-            char *freeAddr = MBLOCK_ROUND_DOWN(bd->start);
-            freeAddr += newSize * MBLOCK_SIZE;
-            bd->blocks = MBLOCK_GROUP_BLOCKS(newSize);
-            freeMBlocks(freeAddr, n);
-            n = 0;
-        }
-        else {
-            char *freeAddr = MBLOCK_ROUND_DOWN(bd->start);
-            n -= size;
-            bd = bd->link;
-            freeMBlocks(freeAddr, size);
+    // ToDo: not fair, we free all the memory starting with node 0.
+    for (node = 0; n > 0 && node < n_numa_nodes; node++) {
+        bd = free_mblock_list[node];
+        while ((n > 0) && (bd != NULL)) {
+            size = BLOCKS_TO_MBLOCKS(bd->blocks);
+            if (size > n) {
+                nat newSize = size - n;
+                char *freeAddr = MBLOCK_ROUND_DOWN(bd->start);
+                freeAddr += newSize * MBLOCK_SIZE;
+                bd->blocks = MBLOCK_GROUP_BLOCKS(newSize);
+                freeMBlocks(freeAddr, n);
+                n = 0;
+            }
+            else {
+                char *freeAddr = MBLOCK_ROUND_DOWN(bd->start);
+                n -= size;
+                bd = bd->link;
+                freeMBlocks(freeAddr, size);
+            }
         }
+        free_mblock_list[node] = bd;
     }
-    free_mblock_list = bd;
 
     osReleaseFreeMemory();
 
@@ -724,6 +947,116 @@ void returnMemoryToOS(nat n /* megablocks */)
     );
 }
 
+/* -----------------------------------------------------------------------------
+   Giving free memory back to the OS gradually (see --release-delay)
+
+   returnMemoryToOS() only frees whole free mblocks, after a major GC,
+   and keeps several times the live data in reserve, so after a spike
+   in heap size the free lists can go on holding most of the peak for
+   ever.  decayFreeMemory() hands the pages of free groups that nobody
+   has wanted for a while back to the OS, without unmapping them
+   (osDiscardMemory()), so it works on a group of any size down to a
+   block; only the bdescrs at the start of each mblock are kept.
+
+   "For a while" is tracked with BF_IDLE.  decayFreeMemory() looks at
+   the free lists at most once per releaseDelay: it releases the groups
+   that are marked BF_IDLE, which have been free since it last looked,
+   and marks the others.  So a group is released after it has been free
+   for between one and two delays (or a little longer, since we only
+   look after a GC).
+
+   The idle GC calls decayFreeMemory() with idle == rtsTrue, which
+   releases every free group at once: an idle program doesn't need the
+   memory, and the ticker stops after an idle GC, so there may not be
+   another GC to do it later.
+   -------------------------------------------------------------------------- */
+
+static Time last_decay = 0;
+static StgWord64 total_released_bytes = 0;
+
+// The memory of a free mega group, apart from the bdescrs
+STATIC_INLINE W_
+mega_group_bytes (bdescr *bd)
+{
+    return (W_)BLOCKS_TO_MBLOCKS(bd->blocks) * MBLOCK_SIZE
+        - ((StgWord8 *)bd->start - (StgWord8 *)MBLOCK_ROUND_DOWN(bd));
+}
+
+static void
+decay_group (bdescr *bd, W_ size, rtsBool idle)
+{
+    if (bd->flags & BF_RELEASED) {
+        return;
+    }
+    if (idle || (bd->flags & BF_IDLE)) {
+        if (osDiscardMemory(bd->start, size)) {
+            bd->flags |= BF_RELEASED;
+            total_released_bytes += size;
+        }
+    } else {
+        bd->flags |= BF_IDLE;
+    }
+}
+
+// Called with the block allocator locked
+void
+decayFreeMemory (rtsBool idle)
+{
+    bdescr *bd;
+    nat ln, node;
+    Time now;
+
+    if (RtsFlags.GcFlags.releaseDelay == 0) {
+        return;
+    }
+
+    now = getProcessElapsedTime();
+    if (!idle && now - last_decay < RtsFlags.GcFlags.releaseDelay) {
+        return;
+    }
+    last_decay = now;
+
+    for (node = 0; node < n_numa_nodes; node++) {
+        for (ln = 0; ln < MAX_FREE_LIST; ln++) {
+            for (bd = free_list[node][ln]; bd != NULL; bd = bd->link) {
+                decay_group(bd, (W_)bd->blocks * BLOCK_SIZE, idle);
+            }
+        }
+        for (bd = free_mblock_list[node]; bd != NULL; bd = bd->link) {
+            decay_group(bd, mega_group_bytes(bd), idle);
+        }
+    }
+}
+
+// For the stats: the free memory on the free lists, how much of it has
+// been given back to the OS, and how much has been given back in all
+// (counting memory that has since been allocated again).
+void
+freeMemoryStats (W_ *free_bytes, W_ *released_bytes, StgWord64 *total)
+{
+    bdescr *bd;
+    nat ln, node;
+    W_ size;
+
+    *free_bytes = 0;
+    *released_bytes = 0;
+    for (node = 0; node < n_numa_nodes; node++) {
+        for (ln = 0; ln < MAX_FREE_LIST; ln++) {
+            for (bd = free_list[node][ln]; bd != NULL; bd = bd->link) {
+                size = (W_)bd->blocks * BLOCK_SIZE;
+                *free_bytes += size;
+                if (bd->flags & BF_RELEASED) *released_bytes += size;
+            }
+        }
+        for (bd = free_mblock_list[node]; bd != NULL; bd = bd->link) {
+            size = mega_group_bytes(bd);
+            *free_bytes += size;
+            if (bd->flags & BF_RELEASED) *released_bytes += size;
+        }
+    }
+    *total = total_released_bytes;
+}
+
 /* -----------------------------------------------------------------------------
    Debugging
    -------------------------------------------------------------------------- */
@@ -747,67 +1080,72 @@ checkFreeListSanity(void)
 {
     bdescr *bd, *prev;
     nat ln, min;
+    nat node;
 
-
-    min = 1;
-    for (ln = 0; ln < MAX_FREE_LIST; ln++) {
-        IF_DEBUG(block_alloc, debugBelch("free block list [%d]:\n", ln));
-
-        prev = NULL;
-        for (bd = free_list[ln]; bd != NULL; prev = bd, bd = bd->link)
-        {
+    for (node = 0; node < n_numa_nodes; node++) {
+        min = 1;
+        for (ln = 0; ln < MAX_FREE_LIST; ln++) {
             IF_DEBUG(block_alloc,
-                     debugBelch("group at %p, length %ld blocks\n", 
-                                bd->start, (long)bd->blocks));
-            ASSERT(bd->free == (P_)-1);
-            ASSERT(bd->blocks > 0 && bd->blocks < BLOCKS_PER_MBLOCK);
-            ASSERT(bd->blocks >= min && bd->blocks <= (min*2 - 1));
-            ASSERT(bd->link != bd); // catch easy loops
-
-            check_tail(bd);
-
-            if (prev)
-                ASSERT(bd->u.back == prev);
-            else 
-                ASSERT(bd->u.back == NULL);
+                     debugBelch("free block list [%d][%d]:\n", node, ln));
 
+            prev = NULL;
+            for (bd = free_list[node][ln]; bd != NULL; prev = bd, bd = bd->link)
             {
-                bdescr *next;
-                next = bd + bd->blocks;
-                if (next <= LAST_BDESCR(MBLOCK_ROUND_DOWN(bd)))
+                IF_DEBUG(block_alloc,
+                         debugBelch("group at %p, length %ld blocks\n",
+                                    bd->start, (long)bd->blocks));
+                ASSERT(bd->free == (P_)-1);
+                ASSERT(bd->blocks > 0 && bd->blocks < BLOCKS_PER_MBLOCK);
+                ASSERT(bd->blocks >= min && bd->blocks <= (min*2 - 1));
+                ASSERT(bd->link != bd); // catch easy loops
+                ASSERT(bd->node == node);
+
+                check_tail(bd);
+
+                if (prev)
+                    ASSERT(bd->u.back == prev);
+                else
+                    ASSERT(bd->u.back == NULL);
+
                 {
-                    ASSERT(next->free != (P_)-1);
+                    bdescr *next;
+                    next = bd + bd->blocks;
+                    if (next <= LAST_BDESCR(MBLOCK_ROUND_DOWN(bd)))
+                    {
+                        ASSERT(next->free != (P_)-1);
+                    }
                 }
             }
+            min = min << 1;
         }
-        min = min << 1;
-    }
 
-    prev = NULL;
-    for (bd = free_mblock_list; bd != NULL; prev = bd, bd = bd->link)
-    {
-        IF_DEBUG(block_alloc,
-                 debugBelch("mega group at %p, length %ld blocks\n", 
-                            bd->start, (long)bd->blocks));
+        prev = NULL;
+        for (bd = free_mblock_list[node]; bd != NULL; prev = bd, bd = bd->link)
+        {
+            IF_DEBUG(block_alloc,
+                     debugBelch("mega group at %p, length %ld blocks\n",
+                                bd->start, (long)bd->blocks));
 
-        ASSERT(bd->link != bd); // catch easy loops
+            ASSERT(bd->link != bd); // catch easy loops
+            ASSERT(bd->node == node);
 
-        if (bd->link != NULL)
-        {
-            // make sure the list is sorted
-            ASSERT(bd->start < bd->link->start);
-        }
+            if (bd->link != NULL)
+            {
+                // make sure the list is sorted
+                ASSERT(bd->start < bd->link->start);
+            }
 
-        ASSERT(bd->blocks >= BLOCKS_PER_MBLOCK);
-        ASSERT(MBLOCK_GROUP_BLOCKS(BLOCKS_TO_MBLOCKS(bd->blocks))
-               == bd->blocks);
+            ASSERT(bd->blocks >= BLOCKS_PER_MBLOCK);
+            ASSERT(MBLOCK_GROUP_BLOCKS(BLOCKS_TO_MBLOCKS(bd->blocks))
+                   == bd->blocks);
 
-        // make sure we're fully coalesced
-        if (bd->link != NULL)
-        {
-            ASSERT (MBLOCK_ROUND_DOWN(bd->link) != 
-                    (StgWord8*)MBLOCK_ROUND_DOWN(bd) + 
-                    BLOCKS_TO_MBLOCKS(bd->blocks) * MBLOCK_SIZE);
+            // make sure we're fully coalesced
+            if (bd->link != NULL)
+            {
+                ASSERT(MBLOCK_ROUND_DOWN(bd->link) !=
+                       (StgWord8*)MBLOCK_ROUND_DOWN(bd) +
+                       BLOCKS_TO_MBLOCKS(bd->blocks) * MBLOCK_SIZE);
+            }
         }
     }
 }
@@ -817,19 +1155,21 @@ countFreeList(void)
 {
   bdescr *bd;
   W_ total_blocks = 0;
-  nat ln;
+  nat ln, node;
 
-  for (ln=0; ln < MAX_FREE_LIST; ln++) {
-      for (bd = free_list[ln]; bd != NULL; bd = bd->link) {
-          total_blocks += bd->blocks;
+  for (node = 0; node < n_numa_nodes; node++) {
+      for (ln=0; ln < MAX_FREE_LIST; ln++) {
+          for (bd = free_list[node][ln]; bd != NULL; bd = bd->link) {
+              total_blocks += bd->blocks;
+          }
+      }
+      for (bd = free_mblock_list[node]; bd != NULL; bd = bd->link) {
+          total_blocks += BLOCKS_PER_MBLOCK * BLOCKS_TO_MBLOCKS(bd->blocks);
+          // The caller of this function, memInventory(), expects to match
+          // the total number of blocks in the system against mblocks *
+          // BLOCKS_PER_MBLOCK, so we must subtract the space for the
+          // block descriptors from *every* mblock.
       }
-  }
-  for (bd = free_mblock_list; bd != NULL; bd = bd->link) {
-      total_blocks += BLOCKS_PER_MBLOCK * BLOCKS_TO_MBLOCKS(bd->blocks);
-      // The caller of this function, memInventory(), expects to match
-      // the total number of blocks in the system against mblocks *
-      // BLOCKS_PER_MBLOCK, so we must subtract the space for the
-      // block descriptors from *every* mblock.
   }
   return total_blocks;
 }
@@ -842,6 +1182,18 @@ markBlocks (bdescr *bd)
     }
 }
 
+void
+markBlockCaches (void)
+{
+    nat i, c;
+
+    for (i = 0; i < n_capabilities; i++) {
+        for (c = 0; c < BLOCK_CACHE_CLASSES; c++) {
+            markBlocks(capabilities[i]->block_cache[c]);
+        }
+    }
+}
+
 void
 reportUnmarkedBlocks (void)
 {
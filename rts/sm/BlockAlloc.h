@@ -12,6 +12,22 @@
 #include "BeginPrivate.h"
 
 bdescr *allocLargeChunk (W_ min, W_ max);
+bdescr *allocLargeChunkOnNode (nat node, W_ min, W_ max);
+
+/* Per-Capability block caches --------------------------------------------- */
+
+// Groups of 1..BLOCK_CACHE_CLASSES blocks are cached per Capability
+#define BLOCK_CACHE_CLASSES 4
+
+// Number of blocks we take from the global allocator per refill
+#define BLOCK_CACHE_BATCH   16
+
+bdescr *allocGroupFromCache  (Capability *cap, W_ n);
+bdescr *allocGroupRefillCache(Capability *cap, W_ n);
+bdescr *allocGroupOnCap_lock (Capability *cap, W_ n);
+bdescr *allocBlockOnCap_lock (Capability *cap);
+void    flushBlockCaches     (void);
+W_      countBlockCaches     (void);
 
 /* Debugging  -------------------------------------------------------------- */
 
@@ -19,10 +35,14 @@ extern W_ countBlocks       (bdescr *bd);
 extern W_ countAllocdBlocks (bdescr *bd);
 extern void returnMemoryToOS(nat n);
 
+void decayFreeMemory (rtsBool idle);
+void freeMemoryStats (W_ *free_bytes, W_ *released_bytes, StgWord64 *total);
+
 #ifdef DEBUG
 void checkFreeListSanity(void);
 W_   countFreeList(void);
 void markBlocks (bdescr *bd);
+void markBlockCaches (void);
 void reportUnmarkedBlocks (void);
 #endif
 
@@ -69,6 +69,36 @@
    if we throw away some of the tags).
    ------------------------------------------------------------------------- */
 
+#if defined(THREADED_RTS)
+// rtsTrue while several GC threads are threading the heap at once
+// (see par_compact()).
+static rtsBool par_threading = rtsFalse;
+
+// thread() for when other GC threads may be adding fields to the
+// same chain: the field is filled in first, and then put at the
+// head of the chain with a CAS on the info pointer of q.
+STATIC_INLINE void
+thread_par (StgClosure **p, StgClosure *q0, StgPtr q)
+{
+    StgWord iptr, head;
+
+    do {
+        iptr = *(StgVolatilePtr)q;
+        switch (GET_CLOSURE_TAG((StgClosure *)iptr))
+        {
+        case 0:
+            *p = (StgClosure *)((StgWord)iptr + GET_CLOSURE_TAG(q0));
+            head = (StgWord)p + 1;
+            break;
+        default:
+            *p = (StgClosure *)iptr;
+            head = (StgWord)p + 2;
+            break;
+        }
+    } while (cas((StgVolatilePtr)q, iptr, head) != iptr);
+}
+#endif
+
 STATIC_INLINE void
 thread (StgClosure **p)
 {
@@ -89,6 +119,12 @@ thread (StgClosure **p)
 
 	if (bd->flags & BF_MARKED)
         {
+#if defined(THREADED_RTS)
+            if (par_threading) {
+                thread_par(p, q0, q);
+                return;
+            }
+#endif
             iptr = *q;
             switch (GET_CLOSURE_TAG((StgClosure *)iptr))
             {
@@ -460,12 +496,12 @@ thread_TSO (StgTSO *tso)
 
 
 static void
-update_fwd_large( bdescr *bd )
+update_fwd_large( bdescr *bd, bdescr *stop )
 {
   StgPtr p;
   const StgInfoTable* info;
 
-  for (; bd != NULL; bd = bd->link) {
+  for (; bd != stop; bd = bd->link) {
 
     // nothing to do in a pinned block; it might not even have an object
     // at the beginning.
@@ -712,7 +748,7 @@ thread_obj (StgInfoTable *info, StgPtr p)
 }
 
 static void
-update_fwd( bdescr *blocks )
+update_fwd( bdescr *blocks, bdescr *stop )
 {
     StgPtr p;
     bdescr *bd;
@@ -721,7 +757,7 @@ update_fwd( bdescr *blocks )
     bd = blocks;
 
     // cycle through all the blocks in the step
-    for (; bd != NULL; bd = bd->link) {
+    for (; bd != stop; bd = bd->link) {
 	p = bd->start;
 
 	// linearly scan the objects in this block
@@ -906,6 +942,377 @@ update_bkwd_compact( generation *gen )
     return free_blocks;
 }
 
+#if defined(THREADED_RTS)
+/* ----------------------------------------------------------------------------
+   Parallel compaction
+
+   The passes above slide the whole of the compacted generation
+   towards the start of its block list, so the destination of an
+   object depends on the size of every live object before it, and
+   only one thread can do it.  To let the GC threads share the work
+   we divide old_blocks into regions of consecutive blocks and slide
+   each region within its own blocks: the destination of an object
+   then depends only on the live objects before it in the same region.
+   The price is up to one partly-filled block at the end of each
+   region.
+
+   With regions, pointers can be threaded and unthreaded in separate
+   passes, instead of interleaving them as update_fwd_compact() and
+   update_bkwd_compact() do:
+
+     1. thread every pointer field in the heap: the objects in the
+        regions, and the rest of the heap split into chunks.  Fields
+        from different threads may be added to the same chain at
+        once, so thread() uses thread_par() during this pass.
+
+     2. for each region, work out the destination of each live object
+        and unthread it.  Every pointer to the object is on its chain
+        by now, so one unthread updates all of them.
+
+     3. for each region, slide the objects to their destinations.
+
+   Regions and chunks are handed out through a shared counter for each
+   pass, and every thread waits for the others at the end of a pass.
+   The roots have already been threaded by the main GC thread.
+   ------------------------------------------------------------------------- */
+
+// Blocks per chunk of the rest of the heap in pass 1
+#define CHUNK_BLOCKS 32
+
+// Smallest region we'll bother with; we aim for a few regions per
+// thread, to balance the load.
+#define MIN_REGION_BLOCKS 32
+#define REGIONS_PER_THREAD 4
+
+typedef struct {
+    bdescr *bd;                 // first block of the chunk
+    bdescr *stop;               // first block after the chunk
+    rtsBool large;              // a chunk of large objects
+} CompactChunk;
+
+typedef struct {
+    bdescr *first;              // first block of the region
+    bdescr *last;               // last block of the region
+    bdescr *free_bd;            // last block still in use after pass 3
+    W_      blocks;             // number of blocks still in use
+} CompactRegion;
+
+static CompactChunk  *chunks;
+static nat            n_chunks, max_chunks;
+static CompactRegion *regions;
+static nat            n_regions;
+
+static nat              compact_threads;
+static volatile rtsBool compact_running = rtsFalse;
+static volatile StgWord next_task[3];
+static volatile StgWord pass_done[3];
+
+static void
+add_chunks (bdescr *bd, rtsBool large)
+{
+    nat i;
+
+    while (bd != NULL) {
+        if (n_chunks == max_chunks) {
+            max_chunks *= 2;
+            chunks = stgReallocBytes(chunks, max_chunks * sizeof(CompactChunk),
+                                     "add_chunks");
+        }
+        chunks[n_chunks].bd = bd;
+        chunks[n_chunks].large = large;
+        for (i = 0; bd != NULL && i < CHUNK_BLOCKS; i++) {
+            bd = bd->link;
+        }
+        chunks[n_chunks].stop = bd;
+        n_chunks++;
+    }
+}
+
+static void
+make_regions (generation *gen, nat n_threads)
+{
+    bdescr *bd;
+    W_ region_blocks, n_blocks, i;
+
+    n_blocks = 0;
+    for (bd = gen->old_blocks; bd != NULL; bd = bd->link) {
+        n_blocks++;
+    }
+
+    region_blocks = stg_max(MIN_REGION_BLOCKS,
+                            n_blocks / (n_threads * REGIONS_PER_THREAD));
+
+    n_regions = (n_blocks + region_blocks - 1) / region_blocks;
+    regions = stgMallocBytes(n_regions * sizeof(CompactRegion),
+                             "make_regions");
+
+    n_regions = 0;
+    bd = gen->old_blocks;
+    while (bd != NULL) {
+        regions[n_regions].first = bd;
+        for (i = 1; i < region_blocks && bd->link != NULL; i++) {
+            bd = bd->link;
+        }
+        regions[n_regions].last = bd;
+        n_regions++;
+        bd = bd->link;
+    }
+}
+
+// Pass 1: thread the fields of the live objects in a region.  As in
+// update_fwd_compact(), the info pointer of each object is threaded,
+// so we have to go to the end of the chain to find it.
+static void
+thread_region (CompactRegion *r)
+{
+    bdescr *bd;
+    StgPtr p;
+    StgWord iptr;
+    StgInfoTable *info;
+
+    for (bd = r->first; ; bd = bd->link) {
+        p = bd->start;
+        while (p < bd->free) {
+            while (p < bd->free && !is_marked(p,bd)) {
+                p++;
+            }
+            if (p >= bd->free) {
+                break;
+            }
+            iptr = get_threaded_info(p);
+            info = INFO_PTR_TO_STRUCT((StgInfoTable *)UNTAG_CLOSURE((StgClosure *)iptr));
+            p = thread_obj(info, p);
+        }
+        if (bd == r->last) break;
+    }
+}
+
+// Pass 2: work out where each live object in a region is going, and
+// unthread it.
+static void
+unthread_region (CompactRegion *r)
+{
+    bdescr *bd, *free_bd;
+    StgPtr p, free;
+    StgWord iptr;
+    StgInfoTable *info;
+    W_ size;
+
+    free_bd = r->first;
+    free = free_bd->start;
+
+    for (bd = r->first; ; bd = bd->link) {
+        p = bd->start;
+        while (p < bd->free) {
+            while (p < bd->free && !is_marked(p,bd)) {
+                p++;
+            }
+            if (p >= bd->free) {
+                break;
+            }
+            iptr = get_threaded_info(p);
+            info = INFO_PTR_TO_STRUCT((StgInfoTable *)UNTAG_CLOSURE((StgClosure *)iptr));
+            size = closure_sizeW_((StgClosure *)p, info);
+
+            if (free + size > free_bd->start + BLOCK_SIZE_W) {
+                // as in update_fwd_compact(), tell pass 3 that this
+                // object goes into the next block.
+                mark(p+1,bd);
+                free_bd = free_bd->link;
+                free = free_bd->start;
+            } else {
+                ASSERT(!is_marked(p+1,bd));
+            }
+
+            unthread(p, (StgWord)free + GET_CLOSURE_TAG((StgClosure *)iptr));
+            free += size;
+            p += size;
+        }
+        if (bd == r->last) break;
+    }
+}
+
+// Pass 3: slide the objects in a region down to their destinations.
+static void
+slide_region (CompactRegion *r)
+{
+    bdescr *bd, *free_bd;
+    StgPtr p, free;
+    StgInfoTable *info;
+    W_ size, blocks;
+
+    free_bd = r->first;
+    free = free_bd->start;
+    blocks = 1;
+
+    for (bd = r->first; ; bd = bd->link) {
+        p = bd->start;
+        while (p < bd->free) {
+            while (p < bd->free && !is_marked(p,bd)) {
+                p++;
+            }
+            if (p >= bd->free) {
+                break;
+            }
+
+            if (is_marked(p+1,bd)) {
+                free_bd->free = free;
+                free_bd = free_bd->link;
+                free = free_bd->start;
+                blocks++;
+            }
+
+            ASSERT(LOOKS_LIKE_INFO_PTR((StgWord)((StgClosure *)p)->header.info));
+            info = get_itbl((StgClosure *)p);
+            size = closure_sizeW_((StgClosure *)p,info);
+
+            if (free != p) {
+                move(free,p,size);
+            }
+
+            // relocate TSOs
+            if (info->type == STACK) {
+                move_STACK((StgStack *)p, (StgStack *)free);
+            }
+
+            free += size;
+            p += size;
+        }
+        if (bd == r->last) break;
+    }
+
+    free_bd->free = free;
+    r->free_bd = free_bd;
+    r->blocks = blocks;
+}
+
+static void
+pass_barrier (volatile StgWord *done)
+{
+    atomic_inc(done, 1);
+    while (*done < compact_threads) {
+        busy_wait_nop();
+    }
+}
+
+static void
+compact_passes (void)
+{
+    StgWord i;
+
+    // pass 1; the regions go first because they are the biggest tasks
+    while ((i = atomic_inc(&next_task[0], 1) - 1) < n_regions + n_chunks) {
+        if (i < n_regions) {
+            thread_region(&regions[i]);
+        } else {
+            CompactChunk *c = &chunks[i - n_regions];
+            if (c->large) {
+                update_fwd_large(c->bd, c->stop);
+            } else {
+                update_fwd(c->bd, c->stop);
+            }
+        }
+    }
+    pass_barrier(&pass_done[0]);
+
+    // pass 2
+    while ((i = atomic_inc(&next_task[1], 1) - 1) < n_regions) {
+        unthread_region(&regions[i]);
+    }
+    pass_barrier(&pass_done[1]);
+
+    // pass 3
+    while ((i = atomic_inc(&next_task[2], 1) - 1) < n_regions) {
+        slide_region(&regions[i]);
+    }
+    pass_barrier(&pass_done[2]);
+}
+
+// Called by the other GC threads once wakeupCompactThreads() has
+// woken them up; returns straight away if there is nothing to do.
+void
+compactWorker (void)
+{
+    if (compact_running) {
+        compact_passes();
+    }
+}
+
+static void
+par_compact (generation *gen, nat n_threads)
+{
+    W_ g, n, blocks;
+    bdescr *prev;
+    CompactRegion *r;
+
+    make_regions(gen, n_threads);
+
+    n_chunks = 0;
+    max_chunks = 64;
+    chunks = stgMallocBytes(max_chunks * sizeof(CompactChunk), "par_compact");
+    for (g = 0; g < RtsFlags.GcFlags.generations; g++) {
+        add_chunks(generations[g].blocks, rtsFalse);
+        for (n = 0; n < n_capabilities; n++) {
+            add_chunks(gc_threads[n]->gens[g].todo_bd, rtsFalse);
+            add_chunks(gc_threads[n]->gens[g].part_list, rtsFalse);
+        }
+        add_chunks(generations[g].scavenged_large_objects, rtsTrue);
+    }
+
+    debugTrace(DEBUG_gc, "compact: %d threads, %d regions, %d chunks",
+               n_threads, n_regions, n_chunks);
+
+    compact_threads = n_threads;
+    for (n = 0; n < 3; n++) {
+        next_task[n] = 0;
+        pass_done[n] = 0;
+    }
+    par_threading = rtsTrue;
+    compact_running = rtsTrue;
+
+    wakeupCompactThreads();
+    compact_passes();
+
+    // All the other threads have finished pass 3 by now.
+    par_threading = rtsFalse;
+    compact_running = rtsFalse;
+
+    // Free the blocks that each region no longer needs, and chain
+    // the rest back together.
+    prev = NULL;
+    blocks = 0;
+    gen->old_blocks = NULL;
+    for (n = 0; n < n_regions; n++) {
+        r = &regions[n];
+        r->last->link = NULL;
+        if (r->free_bd->free == r->free_bd->start) {
+            // nothing in this region survived
+            freeChain(r->first);
+            continue;
+        }
+        if (r->free_bd->link != NULL) {
+            freeChain(r->free_bd->link);
+            r->free_bd->link = NULL;
+        }
+        if (prev == NULL) {
+            gen->old_blocks = r->first;
+        } else {
+            prev->link = r->first;
+        }
+        prev = r->free_bd;
+        blocks += r->blocks;
+    }
+
+    debugTrace(DEBUG_gc,
+               "par_compact: %d (old: %d blocks, now %d blocks)",
+               gen->no, gen->n_old_blocks, blocks);
+    gen->n_old_blocks = blocks;
+
+    stgFree(regions);
+    stgFree(chunks);
+}
+#endif /* THREADED_RTS */
+
 void
 compact(StgClosure *static_objects)
 {
@@ -973,17 +1380,24 @@ compact(StgClosure *static_objects)
     // the CAF list (used by GHCi)
     markCAFs((evac_fn)thread_root, NULL);
 
+#if defined(THREADED_RTS)
+    if (n_compact_threads > 1 && oldest_gen->old_blocks != NULL) {
+        par_compact(oldest_gen, n_compact_threads);
+        return;
+    }
+#endif
+
     // 2. update forward ptrs
     for (g = 0; g < RtsFlags.GcFlags.generations; g++) {
         gen = &generations[g];
         debugTrace(DEBUG_gc, "update_fwd:  %d", g);
 
-        update_fwd(gen->blocks);
+        update_fwd(gen->blocks, NULL);
         for (n = 0; n < n_capabilities; n++) {
-            update_fwd(gc_threads[n]->gens[g].todo_bd);
-            update_fwd(gc_threads[n]->gens[g].part_list);
+            update_fwd(gc_threads[n]->gens[g].todo_bd, NULL);
+            update_fwd(gc_threads[n]->gens[g].part_list, NULL);
         }
-        update_fwd_large(gen->scavenged_large_objects);
+        update_fwd_large(gen->scavenged_large_objects, NULL);
         if (g == RtsFlags.GcFlags.generations-1 && gen->old_blocks != NULL) {
             debugTrace(DEBUG_gc, "update_fwd:  %d (compact)", g);
             update_fwd_compact(gen->old_blocks);
@@ -48,6 +48,10 @@ is_marked(StgPtr p, bdescr *bd)
 
 void compact (StgClosure *static_objects);
 
+#if defined(THREADED_RTS)
+void compactWorker (void);
+#endif
+
 #include "EndPrivate.h"
 
 #endif /* SM_COMPACT_H */
@@ -27,6 +27,7 @@
 #include "MarkWeak.h"
 #include "Sparks.h"
 #include "Sweep.h"
+#include "IncMark.h"
 
 #include "Storage.h"
 #include "RtsUtils.h"
@@ -129,6 +130,23 @@ StgWord8 the_gc_thread[sizeof(gc_thread) + 64 * sizeof(gen_workspace)];
 // step->todos[] lists we have to look in to find work.
 nat n_gc_threads;
 
+#if defined(THREADED_RTS)
+// Number of threads that can take part in compacting the old
+// generation in *this* GC, including the main GC thread (see
+// GarbageCollect() and compact()).
+nat n_compact_threads;
+
+// rtsTrue once wakeupCompactThreads() has woken them up.
+static rtsBool compact_threads_awake;
+
+// rtsTrue if the other GC threads are taking part in *this* GC, so
+// that they can be woken up again to help with a heap census.  The
+// census isn't GC code and can't use gct, so we remember which of the
+// GC threads is ours in gc_leader.
+static rtsBool gc_workers_present;
+static nat gc_leader;
+#endif
+
 // For stats:
 long copied;        // *words* copied & scavenged during this GC
 
@@ -153,6 +171,7 @@ static StgWord inc_running          (void);
 static StgWord dec_running          (void);
 static void wakeup_gc_threads       (nat me);
 static void shutdown_gc_threads     (nat me);
+static void shutdown_compact_threads (nat me);
 static void collect_gct_blocks      (void);
 static void collect_pinned_object_blocks (void);
 
@@ -269,8 +288,25 @@ GarbageCollect (nat collect_gen,
    * We don't try to parallelise minor GCs (unless the user asks for
    * it with +RTS -gn0), or mark/compact/sweep GC.
    */
+  n_compact_threads = 1;
+  gc_workers_present = (gc_type == SYNC_GC_PAR);
+  gc_leader = cap->no;
   if (gc_type == SYNC_GC_PAR) {
-      n_gc_threads = n_capabilities;
+      if (oldest_gen->mark) {
+          // The scheduler asked for a parallel GC of a generation
+          // that we are going to compact.  Marking can only be done
+          // by one thread (the mark stack and the bitmaps are not
+          // thread-safe), so the other GC threads stand by until
+          // compact() wakes them up to help move the heap.
+          n_gc_threads = 1;
+          for (n = 0; n < n_capabilities; n++) {
+              if (n != cap->no && !gc_threads[n]->idle) {
+                  n_compact_threads++;
+              }
+          }
+      } else {
+          n_gc_threads = n_capabilities;
+      }
   } else {
       n_gc_threads = 1;
   }
@@ -293,6 +329,20 @@ GarbageCollect (nat collect_gen,
   // and put them on the g0->large_object list.
   collect_pinned_object_blocks();
 
+  // If the oldest generation is being marked incrementally, this GC
+  // finishes the mark.  The marker needs to know which of the objects
+  // it has traced were mutated since the last GC, so look at the
+  // mutable lists before they are freed below.
+  if (major_gc && inc_mark_active) {
+      incMarkRecordMutLists();
+  }
+
+  // Finish sweeping the oldest generation before it is collected
+  // again (with -wi, the last major GC left it to be swept lazily).
+  if (major_gc) {
+      finishLazySweep();
+  }
+
   // Initialise all the generations/steps that we're collecting.
   for (g = 0; g <= N; g++) {
       prepare_collected_gen(&generations[g]);
@@ -328,6 +378,7 @@ GarbageCollect (nat collect_gen,
   // NB. do this after the mutable lists have been saved above, otherwise
   // the other GC threads will be writing into the old mutable lists.
   inc_running();
+  initStableTablesForGC(major_gc);
   wakeup_gc_threads(gct->thread_index);
 
   traceEventGcWork(gct->cap);
@@ -355,6 +406,13 @@ GarbageCollect (nat collect_gen,
       }
   }
 
+  // pick up the marks made by the incremental mark, and the objects
+  // that it says we must trace again
+  if (major_gc && inc_mark_active) {
+      gct->evac_gen_no = 0;
+      incMarkFinish(mark_root, gct);
+  }
+
   // follow roots from the CAF list (used by GHCi)
   gct->evac_gen_no = 0;
   markCAFs(mark_root, gct);
@@ -381,8 +439,10 @@ GarbageCollect (nat collect_gen,
   markWeakPtrList();
   initWeakForGC();
 
-  // Mark the stable pointer table.
-  markStableTables(mark_root, gct);
+  // Mark the stable pointer table.  The other GC threads take some of
+  // it (see gcWorkerThread()).
+  markStablePtrSegments(mark_root, gct);
+  markStableNameTable();
 
   /* -------------------------------------------------------------------------
    * Repeatedly scavenge all the areas we know about until there's no
@@ -405,6 +465,8 @@ GarbageCollect (nat collect_gen,
       break;
   }
 
+  stat_endGCMark(gct);
+
   if (!DEBUG_IS_ON && n_gc_threads != 1) {
       clearNursery(cap);
   }
@@ -445,10 +507,16 @@ GarbageCollect (nat collect_gen,
   if (major_gc && oldest_gen->mark) {
       if (oldest_gen->compact)
           compact(gct->scavenged_static_objects);
-      else
+      else if (!RtsFlags.GcFlags.incMark)
           sweep(oldest_gen);
+      // with -wi, the oldest generation is swept lazily after the GC
+      // (see startLazySweep() below)
   }
 
+  shutdown_compact_threads(gct->thread_index);
+
+  stat_endGCSweep(gct);
+
   copied = 0;
   par_max_copied = 0;
   par_tot_copied = 0;
@@ -462,6 +530,7 @@ GarbageCollect (nat collect_gen,
               debugTrace(DEBUG_gc,"   any_work         %ld", gc_threads[i]->any_work);
               debugTrace(DEBUG_gc,"   no_work          %ld", gc_threads[i]->no_work);
               debugTrace(DEBUG_gc,"   scav_find_work %ld",   gc_threads[i]->scav_find_work);
+              debugTrace(DEBUG_gc,"   stolen           %ld", gc_threads[i]->stolen);
           }
           copied += gc_threads[i]->copied;
           par_max_copied = stg_max(gc_threads[i]->copied, par_max_copied);
@@ -554,6 +623,13 @@ GarbageCollect (nat collect_gen,
                         // for the nursery have the BF_EVACUATED flag set.
                         bd->flags |= BF_EVACUATED;
 
+                        // a block that hasn't been compacted may
+                        // contain dead objects.  sweep() has already
+                        // flagged it, unless it is being swept lazily.
+                        if (!gen->compact) {
+                            bd->flags |= BF_SWEPT;
+                        }
+
                         prev = bd;
                     }
                 }
@@ -567,6 +643,12 @@ GarbageCollect (nat collect_gen,
             gen->n_blocks += gen->n_old_blocks;
             ASSERT(countBlocks(gen->blocks) == gen->n_blocks);
             ASSERT(countOccupied(gen->blocks) == gen->n_words);
+
+            // with -wi, the marked blocks (now at the front of
+            // gen->blocks) are swept a slice at a time after the GC.
+            if (!gen->compact && RtsFlags.GcFlags.incMark) {
+                startLazySweep(gen, gen->n_old_blocks);
+            }
         }
         else // not copacted
         {
@@ -637,7 +719,7 @@ GarbageCollect (nat collect_gen,
   // Free any bitmaps.
   for (g = 0; g <= N; g++) {
       gen = &generations[g];
-      if (gen->bitmap != NULL) {
+      if (gen->bitmap != NULL && !lazySweepPending(gen)) {
           freeGroup(gen->bitmap);
           gen->bitmap = NULL;
       }
@@ -658,6 +740,11 @@ GarbageCollect (nat collect_gen,
       }
   }
 
+  // Give the blocks cached by each Capability back to the block
+  // allocator, so that they can be coalesced and reused for the
+  // nurseries.
+  flushBlockCaches();
+
   resize_nursery();
 
   resetNurseries();
@@ -693,6 +780,12 @@ GarbageCollect (nat collect_gen,
       }
   }
 
+  // Do a slice of incremental marking of the oldest generation, if a
+  // mark is in progress or due.  Must be before stableUnlock().
+  if (!major_gc && RtsFlags.GcFlags.incMark) {
+      incMarkStep();
+  }
+
   // Update the stable pointer hash table.
   updateStableTables(major_gc);
 
@@ -742,6 +835,9 @@ GarbageCollect (nat collect_gen,
       }
   }
 
+  // give back the memory of groups that have been free for a while
+  decayFreeMemory(rtsFalse);
+
   // extra GC trace info
   IF_DEBUG(gc, statDescribeGens());
 
@@ -809,6 +905,10 @@ new_gc_thread (nat n, gc_thread *t)
     t->idle = rtsFalse;
     t->free_blocks = NULL;
     t->gc_count = 0;
+    t->gc_sync_start_elapsed = 0;
+    // xorshift needs a non-zero seed; it is seeded once here, and
+    // carries on from where it left off in each GC.
+    t->steal_seed = ((StgWord32)n * 2654435761U) | 1;
 
     init_gc_thread(t);
 
@@ -828,7 +928,8 @@ new_gc_thread (nat n, gc_thread *t)
         // but can't, because it uses gct which isn't set up at this point.
         // Hence, allocate a block for todo_bd manually:
         {
-            bdescr *bd = allocBlock(); // no lock, locks aren't initialised yet
+            // no lock, locks aren't initialised yet
+            bdescr *bd = allocBlockOnNode(capNoToNumaNode(n));
             initBdescr(bd, ws->gen, ws->gen->to);
             bd->flags = BF_EVACUATED;
             bd->u.scan = bd->free = bd->start;
@@ -957,14 +1058,17 @@ any_work (void)
 
 #if defined(THREADED_RTS)
     if (work_stealing) {
-        nat n;
-        // look for work to steal
-        for (n = 0; n < n_gc_threads; n++) {
-            if (n == gct->thread_index) continue;
-            for (g = RtsFlags.GcFlags.generations-1; g >= 0; g--) {
-                ws = &gc_threads[n]->gens[g];
-                if (!looksEmptyWSDeque(ws->todo_q)) return rtsTrue;
+        nat i, n;
+        // look for work to steal, starting from a random victim
+        n = steal_victim();
+        for (i = 0; i < n_gc_threads; i++) {
+            if (n != gct->thread_index) {
+                for (g = RtsFlags.GcFlags.generations-1; g >= 0; g--) {
+                    ws = &gc_threads[n]->gens[g];
+                    if (!looksEmptyWSDeque(ws->todo_q)) return rtsTrue;
+                }
             }
+            n = (n + 1 == n_gc_threads) ? 0 : n + 1;
         }
     }
 #endif
@@ -977,10 +1081,17 @@ any_work (void)
     return rtsFalse;
 }
 
+// The most busy_wait_nop()s an idle GC thread does between polls
+// for work.
+#define MAX_IDLE_SPINS 1024
+
 static void
 scavenge_until_all_done (void)
 {
     DEBUG_ONLY( nat r );
+#if defined(THREADED_RTS)
+    nat i, spins;
+#endif
 
 
 loop:
@@ -1008,8 +1119,10 @@ loop:
 
     debugTrace(DEBUG_gc, "%d GC threads still running", r);
 
+#if defined(THREADED_RTS)
+    spins = 1;
+#endif
     while (gc_running_threads != 0) {
-        // usleep(1);
         if (any_work()) {
             inc_running();
             traceEventGcWork(gct->cap);
@@ -1019,6 +1132,17 @@ loop:
         // just checks for the presence of work.  If we find any,
         // then we increment gc_running_threads and go back to
         // scavenge_loop() to perform any pending work.
+
+#if defined(THREADED_RTS)
+        // Back off exponentially, so that idle threads do not keep
+        // pulling the cache lines of every other thread's deques.
+        for (i = 0; i < spins; i++) {
+            busy_wait_nop();
+        }
+        if (spins < MAX_IDLE_SPINS) {
+            spins *= 2;
+        }
+#endif
     }
 
     traceEventGcDone(gct->cap);
@@ -1058,6 +1182,12 @@ gcWorkerThread (Capability *cap)
     papi_thread_start_gc1_count(gct->papi_events);
 #endif
 
+    if (n_compact_threads > 1) {
+        // We're not taking part in the mark, only in compaction.
+        compactWorker();
+        goto done;
+    }
+
     init_gc_thread(gct);
 
     traceEventGcWork(gct->cap);
@@ -1066,6 +1196,7 @@ gcWorkerThread (Capability *cap)
     gct->evac_gen_no = 0;
     markCapability(mark_root, gct, cap, rtsTrue/*prune sparks*/);
     scavenge_capability_mut_lists(cap);
+    markStablePtrSegments(mark_root, gct);
 
     scavenge_until_all_done();
 
@@ -1083,17 +1214,31 @@ gcWorkerThread (Capability *cap)
     pruneSparkQueue(cap);
 #endif
 
+done:
 #ifdef USE_PAPI
     // count events in this thread towards the GC totals
     papi_thread_stop_gc1_count(gct->papi_events);
 #endif
 
-    // Wait until we're told to continue
-    RELEASE_SPIN_LOCK(&gct->gc_spin);
-    gct->wakeup = GC_THREAD_WAITING_TO_CONTINUE;
-    debugTrace(DEBUG_gc, "GC thread %d waiting to continue...",
-               gct->thread_index);
-    ACQUIRE_SPIN_LOCK(&gct->mut_spin);
+    for (;;) {
+        // Wait until we're told to continue
+        RELEASE_SPIN_LOCK(&gct->gc_spin);
+        gct->wakeup = GC_THREAD_WAITING_TO_CONTINUE;
+        debugTrace(DEBUG_gc, "GC thread %d waiting to continue...",
+                   gct->thread_index);
+        ACQUIRE_SPIN_LOCK(&gct->mut_spin);
+
+        // releaseGCThreads() makes us INACTIVE, but
+        // wakeupCensusThreads() wants help with a heap census first.
+        if (gct->wakeup != GC_THREAD_RUNNING) break;
+
+        heapCensusWorker(gct->thread_index);
+
+        // and stand by until shutdownCensusThreads() puts us back
+        RELEASE_SPIN_LOCK(&gct->mut_spin);
+        gct->wakeup = GC_THREAD_STANDING_BY;
+        ACQUIRE_SPIN_LOCK(&gct->gc_spin);
+    }
     debugTrace(DEBUG_gc, "GC thread %d on my way...", gct->thread_index);
 
     // record the time spent doing GC in the Task structure
@@ -1186,6 +1331,98 @@ shutdown_gc_threads (nat me USED_IF_THREADS)
 #endif
 }
 
+#if defined(THREADED_RTS)
+// Wake up the GC threads that were held back from the mark, so that
+// they can help compact() (they call compactWorker()).  Does nothing
+// if they are already awake.
+void
+wakeupCompactThreads (void)
+{
+    nat i;
+
+    if (n_compact_threads == 1 || compact_threads_awake) return;
+
+    for (i=0; i < n_capabilities; i++) {
+        if (i == gct->thread_index || gc_threads[i]->idle) continue;
+        debugTrace(DEBUG_gc, "waking up gc thread %d to compact", i);
+        if (gc_threads[i]->wakeup != GC_THREAD_STANDING_BY)
+            barf("wakeupCompactThreads");
+
+        gc_threads[i]->wakeup = GC_THREAD_RUNNING;
+        ACQUIRE_SPIN_LOCK(&gc_threads[i]->mut_spin);
+        RELEASE_SPIN_LOCK(&gc_threads[i]->gc_spin);
+    }
+    compact_threads_awake = rtsTrue;
+}
+#endif
+
+// The GC threads held back from the mark must also end up waiting to
+// continue, as releaseGCThreads() expects, whether or not compact()
+// ended up needing them.
+static void
+shutdown_compact_threads (nat me USED_IF_THREADS)
+{
+#if defined(THREADED_RTS)
+    nat i;
+
+    if (n_compact_threads == 1) return;
+
+    wakeupCompactThreads();
+
+    for (i=0; i < n_capabilities; i++) {
+        if (i == me || gc_threads[i]->idle) continue;
+        while (gc_threads[i]->wakeup != GC_THREAD_WAITING_TO_CONTINUE) { write_barrier(); }
+    }
+
+    compact_threads_awake = rtsFalse;
+    n_compact_threads = 1;
+#endif
+}
+
+#if defined(THREADED_RTS)
+// Wake up the other GC threads of a parallel GC, which are waiting to
+// continue, to help with a heap census (they call heapCensusWorker()).
+// Returns rtsFalse if there are none.
+rtsBool
+wakeupCensusThreads (void)
+{
+    nat i;
+
+    if (!gc_workers_present) return rtsFalse;
+
+    for (i=0; i < n_capabilities; i++) {
+        if (i == gc_leader || gc_threads[i]->idle) continue;
+        debugTrace(DEBUG_gc, "waking up gc thread %d for the census", i);
+        if (gc_threads[i]->wakeup != GC_THREAD_WAITING_TO_CONTINUE)
+            barf("wakeupCensusThreads");
+
+        gc_threads[i]->wakeup = GC_THREAD_RUNNING;
+        ACQUIRE_SPIN_LOCK(&gc_threads[i]->gc_spin);
+        RELEASE_SPIN_LOCK(&gc_threads[i]->mut_spin);
+    }
+    return rtsTrue;
+}
+
+// Wait for the GC threads to finish their part of the census, and put
+// them back to waiting to continue, as releaseGCThreads() expects.
+void
+shutdownCensusThreads (void)
+{
+    nat i;
+
+    for (i=0; i < n_capabilities; i++) {
+        if (i == gc_leader || gc_threads[i]->idle) continue;
+        while (gc_threads[i]->wakeup != GC_THREAD_STANDING_BY) { write_barrier(); }
+        ACQUIRE_SPIN_LOCK(&gc_threads[i]->mut_spin);
+        RELEASE_SPIN_LOCK(&gc_threads[i]->gc_spin);
+    }
+    for (i=0; i < n_capabilities; i++) {
+        if (i == gc_leader || gc_threads[i]->idle) continue;
+        while (gc_threads[i]->wakeup != GC_THREAD_WAITING_TO_CONTINUE) { write_barrier(); }
+    }
+}
+#endif
+
 #if defined(THREADED_RTS)
 void
 releaseGCThreads (Capability *cap USED_IF_THREADS)
@@ -1223,7 +1460,8 @@ prepare_collected_gen (generation *gen)
     if (g != 0) {
         for (i = 0; i < n_capabilities; i++) {
             freeChain(capabilities[i]->mut_lists[g]);
-            capabilities[i]->mut_lists[g] = allocBlock();
+            capabilities[i]->mut_lists[g] =
+                allocBlockOnNode(capNoToNumaNode(i));
 	}
     }
 
@@ -1335,7 +1573,7 @@ static void
 stash_mut_list (Capability *cap, nat gen_no)
 {
     cap->saved_mut_lists[gen_no] = cap->mut_lists[gen_no];
-    cap->mut_lists[gen_no] = allocBlock_sync();
+    cap->mut_lists[gen_no] = allocBlockOnNode_sync(cap->node);
 }
 
 /* ----------------------------------------------------------------------------
@@ -1457,6 +1695,7 @@ init_gc_thread (gc_thread *t)
     t->any_work = 0;
     t->no_work = 0;
     t->scav_find_work = 0;
+    t->stolen = 0;
 }
 
 /* -----------------------------------------------------------------------------
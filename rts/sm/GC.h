@@ -28,6 +28,10 @@ void         markCAFs     ( evac_fn evac, void *user );
 extern nat N;
 extern rtsBool major_gc;
 
+#if defined(THREADED_RTS)
+extern nat n_compact_threads;
+#endif
+
 extern bdescr *mark_stack_bd;
 extern bdescr *mark_stack_top_bd;
 extern StgPtr mark_sp;
@@ -57,6 +61,9 @@ void freeGcThreads (void);
 #if defined(THREADED_RTS)
 void waitForGcThreads (Capability *cap);
 void releaseGCThreads (Capability *cap);
+void wakeupCompactThreads (void);
+rtsBool wakeupCensusThreads (void);
+void shutdownCensusThreads (void);
 #endif
 
 #define WORK_UNIT_WORDS 128
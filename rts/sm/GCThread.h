@@ -35,17 +35,26 @@
    primary purpose of the gen_workspace is to hold evacuated objects;
    when an object is evacuated, it is copied to the "todo" block in
    the thread's workspace for the appropriate generation.  When the todo
-   block is full, it is pushed to the global gen->todos list, which
-   is protected by a lock.  (in fact we intervene a one-place buffer
-   here to reduce contention).
-
-   A thread repeatedly grabs a block of work from one of the
-   gen->todos lists, scavenges it, and keeps the scavenged block on
-   its own ws->scavd_list (this is to avoid unnecessary contention
-   returning the completed buffers back to the generation: we can just
-   collect them all later).
-
-   When there is no global work to do, we start scavenging the todo
+   block is full, it is pushed onto the workspace's own todo_q, a
+   lock-free work-stealing deque (see WSDeque.c).  If the deque is
+   full, the block goes on the private todo_overflow list, and is moved
+   back into the deque as soon as there is room.
+
+   A thread repeatedly grabs a block of work from its own deques,
+   scavenges it, and keeps the scavenged block on its own
+   ws->scavd_list (this is to avoid unnecessary contention returning
+   the completed buffers back to the generation: we can just collect
+   them all later).  When its own deques are empty, it steals blocks
+   from the deques of the other GC threads, starting from a randomly
+   chosen victim so that the thieves spread out rather than all
+   contending on the same deque (steal_todo_block()).
+
+   A thread that can find no work at all decrements
+   gc_running_threads and polls for work with exponential backoff; the
+   GC is finished when gc_running_threads reaches zero, which can only
+   happen when every deque is empty (see scavenge_until_all_done()).
+
+   When there is no other work to do, we start scavenging the todo
    blocks in the workspaces.  This is where the scan_bd field comes
    in: we can scan the contents of the todo block, when we have
    scavenged the contents of the todo block (up to todo_bd->free), we
@@ -126,6 +135,7 @@ typedef struct gc_thread_ {
 #endif
     nat thread_index;              // a zero based index identifying the thread
     rtsBool idle;                  // sitting out of this GC cycle
+    StgWord32 steal_seed;          // random state for choosing steal victims
 
     bdescr * free_blocks;          // a buffer of free blocks for this thread
                                    //  during GC without accessing the block
@@ -181,11 +191,15 @@ typedef struct gc_thread_ {
     W_ any_work;
     W_ no_work;
     W_ scav_find_work;
+    W_ stolen;                     // todo blocks stolen from other threads
 
     Time gc_start_cpu;   // process CPU time
     Time gc_start_elapsed;  // process elapsed time
     Time gc_start_thread_cpu; // thread CPU time
     W_ gc_start_faults;
+    Time gc_sync_start_elapsed; // when we asked the others to stop
+    Time gc_mark_end_elapsed;   // when the live data had all been found
+    Time gc_sweep_end_elapsed;  // when the oldest gen had been swept
 
     // -------------------
     // workspaces
@@ -30,26 +30,43 @@
 SpinLock gc_alloc_block_sync;
 #endif
 
+// Blocks allocated during GC come from the NUMA node of the GC
+// thread's Capability, which is where the GC thread is running (see
+// setThreadNode() in workerStart()).
+
 bdescr *
-allocBlock_sync(void)
+allocBlockOnNode_sync(nat node)
 {
     bdescr *bd;
     ACQUIRE_SPIN_LOCK(&gc_alloc_block_sync);
-    bd = allocBlock();
+    bd = allocBlockOnNode(node);
     RELEASE_SPIN_LOCK(&gc_alloc_block_sync);
     return bd;
 }
 
+// The common case is served from the block cache of the GC thread's
+// Capability, which we own for the duration of the GC, so it needs
+// no locking (see "Block caches" in BlockAlloc.c).
+
 static bdescr *
 allocGroup_sync(nat n)
 {
     bdescr *bd;
-    ACQUIRE_SPIN_LOCK(&gc_alloc_block_sync);
-    bd = allocGroup(n);
-    RELEASE_SPIN_LOCK(&gc_alloc_block_sync);
+    bd = allocGroupFromCache(gct->cap, n);
+    if (bd == NULL) {
+        ACQUIRE_SPIN_LOCK(&gc_alloc_block_sync);
+        bd = allocGroupRefillCache(gct->cap, n);
+        RELEASE_SPIN_LOCK(&gc_alloc_block_sync);
+    }
     return bd;
 }
 
+bdescr *
+allocBlock_sync(void)
+{
+    return allocGroup_sync(1);
+}
+
 
 #if 0
 static void
@@ -90,7 +107,7 @@ freeChain_sync(bdescr *bd)
 bdescr *
 grab_local_todo_block (gen_workspace *ws)
 {
-    bdescr *bd;
+    bdescr *bd, *next;
 
     bd = ws->todo_overflow;
     if (bd != NULL)
@@ -98,6 +115,19 @@ grab_local_todo_block (gen_workspace *ws)
         ws->todo_overflow = bd->link;
         bd->link = NULL;
         ws->n_todo_overflow--;
+
+        // Move the rest of the overflow blocks into the deque while
+        // there is room, so that other threads can steal them.
+        while (ws->todo_overflow != NULL) {
+            next = ws->todo_overflow->link;
+            ws->todo_overflow->link = NULL;
+            if (!pushWSDeque(ws->todo_q, ws->todo_overflow)) {
+                ws->todo_overflow->link = next;
+                break;
+            }
+            ws->todo_overflow = next;
+            ws->n_todo_overflow--;
+        }
 	return bd;
     }
 
@@ -112,19 +142,40 @@ grab_local_todo_block (gen_workspace *ws)
 }
 
 #if defined(THREADED_RTS)
+/* Choose the GC thread to start looking for work to steal at.  If all
+ * the thieves started at gc_threads[0] they would contend on the same
+ * deque, so we pick a random victim (xorshift32) and go round from
+ * there.
+ */
+nat
+steal_victim (void)
+{
+    StgWord32 x = gct->steal_seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    gct->steal_seed = x;
+    return x % n_gc_threads;
+}
+
 bdescr *
 steal_todo_block (nat g)
 {
-    nat n;
+    nat i, n;
     bdescr *bd;
 
     // look for work to steal
-    for (n = 0; n < n_gc_threads; n++) {
-        if (n == gct->thread_index) continue;
-        bd = stealWSDeque(gc_threads[n]->gens[g].todo_q);
-        if (bd) {
-            return bd;
+    n = steal_victim();
+    for (i = 0; i < n_gc_threads; i++) {
+        if (n != gct->thread_index) {
+            bd = stealWSDeque(gc_threads[n]->gens[g].todo_q);
+            if (bd) {
+                gct->stolen++;
+                return bd;
+            }
         }
+        n = (n + 1 == n_gc_threads) ? 0 : n + 1;
     }
     return NULL;
 }
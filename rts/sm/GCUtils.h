@@ -19,6 +19,7 @@
 #include "GCTDecl.h"
 
 bdescr *allocBlock_sync(void);
+bdescr *allocBlockOnNode_sync(nat node);
 void    freeChain_sync(bdescr *bd);
 
 void    push_scanned_block   (bdescr *bd, gen_workspace *ws);
@@ -28,6 +29,7 @@ StgPtr  alloc_todo_block     (gen_workspace *ws, nat size);
 bdescr *grab_local_todo_block  (gen_workspace *ws);
 #if defined(THREADED_RTS)
 bdescr *steal_todo_block       (nat s);
+nat     steal_victim           (void);
 #endif
 
 // Returns true if a block is partially full.  This predicate is used to try
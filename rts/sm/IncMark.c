@@ -0,0 +1,1110 @@
+/* -----------------------------------------------------------------------------
+ *
+ * (c) The GHC Team 1998-2008
+ *
+ * Incremental marking of the oldest generation (+RTS -wi)
+ *
+ * Documentation on the architecture of the Garbage Collector can be
+ * found in the online commentary:
+ *
+ *   http://hackage.haskell.org/trac/ghc/wiki/Commentary/Rts/Storage/GC
+ *
+ * ---------------------------------------------------------------------------*/
+
+/* -----------------------------------------------------------------------------
+   Overview
+
+   With -w the oldest generation is collected by mark-sweep, but the
+   whole mark still happens in one pause.  With -wi, when the oldest
+   generation is due for collection we do a minor GC instead, and at
+   the end of it we start marking the oldest generation.  At the end
+   of each subsequent minor GC, while the world is still stopped, we
+   do a bounded amount of marking (a "slice").  When the mark is
+   complete, the next GC is a major GC, which takes the marks made so
+   far as its starting point, and so only has to trace what has
+   changed since.
+
+   The snapshot
+
+     The blocks of oldest_gen->blocks and oldest_gen->large_objects
+     are flagged BF_SNAPSHOT.  These blocks don't move, and no
+     objects are added to them until the next major GC.  Each
+     snapshot block gets a mark bitmap (pointed to by bd->u.bitmap,
+     the same representation that the mark phase uses, see
+     Compact.h); snapshot large objects are marked with
+     BF_INCMARKED.  Blocks that are added to oldest_gen->blocks by
+     later minor GCs join the snapshot at the start of the next
+     slice.
+
+     The marker only ever traces objects in snapshot blocks and
+     static objects, because nothing else stays where it is between
+     slices.  The marker never writes to the heap.
+
+   The invariant
+
+     A marked object has either been traced, or is on the marker's
+     stack.  When a traced object T might point to something that the
+     marker hasn't marked, T is put on the "retrace" list, and the
+     major GC that finishes the mark traces it again.  This happens
+     when:
+
+       - T pointed outside the snapshot when it was traced (into a
+         younger generation, or into a block that was not yet in the
+         snapshot).  Those objects are not marked by the marker, so
+         the final GC must find them via T.
+
+       - T has been mutated since it was traced.  We don't need a new
+         write barrier for this: every mutation of an old-generation
+         object already goes through dirty_MUT_VAR(), dirty_TVAR(),
+         dirty_MVAR(), dirty_STACK(), dirty_TSO(), recordClosureMutated()
+         or the MUT_ARR_PTRS card marking, all of which put the object
+         on its generation's mutable list.  So we look at the mutable
+         list of the oldest generation whenever it is scavenged by a
+         minor GC (scavenge_mutable_list()), and once more at the
+         start of the final GC.
+
+     Static objects don't live in the heap, so we can't mark them in a
+     bitmap; the marker keeps a hash table of the ones it has seen,
+     and the final GC evacuates all of them.  Likewise the final GC
+     evacuates every marked large object.  (This means that marked
+     large objects are scanned again, but that's no worse than the
+     non-incremental mark.)
+
+     The final GC also marks all the roots again, so anything that
+     became reachable only from a root during the mark is found then.
+
+   Floating garbage
+
+     Objects that were marked and then became unreachable survive
+     until the next major GC.  That includes weak pointer keys and
+     threads, so finalizers and BlockedIndefinitely exceptions can
+     be delayed by one major GC.
+
+   Termination
+
+     While the mark is running, calcNeeded() doesn't collect the
+     oldest generation (see incMarkDefer()), unless it has grown to
+     twice its maximum size, in which case the final GC happens
+     straight away and does the rest of the mark itself.  A major GC
+     requested for any other reason (performMajorGC, a heap census,
+     etc.) also finishes the mark.
+
+   Sweeping
+
+     The major GC doesn't sweep the oldest generation; the slices
+     that come after it sweep instead of marking until the next mark
+     is due (see "Lazy sweeping" in Sweep.c).
+
+   -------------------------------------------------------------------------- */
+
+#include "PosixSource.h"
+#include "Rts.h"
+
+#include "Storage.h"
+#include "GC.h"
+#include "GCThread.h"
+#include "GCTDecl.h"
+#include "GCUtils.h"
+#include "Compact.h"
+#include "MarkStack.h"
+#include "IncMark.h"
+#include "Sweep.h"
+#include "Capability.h"
+#include "Schedule.h"
+#include "Stable.h"
+#include "Hash.h"
+#include "Apply.h"
+#include "RtsUtils.h"
+#include "Trace.h"
+
+#include <string.h>
+
+rtsBool inc_mark_active = rtsFalse;
+
+// rtsTrue when the marker has run out of work; the next GC will be
+// the major GC that finishes the mark.
+static rtsBool inc_mark_done = rtsFalse;
+
+#define BITMAP_WORDS (BLOCK_SIZE_W / BITS_IN(W_))
+
+/* -----------------------------------------------------------------------------
+   Data structures.  None of these are allocated from the block
+   allocator, so that they don't get in the way of memInventory().
+   -------------------------------------------------------------------------- */
+
+typedef struct {
+    StgClosure **elems;
+    W_ n;
+    W_ size;
+} ClosureList;
+
+typedef struct {
+    bdescr  *bd;
+    StgWord *bitmap;            // NULL for a large object
+} SnapshotBlock;
+
+typedef struct BitmapChunk_ {
+    struct BitmapChunk_ *link;
+    StgWord bitmap[FLEXIBLE_ARRAY];
+} BitmapChunk;
+
+// Marked objects that have not been traced yet
+static ClosureList inc_stack;
+
+// Traced objects that the final GC must trace again, and a hash table
+// to avoid recording them twice
+static ClosureList retrace;
+static HashTable *retrace_table = NULL;
+
+// Static objects that the marker has seen
+static ClosureList statics;
+static HashTable *static_table = NULL;
+
+// The snapshot.  snapshot_blocks_hd and snapshot_large_hd are the
+// heads of oldest_gen->blocks and oldest_gen->large_objects when we
+// last added blocks to the snapshot.
+static SnapshotBlock *snapshot = NULL;
+static W_ n_snapshot, snapshot_size;
+static bdescr *snapshot_blocks_hd;
+static bdescr *snapshot_large_hd;
+static BitmapChunk *bitmap_chunks = NULL;
+
+#if defined(THREADED_RTS)
+// protects retrace and retrace_table in incMarkRecordMutated(), which
+// is called by all the GC threads during a parallel minor GC
+static SpinLock inc_mark_sync;
+#endif
+
+// Set when the object being traced points outside the snapshot
+static rtsBool scan_outside;
+
+static void
+pushClosureList (ClosureList *l, StgClosure *p)
+{
+    if (l->n == l->size) {
+        l->size = l->size == 0 ? 1024 : l->size * 2;
+        l->elems = stgReallocBytes(l->elems, l->size * sizeof(StgClosure *),
+                                   "pushClosureList");
+    }
+    l->elems[l->n++] = p;
+}
+
+static void
+freeClosureList (ClosureList *l)
+{
+    if (l->elems != NULL) {
+        stgFree(l->elems);
+    }
+    l->elems = NULL;
+    l->n = 0;
+    l->size = 0;
+}
+
+static void
+pushSnapshot (bdescr *bd, StgWord *bitmap)
+{
+    if (n_snapshot == snapshot_size) {
+        snapshot_size = snapshot_size == 0 ? 1024 : snapshot_size * 2;
+        snapshot = stgReallocBytes(snapshot,
+                                   snapshot_size * sizeof(SnapshotBlock),
+                                   "pushSnapshot");
+    }
+    snapshot[n_snapshot].bd = bd;
+    snapshot[n_snapshot].bitmap = bitmap;
+    n_snapshot++;
+}
+
+static void
+recordRetrace (StgClosure *p)
+{
+    if (lookupHashTable(retrace_table, (StgWord)p) == NULL) {
+        insertHashTable(retrace_table, (StgWord)p, p);
+        pushClosureList(&retrace, p);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+   Marking a pointer
+   -------------------------------------------------------------------------- */
+
+STATIC_INLINE void
+markPtr (StgClosure *q)
+{
+    bdescr *bd;
+    const StgInfoTable *info;
+
+    q = UNTAG_CLOSURE(q);
+    ASSERT(LOOKS_LIKE_CLOSURE_PTR(q));
+
+    if (!HEAP_ALLOCED_GC(q)) {
+        // the same static objects that evacuate() puts on the static
+        // object list
+        info = get_itbl(q);
+        switch (info->type) {
+        case THUNK_STATIC:
+        case FUN_STATIC:
+            if (info->srt_bitmap == 0) return;
+            break;
+        case IND_STATIC:
+        case CONSTR_STATIC:
+            break;
+        default:
+            return;
+        }
+        if (lookupHashTable(static_table, (StgWord)q) == NULL) {
+            insertHashTable(static_table, (StgWord)q, q);
+            pushClosureList(&statics, q);
+            pushClosureList(&inc_stack, q);
+        }
+        return;
+    }
+
+    bd = Bdescr((P_)q);
+
+    if (!(bd->flags & BF_SNAPSHOT)) {
+        scan_outside = rtsTrue;
+        return;
+    }
+
+    if (bd->flags & BF_LARGE) {
+        if (!(bd->flags & BF_INCMARKED)) {
+            bd->flags |= BF_INCMARKED;
+            // pinned objects don't contain any pointers
+            if (!(bd->flags & BF_PINNED)) {
+                pushClosureList(&inc_stack, q);
+            }
+        }
+        return;
+    }
+
+    if (!is_marked((P_)q, bd)) {
+        mark((P_)q, bd);
+        pushClosureList(&inc_stack, q);
+    }
+}
+
+static void
+markRoot (void *user STG_UNUSED, StgClosure **root)
+{
+    markPtr(*root);
+}
+
+/* -----------------------------------------------------------------------------
+   Tracing.  These follow the corresponding functions in Scav.c, but
+   only read the heap.
+   -------------------------------------------------------------------------- */
+
+static void markStackFrames (StgPtr p, StgPtr stack_end);
+
+static void
+markLargeBitmap (StgPtr p, StgLargeBitmap *large_bitmap, nat size)
+{
+    nat i, j, b;
+    StgWord bitmap;
+
+    b = 0;
+
+    for (i = 0; i < size; b++) {
+        bitmap = large_bitmap->bitmap[b];
+        j = stg_min(size-i, BITS_IN(W_));
+        i += j;
+        for (; j > 0; j--, p++) {
+            if ((bitmap & 1) == 0) {
+                markPtr((StgClosure *)*p);
+            }
+            bitmap = bitmap >> 1;
+        }
+    }
+}
+
+STATIC_INLINE StgPtr
+markSmallBitmap (StgPtr p, nat size, StgWord bitmap)
+{
+    while (size > 0) {
+        if ((bitmap & 1) == 0) {
+            markPtr((StgClosure *)*p);
+        }
+        p++;
+        bitmap = bitmap >> 1;
+        size--;
+    }
+    return p;
+}
+
+static void
+markLargeSRTBitmap (StgLargeSRT *large_srt)
+{
+    nat i, b, size;
+    StgWord bitmap;
+    StgClosure **p;
+
+    b = 0;
+    bitmap = large_srt->l.bitmap[b];
+    size   = (nat)large_srt->l.size;
+    p      = (StgClosure **)large_srt->srt;
+    for (i = 0; i < size; ) {
+        if ((bitmap & 1) != 0) {
+            markPtr(*p);
+        }
+        i++;
+        p++;
+        if (i % BITS_IN(W_) == 0) {
+            b++;
+            bitmap = large_srt->l.bitmap[b];
+        } else {
+            bitmap = bitmap >> 1;
+        }
+    }
+}
+
+STATIC_INLINE void
+markSRT (StgClosure **srt, nat srt_bitmap)
+{
+    nat bitmap;
+    StgClosure **p;
+
+    bitmap = srt_bitmap;
+    p = srt;
+
+    if (bitmap == (StgHalfWord)(-1)) {
+        markLargeSRTBitmap((StgLargeSRT *)srt);
+        return;
+    }
+
+    while (bitmap != 0) {
+        if ((bitmap & 1) != 0) {
+#if defined(COMPILING_WINDOWS_DLL)
+            // see scavenge_srt()
+            if ((W_)(*p) & 0x1) {
+                markPtr(*(StgClosure **)((W_)(*p) & ~0x1));
+            } else {
+                markPtr(*p);
+            }
+#else
+            markPtr(*p);
+#endif
+        }
+        p++;
+        bitmap = bitmap >> 1;
+    }
+}
+
+STATIC_INLINE void
+markThunkSRT (const StgInfoTable *info)
+{
+    StgThunkInfoTable *thunk_info;
+
+    thunk_info = itbl_to_thunk_itbl(info);
+    markSRT((StgClosure **)GET_SRT(thunk_info), thunk_info->i.srt_bitmap);
+}
+
+STATIC_INLINE void
+markFunSRT (const StgInfoTable *info)
+{
+    StgFunInfoTable *fun_info;
+
+    fun_info = itbl_to_fun_itbl(info);
+    markSRT((StgClosure **)GET_FUN_SRT(fun_info), fun_info->i.srt_bitmap);
+}
+
+STATIC_INLINE StgPtr
+markArgBlock (StgFunInfoTable *fun_info, StgClosure **args)
+{
+    StgPtr p;
+    nat size;
+
+    p = (StgPtr)args;
+    switch (fun_info->f.fun_type) {
+    case ARG_GEN:
+        size = BITMAP_SIZE(fun_info->f.b.bitmap);
+        p = markSmallBitmap(p, size, BITMAP_BITS(fun_info->f.b.bitmap));
+        break;
+    case ARG_GEN_BIG:
+        size = GET_FUN_LARGE_BITMAP(fun_info)->size;
+        markLargeBitmap(p, GET_FUN_LARGE_BITMAP(fun_info), size);
+        p += size;
+        break;
+    default:
+        size = BITMAP_SIZE(stg_arg_bitmaps[fun_info->f.fun_type]);
+        p = markSmallBitmap(p, size,
+                            BITMAP_BITS(stg_arg_bitmaps[fun_info->f.fun_type]));
+        break;
+    }
+    return p;
+}
+
+static void
+markPAPPayload (StgClosure *fun, StgClosure **payload, StgWord size)
+{
+    StgFunInfoTable *fun_info;
+
+    markPtr(fun);
+    fun_info = get_fun_itbl(UNTAG_CLOSURE(fun));
+    ASSERT(fun_info->i.type != PAP);
+
+    switch (fun_info->f.fun_type) {
+    case ARG_GEN:
+        markSmallBitmap((StgPtr)payload, size,
+                        BITMAP_BITS(fun_info->f.b.bitmap));
+        break;
+    case ARG_GEN_BIG:
+        markLargeBitmap((StgPtr)payload, GET_FUN_LARGE_BITMAP(fun_info), size);
+        break;
+    case ARG_BCO:
+        markLargeBitmap((StgPtr)payload, BCO_BITMAP(fun), size);
+        break;
+    default:
+        markSmallBitmap((StgPtr)payload, size,
+                        BITMAP_BITS(stg_arg_bitmaps[fun_info->f.fun_type]));
+        break;
+    }
+}
+
+static void
+markStackFrames (StgPtr p, StgPtr stack_end)
+{
+    const StgRetInfoTable* info;
+    nat size;
+
+    while (p < stack_end) {
+        info = get_ret_itbl((StgClosure *)p);
+
+        switch (info->i.type) {
+
+        case UPDATE_FRAME:
+            markPtr(((StgUpdateFrame *)p)->updatee);
+            p += sizeofW(StgUpdateFrame);
+            continue;
+
+        case CATCH_STM_FRAME:
+        case CATCH_RETRY_FRAME:
+        case ATOMICALLY_FRAME:
+        case UNDERFLOW_FRAME:
+        case STOP_FRAME:
+        case CATCH_FRAME:
+        case RET_SMALL:
+            p++;
+            p = markSmallBitmap(p, BITMAP_SIZE(info->i.layout.bitmap),
+                                BITMAP_BITS(info->i.layout.bitmap));
+
+        follow_srt:
+            markSRT((StgClosure **)GET_SRT(info), info->i.srt_bitmap);
+            continue;
+
+        case RET_BCO: {
+            StgBCO *bco;
+
+            p++;
+            markPtr((StgClosure *)*p);
+            bco = (StgBCO *)*p;
+            p++;
+            size = BCO_BITMAP_SIZE(bco);
+            markLargeBitmap(p, BCO_BITMAP(bco), size);
+            p += size;
+            continue;
+        }
+
+        case RET_BIG:
+            size = GET_LARGE_BITMAP(&info->i)->size;
+            p++;
+            markLargeBitmap(p, GET_LARGE_BITMAP(&info->i), size);
+            p += size;
+            goto follow_srt;
+
+        case RET_FUN:
+        {
+            StgRetFun *ret_fun = (StgRetFun *)p;
+            StgFunInfoTable *fun_info;
+
+            markPtr(ret_fun->fun);
+            fun_info = get_fun_itbl(UNTAG_CLOSURE(ret_fun->fun));
+            p = markArgBlock(fun_info, ret_fun->payload);
+            goto follow_srt;
+        }
+
+        default:
+            barf("incremental mark: weird activation record found on stack: %d",
+                 (int)(info->i.type));
+        }
+    }
+}
+
+static void
+markTSO (StgTSO *tso)
+{
+    markPtr((StgClosure *)tso->blocked_exceptions);
+    markPtr((StgClosure *)tso->bq);
+    markPtr((StgClosure *)tso->trec);
+    markPtr((StgClosure *)tso->stackobj);
+    markPtr((StgClosure *)tso->_link);
+    if (   tso->why_blocked == BlockedOnMVar
+        || tso->why_blocked == BlockedOnMVarRead
+        || tso->why_blocked == BlockedOnBlackHole
+        || tso->why_blocked == BlockedOnMsgThrowTo
+        || tso->why_blocked == NotBlocked
+        ) {
+        markPtr(tso->block_info.closure);
+    }
+}
+
+static void
+traceStatic (StgClosure *q, const StgInfoTable *info)
+{
+    StgPtr p, end;
+
+    switch (info->type) {
+    case IND_STATIC:
+        markPtr(((StgInd *)q)->indirectee);
+        break;
+
+    case THUNK_STATIC:
+        markThunkSRT(info);
+        break;
+
+    case FUN_STATIC:
+        markFunSRT(info);
+        break;
+
+    case CONSTR_STATIC:
+        end = (P_)q->payload + info->layout.payload.ptrs;
+        for (p = (P_)q->payload; p < end; p++) {
+            markPtr((StgClosure *)*p);
+        }
+        break;
+
+    default:
+        barf("incremental mark: strange static closure type %d @ %p",
+             (int)(info->type), q);
+    }
+}
+
+// Trace the fields of a marked closure, and return its size in words
+static W_
+traceClosure (StgClosure *q)
+{
+    StgInfoTable *info;
+    StgPtr p, end;
+    W_ i;
+
+    ASSERT(LOOKS_LIKE_CLOSURE_PTR(q));
+    info = get_itbl(q);
+
+    if (!HEAP_ALLOCED_GC(q)) {
+        traceStatic(q, info);
+        return sizeofW(StgHeader);
+    }
+
+    switch (info->type) {
+
+    case MVAR_CLEAN:
+    case MVAR_DIRTY:
+    {
+        StgMVar *mvar = (StgMVar *)q;
+        markPtr((StgClosure *)mvar->head);
+        markPtr((StgClosure *)mvar->tail);
+        markPtr(mvar->value);
+        break;
+    }
+
+    case TVAR:
+    {
+        StgTVar *tvar = (StgTVar *)q;
+        markPtr(tvar->current_value);
+        markPtr((StgClosure *)tvar->first_watch_queue_entry);
+        break;
+    }
+
+    case FUN_2_0:
+        markFunSRT(info);
+        markPtr(q->payload[1]);
+        markPtr(q->payload[0]);
+        break;
+
+    case THUNK_2_0:
+        markThunkSRT(info);
+        markPtr(((StgThunk *)q)->payload[1]);
+        markPtr(((StgThunk *)q)->payload[0]);
+        break;
+
+    case CONSTR_2_0:
+        markPtr(q->payload[1]);
+        markPtr(q->payload[0]);
+        break;
+
+    case FUN_1_0:
+    case FUN_1_1:
+        markFunSRT(info);
+        markPtr(q->payload[0]);
+        break;
+
+    case THUNK_1_0:
+    case THUNK_1_1:
+        markThunkSRT(info);
+        markPtr(((StgThunk *)q)->payload[0]);
+        break;
+
+    case CONSTR_1_0:
+    case CONSTR_1_1:
+        markPtr(q->payload[0]);
+        break;
+
+    case FUN_0_1:
+    case FUN_0_2:
+        markFunSRT(info);
+        break;
+
+    case THUNK_0_1:
+    case THUNK_0_2:
+        markThunkSRT(info);
+        break;
+
+    case CONSTR_0_1:
+    case CONSTR_0_2:
+        break;
+
+    case FUN:
+        markFunSRT(info);
+        goto gen_obj;
+
+    case THUNK:
+        markThunkSRT(info);
+        end = (P_)((StgThunk *)q)->payload + info->layout.payload.ptrs;
+        for (p = (P_)((StgThunk *)q)->payload; p < end; p++) {
+            markPtr((StgClosure *)*p);
+        }
+        break;
+
+    gen_obj:
+    case CONSTR:
+    case WEAK:
+    case PRIM:
+    case MUT_PRIM:
+        end = (P_)q->payload + info->layout.payload.ptrs;
+        for (p = (P_)q->payload; p < end; p++) {
+            markPtr((StgClosure *)*p);
+        }
+        break;
+
+    case BCO:
+    {
+        StgBCO *bco = (StgBCO *)q;
+        markPtr((StgClosure *)bco->instrs);
+        markPtr((StgClosure *)bco->literals);
+        markPtr((StgClosure *)bco->ptrs);
+        break;
+    }
+
+    case IND:
+    case IND_PERM:
+    case BLACKHOLE:
+        markPtr(((StgInd *)q)->indirectee);
+        break;
+
+    case MUT_VAR_CLEAN:
+    case MUT_VAR_DIRTY:
+        markPtr(((StgMutVar *)q)->var);
+        break;
+
+    case BLOCKING_QUEUE:
+    {
+        StgBlockingQueue *bq = (StgBlockingQueue *)q;
+        markPtr(bq->bh);
+        markPtr((StgClosure *)bq->owner);
+        markPtr((StgClosure *)bq->queue);
+        markPtr((StgClosure *)bq->link);
+        break;
+    }
+
+    case ARR_WORDS:
+        break;
+
+    case THUNK_SELECTOR:
+        markPtr(((StgSelector *)q)->selectee);
+        break;
+
+    case AP_STACK:
+    {
+        StgAP_STACK *ap = (StgAP_STACK *)q;
+        markPtr(ap->fun);
+        markStackFrames((StgPtr)ap->payload, (StgPtr)ap->payload + ap->size);
+        break;
+    }
+
+    case PAP:
+        markPAPPayload(((StgPAP *)q)->fun, ((StgPAP *)q)->payload,
+                       ((StgPAP *)q)->n_args);
+        break;
+
+    case AP:
+        markPAPPayload(((StgAP *)q)->fun, ((StgAP *)q)->payload,
+                       ((StgAP *)q)->n_args);
+        break;
+
+    case MUT_ARR_PTRS_CLEAN:
+    case MUT_ARR_PTRS_DIRTY:
+    case MUT_ARR_PTRS_FROZEN:
+    case MUT_ARR_PTRS_FROZEN0:
+    {
+        StgMutArrPtrs *a = (StgMutArrPtrs *)q;
+        for (i = 0; i < a->ptrs; i++) {
+            markPtr(a->payload[i]);
+        }
+        break;
+    }
+
+    case TSO:
+        markTSO((StgTSO *)q);
+        break;
+
+    case STACK:
+    {
+        StgStack *stack = (StgStack *)q;
+        markStackFrames(stack->sp, stack->stack + stack->stack_size);
+        break;
+    }
+
+    case TREC_CHUNK:
+    {
+        StgTRecChunk *tc = (StgTRecChunk *)q;
+        TRecEntry *e = &(tc->entries[0]);
+        markPtr((StgClosure *)tc->prev_chunk);
+        for (i = 0; i < tc->next_entry_idx; i++, e++) {
+            markPtr((StgClosure *)e->tvar);
+            markPtr(e->expected_value);
+            markPtr(e->new_value);
+        }
+        break;
+    }
+
+    default:
+        barf("incremental mark: unimplemented/strange closure type %d @ %p",
+             (int)(info->type), q);
+    }
+
+    return closure_sizeW_(q, info);
+}
+
+/* -----------------------------------------------------------------------------
+   The snapshot
+   -------------------------------------------------------------------------- */
+
+// Add the blocks that have been promoted into the oldest generation
+// since we last looked.  New blocks are always added to the front of
+// oldest_gen->blocks and oldest_gen->large_objects by the GC, and
+// nothing is removed from either list before the next major GC.
+static void
+extendSnapshot (void)
+{
+    bdescr *bd;
+    BitmapChunk *chunk;
+    StgWord *bitmap;
+    W_ n;
+
+    n = 0;
+    for (bd = oldest_gen->blocks; bd != snapshot_blocks_hd; bd = bd->link) {
+        n++;
+    }
+
+    if (n > 0) {
+        chunk = stgMallocBytes(sizeof(BitmapChunk) +
+                               n * BITMAP_WORDS * sizeof(W_),
+                               "extendSnapshot");
+        memset(chunk->bitmap, 0, n * BITMAP_WORDS * sizeof(W_));
+        chunk->link = bitmap_chunks;
+        bitmap_chunks = chunk;
+
+        bitmap = chunk->bitmap;
+        for (bd = oldest_gen->blocks; bd != snapshot_blocks_hd; bd = bd->link) {
+            // We'll mark these blocks in the final GC, so they must
+            // not be evacuated even if sweep() found them to be
+            // fragmented.
+            bd->flags = (bd->flags | BF_SNAPSHOT) & ~BF_FRAGMENTED;
+            bd->u.bitmap = bitmap;
+            pushSnapshot(bd, bitmap);
+            bitmap += BITMAP_WORDS;
+        }
+        snapshot_blocks_hd = oldest_gen->blocks;
+    }
+
+    for (bd = oldest_gen->large_objects; bd != snapshot_large_hd;
+         bd = bd->link) {
+        bd->flags = (bd->flags | BF_SNAPSHOT) & ~BF_INCMARKED;
+        pushSnapshot(bd, NULL);
+    }
+    snapshot_large_hd = oldest_gen->large_objects;
+}
+
+static void
+markRoots (rtsBool all)
+{
+    nat n;
+
+    for (n = 0; n < n_capabilities; n++) {
+        markCapability(markRoot, NULL, capabilities[n],
+                       rtsTrue/*don't mark sparks*/);
+    }
+    markScheduler(markRoot, NULL);
+
+    // These don't change much, so we only look at them once.
+    if (all) {
+        markCAFs(markRoot, NULL);
+        markStablePtrTable(markRoot, NULL);
+    }
+}
+
+static void
+startMark (void)
+{
+    ASSERT(n_snapshot == 0 && inc_stack.n == 0);
+
+    retrace_table = allocHashTable();
+    static_table  = allocHashTable();
+    snapshot_blocks_hd = NULL;
+    snapshot_large_hd  = NULL;
+
+    extendSnapshot();
+    markRoots(rtsTrue);
+
+    inc_mark_active = rtsTrue;
+    inc_mark_done   = rtsFalse;
+
+    debugTrace(DEBUG_gc, "incremental mark: started, %ld blocks in snapshot",
+               (long)n_snapshot);
+}
+
+static void
+resetMark (void)
+{
+    BitmapChunk *chunk, *next;
+
+    freeClosureList(&inc_stack);
+    freeClosureList(&retrace);
+    freeClosureList(&statics);
+
+    if (retrace_table != NULL) {
+        freeHashTable(retrace_table, NULL);
+        retrace_table = NULL;
+    }
+    if (static_table != NULL) {
+        freeHashTable(static_table, NULL);
+        static_table = NULL;
+    }
+
+    if (snapshot != NULL) {
+        stgFree(snapshot);
+        snapshot = NULL;
+    }
+    n_snapshot = 0;
+    snapshot_size = 0;
+
+    for (chunk = bitmap_chunks; chunk != NULL; chunk = next) {
+        next = chunk->link;
+        stgFree(chunk);
+    }
+    bitmap_chunks = NULL;
+
+    inc_mark_active = rtsFalse;
+    inc_mark_done   = rtsFalse;
+}
+
+/* -----------------------------------------------------------------------------
+   Interface to the rest of the GC
+   -------------------------------------------------------------------------- */
+
+void
+initIncMark (void)
+{
+#if defined(THREADED_RTS)
+    initSpinLock(&inc_mark_sync);
+#endif
+    resetMark();
+}
+
+void
+freeIncMark (void)
+{
+    resetMark();
+}
+
+/* Called by calcNeeded() when gen has grown past its maximum size:
+ * returns rtsTrue if we should do a minor GC instead, because an
+ * incremental mark is in progress or is about to start.
+ */
+rtsBool
+incMarkDefer (generation *gen, W_ blocks)
+{
+    if (!RtsFlags.GcFlags.incMark || gen != oldest_gen || gen->compact) {
+        return rtsFalse;
+    }
+    if (!inc_mark_active) {
+        return rtsTrue; // incMarkStep() starts the mark after this GC
+    }
+    return !inc_mark_done && blocks < 2 * gen->max_blocks;
+}
+
+/* Called at the end of each minor GC, with the world stopped.  Starts
+ * a new mark if the oldest generation is due for collection, and then
+ * does one slice of marking.
+ */
+void
+incMarkStep (void)
+{
+    W_ budget, traced;
+    StgClosure *q;
+    bdescr *bd;
+
+    budget = RtsFlags.GcFlags.incMarkSlice;
+    if (budget == 0) {
+        budget = 2 * RtsFlags.GcFlags.minAllocAreaSize * BLOCK_SIZE_W;
+    }
+
+    if (!inc_mark_active) {
+        if (!RtsFlags.GcFlags.incMark || oldest_gen->compact ||
+            oldest_gen->n_blocks + oldest_gen->n_large_blocks
+                <= oldest_gen->max_blocks) {
+            // Not due yet: spend the slice sweeping what the last
+            // major GC marked instead, reading as many bitmap words
+            // as we would trace words of heap.
+            lazySweepSlice(budget / BITMAP_WORDS + 1);
+            return;
+        }
+        // The snapshot needs bd->u.bitmap, and sweeping would take
+        // blocks out of oldest_gen->blocks under its feet.
+        finishLazySweep();
+        startMark();
+    } else if (!inc_mark_done) {
+        extendSnapshot();
+        markRoots(rtsFalse);
+    }
+
+    if (inc_mark_done) {
+        return;
+    }
+
+    traced = 0;
+    while (inc_stack.n > 0 && traced < budget) {
+        q = inc_stack.elems[--inc_stack.n];
+        scan_outside = rtsFalse;
+        traced += traceClosure(q);
+        if (scan_outside && HEAP_ALLOCED_GC(q)) {
+            // marked large objects are scanned again anyway
+            bd = Bdescr((P_)q);
+            if (!(bd->flags & BF_LARGE)) {
+                recordRetrace(q);
+            }
+        }
+    }
+
+    debugTrace(DEBUG_gc, "incremental mark: traced %ld words, %ld to go",
+               (long)traced, (long)inc_stack.n);
+
+    if (inc_stack.n == 0) {
+        inc_mark_done = rtsTrue;
+        debugTrace(DEBUG_gc, "incremental mark: done, %ld objects to retrace",
+                   (long)retrace.n);
+    }
+}
+
+/* Called for each object on the oldest generation's mutable list
+ * during a minor GC (by scavenge_mutable_list()), and at the start of
+ * the final GC (by incMarkRecordMutLists()).
+ */
+void
+incMarkRecordMutated (StgClosure *p)
+{
+    bdescr *bd;
+
+    // static objects are evacuated by the final GC anyway
+    if (!HEAP_ALLOCED_GC(p)) return;
+
+    bd = Bdescr((P_)p);
+
+    // only small objects that have already been marked; the marker
+    // will see the new contents of the others
+    if ((bd->flags & (BF_SNAPSHOT | BF_LARGE)) != BF_SNAPSHOT ||
+        !is_marked((P_)p, bd)) {
+        return;
+    }
+
+    // arrays stay on the mutable list when they haven't been written to
+    if (get_itbl(p)->type == MUT_ARR_PTRS_CLEAN) return;
+
+    ACQUIRE_SPIN_LOCK(&inc_mark_sync);
+    recordRetrace(p);
+    RELEASE_SPIN_LOCK(&inc_mark_sync);
+}
+
+/* Called by the final GC before the mutable lists of the oldest
+ * generation are freed.
+ */
+void
+incMarkRecordMutLists (void)
+{
+    nat n;
+    bdescr *bd;
+    StgPtr p;
+
+    for (n = 0; n < n_capabilities; n++) {
+        for (bd = capabilities[n]->mut_lists[oldest_gen->no]; bd != NULL;
+             bd = bd->link) {
+            for (p = bd->start; p < bd->free; p++) {
+                incMarkRecordMutated((StgClosure *)*p);
+            }
+        }
+    }
+}
+
+/* Called by the final GC after the bitmap for the oldest generation
+ * has been allocated, and before the roots are marked.  Carries over
+ * the marks, and hands the GC everything that it needs to trace
+ * (again).
+ */
+void
+incMarkFinish (evac_fn evac, void *user)
+{
+    W_ i;
+    nat j;
+    bdescr *bd;
+    StgClosure *q;
+
+    debugTrace(DEBUG_gc,
+               "incremental mark: finishing, %ld to retrace, %ld untraced",
+               (long)retrace.n, (long)inc_stack.n);
+
+    for (i = 0; i < n_snapshot; i++) {
+        bd = snapshot[i].bd;
+        if (snapshot[i].bitmap != NULL) {
+            ASSERT(bd->flags & BF_MARKED);
+            for (j = 0; j < BITMAP_WORDS; j++) {
+                bd->u.bitmap[j] |= snapshot[i].bitmap[j];
+            }
+            bd->flags &= ~BF_SNAPSHOT;
+        } else {
+            if (bd->flags & BF_INCMARKED) {
+                q = (StgClosure *)bd->start;
+                evac(user, &q);
+            }
+            bd->flags &= ~(BF_SNAPSHOT | BF_INCMARKED);
+        }
+    }
+
+    for (i = 0; i < retrace.n; i++) {
+        push_mark_stack((StgPtr)retrace.elems[i]);
+    }
+
+    // Objects that were marked but not traced.  Large objects and
+    // static objects have been dealt with already.
+    for (i = 0; i < inc_stack.n; i++) {
+        q = inc_stack.elems[i];
+        if (HEAP_ALLOCED_GC(q) && !(Bdescr((P_)q)->flags & BF_LARGE)) {
+            push_mark_stack((StgPtr)q);
+        }
+    }
+
+    for (i = 0; i < statics.n; i++) {
+        q = statics.elems[i];
+        evac(user, &q);
+    }
+
+    resetMark();
+}
@@ -0,0 +1,37 @@
+/* -----------------------------------------------------------------------------
+ *
+ * (c) The GHC Team 1998-2008
+ *
+ * Incremental marking of the oldest generation
+ *
+ * Documentation on the architecture of the Garbage Collector can be
+ * found in the online commentary:
+ *
+ *   http://hackage.haskell.org/trac/ghc/wiki/Commentary/Rts/Storage/GC
+ *
+ * ---------------------------------------------------------------------------*/
+
+#ifndef SM_INCMARK_H
+#define SM_INCMARK_H
+
+#include "GC.h" // for evac_fn
+
+#include "BeginPrivate.h"
+
+// rtsTrue between the start of an incremental mark and the major GC
+// that finishes it.
+extern rtsBool inc_mark_active;
+
+void    initIncMark            ( void );
+void    freeIncMark            ( void );
+
+rtsBool incMarkDefer           ( generation *gen, W_ blocks );
+void    incMarkStep            ( void );
+
+void    incMarkRecordMutated   ( StgClosure *p );
+void    incMarkRecordMutLists  ( void );
+void    incMarkFinish          ( evac_fn evac, void *user );
+
+#include "EndPrivate.h"
+
+#endif /* SM_INCMARK_H */
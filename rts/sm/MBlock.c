@@ -15,6 +15,7 @@
 #include "BlockAlloc.h"
 #include "Trace.h"
 #include "OSMem.h"
+#include "Capability.h"
 
 #include <string.h>
 
@@ -81,10 +82,238 @@ StgBool HEAP_ALLOCED_miss(StgWord mblock, void *p)
     }
 }
 
+#if defined(USE_HEAP_RESERVATION)
+
+/* -----------------------------------------------------------------------------
+   The reserved range (see HEAP_ALLOCED() in includes/rts/storage/MBlock.h)
+
+   mblocks come from the bottom of the range up to mblock_heap_top,
+   which only goes up.  The memory of a freed mblock is decommitted,
+   and the mblock goes on a list of free ranges, in address order with
+   neighbours merged, which we search (first fit) before taking more
+   from the top.  All of this happens with the same lock held as for
+   the rest of the mblock allocator.
+
+   With --huge-pages, the range is committed ahead of mblock_heap_top
+   a huge page at a time, up to mblock_heap_committed, so that the
+   kernel can back each huge page as a whole.  Explicit huge pages
+   can't be decommitted in parts, so then free mblocks keep their
+   memory, and taking them again needs no commit.
+   -------------------------------------------------------------------------- */
+
+StgWord mblock_heap_start = 0;
+StgWord mblock_heap_size  = 0;
+StgWord *mblock_heap_bitmap = NULL;
+
+static StgWord mblock_heap_top;         // the end of the part used so far
+static StgWord mblock_heap_committed;   // the end of the part committed
+static W_      mblock_commit_unit;      // what we commit the top in
+static rtsBool mblock_decommit;         // decommit free mblocks?
+
+typedef struct FreeRange_ {
+    StgWord start;
+    StgWord size;                       // in bytes
+    struct FreeRange_ *next;
+} FreeRange;
+
+static FreeRange *free_ranges = NULL;
+
+static void
+reserveHeap (void)
+{
+    W_ size;
+    void *p;
+
+    size = RtsFlags.GcFlags.heapReserveSize & ~(W_)MBLOCK_MASK;
+    if (size == 0) {
+        return;
+    }
+
+    // osReserveHeapMemory() settles for less if it must
+    p = osReserveHeapMemory((void *)RtsFlags.GcFlags.heapBase, &size);
+    if (p == NULL) {
+        debugTrace(DEBUG_gc, "couldn't reserve address space for the heap");
+        return;
+    }
+
+    mblock_heap_bitmap =
+        stgCallocBytes(size / MBLOCK_SIZE / BITS_IN(StgWord) + 1,
+                       sizeof(StgWord), "reserveHeap");
+    mblock_heap_start = (StgWord)p;
+    mblock_heap_top   = mblock_heap_start;
+    mblock_heap_committed = mblock_heap_start;
+    mblock_commit_unit = MBLOCK_SIZE;
+    if (osHugePageSize() > mblock_commit_unit) {
+        mblock_commit_unit = osHugePageSize();
+    }
+    mblock_decommit   = !osHugePagesExplicit();
+    free_ranges       = NULL;
+    // last, because it turns the range on
+    mblock_heap_size  = size;
+
+    debugTrace(DEBUG_gc, "reserved %" FMT_Word " bytes for the heap at %p",
+               size, p);
+}
+
+static void
+releaseHeap (void)
+{
+    FreeRange *r, *next;
+
+    if (mblock_heap_size == 0) {
+        return;
+    }
+
+    osReleaseHeapMemory((void *)mblock_heap_start, mblock_heap_size);
+    mblock_heap_size = 0;
+
+    stgFree(mblock_heap_bitmap);
+    mblock_heap_bitmap = NULL;
+    for (r = free_ranges; r != NULL; r = next) {
+        next = r->next;
+        stgFree(r);
+    }
+    free_ranges = NULL;
+}
+
+static void
+setReservedAlloced (void *p, StgWord8 i)
+{
+    StgWord mblock = ((StgWord)p - mblock_heap_start) >> MBLOCK_SHIFT;
+    StgWord bit = (StgWord)1 << (mblock % BITS_IN(StgWord));
+
+    if (i) {
+        mblock_heap_bitmap[mblock / BITS_IN(StgWord)] |= bit;
+    } else {
+        mblock_heap_bitmap[mblock / BITS_IN(StgWord)] &= ~bit;
+    }
+}
+
+// n mblocks from the range, or NULL if there isn't room
+static void *
+getReservedMBlocks (nat n)
+{
+    W_ size = (W_)n * MBLOCK_SIZE;
+    FreeRange *r, **prev;
+    StgWord ret;
+
+    for (prev = &free_ranges; (r = *prev) != NULL; prev = &r->next) {
+        if (r->size >= size) {
+            ret = r->start;
+            r->start += size;
+            r->size  -= size;
+            if (r->size == 0) {
+                *prev = r->next;
+                stgFree(r);
+            }
+            if (mblock_decommit) {
+                osCommitMemory((void *)ret, size);
+            }
+            return (void *)ret;
+        }
+    }
+
+    if (mblock_heap_start + mblock_heap_size - mblock_heap_top < size) {
+        return NULL;
+    }
+    ret = mblock_heap_top;
+    mblock_heap_top += size;
+    if (mblock_heap_top > mblock_heap_committed) {
+        StgWord end;
+        end = (mblock_heap_top + mblock_commit_unit - 1)
+            & ~(mblock_commit_unit - 1);
+        if (end > mblock_heap_start + mblock_heap_size) {
+            end = mblock_heap_start + mblock_heap_size;
+        }
+        osCommitMemory((void *)mblock_heap_committed,
+                       end - mblock_heap_committed);
+        mblock_heap_committed = end;
+    }
+    return (void *)ret;
+}
+
+static void
+freeReservedMBlocks (void *addr, nat n)
+{
+    StgWord start = (StgWord)addr;
+    W_ size = (W_)n * MBLOCK_SIZE;
+    FreeRange *before, *after, *r;
+
+    if (mblock_decommit) {
+        osDecommitMemory(addr, size);
+    }
+
+    before = NULL;
+    for (after = free_ranges; after != NULL && after->start < start;
+         after = after->next) {
+        before = after;
+    }
+
+    if (before != NULL && before->start + before->size == start) {
+        before->size += size;
+        if (after != NULL && before->start + before->size == after->start) {
+            before->size += after->size;
+            before->next = after->next;
+            stgFree(after);
+        }
+        return;
+    }
+
+    if (after != NULL && start + size == after->start) {
+        after->start = start;
+        after->size += size;
+        return;
+    }
+
+    r = stgMallocBytes(sizeof(FreeRange), "freeReservedMBlocks");
+    r->start = start;
+    r->size  = size;
+    r->next  = after;
+    if (before == NULL) {
+        free_ranges = r;
+    } else {
+        before->next = r;
+    }
+}
+
+// The first allocated mblock of the range from the ith on, or NULL
+static void *
+nextReservedMBlock (StgWord i)
+{
+    StgWord n = (mblock_heap_top - mblock_heap_start) >> MBLOCK_SHIFT;
+    StgWord w;
+
+    if (mblock_heap_size == 0) {
+        return NULL;
+    }
+
+    for (; i < n; i++) {
+        w = mblock_heap_bitmap[i / BITS_IN(StgWord)] >> (i % BITS_IN(StgWord));
+        if (w == 0) {
+            // nothing more in this word
+            i |= BITS_IN(StgWord) - 1;
+        } else if (w & 1) {
+            return (void *)(mblock_heap_start + (i << MBLOCK_SHIFT));
+        }
+    }
+    return NULL;
+}
+
+#endif /* USE_HEAP_RESERVATION */
+
 static void
 setHeapAlloced(void *p, StgWord8 i)
 {
-    MBlockMap *map = findMBlockMap(p);
+    MBlockMap *map;
+
+#if defined(USE_HEAP_RESERVATION)
+    if (HEAP_RESERVED(p)) {
+        setReservedAlloced(p, i);
+        return;
+    }
+#endif
+
+    map = findMBlockMap(p);
     if(map == NULL)
     {
     	mblock_map_count++;
@@ -152,7 +381,7 @@ void * getNextMBlock(void *mblock)
 
 #elif SIZEOF_VOID_P == 8
 
-void * getNextMBlock(void *p)
+static void * getNextMappedMBlock(void *p)
 {
     MBlockMap *map;
     nat off, j;
@@ -189,12 +418,15 @@ void * getNextMBlock(void *p)
     return NULL;
 }
 
-void * getFirstMBlock(void)
+static void * getFirstMappedMBlock(void)
 {
-    MBlockMap *map = mblock_maps[0];
+    MBlockMap *map;
     nat line_no, off;
     MbcCacheLine line;
 
+    if (mblock_map_count == 0) return NULL;
+    map = mblock_maps[0];
+
     for (line_no = 0; line_no < MBLOCK_MAP_ENTRIES; line_no++) {
         line = map->lines[line_no];
         if (line) {
@@ -210,6 +442,32 @@ void * getFirstMBlock(void)
     return NULL;
 }
 
+// The mblocks of the reserved range come first, then the others
+
+void * getFirstMBlock(void)
+{
+#if defined(USE_HEAP_RESERVATION)
+    void *p = nextReservedMBlock(0);
+    if (p != NULL) return p;
+#endif
+    return getFirstMappedMBlock();
+}
+
+void * getNextMBlock(void *mblock)
+{
+#if defined(USE_HEAP_RESERVATION)
+    void *p;
+
+    if (HEAP_RESERVED(mblock)) {
+        p = nextReservedMBlock(
+            (((StgWord)mblock - mblock_heap_start) >> MBLOCK_SHIFT) + 1);
+        if (p != NULL) return p;
+        return getFirstMappedMBlock();
+    }
+#endif
+    return getNextMappedMBlock(mblock);
+}
+
 #endif // SIZEOF_VOID_P
 
 /* -----------------------------------------------------------------------------
@@ -231,7 +489,16 @@ getMBlocks(nat n)
     nat i;
     void *ret;
 
-    ret = osGetMBlocks(n);
+    ret = NULL;
+#if defined(USE_HEAP_RESERVATION)
+    if (mblock_heap_size != 0) {
+        ret = getReservedMBlocks(n);
+    }
+    if (ret == NULL)
+#endif
+    {
+        ret = osGetMBlocks(n);
+    }
 
     debugTrace(DEBUG_gc, "allocated %d megablock(s) at %p",n,ret);
     
@@ -246,6 +513,26 @@ getMBlocks(nat n)
     return ret;
 }
 
+// Allocate 'n' mblocks, and ask the OS to back them with memory on
+// the given NUMA node (an index into numa_map[]).
+
+void *
+getMBlocksOnNode(nat node, nat n)
+{
+    void *ret;
+
+    ret = getMBlocks(n);
+#ifdef DEBUG
+    if (!RtsFlags.GcFlags.numa && node != 0) {
+        barf("getMBlocksOnNode: node %d without --numa", node);
+    }
+#endif
+    if (RtsFlags.GcFlags.numa) {
+        osBindMBlocksToNode(ret, (StgWord)n * MBLOCK_SIZE, numa_map[node]);
+    }
+    return ret;
+}
+
 void
 freeMBlocks(void *addr, nat n)
 {
@@ -259,7 +546,26 @@ freeMBlocks(void *addr, nat n)
         markHeapUnalloced( (StgWord8*)addr + i * MBLOCK_SIZE );
     }
 
+#if defined(USE_HEAP_RESERVATION)
+    // The block allocator merges neighbouring free mblocks, so a group
+    // might have mblocks from both inside and outside the range.
+    while (n > 0) {
+        rtsBool reserved = HEAP_RESERVED(addr);
+        for (i = 1; i < n; i++) {
+            if (HEAP_RESERVED((StgWord8*)addr + i * MBLOCK_SIZE) != reserved)
+                break;
+        }
+        if (reserved) {
+            freeReservedMBlocks(addr, i);
+        } else {
+            osFreeMBlocks(addr, i);
+        }
+        addr = (StgWord8*)addr + i * MBLOCK_SIZE;
+        n -= i;
+    }
+#else
     osFreeMBlocks(addr, n);
+#endif
 }
 
 void
@@ -267,6 +573,11 @@ freeAllMBlocks(void)
 {
     debugTrace(DEBUG_gc, "freeing all megablocks");
 
+#if defined(USE_HEAP_RESERVATION)
+    // before osFreeAllMBlocks(), so that it only sees the others
+    releaseHeap();
+#endif
+
     osFreeAllMBlocks();
 
 #if SIZEOF_VOID_P == 8
@@ -275,6 +586,8 @@ freeAllMBlocks(void)
         stgFree(mblock_maps[n]);
     }
     stgFree(mblock_maps);
+    mblock_maps = NULL;
+    mblock_map_count = 0;
 #endif
 }
 
@@ -285,4 +598,7 @@ initMBlocks(void)
 #if SIZEOF_VOID_P == 8
     memset(mblock_cache,0xff,sizeof(mblock_cache));
 #endif
+#if defined(USE_HEAP_RESERVATION)
+    reserveHeap();
+#endif
 }
@@ -15,10 +15,26 @@ void osMemInit(void);
 void *osGetMBlocks(nat n);
 void osFreeMBlocks(char *addr, nat n);
 void osReleaseFreeMemory(void);
+rtsBool osDiscardMemory(void *at, W_ size);
+W_ osResidentMemory(void);
 void osFreeAllMBlocks(void);
 W_ getPageSize (void);
 void setExecutable (void *p, W_ len, rtsBool exec);
 
+rtsBool osNumaAvailable(void);
+nat osNumaNodes(void);
+StgWord osNumaMask(void);
+void osBindMBlocksToNode(void *addr, StgWord size, nat node);
+
+#if defined(USE_HEAP_RESERVATION)
+void *osReserveHeapMemory(void *hint, W_ *len);
+void osCommitMemory(void *at, W_ size);
+void osDecommitMemory(void *at, W_ size);
+void osReleaseHeapMemory(void *at, W_ size);
+W_ osHugePageSize(void);
+rtsBool osHugePagesExplicit(void);
+#endif
+
 #include "EndPrivate.h"
 
 #endif /* SM_OSMEM_H */
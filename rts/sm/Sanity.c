@@ -770,6 +770,8 @@ findMemoryLeak (void)
         markBlocks(capabilities[i]->pinned_object_block);
     }
 
+    markBlockCaches();
+
 #ifdef PROFILING
   // TODO:
   // if (RtsFlags.ProfFlags.doHeapProfile == HEAP_BY_RETAINER) {
@@ -791,13 +793,16 @@ void
 checkRunQueue(Capability *cap)
 {
     StgTSO *prev, *tso;
+    nat n;
     prev = END_TSO_QUEUE;
+    n = 0;
     for (tso = cap->run_queue_hd; tso != END_TSO_QUEUE; 
-         prev = tso, tso = tso->_link) {
+         prev = tso, tso = tso->_link, n++) {
         ASSERT(prev == END_TSO_QUEUE || prev->_link == tso);
         ASSERT(tso->block_info.prev == prev);
     }
     ASSERT(cap->run_queue_tl == prev);
+    ASSERT(cap->n_run_queue == n);
 }
 
 /* -----------------------------------------------------------------------------
@@ -829,7 +834,9 @@ genBlocks (generation *gen)
     ASSERT(countBlocks(gen->blocks) == gen->n_blocks);
     ASSERT(countBlocks(gen->large_objects) == gen->n_large_blocks);
     return gen->n_blocks + gen->n_old_blocks + 
-	    countAllocdBlocks(gen->large_objects);
+	    countAllocdBlocks(gen->large_objects) +
+            // the bitmap outlives the GC while the gen is swept lazily
+            (gen->bitmap != NULL ? gen->bitmap->blocks : 0);
 }
 
 void
@@ -838,7 +845,7 @@ memInventory (rtsBool show)
   nat g, i;
   W_ gen_blocks[RtsFlags.GcFlags.generations];
   W_ nursery_blocks, retainer_blocks,
-       arena_blocks, exec_blocks;
+       arena_blocks, exec_blocks, cached_blocks;
   W_ live_blocks = 0, free_blocks = 0;
   rtsBool leak;
 
@@ -878,6 +885,9 @@ memInventory (rtsBool show)
   // count the blocks containing executable memory
   exec_blocks = countAllocdBlocks(exec_block);
 
+  // count the blocks in the Capabilities' block caches
+  cached_blocks = countBlockCaches();
+
   /* count the blocks on the free list */
   free_blocks = countFreeList();
 
@@ -886,7 +896,7 @@ memInventory (rtsBool show)
       live_blocks += gen_blocks[g];
   }
   live_blocks += nursery_blocks + 
-               + retainer_blocks + arena_blocks + exec_blocks;
+               + retainer_blocks + arena_blocks + exec_blocks + cached_blocks;
 
 #define MB(n) (((double)(n) * BLOCK_SIZE_W) / ((1024*1024)/sizeof(W_)))
 
@@ -911,6 +921,8 @@ memInventory (rtsBool show)
                  arena_blocks, MB(arena_blocks));
       debugBelch("  exec         : %5" FMT_Word " blocks (%6.1lf MB)\n",
                  exec_blocks, MB(exec_blocks));
+      debugBelch("  cached       : %5" FMT_Word " blocks (%6.1lf MB)\n",
+                 cached_blocks, MB(cached_blocks));
       debugBelch("  free         : %5" FMT_Word " blocks (%6.1lf MB)\n",
                  free_blocks, MB(free_blocks));
       debugBelch("  total        : %5" FMT_Word " blocks (%6.1lf MB)\n",
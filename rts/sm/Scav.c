@@ -20,6 +20,7 @@
 #include "GCUtils.h"
 #include "Compact.h"
 #include "MarkStack.h"
+#include "IncMark.h"
 #include "Evac.h"
 #include "Scav.h"
 #include "Apply.h"
@@ -1435,6 +1436,12 @@ scavenge_mutable_list(bdescr *bd, generation *gen)
             }
 #endif
 
+            // The incremental mark needs to know about mutated objects
+            // that it has already traced (see IncMark.c).
+            if (inc_mark_active && gen == oldest_gen) {
+                incMarkRecordMutated((StgClosure *)p);
+            }
+
 	    // Check whether this object is "clean", that is it
 	    // definitely doesn't point into a young generation.
 	    // Clean objects don't need to be scavenged.  Some clean
@@ -29,6 +29,8 @@
 #include "Trace.h"
 #include "GC.h"
 #include "Evac.h"
+#include "IncMark.h"
+#include "Sweep.h"
 #if defined(ios_HOST_OS)
 #include "Hash.h"
 #endif
@@ -169,6 +171,14 @@ initStorage (void)
       }
   }
 
+  if (RtsFlags.GcFlags.incMark) {
+      if (RtsFlags.GcFlags.generations == 1 || RtsFlags.GcFlags.compact) {
+          errorBelch("WARNING: incremental marking is incompatible with -G1 and -c; disabled");
+          RtsFlags.GcFlags.incMark = rtsFalse;
+      }
+  }
+  initIncMark();
+
   generations[0].max_blocks = 0;
 
   caf_list = END_OF_STATIC_LIST;
@@ -231,7 +241,8 @@ void storageAddCapabilities (nat from, nat to)
     // allocate a block for each mut list
     for (n = from; n < to; n++) {
         for (g = 1; g < RtsFlags.GcFlags.generations; g++) {
-            capabilities[n]->mut_lists[g] = allocBlock();
+            capabilities[n]->mut_lists[g] =
+                allocBlockOnNode(capNoToNumaNode(n));
         }
     }
 
@@ -263,6 +274,8 @@ freeStorage (rtsBool free_heap)
     freeThreadLocalKey(&gctKey);
 #endif
     freeGcThreads();
+    freeIncMark();
+    resetLazySweep();
 }
 
 /* -----------------------------------------------------------------------------
@@ -439,7 +452,7 @@ newDynCAF (StgRegTable *reg STG_UNUSED, StgClosure *caf, StgClosure *bh)
    -------------------------------------------------------------------------- */
 
 static bdescr *
-allocNursery (bdescr *tail, W_ blocks)
+allocNursery (nat node, bdescr *tail, W_ blocks)
 {
     bdescr *bd = NULL;
     W_ i, n;
@@ -455,7 +468,7 @@ allocNursery (bdescr *tail, W_ blocks)
         // allocLargeChunk will prefer large chunks, but will pick up
         // small chunks if there are any available.  We must allow
         // single blocks here to avoid fragmentation (#7257)
-        bd = allocLargeChunk(1, n);
+        bd = allocLargeChunkOnNode(node, 1, n);
         n = bd->blocks;
         blocks -= n;
 
@@ -507,7 +520,8 @@ allocNurseries (nat from, nat to)
 
     for (i = from; i < to; i++) {
         nurseries[i].blocks =
-            allocNursery(NULL, RtsFlags.GcFlags.minAllocAreaSize);
+            allocNursery(capNoToNumaNode(i), NULL,
+                         RtsFlags.GcFlags.minAllocAreaSize);
         nurseries[i].n_blocks =
             RtsFlags.GcFlags.minAllocAreaSize;
     }
@@ -551,14 +565,19 @@ resizeNursery (nursery *nursery, W_ blocks)
 {
   bdescr *bd;
   W_ nursery_blocks;
+  nat node;
 
   nursery_blocks = nursery->n_blocks;
   if (nursery_blocks == blocks) return;
 
+  // nursery i belongs to capability i
+  node = capNoToNumaNode(nursery - nurseries);
+
   if (nursery_blocks < blocks) {
       debugTrace(DEBUG_gc, "increasing size of nursery to %d blocks", 
                  blocks);
-    nursery->blocks = allocNursery(nursery->blocks, blocks-nursery_blocks);
+    nursery->blocks = allocNursery(node, nursery->blocks,
+                                   blocks-nursery_blocks);
   } 
   else {
     bdescr *next_bd;
@@ -578,7 +597,8 @@ resizeNursery (nursery *nursery, W_ blocks)
     // might have gone just under, by freeing a large block, so make
     // up the difference.
     if (nursery_blocks < blocks) {
-        nursery->blocks = allocNursery(nursery->blocks, blocks-nursery_blocks);
+        nursery->blocks = allocNursery(node, nursery->blocks,
+                                   blocks-nursery_blocks);
     }
   }
   
@@ -667,8 +687,13 @@ allocate (Capability *cap, W_ n)
             stg_exit(EXIT_HEAPOVERFLOW);
         }
 
+        // Small large objects come from the Capability's block
+        // cache, so we only need the lock to link the object in.
+        bd = allocGroupFromCache(cap, req_blocks);
         ACQUIRE_SM_LOCK
-        bd = allocGroup(req_blocks);
+        if (bd == NULL) {
+            bd = allocGroupRefillCache(cap, req_blocks);
+        }
         dbl_link_onto(bd, &g0->large_objects);
         g0->n_large_blocks += bd->blocks; // might be larger than req_blocks
         g0->n_new_large_words += n;
@@ -693,10 +718,8 @@ allocate (Capability *cap, W_ n)
         if (bd == NULL || bd->free + n > bd->start + BLOCK_SIZE_W) {
             // The nursery is empty, or the next block is already
             // full: allocate a fresh block (we can't fail here).
-            ACQUIRE_SM_LOCK;
-            bd = allocBlock();
+            bd = allocBlockOnCap_lock(cap);
             cap->r.rNursery->n_blocks++;
-            RELEASE_SM_LOCK;
             initBdescr(bd, g0, g0);
             bd->flags = 0;
             // If we had to allocate a new block, then we'll GC
@@ -799,9 +822,7 @@ allocatePinned (Capability *cap, W_ n)
             // counted towards allocation, and we're already counting
             // our pinned obects as allocation in
             // collect_pinned_object_blocks in the GC.
-            ACQUIRE_SM_LOCK;
-            bd = allocBlock();
-            RELEASE_SM_LOCK;
+            bd = allocBlockOnCap_lock(cap);
             initBdescr(bd, g0, g0);
         } else {
             // we have a block in the nursery: steal it
@@ -1049,7 +1070,9 @@ calcNeeded (rtsBool force_major, memcount *blocks_needed)
         
         // are we collecting this gen?
         if (g == 0 || // always collect gen 0
-            blocks > gen->max_blocks)
+            (blocks > gen->max_blocks &&
+             // not while it is being marked incrementally
+             !incMarkDefer(gen, blocks)))
         {
             N = stg_max(N,g);
 
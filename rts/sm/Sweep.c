@@ -15,14 +15,42 @@
 #include "Rts.h"
 
 #include "BlockAlloc.h"
+#include "Storage.h"
 #include "Sweep.h"
 #include "Trace.h"
 
+#define BITMAP_WORDS (BLOCK_SIZE_W / BITS_IN(W_))
+
+// Returns the number of words of bd's mark bitmap that are non-zero,
+// and flags bd BF_FRAGMENTED if that is less than 3/4 of them.
+static W_
+sweepBlock (bdescr *bd)
+{
+    nat i;
+    W_ resid;
+
+    resid = 0;
+    for (i = 0; i < BITMAP_WORDS; i++)
+    {
+        if (bd->u.bitmap[i] != 0) resid++;
+    }
+
+    if (resid != 0)
+    {
+        if (resid < (BITMAP_WORDS * 3) / 4) {
+            bd->flags |= BF_FRAGMENTED;
+        }
+
+        bd->flags |= BF_SWEPT;
+    }
+
+    return resid;
+}
+
 void
 sweep(generation *gen)
 {
     bdescr *bd, *prev, *next;
-    nat i;
     W_ freed, resid, fragd, blocks, live;
     
     ASSERT(countBlocks(gen->old_blocks) == gen->n_old_blocks);
@@ -42,11 +70,7 @@ sweep(generation *gen)
         }
 
         blocks++;
-        resid = 0;
-        for (i = 0; i < BLOCK_SIZE_W / BITS_IN(W_); i++)
-        {
-            if (bd->u.bitmap[i] != 0) resid++;
-        }
+        resid = sweepBlock(bd);
         live += resid * BITS_IN(W_);
 
         if (resid == 0)
@@ -63,12 +87,9 @@ sweep(generation *gen)
         else
         {
             prev = bd;
-            if (resid < (BLOCK_SIZE_W * 3) / (BITS_IN(W_) * 4)) {
+            if (bd->flags & BF_FRAGMENTED) {
                 fragd++;
-                bd->flags |= BF_FRAGMENTED;
             }
-
-            bd->flags |= BF_SWEPT;
         }
     }
 
@@ -84,3 +105,144 @@ sweep(generation *gen)
 
     ASSERT(countBlocks(gen->old_blocks) == gen->n_old_blocks);
 }
+
+/* -----------------------------------------------------------------------------
+   Lazy sweeping (+RTS -wi)
+
+   With incremental marking, the major GC doesn't sweep the oldest
+   generation.  It moves the marked blocks to the front of gen->blocks
+   as usual, keeps gen->bitmap, and calls startLazySweep().  After
+   that, the blocks are swept a slice at a time at the end of each
+   minor GC (lazySweepSlice(), called by incMarkStep()).  Whatever is
+   left is swept by finishLazySweep() before the oldest generation's
+   bitmap is needed again: at the start of the next major GC, and when
+   an incremental mark takes its snapshot.
+
+   Until they are swept, the blocks are flagged BF_SWEPT like swept
+   blocks, because both may contain dead objects.  Nothing is removed
+   from gen->blocks between major GCs other than by the sweep, and new
+   blocks are only ever added to the front, so the block in front of
+   the next one to sweep stays put once we've found it.
+   -------------------------------------------------------------------------- */
+
+static generation *lazy_gen = NULL;     // NULL if there's nothing to sweep
+static bdescr *lazy_bd;                 // next block to sweep
+static bdescr *lazy_prev;               // the block before lazy_bd, or NULL
+static W_ lazy_todo;                    // blocks left to sweep
+static W_ lazy_blocks, lazy_freed, lazy_fragd, lazy_live;
+
+/* Called at the end of a major GC, after the first n blocks of
+ * gen->blocks have been marked (but not swept).
+ */
+void
+startLazySweep (generation *gen, W_ n)
+{
+    ASSERT(lazy_gen == NULL);
+
+    if (n == 0) {
+        return;
+    }
+
+    lazy_gen    = gen;
+    lazy_bd     = gen->blocks;
+    lazy_prev   = NULL;
+    lazy_todo   = n;
+    lazy_blocks = n;
+    lazy_freed  = 0;
+    lazy_fragd  = 0;
+    lazy_live   = 0;
+}
+
+rtsBool
+lazySweepPending (generation *gen)
+{
+    return lazy_gen == gen;
+}
+
+/* Sweep at most n blocks.
+ */
+void
+lazySweepSlice (W_ n)
+{
+    generation *gen;
+    bdescr *bd, *next;
+    W_ resid;
+
+    gen = lazy_gen;
+    if (gen == NULL) {
+        return;
+    }
+
+    if (lazy_prev == NULL && gen->blocks != lazy_bd) {
+        for (bd = gen->blocks; bd->link != lazy_bd; bd = bd->link) {
+            ASSERT(bd->link != NULL);
+        }
+        lazy_prev = bd;
+    }
+
+    for (; lazy_todo > 0 && n > 0; lazy_todo--, n--)
+    {
+        bd = lazy_bd;
+        next = bd->link;
+
+        resid = sweepBlock(bd);
+        lazy_live += resid * BITS_IN(W_);
+
+        if (resid == 0)
+        {
+            lazy_freed++;
+            gen->n_blocks--;
+            gen->n_words -= bd->free - bd->start;
+            if (lazy_prev == NULL) {
+                gen->blocks = next;
+            } else {
+                lazy_prev->link = next;
+            }
+            freeGroup(bd);
+        }
+        else
+        {
+            lazy_prev = bd;
+            if (bd->flags & BF_FRAGMENTED) {
+                lazy_fragd++;
+            }
+        }
+
+        lazy_bd = next;
+    }
+
+    if (lazy_todo > 0) {
+        return;
+    }
+
+    gen->live_estimate = lazy_live;
+
+    freeGroup(gen->bitmap);
+    gen->bitmap = NULL;
+    lazy_gen = NULL;
+
+    debugTrace(DEBUG_gc, "lazy sweep done: %ld blocks, %ld freed, %ld are fragmented, live estimate: %ld words",
+               (long)lazy_blocks, (long)lazy_freed, (long)lazy_fragd,
+               (long)lazy_live);
+
+    ASSERT(countBlocks(gen->blocks) == gen->n_blocks);
+    ASSERT(countOccupied(gen->blocks) == gen->n_words);
+}
+
+void
+finishLazySweep (void)
+{
+    if (lazy_gen != NULL) {
+        debugTrace(DEBUG_gc, "lazy sweep: finishing, %ld blocks to go",
+                   (long)lazy_todo);
+        lazySweepSlice(lazy_todo);
+    }
+}
+
+// Forget about any sweep in progress when the storage manager shuts
+// down; the bitmap goes with the rest of the heap.
+void
+resetLazySweep (void)
+{
+    lazy_gen = NULL;
+}
@@ -16,4 +16,10 @@
 
 RTS_PRIVATE void sweep(generation *gen);
 
+RTS_PRIVATE void    startLazySweep   (generation *gen, W_ n);
+RTS_PRIVATE rtsBool lazySweepPending (generation *gen);
+RTS_PRIVATE void    lazySweepSlice   (W_ n);
+RTS_PRIVATE void    finishLazySweep  (void);
+RTS_PRIVATE void    resetLazySweep   (void);
+
 #endif /* SM_SWEEP_H */
@@ -365,6 +365,27 @@ osFreeAllMBlocks(void)
     }
 }
 
+rtsBool osDiscardMemory(void *at, W_ size)
+{
+    W_ page = getPageSize();
+    W_ start = ((W_)at + page - 1) & ~(page - 1);
+    W_ end = ((W_)at + size) & ~(page - 1);
+
+    if (end <= start) {
+        return rtsFalse;
+    }
+    // MEM_RESET: the pages can be dropped rather than written to the
+    // page file, but stay committed
+    return VirtualAlloc((LPVOID)start, end - start, MEM_RESET,
+                        PAGE_READWRITE) != NULL;
+}
+
+W_ osResidentMemory(void)
+{
+    // needs psapi; we don't report it
+    return 0;
+}
+
 W_ getPageSize (void)
 {
     static W_ pagesize = 0;
@@ -390,3 +411,23 @@ void setExecutable (void *p, W_ len, rtsBool exec)
         stg_exit(EXIT_FAILURE);
     }
 }
+
+rtsBool osNumaAvailable(void)
+{
+    return rtsFalse;
+}
+
+nat osNumaNodes(void)
+{
+    return 1;
+}
+
+StgWord osNumaMask(void)
+{
+    return 1;
+}
+
+void osBindMBlocksToNode(void *addr STG_UNUSED, StgWord size STG_UNUSED,
+                         nat node STG_UNUSED)
+{
+}
@@ -280,6 +280,13 @@ setThreadAffinity (nat n, nat m) // cap N of M
     }
 }
 
+// --numa is rejected on Windows (see procRtsOpts()), so there is only
+// ever one node, and nothing to do.
+void
+setThreadNode (nat node STG_UNUSED)
+{
+}
+
 typedef BOOL (WINAPI *PCSIO)(HANDLE);
 
 void
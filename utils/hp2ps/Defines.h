@@ -13,6 +13,8 @@ extern floatish _thresh_;
 #define DEFAULT_TWENTY		20 /* this is default and maximum per page   */
 extern int _twenty_;
 
+#define DEFAULT_BIN_SAMPLES   2000 /* samples kept of a binary profile	     */
+
 #define LARGE_FONT	        12  /* Helvetica 12pt 			     */
 #define NORMAL_FONT		10  /* Helvetica 10pt 			     */
 
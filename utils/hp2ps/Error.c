@@ -40,7 +40,7 @@ void
 Usage(const char *str)
 {
    if (str) printf("error: %s\n", str);
-   printf("usage: %s -b -d -ef -g -i -p -mn -p -s -tf -y [file[.hp]]\n", programname);
+   printf("usage: %s -b -d -ef -g -i -p -mn -p -s -tf -y -wf,f -nn [file[.hp]]\n", programname);
    printf("where -b  use large title box\n");
    printf("      -d  sort by standard deviation\n"); 
    printf("      -ef[in|mm|pt] produce Encapsulated PostScript f units wide (f > 2 inches)\n");
@@ -54,6 +54,10 @@ Usage(const char *str)
    printf("      -tf ignore trace bands which sum below f%% (default 1%%, max 5%%)\n");
    printf("      -y  traditional\n");
    printf("      -c  colour output\n");
+   printf("      -wf,f draw only the samples between the two times\n");
+   printf("      -nn keep at most n samples, thinning them out evenly\n");
+   printf("          (default: all of a text profile, %d of a binary one)\n", DEFAULT_BIN_SAMPLES);
+   printf("          -n0 keeps every sample\n");
    exit(0);
 }
 
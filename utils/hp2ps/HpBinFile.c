@@ -0,0 +1,236 @@
+#include "Main.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Defines.h"
+#include "Error.h"
+#include "HpFile.h"
+#include "Utilities.h"
+#include "rts/HeapProfileFormat.h"
+
+/* own stuff */
+#include "HpBinFile.h"
+
+/*
+ *	Read a binary heap profile, as written by the RTS with
+ *	+RTS --heap-profile-format=binary.  The format is described in
+ *	includes/rts/HeapProfileFormat.h.
+ *
+ *	The profile is read a record at a time.  All that is kept of the
+ *	samples read so far is the current value of each identifier, so
+ *	the memory needed is bounded by the number of identifiers and the
+ *	number of samples kept (see BeginSample()), however long the
+ *	profile is.  The samples that are kept are stored just as those
+ *	of a text profile are.
+ */
+
+struct ident {
+    char *name;
+    struct entry *entry;	/* made when its value is first stored */
+    intish value;		/* its value in the last sample		*/
+};
+
+static struct ident *idents;	/* indexed by identifier number		*/
+static uintish nbinidents;	/* identifiers read so far		*/
+static uintish nbinidentmax;	/* size of idents			*/
+
+static FILE *binfp;
+static long offset;		/* bytes read, for error messages	*/
+
+static int
+GetByte(void)
+{
+    int c;
+
+    c = getc(binfp);
+    if (c == EOF) {
+	Error("%s, byte %ld: unexpected end of file", hpfile, offset);
+    }
+    offset++;
+    return c;
+}
+
+static uintish
+GetVarint(void)
+{
+    uintish w;
+    int shift;
+    int c;
+
+    w = 0;
+    shift = 0;
+    do {
+	c = GetByte();
+	if (shift < (int) (8 * sizeof(uintish))) {
+	    w |= (uintish) (c & 0x7f) << shift;
+	}
+	shift += 7;
+    } while (c & 0x80);
+
+    return w;
+}
+
+static intish
+GetSVarint(void)
+{
+    uintish w;
+
+    w = GetVarint();
+    return (intish) (w >> 1) ^ -(intish) (w & 1);
+}
+
+static char *
+GetBinString(void)
+{
+    char *s;
+    size_t i, size;
+
+    size = 64;
+    s = xmalloc(size);
+
+    for (i = 0; (s[ i ] = GetByte()) != '\0'; i++) {
+	if (i == size - 1) {
+	    size *= 2;
+	    s = xrealloc(s, size);
+	}
+    }
+
+    return s;
+}
+
+static void
+GetBinIdent(void)
+{
+    uintish id;
+
+    id = GetVarint();
+    if (id != nbinidents) {
+	Error("%s, byte %ld: identifier %lu out of sequence", hpfile,
+	      offset, (unsigned long) id);
+    }
+
+    if (nbinidents >= nbinidentmax) {
+	if (!idents) {
+	    nbinidentmax = 256;
+	    idents = (struct ident *) xmalloc(nbinidentmax * sizeof(struct ident));
+	} else {
+	    nbinidentmax *= 2;
+	    idents = (struct ident *) xrealloc(idents,
+					       nbinidentmax * sizeof(struct ident));
+	}
+    }
+
+    idents[ id ].name  = GetBinString();
+    idents[ id ].entry = 0;
+    idents[ id ].value = 0;
+    nbinidents++;
+}
+
+/*
+ *	Apply the changes of a sample to the current values, and then,
+ *	if the sample is to be kept, store all the values that aren't 0.
+ */
+
+static void
+GetBinSample(floatish t)
+{
+    uintish n, id;
+    uintish i;
+
+    for (n = GetVarint(); n > 0; n--) {
+	id = GetVarint();
+	if (id >= nbinidents) {
+	    Error("%s, byte %ld: unknown identifier %lu", hpfile,
+		  offset, (unsigned long) id);
+	}
+	idents[ id ].value += GetSVarint();
+    }
+
+    if (BeginSample(t)) {
+	for (i = 0; i < nbinidents; i++) {
+	    if (idents[ i ].value == 0) continue;
+	    if (!idents[ i ].entry) {
+		idents[ i ].entry = GetEntry(idents[ i ].name);
+	    }
+	    StoreSample(idents[ i ].entry, nsamples, (floatish) idents[ i ].value);
+	}
+	EndSample();
+    }
+}
+
+void
+GetHpBinFile(FILE *infp)
+{
+    char magic[ HP_BIN_MAGIC_LEN ];
+    intish time, delta;
+    uintish i;
+    int tag;
+
+    binfp = infp;
+    offset = 0;
+    nbinidents = 0;
+
+    for (i = 0; i < HP_BIN_MAGIC_LEN; i++) {
+	magic[ i ] = GetByte();
+    }
+    if (memcmp(magic, HP_BIN_MAGIC, HP_BIN_MAGIC_LEN - 1) != 0) {
+	Error("%s: not a binary heap profile", hpfile);
+    }
+    if (magic[ HP_BIN_MAGIC_LEN - 1 ] != HP_BIN_MAGIC[ HP_BIN_MAGIC_LEN - 1 ]) {
+	Error("%s: binary heap profile version %d, expected %d", hpfile,
+	      magic[ HP_BIN_MAGIC_LEN - 1 ],
+	      HP_BIN_MAGIC[ HP_BIN_MAGIC_LEN - 1 ]);
+    }
+
+    time = 0;
+
+    while ((tag = getc(binfp)) != EOF) {
+	offset++;
+
+	switch (tag) {
+	case HP_BIN_JOB:
+	    jobstring = GetBinString();
+	    break;
+
+	case HP_BIN_DATE:
+	    datestring = GetBinString();
+	    break;
+
+	case HP_BIN_SAMPLE_UNIT:
+	    sampleunitstring = GetBinString();
+	    break;
+
+	case HP_BIN_VALUE_UNIT:
+	    valueunitstring = GetBinString();
+	    break;
+
+	case HP_BIN_IDENT:
+	    GetBinIdent();
+	    break;
+
+	case HP_BIN_SAMPLE:
+	    delta = GetSVarint();
+	    if (delta < 0) {
+		Error("%s, byte %ld: samples out of sequence", hpfile, offset);
+	    }
+	    time += delta;
+	    GetBinSample((floatish) time / 1000000);
+	    break;
+
+	case HP_BIN_MARK:
+	    StoreMark((floatish) (time + GetSVarint()) / 1000000);
+	    break;
+
+	default:
+	    Error("%s, byte %ld: unknown record type %d", hpfile,
+		  offset - 1, tag);
+	}
+    }
+
+    for (i = 0; i < nbinidents; i++) {
+	free(idents[ i ].name);
+    }
+    free(idents);
+    idents = 0;
+    nbinidentmax = 0;
+}
@@ -0,0 +1,6 @@
+#ifndef HP_BIN_FILE_H
+#define HP_BIN_FILE_H
+
+void GetHpBinFile PROTO((FILE *));
+
+#endif /* HP_BIN_FILE_H */
@@ -6,7 +6,9 @@
 #include "Defines.h"
 #include "Error.h"
 #include "HpFile.h"
+#include "HpBinFile.h"
 #include "Utilities.h"
+#include "rts/HeapProfileFormat.h"
 
 #ifndef atof
 double atof PROTO((const char *));
@@ -31,15 +33,21 @@ static boolish gotdate = 0;			/* "DATE" read          */
 static boolish gotvalueunit = 0;		/* "VALUE_UNIT" read    */
 static boolish gotsampleunit = 0;		/* "SAMPLE_UNIT" read   */
 static boolish insample = 0;			/* true when in sample  */
+static boolish keepsample = 0;			/* sample is being kept */
+
+static intish samplelimit;			/* samples kept, or 0	*/
+static intish samplestride;			/* keep every nth...	*/
+static intish windowsamples;			/* ...of these samples	*/
+static intish nsamplemax;			/* size of samplemap	*/
+static intish nmarkmax;				/* size of markmap	*/
 
 static floatish lastsample;			/* the last sample time */
 
 static void GetHpLine PROTO((FILE *));		/* forward */
 static void GetHpTok  PROTO((FILE *));		/* forward */
 
-static struct entry *GetEntry PROTO((char *));	/* forward */
-
 static void MakeIdentTable PROTO((void));	/* forward */
+static void ThinSamples PROTO((void));		/* forward */
 
 char *jobstring;
 char *datestring;
@@ -68,19 +76,39 @@ floatish *markmap;		/* sample marks		*/
 void
 GetHpFile(FILE *infp)
 {
+    int c;
+
     nsamples = 0;
     nmarks   = 0;
     nidents  = 0;
 
-    ch = ' ';
-    endfile = 0;
-    linenum = 1;
-    lastsample = 0.0;
+    samplestride  = 1;
+    windowsamples = 0;
 
-    GetHpTok(infp);
+    /* A binary profile starts with a byte that a text one can't */
+    c = getc(infp);
+    ungetc(c, infp);
+
+    if (c == (unsigned char) HP_BIN_MAGIC[0]) {
+	samplelimit = nflag ? maxsamples : DEFAULT_BIN_SAMPLES;
+	GetHpBinFile(infp);
+	gotjob = jobstring != 0;
+	gotdate = datestring != 0;
+	gotvalueunit = valueunitstring != 0;
+	gotsampleunit = sampleunitstring != 0;
+    } else {
+	samplelimit = nflag ? maxsamples : 0;
 
-    while (endfile == 0) {
-	GetHpLine(infp);
+	ch = ' ';
+	endfile = 0;
+	linenum = 1;
+	lastsample = 0.0;
+
+	GetHpTok(infp);
+
+	while (endfile == 0) {
+	    GetHpLine(infp);
+	}
     }
 
     if (!gotjob) {
@@ -100,6 +128,9 @@ GetHpFile(FILE *infp)
     }
 
     if (nsamples == 0) {
+	if (wflag) {
+	    Error("%s: contains no samples in the window", hpfile);
+	}
 	Error("%s: contains no samples", hpfile);
     }
 
@@ -118,8 +149,6 @@ GetHpFile(FILE *infp)
 static void
 GetHpLine(FILE *infp)
 {
-    static intish nmarkmax = 0, nsamplemax = 0;
-
     switch (thetok) {
     case JOB_TOK:
 	GetHpTok(infp);
@@ -172,16 +201,7 @@ GetHpLine(FILE *infp)
 	if (insample) {
 	    Error("%s, line %d, MARK occurs within sample", hpfile, linenum);
 	}
-	if (nmarks >= nmarkmax) {
-	    if (!markmap) {
-		nmarkmax = N_MARKS;
-		markmap = (floatish*) xmalloc(nmarkmax * sizeof(floatish));
-	    } else {
-		nmarkmax *= 2;
-		markmap = (floatish*) xrealloc(markmap, nmarkmax * sizeof(floatish));
-	    }
-	}
-	markmap[ nmarks++ ] = thefloatish; 
+	StoreMark(thefloatish);
         GetHpTok(infp);
         break;
 
@@ -196,17 +216,7 @@ GetHpLine(FILE *infp)
 	} else {
 	    lastsample = thefloatish;
         }
-	if (nsamples >= nsamplemax) {
-	    if (!samplemap) {
-		nsamplemax = N_SAMPLES;
-		samplemap = (floatish*) xmalloc(nsamplemax * sizeof(floatish));
-	    } else {
-		nsamplemax *= 2;
-		samplemap = (floatish*) xrealloc(samplemap, 
-	                                      nsamplemax * sizeof(floatish));
-	    }
-	}
-	samplemap[ nsamples ] = thefloatish;
+	keepsample = BeginSample(thefloatish);
 	GetHpTok(infp);
 	break;
 
@@ -217,7 +227,9 @@ GetHpLine(FILE *infp)
 	    Error("%s, line %d: floating point number must follow END_SAMPLE", 
                   hpfile, linenum);
 	}
-        nsamples++;
+	if (keepsample) {
+	    EndSample();
+	}
 	GetHpTok(infp);
 	break;
 
@@ -227,7 +239,9 @@ GetHpLine(FILE *infp)
 	    Error("%s, line %d: integer must follow identifier", hpfile, 
                   linenum);
 	}
-        StoreSample(GetEntry(theident), nsamples, (floatish) theinteger);
+	if (keepsample) {
+	    StoreSample(GetEntry(theident), nsamples, (floatish) theinteger);
+	}
 	GetHpTok(infp); 
         break;
 
@@ -493,6 +507,7 @@ MakeEntry(char *name)
 
     e = (struct entry *) xmalloc(sizeof(struct entry));
     e->chk = MakeChunk();
+    e->last = e->chk;
     e->name = copystring(name); 
     return e;
 }
@@ -502,7 +517,7 @@ MakeEntry(char *name)
  *	necessary.
  */
 
-static struct entry *
+struct entry *
 GetEntry(char *name)
 {
     intish h;
@@ -537,8 +552,7 @@ StoreSample(struct entry *en, intish bucket, floatish value)
 {
     struct chunk* chk; 
 
-    for (chk = en->chk; chk->next != 0; chk = chk->next)
-	; 
+    chk = en->last;
 
     if (chk->nd < N_CHUNK) {
 	chk->d[ chk->nd ].bucket = bucket;
@@ -550,7 +564,127 @@ StoreSample(struct entry *en, intish bucket, floatish value)
 	t->d[ 0 ].bucket = bucket;
 	t->d[ 0 ].value  = value;
 	t->nd += 1;
+	en->last = t;
+    }
+}
+
+
+/*
+ *	Start a sample taken at time "t", returning true if it is to be
+ *	kept: it must lie in the window (-w), and once there is a limit
+ *	on the number of samples (-n), only every "samplestride"th sample
+ *	in the window is kept.  The values of a kept sample are stored
+ *	with the bucket "nsamples", and EndSample() ends it.
+ */
+
+boolish
+BeginSample(floatish t)
+{
+    if (wflag && (t < windowstart || (windowend >= 0 && t > windowend))) {
+	return 0;
+    }
+
+    if (windowsamples++ % samplestride != 0) {
+	return 0;
+    }
+
+    if (nsamples >= nsamplemax) {
+	if (!samplemap) {
+	    nsamplemax = N_SAMPLES;
+	    samplemap = (floatish*) xmalloc(nsamplemax * sizeof(floatish));
+	} else {
+	    nsamplemax *= 2;
+	    samplemap = (floatish*) xrealloc(samplemap, 
+					  nsamplemax * sizeof(floatish));
+	}
+    }
+    samplemap[ nsamples ] = t;
+    return 1;
+}
+
+void
+EndSample(void)
+{
+    nsamples++;
+
+    if (samplelimit > 0 && nsamples >= samplelimit + (samplelimit & 1)) {
+	ThinSamples();
+    }
+}
+
+/*
+ *	When there are too many samples, throw away every other one (the
+ *	odd buckets), and from now on keep half as many.  The limit is
+ *	rounded up to be even, so the samples kept from now on are the
+ *	ones that would have been kept at the new rate all along.
+ */
+
+static void
+ThinSamples(void)
+{
+    intish i;
+    int f, t;
+    struct entry *e;
+    struct chunk *from, *to, *next;
+
+    for (i = 0; 2 * i < nsamples; i++) {
+	samplemap[ i ] = samplemap[ 2 * i ];
+    }
+
+    for (i = 0; i < N_HASH; i++) {
+	for (e = hashtable[ i ]; e; e = e->next) {
+	    to = e->chk;
+	    t = 0;
+	    for (from = e->chk; from; from = from->next) {
+		for (f = 0; f < from->nd; f++) {
+		    if (from->d[ f ].bucket % 2 != 0) continue;
+		    if (t == N_CHUNK) {
+			to->nd = N_CHUNK;
+			to = to->next;
+			t = 0;
+		    }
+		    to->d[ t ].bucket = from->d[ f ].bucket / 2;
+		    to->d[ t ].value  = from->d[ f ].value;
+		    t++;
+		}
+	    }
+	    to->nd = t;
+
+	    for (from = to->next; from; from = next) {
+		next = from->next;
+		free(from->d);
+		free(from);
+	    }
+	    to->next = 0;
+	    e->last = to;
+	}
+    }
+
+    nsamples = (nsamples + 1) / 2;
+    samplestride *= 2;
+}
+
+/*
+ *	Store a mark, if it lies in the window.
+ */
+
+void
+StoreMark(floatish t)
+{
+    if (wflag && (t < windowstart || (windowend >= 0 && t > windowend))) {
+	return;
+    }
+
+    if (nmarks >= nmarkmax) {
+	if (!markmap) {
+	    nmarkmax = N_MARKS;
+	    markmap = (floatish*) xmalloc(nmarkmax * sizeof(floatish));
+	} else {
+	    nmarkmax *= 2;
+	    markmap = (floatish*) xrealloc(markmap, nmarkmax * sizeof(floatish));
+	}
     }
+    markmap[ nmarks++ ] = t; 
 }
 
 
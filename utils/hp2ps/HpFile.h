@@ -40,6 +40,7 @@ struct chunk {
 struct entry {
     struct entry *next;
     struct chunk *chk;
+    struct chunk *last;                 /* the last chunk of chk */
     char   *name;
 };
 
@@ -62,6 +63,11 @@ extern floatish *markmap;
 void GetHpFile PROTO((FILE *));
 void StoreSample PROTO((struct entry *, intish, floatish));
 struct entry *MakeEntry PROTO((char *));
+struct entry *GetEntry PROTO((char *));
+
+boolish BeginSample PROTO((floatish));
+void EndSample PROTO((void));
+void StoreMark PROTO((floatish));
 
 token GetNumber PROTO((FILE *));
 void  GetIdent  PROTO((FILE *));
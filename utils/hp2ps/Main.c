@@ -27,11 +27,14 @@ boolish sflag = 0;	/* use a small title box		*/
 int     mflag = 0;	/* max no. of bands displayed (default 20) */
 boolish tflag = 0;	/* ignored threshold specified          */
 boolish cflag = 0;      /* colour output                        */
+boolish wflag = 0;	/* draw only a window of time		*/
+boolish nflag = 0;	/* max no. of samples kept		*/
 
 boolish filter;		/* true when running as a filter	*/
 boolish multipageflag = 0;  /* true when the output should be 2 pages - key and profile */ 
 
 static floatish WidthInPoints PROTO((char *));		  /* forward */
+static void ParseWindow PROTO((char *));		  /* forward */
 static FILE *Fp PROTO((char *, char **, char *, char *)); /* forward */
 
 char *hpfile;
@@ -63,6 +66,10 @@ intish nidents;
 floatish THRESHOLD_PERCENT = DEFAULT_THRESHOLD;
 int TWENTY = DEFAULT_TWENTY;
 
+floatish windowstart = 0.0;
+floatish windowend = -1.0;	/* no end */
+intish maxsamples;
+
 int main(int argc, char *argv[])
 {
 
@@ -122,6 +129,16 @@ int main(int argc, char *argv[])
 	    case 'c':
 		cflag++;
 		goto nextarg;
+	    case 'w':
+		wflag++;
+		ParseWindow(*argv + 1);
+		goto nextarg;
+	    case 'n':
+		nflag++;
+		maxsamples = atoi(*argv + 1);
+		if (maxsamples < 0 || maxsamples == 1)
+		    Usage(*argv-1);
+		goto nextarg;
 	    case '?':
 	    default:
 		Usage(*argv-1);
@@ -148,7 +165,7 @@ nextarg: ;
 #endif
 	baseName = copystring(Basename(pathName));
         
-        hpfp  = Fp(pathName, &hpfile, ".hp", "r"); 
+        hpfp  = Fp(pathName, &hpfile, ".hp", "rb"); 
 	psfp  = Fp(baseName, &psfile, ".ps", "w"); 
 
 	if (pflag) auxfp = Fp(baseName, &auxfile, ".aux", "r");
@@ -188,6 +205,34 @@ nextarg: ;
 
 
 
+/*
+ *	-w<start>,<end>: either time may be left out.
+ */
+
+static void
+ParseWindow(char *wstr)
+{
+    char *end;
+
+    if (*wstr != ',') {
+	windowstart = (floatish) strtod(wstr, &end);
+	if (end == wstr)
+	    Usage(wstr);
+	wstr = end;
+    }
+
+    if (*wstr != ',')
+	Usage(wstr);
+    wstr++;
+
+    if (*wstr != '\0') {
+	windowend = (floatish) strtod(wstr, &end);
+	if (end == wstr || *end != '\0' || windowend < windowstart)
+	    Usage(wstr);
+    }
+}
+
+
 typedef enum {POINTS, INCHES, MILLIMETRES} pim;
 
 static pim Units PROTO((char *));   /* forward */
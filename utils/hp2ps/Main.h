@@ -37,8 +37,10 @@ typedef int	boolish;
  */
 #ifdef HAVE_LONG_LONG
 typedef long long int intish;
+typedef unsigned long long int uintish;
 #else
 typedef long int intish;
+typedef unsigned long int uintish;
 #endif
 
 extern intish nsamples;
@@ -63,6 +65,12 @@ extern boolish sflag;
 extern int     mflag;
 extern boolish tflag;
 extern boolish cflag;
+extern boolish wflag;
+extern boolish nflag;
+
+extern floatish windowstart;
+extern floatish windowend;
+extern intish maxsamples;
 
 extern boolish multipageflag;
 
@@ -12,9 +12,9 @@
 
 utils/hp2ps_dist_C_SRCS          = AreaBelow.c Curves.c Error.c Main.c \
                                    Reorder.c TopTwenty.c AuxFile.c Deviation.c \
-                                   HpFile.c Marks.c Scale.c TraceElement.c \
-                                   Axes.c Dimensions.c Key.c PsFile.c Shade.c \
-                                   Utilities.c
+                                   HpFile.c HpBinFile.c Marks.c Scale.c \
+                                   TraceElement.c Axes.c Dimensions.c Key.c \
+                                   PsFile.c Shade.c Utilities.c
 utils/hp2ps_dist_EXTRA_LIBRARIES = m
 utils/hp2ps_dist_PROGNAME        = $(CrossCompilePrefix)hp2ps
 utils/hp2ps_dist_INSTALL         = YES